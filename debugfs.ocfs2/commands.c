@@ -286,7 +286,7 @@ static struct command commands[] = {
 	},
 	{ "stats",
 		do_stats,
-		"stats [-h]",
+		"stats [-h] [-i]",
 		"Show superblock",
 	},
 	{ "xattr",
@@ -703,6 +703,12 @@ static void do_open(char **args)
 		return ;
 	}
 
+	/*
+	 * We hop from block to block as the user pokes around, so
+	 * readahead mostly wastes I/O.  It's only a hint.
+	 */
+	io_set_access_pattern(gbls.fs->fs_io, IO_ACCESS_RANDOM);
+
 	/* allocate blocksize buffer */
 	ret = ocfs2_malloc_block(gbls.fs->fs_io, &gbls.blockbuf);
 	if (ret) {
@@ -950,8 +956,10 @@ static void do_stats(char **args)
 	int c, argc;
 	int sb_num = 0;
 	int only_super = 0;
+	int io_stats = 0;
 	char *ptr = NULL;
-	char *stats_usage = "usage: stats [-h] [-s backup#]";
+	char *stats_usage = "usage: stats [-h] [-i] [-s backup#]";
+	struct ocfs2_io_stats ios;
 	char *buf = gbls.blockbuf;
 
 	if (check_device_open())
@@ -960,11 +968,14 @@ static void do_stats(char **args)
 	for (argc = 0; (args[argc]); ++argc);
 	optind = 0;
 
-	while ((c = getopt(argc, args, "hs:")) != -1) {
+	while ((c = getopt(argc, args, "his:")) != -1) {
 		switch (c) {
 		case 'h':
 			only_super = 1;
 			break;
+		case 'i':
+			io_stats = 1;
+			break;
 		case 's':
 			sb_num = strtoul(optarg, &ptr, 0);
 			if (!ptr || *ptr) {
@@ -995,6 +1006,10 @@ static void do_stats(char **args)
 	dump_super_block(out, sb);
 	if (!only_super)
 		dump_inode(out, in);
+	if (io_stats) {
+		io_get_stats(gbls.fs->fs_io, &ios);
+		dump_io_stats(out, &ios);
+	}
 	close_pager(out);
 
 bail:
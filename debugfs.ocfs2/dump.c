@@ -111,6 +111,49 @@ void dump_super_block(FILE *out, struct ocfs2_super_block *sb)
 	return ;
 }
 
+/*
+ * dump_io_stats()
+ *
+ * The histograms are log2; each bucket is shown as the smallest value
+ * it holds and its count.  Empty buckets are skipped.
+ */
+static void dump_io_hist(FILE *out, const char *what, uint64_t *hist)
+{
+	int i;
+
+	fprintf(out, "\t\t%s:", what);
+	for (i = 0; i < OCFS2_IO_HIST_BUCKETS; i++)
+		if (hist[i])
+			fprintf(out, " %"PRIu64":%"PRIu64,
+				(uint64_t)1 << i, hist[i]);
+	fprintf(out, "\n");
+}
+
+void dump_io_stats(FILE *out, struct ocfs2_io_stats *stats)
+{
+	enum ocfs2_io_kind kind;
+	uint64_t requests;
+	int i;
+
+	fprintf(out, "\tI/O Bytes Read: %"PRIu64"   Written: %"PRIu64"\n",
+		stats->is_bytes_read, stats->is_bytes_written);
+	fprintf(out, "\tCache Hits: %u   Misses: %u\n",
+		stats->is_cache_hits, stats->is_cache_misses);
+
+	for (kind = 0; kind < OCFS2_IO_NR_KINDS; kind++) {
+		requests = 0;
+		for (i = 0; i < OCFS2_IO_HIST_BUCKETS; i++)
+			requests += stats->is_size_hist[kind][i];
+		if (!requests)
+			continue;
+
+		fprintf(out, "\tI/O %s Requests: %"PRIu64"\n",
+			io_kind_name(kind), requests);
+		dump_io_hist(out, "Latency (usecs)", stats->is_lat_hist[kind]);
+		dump_io_hist(out, "Size (bytes)", stats->is_size_hist[kind]);
+	}
+}
+
 /*
  * dump_local_alloc()
  *
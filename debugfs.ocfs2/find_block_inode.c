@@ -24,6 +24,7 @@
  */
 
 #include "main.h"
+#include <pthread.h>
 
 extern struct dbgfs_gbls gbls;
 
@@ -36,24 +37,61 @@ struct block_array {
 #define STATUS_USED	1
 #define STATUS_FREE	2
 	int status;
+	int scanned;		/* inode was found by the inode scan */
 };
 
+struct icheck_ctxt {
+	struct block_array *ba;
+	int count;
+	uint64_t gb_blkno;
+	int reported;			/* The lookups print their errors */
+	pthread_mutex_t lock;		/* Around ba and reported */
+};
+
+/*
+ * The inode scan's workers walk their trees unlocked and only take
+ * the lock to claim blocks.  Marks the blocks of ba in
+ * [start, start + len) as owned by inode.  If data is set, they hold
+ * file data and start is at block offset off in the file.
+ *
+ * The workers finish in no particular order.  So that a cross-linked
+ * block gets the same answer every time, the lowest numbered inode
+ * claiming it wins, and the scan runs to the end.
+ */
+static void claim_blocks(struct icheck_ctxt *ctxt, uint64_t inode,
+			 uint64_t start, uint64_t len, int data, uint64_t off)
+{
+	struct block_array *ba = ctxt->ba;
+	int i;
+
+	pthread_mutex_lock(&ctxt->lock);
+	for (i = 0; i < ctxt->count; ++i) {
+		if (ba[i].blkno < start || ba[i].blkno >= start + len)
+			continue;
+		if (ba[i].status == STATUS_UNKNOWN)
+			ba[i].scanned = 1;
+		else if (!ba[i].scanned || (ba[i].inode <= inode))
+			continue;
+
+		ba[i].status = STATUS_USED;
+		ba[i].inode = inode;
+		ba[i].data = data;
+		ba[i].offset = data ? off + ba[i].blkno - start : 0;
+	}
+	pthread_mutex_unlock(&ctxt->lock);
+}
+
 static errcode_t lookup_regular(ocfs2_filesys *fs, uint64_t inode,
 				struct ocfs2_extent_list *el,
-				struct block_array *ba, int count, int *found)
+				struct icheck_ctxt *ctxt)
 {
 	struct ocfs2_extent_block *eb;
 	struct ocfs2_extent_rec *rec;
 	errcode_t ret = 0;
 	char *buf = NULL;
 	int i;
-	int j;
-	uint64_t numblks;
 	uint32_t clusters;
 
-	if (*found >= count)
-		return 0;
-
 	ret = ocfs2_malloc_block(gbls.fs->fs_io, &buf);
 	if (ret) {
 		com_err(gbls.cmd, ret, "while allocating a block");
@@ -81,41 +119,16 @@ static errcode_t lookup_regular(ocfs2_filesys *fs, uint64_t inode,
 				goto bail;
 			}
 
-			for (j = 0; j < count; ++j) {
-				if (ba[j].status != STATUS_UNKNOWN)
-					continue;
-				if (ba[j].blkno == rec->e_blkno) {
-					ba[j].status = STATUS_USED;
-					ba[j].inode = inode;
-					(*found)++;
-				}
-			}
+			claim_blocks(ctxt, inode, rec->e_blkno, 1, 0, 0);
 
-			lookup_regular(fs, inode, &(eb->h_list), ba, count,
-				       found);
+			lookup_regular(fs, inode, &(eb->h_list), ctxt);
 
 			continue;
 		}
 
-		for (j = 0; j < count; ++j) {
-			if (ba[j].status != STATUS_UNKNOWN)
-				continue;
-
-			numblks = ocfs2_clusters_to_blocks(fs, clusters);
-
-			if (ba[j].blkno >= rec->e_blkno &&
-			    ba[j].blkno < rec->e_blkno + numblks) {
-				ba[j].status = STATUS_USED;
-				ba[j].inode = inode;
-				ba[j].data = 1;
-				ba[j].offset = ocfs2_clusters_to_blocks(fs, rec->e_cpos);
-				ba[j].offset += ba[j].blkno - rec->e_blkno;
-				(*found)++;
-			}
-		}
-
-		if (*found >= count)
-			return 0;
+		claim_blocks(ctxt, inode, rec->e_blkno,
+			     ocfs2_clusters_to_blocks(fs, clusters), 1,
+			     ocfs2_clusters_to_blocks(fs, rec->e_cpos));
 	}
 bail:
 	if (buf)
@@ -125,10 +138,8 @@ bail:
 
 struct walk_it {
 	char *buf;
-	struct block_array *ba;
+	struct icheck_ctxt *ctxt;
 	uint64_t inode;
-	int count;
-	int found;
 };
 
 static int walk_chain_func(ocfs2_filesys *fs, uint64_t blkno, int chain,
@@ -136,7 +147,6 @@ static int walk_chain_func(ocfs2_filesys *fs, uint64_t blkno, int chain,
 {
 	struct walk_it *wi = (struct walk_it *)priv_data;
 	struct ocfs2_group_desc *gd;
-	int i;
 	errcode_t ret;
 
 	ret = ocfs2_read_group_desc(fs, blkno, wi->buf);
@@ -147,35 +157,20 @@ static int walk_chain_func(ocfs2_filesys *fs, uint64_t blkno, int chain,
 
 	gd = (struct ocfs2_group_desc *)wi->buf;
 
-	for (i = 0; i < wi->count; ++i)
-	{
-		if (wi->ba[i].status != STATUS_UNKNOWN)
-			continue;
-
-		if (wi->ba[i].blkno == gd->bg_blkno) {
-			wi->ba[i].status = STATUS_USED;
-			wi->ba[i].inode = wi->inode;
-			wi->found++;
-		}
-
-		if (wi->found >= wi->count)
-			break;
-	}
+	claim_blocks(wi->ctxt, wi->inode, gd->bg_blkno, 1, 0, 0);
 
 	return 0;
 }
 
 static errcode_t lookup_chain(ocfs2_filesys *fs, struct ocfs2_dinode *di,
-			      struct block_array *ba, int count, int *found)
+			      struct icheck_ctxt *ctxt)
 {
 	struct walk_it wi;
 	errcode_t ret = 0;
 
 	memset(&wi, 0, sizeof(wi));
-	wi.ba = ba;
+	wi.ctxt = ctxt;
 	wi.inode = di->i_blkno;
-	wi.count = count;
-	wi.found = *found;
 
 	ret = ocfs2_malloc_block(fs->fs_io, &wi.buf);
 	if (ret) {
@@ -189,8 +184,6 @@ static errcode_t lookup_chain(ocfs2_filesys *fs, struct ocfs2_dinode *di,
 		goto bail;
 	}
 
-	*found = wi.found;
-
 bail:
 	if (wi.buf)
 		ocfs2_free(&wi.buf);
@@ -312,26 +305,64 @@ static void check_computed_blocks(ocfs2_filesys *fs, uint64_t gb_blkno,
 	return;
 }
 
+/* Called from the inode scan's workers, several at once */
+static errcode_t icheck_inode(ocfs2_filesys *fs, int worker,
+			      uint64_t inode_num, char *buf,
+			      errcode_t ecc_status, void *priv_data)
+{
+	struct icheck_ctxt *ctxt = priv_data;
+	struct ocfs2_dinode *di = (struct ocfs2_dinode *)buf;
+	errcode_t ret = 0;
+
+	if (memcmp(di->i_signature, OCFS2_INODE_SIGNATURE,
+		   strlen(OCFS2_INODE_SIGNATURE)))
+		return 0;
+
+	ocfs2_swap_inode_to_cpu(fs, di);
+
+	if (di->i_fs_generation != fs->fs_super->i_fs_generation)
+		return 0;
+
+	if (!(di->i_flags & OCFS2_VALID_FL))
+		return 0;
+
+	claim_blocks(ctxt, di->i_blkno, di->i_blkno, 1, 0, 0);
+
+	if (S_ISLNK(di->i_mode) && !di->i_clusters)
+		return 0;
+
+	if (di->i_flags & (OCFS2_LOCAL_ALLOC_FL | OCFS2_DEALLOC_FL))
+		return 0;
+
+	if (di->i_blkno == ctxt->gb_blkno)
+		return 0;
+
+	if (di->i_flags & OCFS2_CHAIN_FL)
+		ret = lookup_chain(fs, di, ctxt);
+	else
+		ret = lookup_regular(fs, di->i_blkno, &(di->id2.i_list),
+				     ctxt);
+
+	if (ret) {
+		pthread_mutex_lock(&ctxt->lock);
+		ctxt->reported = 1;
+		pthread_mutex_unlock(&ctxt->lock);
+	}
+
+	return ret;
+}
+
 errcode_t find_block_inode(ocfs2_filesys *fs, uint64_t *blkno, int count,
 			   FILE *out)
 {
 	errcode_t ret = 0;
-	uint64_t inode_num;
 	struct block_array *ba = NULL;
-	char *buf = NULL;
-	struct ocfs2_dinode *di;
-	ocfs2_inode_scan *scan = NULL;
+	ocfs2_parallel_inode_scan *scan = NULL;
+	struct icheck_ctxt ctxt;
 	int i;
 	int found = 0;
 	uint64_t gb_blkno;
 
-	ret = ocfs2_malloc_block(fs->fs_io, &buf);
-	if (ret) {
-		com_err(gbls.cmd, ret, "while allocating a block");
-		goto out;
-	}
-	di = (struct ocfs2_dinode *)buf;
-
 	ba = calloc(count, sizeof(struct block_array));
 	if (!ba) {
 		com_err(gbls.cmd, ret, "while allocating memory");
@@ -359,66 +390,24 @@ errcode_t find_block_inode(ocfs2_filesys *fs, uint64_t *blkno, int count,
 	if (found >= count)
 		goto output;
 
-	ret = ocfs2_open_inode_scan(fs, &scan);
+	ret = ocfs2_open_inode_scan_parallel(fs, 0, &scan);
 	if (ret) {
 		com_err(gbls.cmd, ret, "while opening inode scan");
 		goto out_free;
 	}
 
-	for (;;) {
-		ret = ocfs2_get_next_inode(scan, &inode_num, (char *)di);
-		if (ret) {
-			com_err(gbls.cmd, ret, "while scanning next inode");
-			goto out_close_scan;
-		}
-
-		if (!inode_num)
-			break;
+	memset(&ctxt, 0, sizeof(ctxt));
+	ctxt.ba = ba;
+	ctxt.count = count;
+	ctxt.gb_blkno = gb_blkno;
+	pthread_mutex_init(&ctxt.lock, NULL);
 
-		if (memcmp(di->i_signature, OCFS2_INODE_SIGNATURE,
-			   strlen(OCFS2_INODE_SIGNATURE)))
-			continue;
-
-		ocfs2_swap_inode_to_cpu(fs, di);
-
-		if (di->i_fs_generation != fs->fs_super->i_fs_generation)
-			continue;
-
-		if (!(di->i_flags & OCFS2_VALID_FL))
-			continue;
-
-		for (i = 0; i < count; ++i) {
-			if (ba[i].status != STATUS_UNKNOWN)
-				continue;
-			if (ba[i].blkno == di->i_blkno) {
-				ba[i].status = STATUS_USED;
-				ba[i].inode = di->i_blkno;
-				found++;
-			}
-		}
-
-		if (found >= count)
-			break;
-
-		if (S_ISLNK(di->i_mode) && !di->i_clusters)
-			continue;
-
-		if (di->i_flags & (OCFS2_LOCAL_ALLOC_FL | OCFS2_DEALLOC_FL))
-			continue;
-
-		if (di->i_blkno == gb_blkno)
-			continue;
-
-		if (di->i_flags & OCFS2_CHAIN_FL)
-			ret = lookup_chain(fs, di, ba, count, &found);
-		else
-			ret = lookup_regular(fs, di->i_blkno, &(di->id2.i_list),
-					     ba, count, &found);
-		if (ret)
-			goto out_close_scan;
-
-		if (found >= count)
-			break;
+	ret = ocfs2_inode_scan_parallel_iterate(scan, icheck_inode, &ctxt);
+	pthread_mutex_destroy(&ctxt.lock);
+	if (ret) {
+		if (!ctxt.reported)
+			com_err(gbls.cmd, ret, "while scanning inodes");
+		goto out_close_scan;
 	}
 
 output:
@@ -428,11 +417,9 @@ output:
 
 out_close_scan:
 	if (scan)
-		ocfs2_close_inode_scan(scan);
+		ocfs2_close_inode_scan_parallel(scan);
 
 out_free:
-	if (buf)
-		ocfs2_free(&buf);
 	if (ba)
 		free(ba);
 out:
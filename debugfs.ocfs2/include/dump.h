@@ -35,6 +35,7 @@ struct dirblocks_walk {
 };
 
 void dump_super_block (FILE *out, struct ocfs2_super_block *sb);
+void dump_io_stats (FILE *out, struct ocfs2_io_stats *stats);
 void dump_local_alloc (FILE *out, struct ocfs2_local_alloc *loc);
 void dump_truncate_log (FILE *out, struct ocfs2_truncate_log *tl);
 void dump_inode (FILE *out, struct ocfs2_dinode *in);
@@ -24,6 +24,8 @@
  *
  */
 
+#include <limits.h>
+
 #include "main.h"
 #include "ocfs2/bitops.h"
 
@@ -369,6 +371,90 @@ bail:
 	return ret;
 }
 
+static errcode_t write_all(int fd, const char *buf, uint64_t len)
+{
+	ssize_t wrote;
+
+	while (len) {
+		wrote = write(fd, buf, len > INT_MAX ? INT_MAX : len);
+		if (wrote <= 0) {
+			com_err(gbls.cmd, errno, "while writing file");
+			return errno;
+		}
+		buf += wrote;
+		len -= wrote;
+	}
+
+	return 0;
+}
+
+/*
+ * A volume file opened read-only is mapped, so its extents can be
+ * written out straight from the mapping instead of being copied
+ * through buf first.  buf is only used for zeroes, for holes and
+ * unwritten extents.  Returns OCFS2_ET_INVALID_ARGUMENT, having
+ * written nothing, if the channel isn't mapped.  Image files are
+ * never used this way; their block numbers don't match the file's.
+ */
+static errcode_t dump_file_mapped(ocfs2_filesys *fs, ocfs2_cached_inode *ci,
+				  int fd, char *buf, int buflen)
+{
+	struct ocfs2_dinode *di = ci->ci_inode;
+	int bits = OCFS2_RAW_SB(fs->fs_super)->s_blocksize_bits;
+	uint64_t v_blkno, p_blkno, contig, num_blocks, len;
+	uint16_t extent_flags;
+	const char *ptr;
+	errcode_t ret;
+
+	if ((fs->fs_flags & OCFS2_FLAG_IMAGE_FILE) ||
+	    (di->i_dyn_features & OCFS2_INLINE_DATA_FL) ||
+	    io_map_block(fs->fs_io, 0, 1, &ptr))
+		return OCFS2_ET_INVALID_ARGUMENT;
+
+	memset(buf, 0, buflen);
+	num_blocks = (di->i_size + fs->fs_blocksize - 1) >> bits;
+	for (v_blkno = 0; v_blkno < num_blocks; v_blkno += contig) {
+		ret = ocfs2_extent_map_get_blocks(ci, v_blkno, 1, &p_blkno,
+						  &contig, &extent_flags);
+		if (ret) {
+			com_err(gbls.cmd, ret, "while mapping file %"PRIu64" "
+				"at block %"PRIu64, ci->ci_blkno, v_blkno);
+			return ret;
+		}
+
+		/* io_map_block() takes an int count */
+		if (contig > (INT_MAX >> bits))
+			contig = INT_MAX >> bits;
+		if (contig > num_blocks - v_blkno)
+			contig = num_blocks - v_blkno;
+		len = contig << bits;
+		if ((v_blkno + contig) == num_blocks)
+			len = di->i_size - (v_blkno << bits);
+
+		if (!p_blkno || (extent_flags & OCFS2_EXT_UNWRITTEN)) {
+			for (; len > buflen; len -= buflen) {
+				ret = write_all(fd, buf, buflen);
+				if (ret)
+					return ret;
+			}
+			ret = write_all(fd, buf, len);
+		} else {
+			ret = io_map_block(fs->fs_io, p_blkno, contig, &ptr);
+			if (ret) {
+				com_err(gbls.cmd, ret, "while reading file "
+					"%"PRIu64" at block %"PRIu64,
+					ci->ci_blkno, v_blkno);
+				return ret;
+			}
+			ret = write_all(fd, ptr, len);
+		}
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
 /*
  * dump_file()
  *
@@ -414,6 +500,14 @@ errcode_t dump_file(ocfs2_filesys *fs, uint64_t ino, int fd, char *out_file,
 		goto bail;
 	}
 
+	ret = dump_file_mapped(fs, ci, fd, buf, buflen);
+	if (ret != OCFS2_ET_INVALID_ARGUMENT) {
+		if (ret)
+			goto bail;
+		goto done;
+	}
+	ret = 0;
+
 	while (1) {
 		ret = ocfs2_file_read(ci, buf, buflen, offset, &got);
 		if (ret) {
@@ -438,6 +532,7 @@ errcode_t dump_file(ocfs2_filesys *fs, uint64_t ino, int fd, char *out_file,
 			offset += got;
 	}
 
+done:
 	if (preserve)
 		ret = fix_perms(ci->ci_inode, &fd, out_file);
 
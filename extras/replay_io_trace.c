@@ -0,0 +1,487 @@
+/* -*- mode: c; c-basic-offset: 8; -*-
+ * vim: noexpandtab sw=8 ts=8 sts=0:
+ *
+ * replay_io_trace.c
+ *
+ * Re-issues an I/O trace recorded with OCFS2_IO_TRACE against a device
+ * or file, so the I/O of a tool run can be benchmarked without the
+ * data it ran against.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License, version 2,  as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "ocfs2/ocfs2.h"
+#include "ocfs2/byteorder.h"
+
+/* Most io_vec_units one vectored read may have */
+#define MAX_VEC		4096
+
+struct replay_state {
+	io_channel *rs_channel;
+	int rs_blksize;
+	int rs_writes;			/* -w */
+	int rs_timed;			/* -t */
+	long rs_cache_blocks;		/* -c */
+	int rs_policy;			/* -p */
+	int rs_writeback;		/* -W */
+	uint64_t rs_start;
+
+	char *rs_buf;
+	size_t rs_buflen;
+	struct io_vec_unit *rs_ivus;
+	int rs_nr_ivus;
+	size_t rs_vec_bytes;
+
+	/* From the trace */
+	uint64_t rs_records;
+	uint64_t rs_disk;
+	uint64_t rs_usecs;
+	uint64_t rs_failed;
+
+	/* From the replay */
+	uint64_t rs_skipped;
+	uint64_t rs_errors;
+	uint64_t rs_ops[OCFS2_IO_TRACE_NR_OPS];
+};
+
+static void print_usage(void)
+{
+	fprintf(stderr,
+		"Usage: replay_io_trace [-q <depth>] [-c <cache blocks>] "
+		"[-p <policy>] [-W] [-w] [-t] <trace> <device>\n"
+		"       replay_io_trace -d <trace>\n"
+		"  -q  queue depth for vectored reads\n"
+		"  -c  I/O cache size in blocks, default none\n"
+		"  -p  cache policy: lru, 2q, or arc\n"
+		"  -W  write-back mode\n"
+		"  -w  replay writes; they overwrite the device with junk\n"
+		"  -t  keep the recorded gaps between requests\n"
+		"  -d  print the trace\n");
+	exit(1);
+}
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+static errcode_t read_header(FILE *trace, int *blksize)
+{
+	struct ocfs2_io_trace_header th;
+
+	if (fread(&th, sizeof(th), 1, trace) != 1)
+		return OCFS2_ET_SHORT_READ;
+	if (memcmp(th.th_magic, OCFS2_IO_TRACE_MAGIC, sizeof(th.th_magic)) ||
+	    (le32_to_cpu(th.th_version) != OCFS2_IO_TRACE_VERSION))
+		return OCFS2_ET_BAD_MAGIC;
+
+	*blksize = le32_to_cpu(th.th_blksize);
+	return 0;
+}
+
+static size_t request_bytes(int blksize, int32_t count)
+{
+	return (count < 0) ? -count : (size_t)count * blksize;
+}
+
+/* Make sure rs_buf has room for bytes more than used */
+static errcode_t grow_buffer(struct replay_state *rs, size_t used,
+			     size_t bytes)
+{
+	char *buf;
+	size_t len = rs->rs_buflen ? rs->rs_buflen : 1024 * 1024;
+	errcode_t ret;
+
+	if ((used + bytes) <= rs->rs_buflen)
+		return 0;
+
+	while (len < (used + bytes))
+		len <<= 1;
+
+	ret = ocfs2_malloc_blocks(rs->rs_channel,
+				  (len + rs->rs_blksize - 1) / rs->rs_blksize,
+				  &buf);
+	if (ret)
+		return ret;
+
+	if (rs->rs_buf) {
+		memcpy(buf, rs->rs_buf, used);
+		ocfs2_free(&rs->rs_buf);
+	}
+	memset(buf + used, 0xA5, len - used);
+	rs->rs_buf = buf;
+	rs->rs_buflen = len;
+
+	return 0;
+}
+
+/*
+ * The cache is sized in blocks of the current block size, so a
+ * BLKSIZE record gets a fresh one, just as the tools only set up
+ * their cache once the superblock has told them the block size.
+ */
+static errcode_t setup_cache(struct replay_state *rs)
+{
+	errcode_t ret;
+
+	if (!rs->rs_cache_blocks)
+		return 0;
+
+	ret = io_init_cache_policy(rs->rs_channel, rs->rs_cache_blocks,
+				   rs->rs_policy);
+	if (!ret && rs->rs_writeback)
+		ret = io_set_writeback(rs->rs_channel, true);
+
+	return ret;
+}
+
+static errcode_t set_blksize(struct replay_state *rs, int blksize)
+{
+	errcode_t ret = 0;
+
+	if (blksize == rs->rs_blksize)
+		return 0;
+
+	if (rs->rs_cache_blocks) {
+		ret = io_flush(rs->rs_channel);
+		if (ret)
+			return ret;
+		io_destroy_cache(rs->rs_channel);
+	}
+
+	rs->rs_blksize = blksize;
+	ret = io_set_blksize(rs->rs_channel, blksize);
+	if (!ret)
+		ret = setup_cache(rs);
+
+	return ret;
+}
+
+static errcode_t replay_vec(struct replay_state *rs,
+			    struct ocfs2_io_trace_record *tr)
+{
+	struct io_vec_unit *ivu;
+	size_t bytes = request_bytes(rs->rs_blksize,
+				     (int32_t)le32_to_cpu(tr->tr_count));
+	errcode_t ret = OCFS2_ET_NO_MEMORY;
+	int i;
+
+	if (rs->rs_nr_ivus < MAX_VEC)
+		ret = grow_buffer(rs, rs->rs_vec_bytes, bytes);
+	if (ret) {
+		/* Drop the partial vector so the next one starts clean */
+		rs->rs_nr_ivus = 0;
+		rs->rs_vec_bytes = 0;
+		return ret;
+	}
+
+	ivu = &rs->rs_ivus[rs->rs_nr_ivus++];
+	ivu->ivu_blkno = le64_to_cpu(tr->tr_blkno);
+	ivu->ivu_buflen = bytes;
+	ivu->ivu_buf = (char *)rs->rs_vec_bytes;
+	rs->rs_vec_bytes += bytes;
+
+	if (tr->tr_flags & OCFS2_IO_TRACE_MORE)
+		return 0;
+
+	/* The buffer may have moved, so the offsets become pointers last */
+	for (i = 0; i < rs->rs_nr_ivus; i++)
+		rs->rs_ivus[i].ivu_buf = rs->rs_buf +
+			(size_t)rs->rs_ivus[i].ivu_buf;
+
+	io_set_nocache(rs->rs_channel,
+		       !!(tr->tr_flags & OCFS2_IO_TRACE_NOCACHE));
+	ret = io_vec_read_blocks(rs->rs_channel, rs->rs_ivus,
+				 rs->rs_nr_ivus);
+	io_set_nocache(rs->rs_channel, false);
+
+	rs->rs_nr_ivus = 0;
+	rs->rs_vec_bytes = 0;
+
+	return ret;
+}
+
+static errcode_t replay_one(struct replay_state *rs,
+			    struct ocfs2_io_trace_record *tr)
+{
+	uint64_t blkno = le64_to_cpu(tr->tr_blkno);
+	int32_t count = le32_to_cpu(tr->tr_count);
+	int nocache = tr->tr_flags & OCFS2_IO_TRACE_NOCACHE;
+	errcode_t ret = 0;
+
+	switch (tr->tr_op) {
+	case OCFS2_IO_TRACE_READ:
+		ret = grow_buffer(rs, 0, request_bytes(rs->rs_blksize, count));
+		if (ret)
+			break;
+		if (nocache)
+			ret = io_read_block_nocache(rs->rs_channel, blkno,
+						    count, rs->rs_buf);
+		else
+			ret = io_read_block(rs->rs_channel, blkno, count,
+					    rs->rs_buf);
+		break;
+
+	case OCFS2_IO_TRACE_WRITE:
+		if (!rs->rs_writes) {
+			rs->rs_skipped++;
+			return 0;
+		}
+		ret = grow_buffer(rs, 0, request_bytes(rs->rs_blksize, count));
+		if (ret)
+			break;
+		if (nocache)
+			ret = io_write_block_nocache(rs->rs_channel, blkno,
+						     count, rs->rs_buf);
+		else
+			ret = io_write_block(rs->rs_channel, blkno, count,
+					     rs->rs_buf);
+		break;
+
+	case OCFS2_IO_TRACE_VEC_READ:
+		ret = replay_vec(rs, tr);
+		break;
+
+	case OCFS2_IO_TRACE_PREFETCH:
+		ret = io_prefetch_blocks(rs->rs_channel, blkno, count);
+		break;
+
+	case OCFS2_IO_TRACE_FLUSH:
+		if (rs->rs_writes)
+			ret = io_flush(rs->rs_channel);
+		break;
+
+	case OCFS2_IO_TRACE_BARRIER:
+		if (rs->rs_writes)
+			ret = io_barrier(rs->rs_channel);
+		break;
+
+	case OCFS2_IO_TRACE_BLKSIZE:
+		ret = set_blksize(rs, blkno);
+		break;
+
+	default:
+		rs->rs_skipped++;
+		return 0;
+	}
+
+	rs->rs_ops[tr->tr_op]++;
+	return ret;
+}
+
+static errcode_t replay(struct replay_state *rs, FILE *trace)
+{
+	struct ocfs2_io_trace_record tr;
+	uint64_t when, now;
+	errcode_t ret;
+
+	rs->rs_start = now_us();
+	while (fread(&tr, sizeof(tr), 1, trace) == 1) {
+		rs->rs_records++;
+		rs->rs_disk += le32_to_cpu(tr.tr_disk);
+		rs->rs_usecs += le32_to_cpu(tr.tr_usecs);
+		if (tr.tr_flags & OCFS2_IO_TRACE_ERROR)
+			rs->rs_failed++;
+
+		if (rs->rs_timed) {
+			when = rs->rs_start + le64_to_cpu(tr.tr_time);
+			now = now_us();
+			if (when > now)
+				usleep(when - now);
+		}
+
+		/* A failed request may well fail again.  Keep going. */
+		ret = replay_one(rs, &tr);
+		if (ret)
+			rs->rs_errors++;
+	}
+
+	return ferror(trace) ? OCFS2_ET_IO : 0;
+}
+
+static void print_results(struct replay_state *rs)
+{
+	struct ocfs2_io_stats stats;
+	uint64_t elapsed = now_us() - rs->rs_start;
+	uint64_t disk;
+	int i;
+
+	io_get_stats(rs->rs_channel, &stats);
+	disk = (stats.is_bytes_read + stats.is_bytes_written) /
+		rs->rs_blksize;
+
+	printf("Records: %"PRIu64", skipped: %"PRIu64", "
+	       "errors: %"PRIu64" (recorded %"PRIu64")\n",
+	       rs->rs_records, rs->rs_skipped, rs->rs_errors, rs->rs_failed);
+	for (i = 0; i < OCFS2_IO_TRACE_NR_OPS; i++)
+		if (rs->rs_ops[i])
+			printf("  %s: %"PRIu64"\n", io_trace_op_name(i),
+			       rs->rs_ops[i]);
+	printf("Disk blocks: %"PRIu64" (recorded %"PRIu64")\n",
+	       disk, rs->rs_disk);
+	printf("Cache hits: %"PRIu32", misses: %"PRIu32"\n",
+	       stats.is_cache_hits, stats.is_cache_misses);
+	printf("Time: %"PRIu64" usecs (recorded %"PRIu64" in requests)\n",
+	       elapsed, rs->rs_usecs);
+}
+
+static errcode_t dump_trace(FILE *trace)
+{
+	struct ocfs2_io_trace_record tr;
+	const char *op;
+
+	printf("%-12s %-6s %-9s %-20s %-10s %-8s %-10s %s\n", "usecs",
+	       "thread", "op", "blkno", "count", "disk", "took", "flags");
+	while (fread(&tr, sizeof(tr), 1, trace) == 1) {
+		op = io_trace_op_name(tr.tr_op);
+		printf("%-12"PRIu64" %-6u %-9s %-20"PRIu64" %-10"PRId32" "
+		       "%-8"PRIu32" %-10"PRIu32" %s%s%s\n",
+		       le64_to_cpu(tr.tr_time), le16_to_cpu(tr.tr_thread),
+		       op ? op : "?", le64_to_cpu(tr.tr_blkno),
+		       (int32_t)le32_to_cpu(tr.tr_count),
+		       le32_to_cpu(tr.tr_disk), le32_to_cpu(tr.tr_usecs),
+		       (tr.tr_flags & OCFS2_IO_TRACE_NOCACHE) ? "nocache " : "",
+		       (tr.tr_flags & OCFS2_IO_TRACE_MORE) ? "more " : "",
+		       (tr.tr_flags & OCFS2_IO_TRACE_ERROR) ? "error" : "");
+	}
+
+	return ferror(trace) ? OCFS2_ET_IO : 0;
+}
+
+static int parse_policy(const char *name)
+{
+	int i;
+
+	for (i = 0; i < IO_CACHE_NR_POLICIES; i++)
+		if (!strcmp(name, io_cache_policy_name(i)))
+			return i;
+	return -1;
+}
+
+int main(int argc, char **argv)
+{
+	struct replay_state rs;
+	FILE *trace;
+	int c, dump = 0, depth = 0;
+	errcode_t ret;
+
+	memset(&rs, 0, sizeof(rs));
+	initialize_ocfs_error_table();
+
+	while ((c = getopt(argc, argv, "q:c:p:Wwtd")) != EOF) {
+		switch (c) {
+		case 'q':
+			depth = atoi(optarg);
+			break;
+		case 'c':
+			rs.rs_cache_blocks = atol(optarg);
+			break;
+		case 'p':
+			rs.rs_policy = parse_policy(optarg);
+			if (rs.rs_policy < 0)
+				print_usage();
+			break;
+		case 'W':
+			rs.rs_writeback = 1;
+			break;
+		case 'w':
+			rs.rs_writes = 1;
+			break;
+		case 't':
+			rs.rs_timed = 1;
+			break;
+		case 'd':
+			dump = 1;
+			break;
+		default:
+			print_usage();
+		}
+	}
+
+	if ((optind + (dump ? 1 : 2)) != argc)
+		print_usage();
+
+	trace = fopen(argv[optind], "r");
+	if (!trace) {
+		com_err(argv[0], OCFS2_ET_IO, "while opening trace %s",
+			argv[optind]);
+		return 1;
+	}
+
+	ret = read_header(trace, &rs.rs_blksize);
+	if (ret) {
+		com_err(argv[0], ret, "while reading the header of %s",
+			argv[optind]);
+		return 1;
+	}
+
+	if (dump) {
+		printf("Block size: %d\n", rs.rs_blksize);
+		ret = dump_trace(trace);
+		if (ret)
+			com_err(argv[0], ret, "while reading %s", argv[optind]);
+		return !!ret;
+	}
+
+	ret = io_open(argv[optind + 1],
+		      rs.rs_writes ? OCFS2_FLAG_RW : OCFS2_FLAG_RO,
+		      &rs.rs_channel);
+	if (ret) {
+		com_err(argv[0], ret, "while opening %s", argv[optind + 1]);
+		return 1;
+	}
+
+	ret = io_set_blksize(rs.rs_channel, rs.rs_blksize);
+	if (!ret && depth)
+		ret = io_set_queue_depth(rs.rs_channel, depth);
+	if (!ret)
+		ret = setup_cache(&rs);
+	if (!ret)
+		ret = ocfs2_malloc(sizeof(struct io_vec_unit) * MAX_VEC,
+				   &rs.rs_ivus);
+	if (ret) {
+		com_err(argv[0], ret, "while setting up %s", argv[optind + 1]);
+		goto out;
+	}
+
+	ret = replay(&rs, trace);
+	if (ret)
+		com_err(argv[0], ret, "while reading %s", argv[optind]);
+
+	if (rs.rs_writes && !ret)
+		ret = io_flush(rs.rs_channel);
+	print_results(&rs);
+
+out:
+	if (rs.rs_buf)
+		ocfs2_free(&rs.rs_buf);
+	if (rs.rs_ivus)
+		ocfs2_free(&rs.rs_ivus);
+	io_close(rs.rs_channel);
+	fclose(trace);
+
+	return !!ret;
+}
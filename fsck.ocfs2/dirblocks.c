@@ -37,15 +37,18 @@
 #include "extent.h"
 
 #define NUM_RA_BLOCKS		1024
+/*
+ * The reads are queued in the background.  By the time the iterator
+ * gets to a block, it is usually cached; if not, only that block is
+ * waited for.
+ */
 static void o2fsck_readahead_dirblocks(o2fsck_state *ost, struct rb_node *node,
 				       struct rb_node **last_read_node)
 {
 	ocfs2_filesys *fs = ost->ost_fs;
 	o2fsck_dirblock_entry *dbe;
 	struct io_vec_unit *ivus = NULL;
-	char *buf = NULL;
 	int buflen =  NUM_RA_BLOCKS * fs->fs_blocksize;
-	uint32_t offset = 0;
 	int i;
 	errcode_t ret;
 
@@ -57,11 +60,6 @@ static void o2fsck_readahead_dirblocks(o2fsck_state *ost, struct rb_node *node,
 	if (buflen > io_get_cache_size(fs->fs_io))
 		return;
 
-	ret = ocfs2_malloc_blocks(fs->fs_io, NUM_RA_BLOCKS, &buf);
-	if (ret)
-		goto out;
-	 memset(buf, 0, buflen);
-
 	ret = ocfs2_malloc(sizeof(struct io_vec_unit) * NUM_RA_BLOCKS, &ivus);
 	if (ret)
 		goto out;
@@ -69,17 +67,15 @@ static void o2fsck_readahead_dirblocks(o2fsck_state *ost, struct rb_node *node,
 	for (i = 0; node && (i < NUM_RA_BLOCKS); ++i, node = rb_next(node)) {
 		dbe = rb_entry(node, o2fsck_dirblock_entry, e_node);
 		ivus[i].ivu_blkno = dbe->e_blkno;
-		ivus[i].ivu_buf = buf + offset;
+		ivus[i].ivu_buf = NULL;
 		ivus[i].ivu_buflen = fs->fs_blocksize;
-		offset += fs->fs_blocksize;
 		*last_read_node = node;
 	}
 
-	ret = io_vec_read_blocks(fs->fs_io, ivus, i);
+	ret = io_prefetch_vec(fs->fs_io, ivus, i);
 
 out:
 	ocfs2_free(&ivus);
-	ocfs2_free(&buf);
 }
 
 errcode_t o2fsck_add_dir_block(o2fsck_dirblocks *db, uint64_t ino,
@@ -245,8 +241,10 @@ errcode_t o2fsck_rebuild_indexed_dirs(ocfs2_filesys *fs, struct rb_root *root)
 	struct rb_node *node;
 	o2fsck_dirblock_entry *dbe;
 	uint64_t ino;
-	errcode_t ret = 0;
+	errcode_t ret = 0, tmp;
 
+	/* One allocator write for all the rebuilt directories */
+	ocfs2_begin_alloc_batch(fs);
 	for (node = rb_first(root); node; node = rb_next(node)) {
 		dbe = rb_entry(node, o2fsck_dirblock_entry, e_node);
 		ino = dbe->e_ino;
@@ -255,6 +253,9 @@ errcode_t o2fsck_rebuild_indexed_dirs(ocfs2_filesys *fs, struct rb_root *root)
 			goto out;
 	}
 out:
+	tmp = ocfs2_end_alloc_batch(fs);
+	if (!ret)
+		ret = tmp;
 	return ret;
 }
 
@@ -119,7 +119,7 @@ static void print_usage(void)
 {
 	fprintf(stderr,
 		"Usage: fsck.ocfs2 {-y|-n|-p} [ -fGnuvVy ] [ -b superblock block ]\n"
-		"		    [ -B block size ] [-r num] device\n"
+		"		    [ -B block size ] [-r num] [ -C policy ] device\n"
 		"\n"
 		"Critical flags for emergency repair:\n" 
 		" -n		Check but don't change the file system\n"
@@ -132,6 +132,7 @@ static void print_usage(void)
 		"Less critical flags:\n"
 		" -b superblock	Treat given block as the super block\n"
 		" -B blocksize	Force the given block size\n"
+		" -C policy	I/O cache replacement policy (lru, 2q, arc)\n"
 		" -G		Ask to fix mismatched inode generations\n"
 		" -P		Show progress\n"
 		" -t		Show I/O statistics\n"
@@ -706,7 +707,7 @@ int main(int argc, char **argv)
 
 	tools_progress_disable();
 
-	while ((c = getopt(argc, argv, "b:B:DfFGnupavVytPr:")) != EOF) {
+	while ((c = getopt(argc, argv, "b:B:C:DfFGnupavVytPr:")) != EOF) {
 		switch (c) {
 			case 'b':
 				blkno = read_number(optarg);
@@ -731,6 +732,22 @@ int main(int argc, char **argv)
 					goto out;
 				}
 				break;
+			case 'C':
+				for (c = 0; c < IO_CACHE_NR_POLICIES; c++)
+					if (!strcmp(optarg,
+						io_cache_policy_name(c)))
+						break;
+				if (c == IO_CACHE_NR_POLICIES) {
+					fprintf(stderr,
+						"Invalid cache policy: %s\n",
+						optarg);
+					fsck_mask |= FSCK_USAGE;
+					print_usage();
+					goto out;
+				}
+				ost->ost_cache_policy = c;
+				break;
+
 			case 'D':
 				ost->ost_compress_dirs = 1;
 				break;
@@ -20,8 +20,18 @@
  *
  * --
  *
- * A trivial rbtree that stores a u16 icount indexed by an inode's block
- * number.
+ * Stores a u16 icount indexed by an inode's block number.
+ *
+ * Most inodes have a count of one, and those are just a bit in
+ * ic_single_bm.  Directories and hard links have more.  Their counts are
+ * kept in an open-addressed hash table of (blkno, count) pairs packed into
+ * a u64 each, with ic_multiple_bm marking which blocks are in it so that
+ * o2fsck_icount_next_blkno() can still walk them in order.  The table
+ * doubles before it gets more than three quarters full, so while it fills
+ * it is at least three eighths full.  That's 11 to 21 bytes an inode
+ * rather than a 48 byte rbtree node, which matters on volumes with tens
+ * of millions of directories.  It never shrinks; counts that drop back
+ * below two just leave their slots empty.
  */
 #include <unistd.h>
 #include <stdlib.h>
@@ -35,63 +45,144 @@
 #include "icount.h"
 #include "util.h"
 
-typedef struct _icount_node {
-	struct rb_node	in_node;
-	uint64_t	in_blkno;
-	uint16_t	in_icount;
-} icount_node;
+#define ICOUNT_COUNT_BITS	16
+#define ICOUNT_MAX_BLKNO	((1ULL << (64 - ICOUNT_COUNT_BITS)) - 1)
+#define ICOUNT_MIN_HASH_BITS	10
 
-/* XXX this is currently fragile in that it requires that the caller make
- * sure that the node doesn't already exist in the tree.
- */
-static void icount_insert(o2fsck_icount *icount, icount_node *in)
+/* A zero entry is an empty slot; stored counts are always > 1 */
+static inline uint64_t icount_entry(uint64_t blkno, uint16_t count)
+{
+	return (blkno << ICOUNT_COUNT_BITS) | count;
+}
+
+static inline uint64_t entry_blkno(uint64_t entry)
+{
+	return entry >> ICOUNT_COUNT_BITS;
+}
+
+static inline uint16_t entry_count(uint64_t entry)
+{
+	return (uint16_t)entry;
+}
+
+static inline uint64_t icount_slots(o2fsck_icount *icount)
+{
+	return icount->ic_multiple ? 1ULL << icount->ic_hash_bits : 0;
+}
+
+static inline uint64_t icount_hash(o2fsck_icount *icount, uint64_t blkno)
+{
+	return (blkno * 0x9e3779b97f4a7c15ULL) >> (64 - icount->ic_hash_bits);
+}
+
+/* Returns the slot holding blkno, or the empty slot it would go in */
+static uint64_t *icount_probe(o2fsck_icount *icount, uint64_t blkno)
+{
+	uint64_t mask = icount_slots(icount) - 1;
+	uint64_t i = icount_hash(icount, blkno);
+
+	while (icount->ic_multiple[i] &&
+	       entry_blkno(icount->ic_multiple[i]) != blkno)
+		i = (i + 1) & mask;
+
+	return &icount->ic_multiple[i];
+}
+
+static uint64_t *icount_search(o2fsck_icount *icount, uint64_t blkno)
+{
+	uint64_t *slot;
+
+	if (!icount->ic_nr_multiple)
+		return NULL;
+
+	slot = icount_probe(icount, blkno);
+	return *slot ? slot : NULL;
+}
+
+static errcode_t icount_resize(o2fsck_icount *icount, unsigned int bits)
+{
+	uint64_t *old = icount->ic_multiple;
+	uint64_t i, old_slots = icount_slots(icount);
+
+	icount->ic_multiple = calloc(1ULL << bits, sizeof(uint64_t));
+	if (!icount->ic_multiple) {
+		icount->ic_multiple = old;
+		return OCFS2_ET_NO_MEMORY;
+	}
+	icount->ic_hash_bits = bits;
+
+	for (i = 0; i < old_slots; i++) {
+		if (old[i])
+			*icount_probe(icount, entry_blkno(old[i])) = old[i];
+	}
+	free(old);
+
+	return 0;
+}
+
+/* Keeps the table at most three quarters full */
+static unsigned int icount_bits_for(uint64_t nr)
 {
-	struct rb_node ** p = &icount->ic_multiple_tree.rb_node;
-	struct rb_node * parent = NULL;
-	icount_node *tmp_in;
+	unsigned int bits = ICOUNT_MIN_HASH_BITS;
+
+	while ((1ULL << bits) * 3 < nr * 4)
+		bits++;
+	return bits;
+}
+
+/* The caller has made sure blkno isn't in the table */
+static errcode_t icount_insert(o2fsck_icount *icount, uint64_t blkno,
+			       uint16_t count)
+{
+	errcode_t ret;
+	unsigned int bits;
 
-	while (*p)
-	{
-		parent = *p;
-		tmp_in = rb_entry(parent, icount_node, in_node);
+	if (blkno > ICOUNT_MAX_BLKNO)
+		return OCFS2_ET_INVALID_ARGUMENT;
 
-		if (in->in_blkno < tmp_in->in_blkno)
-			p = &(*p)->rb_left;
-		else if (in->in_blkno > tmp_in->in_blkno)
-			p = &(*p)->rb_right;
+	bits = icount_bits_for(icount->ic_nr_multiple + 1);
+	if (!icount->ic_multiple || (bits > icount->ic_hash_bits)) {
+		ret = icount_resize(icount, bits);
+		if (ret)
+			return ret;
 	}
 
-	rb_link_node(&in->in_node, parent, p);
-	rb_insert_color(&in->in_node, &icount->ic_multiple_tree);
+	*icount_probe(icount, blkno) = icount_entry(blkno, count);
+	icount->ic_nr_multiple++;
+	o2fsck_bitmap_set(icount->ic_multiple_bm, blkno, NULL);
+
+	return 0;
 }
 
-static icount_node *icount_search(o2fsck_icount *icount, uint64_t blkno,
-				  icount_node **next)
+/*
+ * Linear probing lets us delete without tombstones: entries after the
+ * hole slide back into it unless that would move them before their
+ * home slot.
+ */
+static void icount_remove(o2fsck_icount *icount, uint64_t *slot)
 {
-	struct rb_node *node = icount->ic_multiple_tree.rb_node;
-	icount_node *in, *last_left = NULL;
+	uint64_t *table = icount->ic_multiple;
+	uint64_t mask = icount_slots(icount) - 1;
+	uint64_t hole = slot - table, i, home;
 
-	while (node) {
-		in = rb_entry(node, icount_node, in_node);
+	o2fsck_bitmap_clear(icount->ic_multiple_bm, entry_blkno(*slot), NULL);
 
-		if (blkno < in->in_blkno) {
-			last_left = in;
-			node = node->rb_left;
-		} else if (blkno > in->in_blkno)
-			node = node->rb_right;
-		else
-			return in;
+	for (i = (hole + 1) & mask; table[i]; i = (i + 1) & mask) {
+		home = icount_hash(icount, entry_blkno(table[i]));
+		if (((i - home) & mask) >= ((i - hole) & mask)) {
+			table[hole] = table[i];
+			hole = i;
+		}
 	}
-	if (next && last_left)
-		*next = last_left;
-	return NULL;
+	table[hole] = 0;
+	icount->ic_nr_multiple--;
 }
 
 /* keep it simple for now by always updating both data structures */
 errcode_t o2fsck_icount_set(o2fsck_icount *icount, uint64_t blkno, 
 			    uint16_t count)
 {
-	icount_node *in;
+	uint64_t *slot;
 	errcode_t ret = 0;
 
 	if (count == 1)
@@ -99,33 +190,21 @@ errcode_t o2fsck_icount_set(o2fsck_icount *icount, uint64_t blkno,
 	else
 		o2fsck_bitmap_clear(icount->ic_single_bm, blkno, NULL);
 
-	in = icount_search(icount, blkno, NULL);
-	if (in) {
-		if (count < 2) {
-			rb_erase(&in->in_node, &icount->ic_multiple_tree);
-			free(in);
-		} else {
-			in->in_icount = count;
-		}
-	} else if (count > 1) {
-		in = calloc(1, sizeof(*in));
-		if (in == NULL) {
-			ret = OCFS2_ET_NO_MEMORY;
-			goto out;
-		}
-
-		in->in_blkno = blkno;
-		in->in_icount = count;
-		icount_insert(icount, in);
-	}
+	slot = icount_search(icount, blkno);
+	if (slot) {
+		if (count < 2)
+			icount_remove(icount, slot);
+		else
+			*slot = icount_entry(blkno, count);
+	} else if (count > 1)
+		ret = icount_insert(icount, blkno, count);
 
-out:
 	return ret;
 }
 
 uint16_t o2fsck_icount_get(o2fsck_icount *icount, uint64_t blkno)
 {
-	icount_node *in;
+	uint64_t *slot;
 	int was_set;
 	uint16_t ret = 0;
 
@@ -135,9 +214,9 @@ uint16_t o2fsck_icount_get(o2fsck_icount *icount, uint64_t blkno)
 		goto out;
 	}
 
-	in = icount_search(icount, blkno, NULL);
-	if (in)
-		ret = in->in_icount;
+	slot = icount_search(icount, blkno);
+	if (slot)
+		ret = entry_count(*slot);
 
 out:
 	return ret;
@@ -145,13 +224,13 @@ out:
 
 /* again, simple before efficient.  We just find the old value and
  * use _set to make sure that the new value updates both the bitmap
- * and the tree */
+ * and the table */
 void o2fsck_icount_delta(o2fsck_icount *icount, uint64_t blkno, 
 			 int delta)
 {
 	int was_set;
 	uint16_t prev_count;
-	icount_node *in;
+	uint64_t *slot;
 
 	if (delta == 0)
 		return;
@@ -160,11 +239,11 @@ void o2fsck_icount_delta(o2fsck_icount *icount, uint64_t blkno,
 	if (was_set) {
 		prev_count = 1;
 	} else {
-		in = icount_search(icount, blkno, NULL);
-		if (in == NULL)
+		slot = icount_search(icount, blkno);
+		if (slot == NULL)
 			prev_count = 0;
 		else
-			prev_count = in->in_icount;
+			prev_count = entry_count(*slot);
 	}
 
 	if (prev_count + delta < 0) 
@@ -175,6 +254,31 @@ void o2fsck_icount_delta(o2fsck_icount *icount, uint64_t blkno,
 	o2fsck_icount_set(icount, blkno, prev_count + delta);
 }
 
+/*
+ * Sizes the table for nr inodes with more than one link, so that filling
+ * it doesn't rehash again and again.  Pass 2 uses the count pass 1 found.
+ */
+errcode_t o2fsck_icount_reserve(o2fsck_icount *icount, uint64_t nr)
+{
+	unsigned int bits = icount_bits_for(nr);
+
+	if (icount->ic_multiple && (bits <= icount->ic_hash_bits))
+		return 0;
+
+	return icount_resize(icount, bits);
+}
+
+uint64_t o2fsck_icount_multiple(o2fsck_icount *icount)
+{
+	return icount->ic_nr_multiple;
+}
+
+/* Memory held by the count table, not counting the bitmaps */
+size_t o2fsck_icount_bytes(o2fsck_icount *icount)
+{
+	return icount_slots(icount) * sizeof(uint64_t);
+}
+
 errcode_t o2fsck_icount_new(ocfs2_filesys *fs, o2fsck_icount **ret)
 {
 	o2fsck_icount *icount;
@@ -192,7 +296,15 @@ errcode_t o2fsck_icount_new(ocfs2_filesys *fs, o2fsck_icount **ret)
 		return err;
 	}
 
-	icount->ic_multiple_tree = RB_ROOT;
+	err = ocfs2_block_bitmap_new(fs, "inodes with multiple link_count",
+				     &icount->ic_multiple_bm);
+	if (err) {
+		ocfs2_bitmap_free(&icount->ic_single_bm);
+		free(icount);
+		com_err("icount", err,
+			"while allocating multiple link_count bm");
+		return err;
+	}
 
 	*ret = icount;
 	return 0;
@@ -201,42 +313,171 @@ errcode_t o2fsck_icount_new(ocfs2_filesys *fs, o2fsck_icount **ret)
 errcode_t o2fsck_icount_next_blkno(o2fsck_icount *icount, uint64_t start,
 				   uint64_t *found)
 {
-	uint64_t next_bit;
-	errcode_t ret;
-	icount_node *in, *next = NULL;
+	uint64_t next_single, next_multiple;
+	errcode_t ret, ret_multiple;
 
 	ret = ocfs2_bitmap_find_next_set(icount->ic_single_bm, start,
-						  &next_bit);
+					 &next_single);
+	ret_multiple = ocfs2_bitmap_find_next_set(icount->ic_multiple_bm,
+						  start, &next_multiple);
 
-	in = icount_search(icount, start, &next);
-	if (in == NULL)
-		in = next;
-
-	if (in) {
+	if (!ret_multiple) {
 		if (ret == OCFS2_ET_BIT_NOT_FOUND)
-			*found = in->in_blkno;
+			*found = next_multiple;
 		else
-			*found = next_bit < in->in_blkno ? next_bit :
-							   in->in_blkno;
+			*found = next_single < next_multiple ? next_single :
+							       next_multiple;
 		ret = 0;
 	}
 	else {
 		if (ret != OCFS2_ET_BIT_NOT_FOUND)
-			*found = next_bit;
+			*found = next_single;
 	}
 	return ret;
 }
 
 void o2fsck_icount_free(o2fsck_icount *icount)
 {
-	struct rb_node *node;
-	icount_node *in; 
-
 	ocfs2_bitmap_free(&icount->ic_single_bm);
-	while((node = rb_first(&icount->ic_multiple_tree)) != NULL) {
-		in = rb_entry(node, icount_node, in_node);
-		rb_erase(node, &icount->ic_multiple_tree);
-		free(in);
-	}
+	ocfs2_bitmap_free(&icount->ic_multiple_bm);
+	free(icount->ic_multiple);
 	free(icount);
 }
+
+#ifdef DEBUG_EXE
+#include <stdio.h>
+
+/*
+ * Drive an icount and a plain array of counts the same way and make sure
+ * they agree.  One pass spreads blocks over the whole volume; the other
+ * keeps them in a few thousand blocks so the table fills, collides, and
+ * empties again through o2fsck_icount_set() and o2fsck_icount_delta().
+ */
+int verbose = 0;
+
+static uint64_t nr_bad;
+
+static void check_next(o2fsck_icount *icount, uint16_t *counts,
+		       uint64_t nr_blocks, const char *what, uint64_t blkno)
+{
+	errcode_t ret;
+	uint64_t found = 0, expected = blkno;
+
+	while ((expected < nr_blocks) && !counts[expected])
+		expected++;
+
+	ret = o2fsck_icount_next_blkno(icount, blkno, &found);
+	if ((expected == nr_blocks) ? !ret : (ret || (found != expected))) {
+		fprintf(stdout, "%s: next_blkno(%"PRIu64") gave %"PRIu64
+			", expected %"PRIu64"\n", what, blkno,
+			ret ? nr_blocks : found, expected);
+		nr_bad++;
+	}
+}
+
+static void run_pass(ocfs2_filesys *fs, const char *what, uint64_t range)
+{
+	errcode_t ret;
+	o2fsck_icount *icount;
+	uint16_t *counts, count;
+	uint64_t i, blkno, nr_multiple = 0, nr_blocks = fs->fs_blocks;
+	int delta;
+
+	counts = calloc(nr_blocks, sizeof(uint16_t));
+	if (!counts) {
+		com_err(what, OCFS2_ET_NO_MEMORY, "while allocating counts");
+		exit(1);
+	}
+
+	ret = o2fsck_icount_new(fs, &icount);
+	if (ret) {
+		com_err(what, ret, "while creating icount");
+		exit(1);
+	}
+
+	for (i = 0; i < 200000; i++) {
+		blkno = (random() % range) * (nr_blocks / range);
+		switch (random() % 4) {
+			case 0:
+				count = random() % 4;
+				if (!(random() % 64))
+					count = random();
+				o2fsck_icount_set(icount, blkno, count);
+				counts[blkno] = count;
+				break;
+			case 1:
+				delta = (random() % 3) - 1;
+				if ((counts[blkno] + delta < 0) ||
+				    (counts[blkno] + delta > UINT16_MAX))
+					delta = -delta;
+				o2fsck_icount_delta(icount, blkno, delta);
+				counts[blkno] += delta;
+				break;
+			case 2:
+				count = o2fsck_icount_get(icount, blkno);
+				if (count != counts[blkno]) {
+					fprintf(stdout, "%s: get(%"PRIu64") gave "
+						"%"PRIu16", expected %"PRIu16"\n",
+						what, blkno, count,
+						counts[blkno]);
+					nr_bad++;
+				}
+				break;
+			default:
+				check_next(icount, counts, nr_blocks, what,
+					   blkno);
+				break;
+		}
+	}
+
+	for (blkno = 0; blkno < nr_blocks; blkno++) {
+		if (counts[blkno] > 1)
+			nr_multiple++;
+		if (o2fsck_icount_get(icount, blkno) != counts[blkno]) {
+			fprintf(stdout, "%s: get(%"PRIu64") gave %"PRIu16
+				", expected %"PRIu16"\n", what, blkno,
+				o2fsck_icount_get(icount, blkno),
+				counts[blkno]);
+			nr_bad++;
+		}
+	}
+
+	for (blkno = 0; blkno < nr_blocks; blkno = i + 1) {
+		check_next(icount, counts, nr_blocks, what, blkno);
+		if (o2fsck_icount_next_blkno(icount, blkno, &i))
+			break;
+	}
+
+	if (o2fsck_icount_multiple(icount) != nr_multiple) {
+		fprintf(stdout, "%s: %"PRIu64" multiple counts, expected "
+			"%"PRIu64"\n", what, o2fsck_icount_multiple(icount),
+			nr_multiple);
+		nr_bad++;
+	}
+
+	fprintf(stdout, "%s: %"PRIu64" multiple counts in %zu bytes\n",
+		what, nr_multiple, o2fsck_icount_bytes(icount));
+
+	o2fsck_icount_free(icount);
+	free(counts);
+}
+
+int main(int argc, char *argv[])
+{
+	struct _ocfs2_filesys fake_fs;
+
+	initialize_ocfs_error_table();
+
+	memset(&fake_fs, 0, sizeof(fake_fs));
+	fake_fs.fs_blocksize = 4096;
+	fake_fs.fs_blocks = 1000003;
+
+	srandom(argc > 1 ? atoi(argv[1]) : 1);
+	run_pass(&fake_fs, "sparse", fake_fs.fs_blocks);
+	run_pass(&fake_fs, "dense", 4000);
+
+	fprintf(stdout, "icount: %s\n", nr_bad ? "_incorrect_" : "correct");
+
+	return !!nr_bad;
+}
+#endif  /* DEBUG_EXE */
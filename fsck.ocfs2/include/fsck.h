@@ -81,6 +81,9 @@ typedef struct _o2fsck_state {
 			ost_skip_o2cb:1,/* -F: ignore cluster services */
 			ost_write_inode_alloc_asked:1,
 			ost_write_inode_alloc:1,
+			ost_inode_allocs_loaded:1, /* pass 1 had every
+						    * inode allocator's
+						    * chains */
 			ost_write_error:1,
 			ost_write_cluster_alloc_asked:1,
  			ost_write_cluster_alloc:1,
@@ -96,6 +99,8 @@ typedef struct _o2fsck_state {
 			ost_show_extended_stats:1;
 	errcode_t ost_err;
 
+	enum io_cache_policy	ost_cache_policy;	/* -C */
+
 	struct o2fsck_resource_track	ost_rt;
 	struct tools_progress		*ost_prog;
 
@@ -25,11 +25,13 @@
 #define __O2FSCK_ICOUNT_H__
 
 #include "ocfs2/ocfs2.h"
-#include "ocfs2/kernel-rbtree.h"
 
 typedef struct _o2fsck_icount {
 	ocfs2_bitmap	*ic_single_bm;
-	struct rb_root	ic_multiple_tree;
+	ocfs2_bitmap	*ic_multiple_bm;
+	uint64_t	*ic_multiple;	/* hash of packed (blkno, count) */
+	unsigned int	ic_hash_bits;
+	uint64_t	ic_nr_multiple;
 } o2fsck_icount;
 
 errcode_t o2fsck_icount_set(o2fsck_icount *icount, uint64_t blkno, 
@@ -41,6 +43,9 @@ void o2fsck_icount_delta(o2fsck_icount *icount, uint64_t blkno,
 			 int delta);
 errcode_t o2fsck_icount_next_blkno(o2fsck_icount *icount, uint64_t start,
 				   uint64_t *found);
+errcode_t o2fsck_icount_reserve(o2fsck_icount *icount, uint64_t nr);
+uint64_t o2fsck_icount_multiple(o2fsck_icount *icount);
+size_t o2fsck_icount_bytes(o2fsck_icount *icount);
 
 #endif /* __O2FSCK_ICOUNT_H__ */
 
@@ -85,6 +85,23 @@ void o2fsck_free_inode_allocs(o2fsck_state *ost)
 		ocfs2_free_cached_inode(ost->ost_fs, ost->ost_inode_allocs[i]);
 }
 
+/* pass 0 leaves an allocator NULL if it couldn't load its chains */
+static int inode_allocs_loaded(o2fsck_state *ost)
+{
+	uint16_t max_slots = OCFS2_RAW_SB(ost->ost_fs->fs_super)->s_max_slots;
+	uint16_t i;
+
+	if (!ost->ost_global_inode_alloc || !ost->ost_inode_allocs)
+		return 0;
+
+	for (i = 0; i < max_slots; i++) {
+		if (!ost->ost_inode_allocs[i])
+			return 0;
+	}
+
+	return 1;
+}
+
 /* update our in memory images of the inode chain alloc bitmaps.  these
  * will be written out at the end of pass1 and the library will read
  * them off disk for use from then on. */
@@ -1443,9 +1460,11 @@ static void write_inode_alloc(o2fsck_state *ost)
 		verbosef("writing slot %d's allocator\n", i);
 
 		ret = ocfs2_write_chain_allocator(ost->ost_fs, *ci);
-		if (ret)
+		if (ret) {
 			com_err(whoami, ret, "while trying to write back slot "
 				"%d's inode allocator", i);
+			ost->ost_inode_allocs_loaded = 0;
+		}
 	}
 
 	o2fsck_free_inode_allocs(ost);
@@ -1467,6 +1486,8 @@ errcode_t o2fsck_pass1(o2fsck_state *ost)
 
 	o2fsck_init_resource_track(&rt, fs->fs_io);
 
+	ost->ost_inode_allocs_loaded = inode_allocs_loaded(ost);
+
 	ret = ocfs2_malloc_block(fs->fs_io, &buf);
 	if (ret) {
 		com_err(whoami, ret, "while allocating inode buffer");
@@ -1005,7 +1005,18 @@ errcode_t o2fsck_pass2(o2fsck_state *ost)
 		goto out;
 	}
 
-	/* 
+	/*
+	 * Every inode pass 1 found with more than one link, directories
+	 * above all, should end up with more than one reference here too.
+	 */
+	ret = o2fsck_icount_reserve(ost->ost_icount_refs,
+			o2fsck_icount_multiple(ost->ost_icount_in_inodes));
+	if (ret) {
+		com_err(whoami, ret, "while allocating the reference counts");
+		goto out;
+	}
+
+	/*
 	 * Mark the root directory's dirent parent as itself if we found the
 	 * inode during inode scanning.  The dir will be created in pass3
 	 * if it didn't exist already.  XXX we should do this for all our other
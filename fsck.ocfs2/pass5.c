@@ -459,7 +459,7 @@ errcode_t o2fsck_pass5(o2fsck_state *ost)
 	errcode_t ret;
 	ocfs2_filesys *fs = ost->ost_fs;
 	struct ocfs2_super_block *super = OCFS2_RAW_SB(fs->fs_super);
-	int has_usrquota, has_grpquota;
+	int has_usrquota, has_grpquota, scan_flags;
 	struct o2fsck_resource_track rt;
 
 	has_usrquota = OCFS2_HAS_RO_COMPAT_FEATURE(super,
@@ -495,7 +495,18 @@ errcode_t o2fsck_pass5(o2fsck_state *ost)
 		if (ret)
 			goto out;
 	}
-	ret = ocfs2_compute_quota_usage(fs, qhash[USRQUOTA], qhash[GRPQUOTA]);
+	/*
+	 * Free inodes charge nothing, so we can skip them if the inode
+	 * alloc bitmaps are right.  They are if pass 1 checked them
+	 * against every allocator and either found nothing to fix or
+	 * wrote its fixes back.
+	 */
+	scan_flags = 0;
+	if (ost->ost_inode_allocs_loaded &&
+	    (!ost->ost_write_inode_alloc_asked || ost->ost_write_inode_alloc))
+		scan_flags = OCFS2_INODE_SCAN_ALLOCATED;
+	ret = ocfs2_compute_quota_usage(fs, qhash[USRQUOTA], qhash[GRPQUOTA],
+					scan_flags);
 	if (ret) {
 		com_err(whoami, ret, "while computing quota usage");
 		goto out;
@@ -236,6 +236,19 @@ static inline void add_timeval(struct timeval *tv1, struct timeval *tv2)
 	}
 }
 
+/* hist1 += hist2, or hist1 = hist2 - hist1 when computing a delta */
+static void add_io_hist(uint64_t *hist1, uint64_t *hist2, int delta)
+{
+	int i, nr = OCFS2_IO_NR_KINDS * OCFS2_IO_HIST_BUCKETS;
+
+	for (i = 0; i < nr; i++) {
+		if (delta)
+			hist1[i] = hist2[i] - hist1[i];
+		else
+			hist1[i] += hist2[i];
+	}
+}
+
 void o2fsck_add_resource_track(struct o2fsck_resource_track *rt1,
 			       struct o2fsck_resource_track *rt2)
 {
@@ -252,7 +265,19 @@ void o2fsck_add_resource_track(struct o2fsck_resource_track *rt1,
 	io1->is_cache_misses += io2->is_cache_misses;
 	io1->is_cache_inserts += io2->is_cache_inserts;
 	io1->is_cache_removes += io2->is_cache_removes;
-
+	io1->is_queue_depth = io2->is_queue_depth;
+	io1->is_queue_reaps += io2->is_queue_reaps;
+	io1->is_queue_inflight += io2->is_queue_inflight;
+	io1->is_cache_policy = io2->is_cache_policy;
+	io1->is_cache_pages = io2->is_cache_pages;
+	io1->is_cache_node = io2->is_cache_node;
+	io1->is_cache_recent_hits += io2->is_cache_recent_hits;
+	io1->is_cache_frequent_hits += io2->is_cache_frequent_hits;
+	io1->is_cache_ghost_hits += io2->is_cache_ghost_hits;
+	io1->is_prefetch_blocks += io2->is_prefetch_blocks;
+	io1->is_prefetch_waits += io2->is_prefetch_waits;
+	add_io_hist(&io1->is_lat_hist[0][0], &io2->is_lat_hist[0][0], 0);
+	add_io_hist(&io1->is_size_hist[0][0], &io2->is_size_hist[0][0], 0);
 }
 
 void o2fsck_compute_resource_track(struct o2fsck_resource_track *rt,
@@ -282,6 +307,67 @@ void o2fsck_compute_resource_track(struct o2fsck_resource_track *rt,
 	rtio->is_cache_misses = ios->is_cache_misses - rtio->is_cache_misses;
 	rtio->is_cache_inserts = ios->is_cache_inserts - rtio->is_cache_inserts;
 	rtio->is_cache_removes = ios->is_cache_removes - rtio->is_cache_removes;
+	rtio->is_queue_depth = ios->is_queue_depth;
+	rtio->is_queue_reaps = ios->is_queue_reaps - rtio->is_queue_reaps;
+	rtio->is_queue_inflight = ios->is_queue_inflight -
+		rtio->is_queue_inflight;
+	rtio->is_cache_policy = ios->is_cache_policy;
+	rtio->is_cache_pages = ios->is_cache_pages;
+	rtio->is_cache_node = ios->is_cache_node;
+	rtio->is_cache_recent_hits = ios->is_cache_recent_hits -
+		rtio->is_cache_recent_hits;
+	rtio->is_cache_frequent_hits = ios->is_cache_frequent_hits -
+		rtio->is_cache_frequent_hits;
+	rtio->is_cache_ghost_hits = ios->is_cache_ghost_hits -
+		rtio->is_cache_ghost_hits;
+	rtio->is_prefetch_blocks = ios->is_prefetch_blocks -
+		rtio->is_prefetch_blocks;
+	rtio->is_prefetch_waits = ios->is_prefetch_waits -
+		rtio->is_prefetch_waits;
+	add_io_hist(&rtio->is_lat_hist[0][0], &ios->is_lat_hist[0][0], 1);
+	add_io_hist(&rtio->is_size_hist[0][0], &ios->is_size_hist[0][0], 1);
+}
+
+/*
+ * Prints the non-empty buckets of a log2 histogram as "bound:count",
+ * where bound is the smallest value the bucket holds.
+ */
+static void print_io_hist(const char *what, uint64_t *hist, int bytes)
+{
+	static const char *units[] = { "", "K", "M", "G" };
+	uint64_t bound;
+	int i, unit;
+
+	printf("    %-6s", what);
+	for (i = 0; i < OCFS2_IO_HIST_BUCKETS; i++) {
+		if (!hist[i])
+			continue;
+		bound = 1ULL << i;
+		for (unit = 0; bytes && (unit < 3) && (bound >= 1024); unit++)
+			bound >>= 10;
+		printf(" %"PRIu64"%s:%"PRIu64, bound, units[unit], hist[i]);
+	}
+	printf("\n");
+}
+
+static void print_io_hists(struct ocfs2_io_stats *rtio)
+{
+	enum ocfs2_io_kind kind;
+	uint64_t requests;
+	int i;
+
+	for (kind = 0; kind < OCFS2_IO_NR_KINDS; kind++) {
+		requests = 0;
+		for (i = 0; i < OCFS2_IO_HIST_BUCKETS; i++)
+			requests += rtio->is_size_hist[kind][i];
+		if (!requests)
+			continue;
+
+		printf("  I/O %s requests: %"PRIu64"\n", io_kind_name(kind),
+		       requests);
+		print_io_hist("usecs", rtio->is_lat_hist[kind], 0);
+		print_io_hist("bytes", rtio->is_size_hist[kind], 1);
+	}
 }
 
 void o2fsck_print_resource_track(char *pass, o2fsck_state *ost,
@@ -289,9 +375,10 @@ void o2fsck_print_resource_track(char *pass, o2fsck_state *ost,
 				 io_channel *channel)
 {
 	struct ocfs2_io_stats *rtio = &rt->rt_io_stats;
-	uint64_t total_io, cache_read;
+	uint64_t total_io, cache_read, cache_lookups;
 	float rtime_s, utime_s, stime_s, walltime;
 	uint32_t rtime_m, utime_m, stime_m;
+	size_t icount_bytes;
 
 	if (!ost->ost_show_stats)
 		return ;
@@ -320,9 +407,23 @@ void o2fsck_print_resource_track(char *pass, o2fsck_state *ost,
 	cache_read = (uint64_t)rtio->is_cache_hits * io_get_blksize(channel);
 	total_io = rtio->is_bytes_read + rtio->is_bytes_written;
 
-	if (!pass)
+	if (!pass) {
 		printf("  Cache size: %luMB\n",
 		       mbytes(io_get_cache_size(channel)));
+		if (io_get_cache_size(channel))
+			printf("  Cache pages: %s, NUMA node: %d\n",
+			       io_cache_pages_name(rtio->is_cache_pages),
+			       rtio->is_cache_node);
+		if (ost->ost_icount_in_inodes && ost->ost_icount_refs) {
+			icount_bytes =
+				o2fsck_icount_bytes(ost->ost_icount_in_inodes) +
+				o2fsck_icount_bytes(ost->ost_icount_refs);
+			printf("  Link counts: %"PRIu64" inodes with more "
+			       "than one, tables: %luKB\n",
+			       o2fsck_icount_multiple(ost->ost_icount_in_inodes),
+			       (unsigned long)(icount_bytes >> 10));
+		}
+	}
 
 	printf("  I/O read disk/cache: %"PRIu64"MB / %"PRIu64"MB, "
 	       "write: %"PRIu64"MB, rate: %.2fMB/s\n",
@@ -330,6 +431,28 @@ void o2fsck_print_resource_track(char *pass, o2fsck_state *ost,
 	       mbytes(cache_read), mbytes(rtio->is_bytes_written),
 	       (double)(mbytes(total_io) / walltime));
 
+	cache_lookups = (uint64_t)rtio->is_cache_hits + rtio->is_cache_misses;
+	if (cache_lookups)
+		printf("  Cache policy: %s, hit ratio: %.1f%% "
+		       "(recent %u, frequent %u, ghost %u)\n",
+		       io_cache_policy_name(rtio->is_cache_policy),
+		       100.0 * rtio->is_cache_hits / cache_lookups,
+		       rtio->is_cache_recent_hits,
+		       rtio->is_cache_frequent_hits,
+		       rtio->is_cache_ghost_hits);
+
+	if (rtio->is_queue_reaps)
+		printf("  I/O queue depth: %u, average in flight: %.1f\n",
+		       rtio->is_queue_depth,
+		       (double)rtio->is_queue_inflight /
+		       rtio->is_queue_reaps);
+
+	if (rtio->is_prefetch_blocks)
+		printf("  Prefetched blocks: %"PRIu64", waited for: %"PRIu64"\n",
+		       rtio->is_prefetch_blocks, rtio->is_prefetch_waits);
+
+	print_io_hists(rtio);
+
 	printf("  Times real: %dm%.3fs, user: %dm%.3fs, sys: %dm%.3fs\n",
 	       rtime_m, rtime_s, utime_m, utime_s, stime_m, stime_s);
 }
@@ -343,6 +466,16 @@ static int cache_blocks;
  */
 static int blocks_cached;
 
+static void verbose_cache_pages(io_channel *channel)
+{
+	struct ocfs2_io_stats stats;
+
+	io_get_stats(channel, &stats);
+	verbosef("Cache is on %s pages, NUMA node %d\n",
+		 io_cache_pages_name(stats.is_cache_pages),
+		 stats.is_cache_node);
+}
+
 void o2fsck_init_cache(o2fsck_state *ost, enum o2fsck_cache_hint hint)
 {
 	errcode_t ret;
@@ -389,6 +522,9 @@ void o2fsck_init_cache(o2fsck_state *ost, enum o2fsck_cache_hint hint)
 	if (blocks_wanted > INT_MAX)
 		blocks_wanted = INT_MAX;
 
+	/* We're about to walk the whole cache from this thread */
+	io_set_cache_local_node(fs->fs_io, true);
+
 	av_blocks = blocks_wanted;
 	avpages = sysconf(_SC_AVPHYS_PAGES);
 	pages_wanted = blocks_wanted * fs->fs_blocksize / getpagesize();
@@ -402,7 +538,8 @@ void o2fsck_init_cache(o2fsck_state *ost, enum o2fsck_cache_hint hint)
 			 blocks_wanted);
 		if (blocks_wanted > av_blocks)
 			blocks_wanted = av_blocks;
-		ret = io_init_cache(fs->fs_io, blocks_wanted);
+		ret = io_init_cache_policy(fs->fs_io, blocks_wanted,
+					   ost->ost_cache_policy);
 		if (!ret) {
 			/*
 			 * We want to pin our cache; there's no point in
@@ -425,6 +562,7 @@ void o2fsck_init_cache(o2fsck_state *ost, enum o2fsck_cache_hint hint)
 			 */
 			if (!leave_room) {
 				cache_blocks = blocks_wanted;
+				verbose_cache_pages(fs->fs_io);
 				break;
 			}
 
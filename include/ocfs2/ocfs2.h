@@ -144,6 +144,8 @@ typedef struct _ocfs2_cached_inode ocfs2_cached_inode;
 typedef struct _ocfs2_cached_dquot ocfs2_cached_dquot;
 typedef struct _io_channel io_channel;
 typedef struct _ocfs2_inode_scan ocfs2_inode_scan;
+typedef struct _ocfs2_parallel_inode_scan ocfs2_parallel_inode_scan;
+typedef struct _ocfs2_ecc_pool ocfs2_ecc_pool;
 typedef struct _ocfs2_dir_scan ocfs2_dir_scan;
 typedef struct _ocfs2_bitmap ocfs2_bitmap;
 typedef struct _ocfs2_devices ocfs2_devices;
@@ -199,6 +201,7 @@ struct _ocfs2_filesys {
 	ocfs2_cached_inode *fs_system_inode_alloc;
 	ocfs2_cached_inode **fs_eb_allocs;
 	ocfs2_cached_inode *fs_system_eb_alloc;
+	int fs_alloc_batch;	/* ocfs2_begin_alloc_batch() depth */
 
 	struct o2dlm_ctxt *fs_dlm_ctxt;
 	struct ocfs2_image_state *ost;
@@ -303,6 +306,11 @@ errcode_t ocfs2_malloc_blocks(io_channel *channel, int num_blocks,
 errcode_t ocfs2_malloc_block(io_channel *channel, void *ptr);
 
 int io_is_device_readonly(io_channel *channel);
+/*
+ * A name of the form "slow:<path>?lat=2ms&bw=200M&qd=32" opens <path>
+ * behind an emulated high-latency device, for benchmarking.  Any of the
+ * options may be left out.
+ */
 errcode_t io_open(const char *name, int flags, io_channel **channel);
 errcode_t io_close(io_channel *channel);
 int io_get_error(io_channel *channel);
@@ -310,6 +318,22 @@ errcode_t io_set_blksize(io_channel *channel, int blksize);
 int io_get_blksize(io_channel *channel);
 int io_get_fd(io_channel *channel);
 
+/*
+ * I/O histograms are log2.  Bucket i counts requests that took
+ * [2^i, 2^(i+1)) usecs, or moved [2^i, 2^(i+1)) bytes.  The last bucket
+ * also counts anything bigger.  A request is one system call, or one
+ * queued read from the time it is prepared until it completes.
+ */
+#define OCFS2_IO_HIST_BUCKETS	32
+
+enum ocfs2_io_kind {
+	OCFS2_IO_READ = 0,	/* pread() */
+	OCFS2_IO_VEC_READ,	/* Queued reads, including prefetches */
+	OCFS2_IO_WRITE,		/* pwrite() */
+	OCFS2_IO_VEC_WRITE,	/* pwritev() of write-back runs */
+	OCFS2_IO_NR_KINDS,
+};
+
 struct ocfs2_io_stats {
 	uint64_t is_bytes_read;
 	uint64_t is_bytes_written;
@@ -317,9 +341,43 @@ struct ocfs2_io_stats {
 	uint32_t is_cache_misses;
 	uint32_t is_cache_inserts;
 	uint32_t is_cache_removes;
+	/*
+	 * Vectored read queue.  is_queue_inflight is the sum of the
+	 * requests in flight each time one completed, so
+	 * is_queue_inflight / is_queue_reaps is the average queue depth
+	 * actually achieved.
+	 */
+	uint32_t is_queue_depth;
+	uint64_t is_queue_reaps;
+	uint64_t is_queue_inflight;
+	/*
+	 * Cache replacement.  Hits are split by the list the block was
+	 * found on: recent for blocks seen once, frequent for blocks seen
+	 * more than once.  LRU only has the recent list.  Ghost hits are
+	 * misses on blocks the policy still remembered stealing.
+	 */
+	uint32_t is_cache_policy;
+	uint32_t is_cache_recent_hits;
+	uint32_t is_cache_frequent_hits;
+	uint32_t is_cache_ghost_hits;
+	/*
+	 * Prefetch.  is_prefetch_waits counts reads and writes that had
+	 * to wait for a prefetch still in flight.
+	 */
+	uint64_t is_prefetch_blocks;
+	uint64_t is_prefetch_waits;
+	/*
+	 * Cache memory.  is_cache_pages is an enum io_cache_pages.
+	 * is_cache_node is the NUMA node the cache prefers, or -1.
+	 */
+	uint32_t is_cache_pages;
+	int32_t is_cache_node;
+	uint64_t is_lat_hist[OCFS2_IO_NR_KINDS][OCFS2_IO_HIST_BUCKETS];
+	uint64_t is_size_hist[OCFS2_IO_NR_KINDS][OCFS2_IO_HIST_BUCKETS];
 };
 
 void io_get_stats(io_channel *channel, struct ocfs2_io_stats *stats);
+const char *io_kind_name(enum ocfs2_io_kind kind);
 
 /*
  * Raw I/O functions.  They will use the I/O cache if available.  The
@@ -344,6 +402,37 @@ errcode_t io_write_block(io_channel *channel, int64_t blkno, int count,
 errcode_t io_write_block_nocache(io_channel *channel, int64_t blkno, int count,
 			 const char *data);
 errcode_t io_init_cache(io_channel *channel, size_t nr_blocks);
+
+/*
+ * Replacement policies for the I/O cache.  io_init_cache() uses LRU.
+ * 2Q and ARC keep blocks that are read once, such as a large scan, from
+ * pushing out blocks that are read again and again.
+ */
+enum io_cache_policy {
+	IO_CACHE_POLICY_LRU = 0,
+	IO_CACHE_POLICY_2Q,
+	IO_CACHE_POLICY_ARC,
+	IO_CACHE_NR_POLICIES,
+};
+errcode_t io_init_cache_policy(io_channel *channel, size_t nr_blocks,
+			       enum io_cache_policy policy);
+const char *io_cache_policy_name(enum io_cache_policy policy);
+
+/*
+ * The pages backing the cache.  Huge pages are tried first, and the
+ * cache falls back to normal ones.  io_set_cache_local_node() makes the
+ * next cache prefer the calling thread's NUMA node.
+ */
+enum io_cache_pages {
+	IO_CACHE_PAGES_NORMAL = 0,
+	IO_CACHE_PAGES_THP,	/* Transparent huge pages asked for */
+	IO_CACHE_PAGES_2M,
+	IO_CACHE_PAGES_1G,
+	IO_CACHE_NR_PAGES,
+};
+void io_set_cache_local_node(io_channel *channel, bool local);
+const char *io_cache_pages_name(enum io_cache_pages pages);
+
 void io_set_nocache(io_channel *channel, bool nocache);
 errcode_t io_init_cache_size(io_channel *channel, size_t bytes);
 size_t io_get_cache_size(io_channel *channel);
@@ -351,6 +440,17 @@ errcode_t io_share_cache(io_channel *from, io_channel *to);
 errcode_t io_mlock_cache(io_channel *channel);
 void io_destroy_cache(io_channel *channel);
 
+/*
+ * Write-back mode keeps written blocks in the I/O cache.  They go to disk
+ * on io_flush(), io_close(), or when they fill half the cache, sorted and
+ * merged into large writes.  io_barrier() marks an ordering point such as
+ * a superblock update: every write before it is on disk before any write
+ * after it.  _nocache writes always go straight to disk.
+ */
+errcode_t io_set_writeback(io_channel *channel, bool writeback);
+errcode_t io_flush(io_channel *channel);
+errcode_t io_barrier(io_channel *channel);
+
 
 struct io_vec_unit {
 	uint64_t	ivu_blkno;
@@ -360,6 +460,123 @@ struct io_vec_unit {
 
 errcode_t io_vec_read_blocks(io_channel *channel, struct io_vec_unit *ivus,
 			     int count);
+/*
+ * io_vec_read_blocks() keeps up to this many reads in flight.  Defaults
+ * to 128.  io_get_queue_depth() returns 0 if the channel has no async
+ * queue and does vectored reads synchronously.
+ */
+errcode_t io_set_queue_depth(io_channel *channel, int depth);
+int io_get_queue_depth(io_channel *channel);
+
+/*
+ * Queue reads into the I/O cache and return without waiting.  A later
+ * read of a prefetched block waits only for that block.  Nothing is
+ * done without a cache or an async queue, or once the blocks in flight
+ * fill half the cache.  The ivu buffers are not used.
+ */
+errcode_t io_prefetch_blocks(io_channel *channel, int64_t blkno, int count);
+errcode_t io_prefetch_vec(io_channel *channel, struct io_vec_unit *ivus,
+			  int count);
+
+/*
+ * io_start_read() starts reading count blocks into data and returns
+ * without waiting.  io_finish_read() waits for the read and returns its
+ * result.  Call it exactly once for every started read, before touching
+ * data.  A read the cache can't satisfy goes to the device through the
+ * async queue, and the blocks it brings in are added to the cache.  A
+ * channel that has no queue, is threaded or mapped, or has dirty cached
+ * blocks reads through the cache in io_start_read() instead.
+ */
+struct io_async_read {
+	struct io_vec_unit	iar_ivu;
+	errcode_t		iar_ret;
+	bool			iar_pending;
+};
+
+errcode_t io_start_read(io_channel *channel, struct io_async_read *iar,
+			int64_t blkno, int count, char *data);
+errcode_t io_finish_read(io_channel *channel, struct io_async_read *iar);
+
+/*
+ * Threaded mode lets many threads do I/O on one channel at once.  The
+ * cache is split into locked shards, stats are kept per thread and
+ * summed by io_get_stats(), and io_get_error() returns the calling
+ * thread's error.  Prefetches do nothing.  Switch modes while no I/O is
+ * running, and before sharing the cache.  Switching flushes the cache
+ * and keeps its blocks; on failure the channel is left as it was.
+ */
+errcode_t io_set_threaded(io_channel *channel, bool threaded);
+bool io_is_threaded(io_channel *channel);
+
+/*
+ * A regular file opened read-only is mmap()ed.  Reads copy from the
+ * mapping and skip the I/O cache, and io_map_block() hands out pointers
+ * into it without copying.  Other channels return
+ * OCFS2_ET_INVALID_ARGUMENT from io_map_block().
+ */
+enum io_access_pattern {
+	IO_ACCESS_NORMAL = 0,
+	IO_ACCESS_SEQUENTIAL,
+	IO_ACCESS_RANDOM,
+	IO_ACCESS_NR_PATTERNS,
+};
+
+errcode_t io_map_block(io_channel *channel, int64_t blkno, int count,
+		       const char **ptr);
+errcode_t io_set_access_pattern(io_channel *channel,
+				enum io_access_pattern pattern);
+
+/*
+ * I/O traces.  io_start_trace() records every request made of the
+ * channel to a file: a header, then one record per request.  A
+ * vectored read gets a record per io_vec_unit; all but the last have
+ * OCFS2_IO_TRACE_MORE set, and the last carries the disk blocks and
+ * time of the whole call.  Everything is little-endian.  If
+ * OCFS2_IO_TRACE is set in the environment, io_open() starts a trace to
+ * that file, adding ".<n>" for every channel after the first.
+ * extras/replay_io_trace re-issues a trace.
+ */
+#define OCFS2_IO_TRACE_MAGIC	"O2IOTRCE"
+#define OCFS2_IO_TRACE_VERSION	1
+
+enum ocfs2_io_trace_op {
+	OCFS2_IO_TRACE_READ = 0,
+	OCFS2_IO_TRACE_WRITE,
+	OCFS2_IO_TRACE_VEC_READ,
+	OCFS2_IO_TRACE_PREFETCH,
+	OCFS2_IO_TRACE_FLUSH,
+	OCFS2_IO_TRACE_BARRIER,
+	OCFS2_IO_TRACE_BLKSIZE,		/* tr_blkno is the new size */
+	OCFS2_IO_TRACE_NR_OPS,
+};
+
+#define OCFS2_IO_TRACE_NOCACHE	0x01	/* _nocache, or io_set_nocache() */
+#define OCFS2_IO_TRACE_MORE	0x02	/* Next record is the same call */
+#define OCFS2_IO_TRACE_ERROR	0x04	/* The request failed */
+
+struct ocfs2_io_trace_header {
+	char th_magic[8];
+	__le32 th_version;
+	__le32 th_blksize;		/* At the start of the trace */
+	__le64 th_start;		/* Seconds since the epoch */
+	__le64 th_reserved;
+};
+
+struct ocfs2_io_trace_record {
+	__le64 tr_time;			/* usecs since the trace started */
+	__le64 tr_blkno;
+	__le32 tr_count;		/* Negative is bytes */
+	__le32 tr_disk;			/* Blocks read or written on disk;
+					   the rest were cache hits */
+	__le32 tr_usecs;		/* How long the call took */
+	__u8 tr_op;
+	__u8 tr_flags;
+	__le16 tr_thread;		/* Per-channel thread number */
+};
+
+errcode_t io_start_trace(io_channel *channel, const char *filename);
+errcode_t io_stop_trace(io_channel *channel);
+const char *io_trace_op_name(enum ocfs2_io_trace_op op);
 
 errcode_t ocfs2_read_super(ocfs2_filesys *fs, uint64_t superblock, char *sb);
 /* Writes the main superblock at OCFS2_SUPER_BLOCK_BLKNO */
@@ -613,6 +830,62 @@ void ocfs2_close_inode_scan(ocfs2_inode_scan *scan);
 errcode_t ocfs2_get_next_inode(ocfs2_inode_scan *scan,
 			       uint64_t *blkno, char *inode);
 uint64_t ocfs2_get_max_inode_count(ocfs2_inode_scan *scan);
+errcode_t ocfs2_inode_scan_ecc_status(ocfs2_inode_scan *scan);
+
+/*
+ * The scan plans its reads ahead and keeps the next readahead of them
+ * in flight, each into its own 4MB buffer, while the caller works
+ * through the current one.  The default is one: double buffering.  Set
+ * it before the first ocfs2_get_next_inode().  The stats say how long
+ * the caller spent waiting on the scan's reads.
+ */
+#define OCFS2_INODE_SCAN_MAX_READAHEAD	16
+struct ocfs2_inode_scan_stats {
+	uint64_t ss_reads;		/* Buffers of inode blocks */
+	uint64_t ss_blocks;		/* Blocks in them */
+	uint64_t ss_desc_reads;		/* Group descriptors */
+	uint64_t ss_wait_us;		/* Waiting on all of the above */
+	uint64_t ss_skipped;		/* Free blocks not read */
+};
+errcode_t ocfs2_inode_scan_set_readahead(ocfs2_inode_scan *scan, int depth);
+
+/*
+ * OCFS2_INODE_SCAN_ALLOCATED reads only the blocks that are allocated
+ * in each group descriptor's bitmap.  Runs of them a few free blocks
+ * apart are read together, and the free blocks in between are still
+ * returned, so callers check i_signature and OCFS2_VALID_FL as before.
+ * Only use it when the bitmaps can be trusted; fsck can't.
+ */
+#define OCFS2_INODE_SCAN_ALLOCATED	0x01
+errcode_t ocfs2_inode_scan_set_flags(ocfs2_inode_scan *scan, int flags);
+void ocfs2_inode_scan_get_stats(ocfs2_inode_scan *scan,
+				struct ocfs2_inode_scan_stats *stats);
+
+/*
+ * A parallel inode scan shares the groups of the inode allocators out
+ * among nr_threads workers, each with its own buffer.  Zero asks for
+ * one per online CPU.  The calling thread is worker 0.  func is called
+ * for every block, as ocfs2_get_next_inode() would return it, from
+ * whichever worker read it and in no particular order.  Blocks are in
+ * disk format and belong to func until it returns.  ecc_status is
+ * ocfs2_inode_scan_ecc_status() for the block.  A nonzero return stops
+ * the scan and is passed back, except OCFS2_ET_ITERATION_COMPLETE,
+ * which just stops it.  The io_channel is put in threaded mode while
+ * the scan is open, or the scan drops to one worker if it can't be.
+ */
+typedef errcode_t (*ocfs2_inode_scan_func)(ocfs2_filesys *fs, int worker,
+					   uint64_t blkno, char *inode,
+					   errcode_t ecc_status,
+					   void *priv_data);
+errcode_t ocfs2_open_inode_scan_parallel(ocfs2_filesys *fs, int nr_threads,
+					 ocfs2_parallel_inode_scan **ret_scan);
+int ocfs2_inode_scan_parallel_workers(ocfs2_parallel_inode_scan *scan);
+errcode_t ocfs2_inode_scan_parallel_set_flags(ocfs2_parallel_inode_scan *scan,
+					      int flags);
+errcode_t ocfs2_inode_scan_parallel_iterate(ocfs2_parallel_inode_scan *scan,
+					    ocfs2_inode_scan_func func,
+					    void *priv_data);
+void ocfs2_close_inode_scan_parallel(ocfs2_parallel_inode_scan *scan);
 
 errcode_t ocfs2_open_dir_scan(ocfs2_filesys *fs, uint64_t dir, int flags,
 			      ocfs2_dir_scan **ret_scan);
@@ -626,6 +899,15 @@ errcode_t ocfs2_cluster_bitmap_new(ocfs2_filesys *fs,
 errcode_t ocfs2_block_bitmap_new(ocfs2_filesys *fs,
 				 const char *description,
 				 ocfs2_bitmap **ret_bitmap);
+/*
+ * A bitmap kept as 64K-bit chunks of sorted bits, runs, or plain
+ * bitmap, whichever is smallest.  Cluster and block bitmaps for large
+ * volumes are made this way.
+ */
+errcode_t ocfs2_compressed_bitmap_new(ocfs2_filesys *fs,
+				      uint64_t total_bits,
+				      const char *description,
+				      ocfs2_bitmap **ret_bitmap);
 void ocfs2_bitmap_free(ocfs2_bitmap **bitmap);
 errcode_t ocfs2_bitmap_set(ocfs2_bitmap *bitmap, uint64_t bitno,
 			   int *oldval);
@@ -694,6 +976,18 @@ errcode_t ocfs2_load_chain_allocator(ocfs2_filesys *fs,
 				     ocfs2_cached_inode *cinode);
 errcode_t ocfs2_write_chain_allocator(ocfs2_filesys *fs,
 				      ocfs2_cached_inode *cinode);
+/*
+ * Allocation batches.  Between ocfs2_begin_alloc_batch() and the
+ * matching ocfs2_end_alloc_batch(), inodes, extent blocks and clusters
+ * allocated or freed through the filesystem's allocators only change
+ * the bitmaps in memory.  The outermost end writes the groups that
+ * changed, once, with ocfs2_write_allocators().  Batches nest.  Until
+ * then the allocators on disk are behind; ocfs2_flush() and
+ * ocfs2_close() catch them up.
+ */
+void ocfs2_begin_alloc_batch(ocfs2_filesys *fs);
+errcode_t ocfs2_end_alloc_batch(ocfs2_filesys *fs);
+errcode_t ocfs2_write_allocators(ocfs2_filesys *fs);
 errcode_t ocfs2_chain_alloc(ocfs2_filesys *fs,
 			    ocfs2_cached_inode *cinode,
 			    uint64_t *gd_blkno,
@@ -897,9 +1191,11 @@ errcode_t ocfs2_find_create_quota_hash(ocfs2_quota_hash *hash, qid_t id,
 errcode_t ocfs2_find_read_quota_hash(ocfs2_filesys *fs, ocfs2_quota_hash *hash,
 				     int type, qid_t id,
 				     ocfs2_cached_dquot **dquotp);
+/* scan_flags are passed on to the inode scan, e.g. OCFS2_INODE_SCAN_* */
 errcode_t ocfs2_compute_quota_usage(ocfs2_filesys *fs,
 				    ocfs2_quota_hash *usr_hash,
-				    ocfs2_quota_hash *grp_hash);
+				    ocfs2_quota_hash *grp_hash,
+				    int scan_flags);
 errcode_t ocfs2_init_quota_change(ocfs2_filesys *fs,
 				  ocfs2_quota_hash **usrhash,
 				  ocfs2_quota_hash **grphash);
@@ -940,6 +1236,20 @@ void ocfs2_compute_meta_ecc(ocfs2_filesys *fs, void *data,
 			    struct ocfs2_block_check *bc);
 errcode_t ocfs2_validate_meta_ecc(ocfs2_filesys *fs, void *data,
 				  struct ocfs2_block_check *bc);
+/*
+ * The same over many blocks, spread across the threads of a pool.
+ * Batches smaller than OCFS2_ECC_POOL_MIN_BATCH run in the caller.
+ */
+#define OCFS2_ECC_POOL_MIN_BATCH	32
+errcode_t ocfs2_ecc_pool_create(int nr_threads, ocfs2_ecc_pool **ret_pool);
+void ocfs2_ecc_pool_destroy(ocfs2_ecc_pool *pool);
+void ocfs2_compute_meta_ecc_batch(ocfs2_filesys *fs, ocfs2_ecc_pool *pool,
+				  void **blocks,
+				  struct ocfs2_block_check **bcs, int count);
+errcode_t ocfs2_validate_meta_ecc_batch(ocfs2_filesys *fs,
+					ocfs2_ecc_pool *pool, void **blocks,
+					struct ocfs2_block_check **bcs,
+					int count, errcode_t *errs);
 /* Low level checksum compute functions.  Use the high-level ones. */
 extern void ocfs2_block_check_compute(void *data, size_t blocksize,
 				      struct ocfs2_block_check *bc);
@@ -31,6 +31,16 @@
 
 #include "ocfs2/ocfs2.h"
 
+/* Inside an allocation batch, ocfs2_end_alloc_batch() does the write */
+static errcode_t ocfs2_write_allocator(ocfs2_filesys *fs,
+				       ocfs2_cached_inode *cinode)
+{
+	if (fs->fs_alloc_batch)
+		return 0;
+
+	return ocfs2_write_chain_allocator(fs, cinode);
+}
+
 static errcode_t ocfs2_chain_alloc_with_io(ocfs2_filesys *fs,
 					   ocfs2_cached_inode *cinode,
 					   uint64_t *gd_blkno,
@@ -49,7 +59,7 @@ static errcode_t ocfs2_chain_alloc_with_io(ocfs2_filesys *fs,
 	if (ret)
 		return ret;
 
-	return ocfs2_write_chain_allocator(fs, cinode);
+	return ocfs2_write_allocator(fs, cinode);
 }
 
 static errcode_t ocfs2_chain_free_with_io(ocfs2_filesys *fs,
@@ -68,7 +78,64 @@ static errcode_t ocfs2_chain_free_with_io(ocfs2_filesys *fs,
 	if (ret)
 		return ret;
 
-	return ocfs2_write_chain_allocator(fs, cinode);
+	return ocfs2_write_allocator(fs, cinode);
+}
+
+static errcode_t ocfs2_write_one_allocator(ocfs2_filesys *fs,
+					   ocfs2_cached_inode *cinode,
+					   errcode_t ret)
+{
+	errcode_t tmp;
+
+	if (!cinode || !cinode->ci_chains)
+		return ret;
+
+	tmp = ocfs2_write_chain_allocator(fs, cinode);
+
+	return ret ? ret : tmp;
+}
+
+/*
+ * Write every allocator the filesystem has loaded.  Only the groups
+ * that changed are written.  Keeps going past errors and returns the
+ * first.
+ */
+errcode_t ocfs2_write_allocators(ocfs2_filesys *fs)
+{
+	errcode_t ret = 0;
+	int i;
+
+	ret = ocfs2_write_one_allocator(fs, fs->fs_cluster_alloc, ret);
+	ret = ocfs2_write_one_allocator(fs, fs->fs_system_inode_alloc, ret);
+	ret = ocfs2_write_one_allocator(fs, fs->fs_system_eb_alloc, ret);
+	for (i = 0; i < OCFS2_RAW_SB(fs->fs_super)->s_max_slots; i++) {
+		if (fs->fs_inode_allocs)
+			ret = ocfs2_write_one_allocator(fs,
+							fs->fs_inode_allocs[i],
+							ret);
+		if (fs->fs_eb_allocs)
+			ret = ocfs2_write_one_allocator(fs,
+							fs->fs_eb_allocs[i],
+							ret);
+	}
+
+	return ret;
+}
+
+void ocfs2_begin_alloc_batch(ocfs2_filesys *fs)
+{
+	fs->fs_alloc_batch++;
+}
+
+errcode_t ocfs2_end_alloc_batch(ocfs2_filesys *fs)
+{
+	if (!fs->fs_alloc_batch)
+		return OCFS2_ET_INVALID_ARGUMENT;
+
+	if (--fs->fs_alloc_batch)
+		return 0;
+
+	return ocfs2_write_allocators(fs);
 }
 
 static errcode_t ocfs2_load_allocator(ocfs2_filesys *fs,
@@ -777,7 +844,7 @@ errcode_t ocfs2_new_clusters(ocfs2_filesys *fs,
 	 * fixing. */
 	*clusters_found = (uint32_t) found;
 
-	ret = ocfs2_write_chain_allocator(fs, fs->fs_cluster_alloc);
+	ret = ocfs2_write_allocator(fs, fs->fs_cluster_alloc);
 	if (ret)
 		ocfs2_free_clusters(fs, requested, *start_blkno);
 
@@ -815,7 +882,7 @@ errcode_t ocfs2_new_specific_cluster(ocfs2_filesys *fs, uint32_t cpos)
 	}
 
 	ocfs2_chain_force_val(fs, fs->fs_cluster_alloc, cpos, 1, NULL);
-	ret = ocfs2_write_chain_allocator(fs, fs->fs_cluster_alloc);
+	ret = ocfs2_write_allocator(fs, fs->fs_cluster_alloc);
 	if (ret)
 		ocfs2_free_clusters(fs, 1,
 				    ocfs2_blocks_to_clusters(fs, cpos));
@@ -841,7 +908,7 @@ errcode_t ocfs2_free_clusters(ocfs2_filesys *fs,
 		goto out;
 
 	/* XXX OK, it's bad if we can't revert this after the io fails */
-	ret = ocfs2_write_chain_allocator(fs, fs->fs_cluster_alloc);
+	ret = ocfs2_write_allocator(fs, fs->fs_cluster_alloc);
 out:
 	return ret;
 }
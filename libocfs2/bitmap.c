@@ -57,6 +57,8 @@ void ocfs2_bitmap_free(ocfs2_bitmap **bitmap)
 		ocfs2_bitmap_free_region(br);
 	}
 
+	if ((*bitmap)->b_index)
+		ocfs2_free(&(*bitmap)->b_index);
 	ocfs2_free(&(*bitmap)->b_description);
 	ocfs2_free(bitmap);
 }
@@ -329,6 +331,85 @@ errcode_t ocfs2_bitmap_foreach_region(ocfs2_bitmap *bitmap,
 	return ret;
 }
 
+/*
+ * Point every index slot that br covers completely at br.  The last
+ * slot ends at b_total_bits.
+ */
+static void ocfs2_bitmap_index_region(ocfs2_bitmap *bitmap,
+				      struct ocfs2_bitmap_region *br)
+{
+	uint64_t slot, slot_end, end = br->br_start_bit + br->br_valid_bits;
+
+	if (!bitmap->b_index)
+		return;
+
+	slot = (br->br_start_bit + bitmap->b_index_bits - 1) /
+		bitmap->b_index_bits;
+	for (; slot < bitmap->b_index_slots; slot++) {
+		slot_end = (slot + 1) * bitmap->b_index_bits;
+		if (slot_end > bitmap->b_total_bits)
+			slot_end = bitmap->b_total_bits;
+		if (slot_end > end)
+			break;
+		bitmap->b_index[slot] = br;
+	}
+}
+
+/* br is going away */
+static void ocfs2_bitmap_unindex_region(ocfs2_bitmap *bitmap,
+				        struct ocfs2_bitmap_region *br)
+{
+	uint64_t slot;
+
+	if (bitmap->b_last == br)
+		bitmap->b_last = NULL;
+	if (!bitmap->b_index)
+		return;
+
+	for (slot = br->br_start_bit / bitmap->b_index_bits;
+	     (slot < bitmap->b_index_slots) &&
+	     ((slot * bitmap->b_index_bits) <
+	      (br->br_start_bit + br->br_valid_bits));
+	     slot++) {
+		if (bitmap->b_index[slot] == br)
+			bitmap->b_index[slot] = NULL;
+	}
+}
+
+/*
+ * Look regions up through a flat index of slot_bits bits per slot as
+ * well as the tree.  Only worth it when the regions are all about
+ * slot_bits long and start on slot boundaries.
+ */
+errcode_t ocfs2_bitmap_set_index(ocfs2_bitmap *bitmap, uint64_t slot_bits)
+{
+	errcode_t ret;
+	struct rb_node *node;
+
+	if (!slot_bits)
+		return OCFS2_ET_INVALID_ARGUMENT;
+
+	if (bitmap->b_index)
+		ocfs2_free(&bitmap->b_index);
+
+	bitmap->b_index_bits = slot_bits;
+	bitmap->b_index_slots = (bitmap->b_total_bits + slot_bits - 1) /
+		slot_bits;
+	ret = ocfs2_malloc0(bitmap->b_index_slots *
+			    sizeof(struct ocfs2_bitmap_region *),
+			    &bitmap->b_index);
+	if (ret)
+		return ret;
+
+	for (node = rb_first(&bitmap->b_regions); node; node = rb_next(node))
+		ocfs2_bitmap_index_region(bitmap,
+					  rb_entry(node,
+						   struct ocfs2_bitmap_region,
+						   br_node));
+
+	return 0;
+}
+
 /*
  * Attempt to merge two regions.  If the merge is successful, 0 will
  * be returned and prev will be the only valid region.  Next will
@@ -400,6 +481,7 @@ static errcode_t ocfs2_bitmap_merge_region(ocfs2_bitmap *bitmap,
 
 done:
 	prev->br_set_bits = prev->br_set_bits + next->br_set_bits;
+	ocfs2_bitmap_unindex_region(bitmap, next);
 	rb_erase(&next->br_node, &bitmap->b_regions);
 	ocfs2_bitmap_free_region(next);
 
@@ -417,6 +499,10 @@ done:
  * _next is only used if a bitmap_region isn't found.  it is set
  * to the next node in the tree greater than the bitmap range
  * that was searched.
+ *
+ * Callers mostly touch bits near the ones they touched last, so
+ * plain lookups try the last region found, then the index, before
+ * the tree.  Those return the region holding bitno.
  */
 static
 struct ocfs2_bitmap_region *ocfs2_bitmap_lookup(ocfs2_bitmap *bitmap, 
@@ -430,6 +516,22 @@ struct ocfs2_bitmap_region *ocfs2_bitmap_lookup(ocfs2_bitmap *bitmap,
 	struct rb_node *parent = NULL, *last_left = NULL;
 	struct ocfs2_bitmap_region *br = NULL;
 
+	if (!ret_p && !ret_parent) {
+		br = bitmap->b_last;
+		if (br && (bitno >= br->br_start_bit) &&
+		    (bitno < (br->br_start_bit + br->br_valid_bits)))
+			return br;
+
+		if (bitmap->b_index) {
+			br = bitmap->b_index[bitno / bitmap->b_index_bits];
+			if (br) {
+				bitmap->b_last = br;
+				return br;
+			}
+		}
+		br = NULL;
+	}
+
 	while (*p)
 	{
 		parent = *p;
@@ -451,14 +553,23 @@ struct ocfs2_bitmap_region *ocfs2_bitmap_lookup(ocfs2_bitmap *bitmap,
 		*ret_parent = parent;
 	if (br == NULL && ret_next != NULL)
 		*ret_next = last_left;
+	if (br && !ret_p && !ret_parent)
+		bitmap->b_last = br;
 	return br;
 }
 
+struct ocfs2_bitmap_region *ocfs2_bitmap_find_region(ocfs2_bitmap *bitmap,
+						     uint64_t bitno)
+{
+	return ocfs2_bitmap_lookup(bitmap, bitno, 1, NULL, NULL, NULL);
+}
+
 errcode_t ocfs2_bitmap_insert_region(ocfs2_bitmap *bitmap,
 				     struct ocfs2_bitmap_region *br)
 {
 	struct ocfs2_bitmap_region *br_tmp;
 	struct rb_node **p, *parent, *node;
+	uint64_t start_bit = br->br_start_bit;
 
 	if (br->br_start_bit > bitmap->b_total_bits)
 		return OCFS2_ET_INVALID_BIT;
@@ -487,6 +598,14 @@ errcode_t ocfs2_bitmap_insert_region(ocfs2_bitmap *bitmap,
 		ocfs2_bitmap_merge_region(bitmap, br, br_tmp);
 	}
 
+	/* Whatever region holds the new bits now, index it */
+	if (bitmap->b_index) {
+		br = ocfs2_bitmap_lookup(bitmap, start_bit, 1, &p, &parent,
+					 NULL);
+		if (br)
+			ocfs2_bitmap_index_region(bitmap, br);
+	}
+
 	return 0;
 }
 
@@ -765,23 +884,35 @@ errcode_t ocfs2_bitmap_clear_range_generic(ocfs2_bitmap *bitmap,
 /*
  * Helper functions for a bitmap with holes in it.
  * If a bit doesn't have memory allocated for it, we allocate.
+ * Holes are filled OCFS2_BITMAP_HOLE_BITS at a time, on
+ * OCFS2_BITMAP_HOLE_BITS boundaries, so the regions can be indexed.
+ * A hole reads as clear, so clearing one needs no memory.
  */
+#define OCFS2_BITMAP_HOLE_BITS	(1 << 15)
+
 errcode_t ocfs2_bitmap_set_holes(ocfs2_bitmap *bitmap,
 				 uint64_t bitno, int *oldval)
 {
 	errcode_t ret;
 	struct ocfs2_bitmap_region *br;
+	uint64_t start = bitno - (bitno % OCFS2_BITMAP_HOLE_BITS);
+	int bits = OCFS2_BITMAP_HOLE_BITS;
 
 	if (!ocfs2_bitmap_set_generic(bitmap, bitno, oldval))
 		return 0;
 
-	ret = ocfs2_bitmap_alloc_region(bitmap, bitno, 0, 1, &br);
+	if ((start + bits) > bitmap->b_total_bits)
+		bits = bitmap->b_total_bits - start;
+
+	ret = ocfs2_bitmap_alloc_region(bitmap, start, 0, bits, &br);
 	if (ret)
 		return ret;
 
 	ret = ocfs2_bitmap_insert_region(bitmap, br);
-	if (ret)
+	if (ret) {
+		ocfs2_bitmap_free_region(br);
 		return ret;
+	}
 
 	return ocfs2_bitmap_set_generic(bitmap, bitno, oldval);
 }
@@ -789,19 +920,18 @@ errcode_t ocfs2_bitmap_set_holes(ocfs2_bitmap *bitmap,
 errcode_t ocfs2_bitmap_clear_holes(ocfs2_bitmap *bitmap,
 				   uint64_t bitno, int *oldval)
 {
-	errcode_t ret;
-	struct ocfs2_bitmap_region *br;
-
-	if (!ocfs2_bitmap_clear_generic(bitmap, bitno, oldval))
-		return 0;
+	if (ocfs2_bitmap_clear_generic(bitmap, bitno, oldval) && oldval)
+		*oldval = 0;
 
-	ret = ocfs2_bitmap_alloc_region(bitmap, bitno, 0, 1, &br);
-	if (ret)
-		return ret;
-
-	ret = ocfs2_bitmap_insert_region(bitmap, br);
+	return 0;
+}
 
-	return ret;
+static int ocfs2_bitmap_merge_holes(ocfs2_bitmap *bitmap,
+				    struct ocfs2_bitmap_region *prev,
+				    struct ocfs2_bitmap_region *next)
+{
+	/* Keep one region per index slot */
+	return 0;
 }
 
 errcode_t ocfs2_bitmap_test_holes(ocfs2_bitmap *bitmap,
@@ -878,9 +1008,9 @@ static struct ocfs2_bitmap_operations global_cluster_ops = {
 	.clear_range		= ocfs2_bitmap_clear_range_generic,
 };
 
-errcode_t ocfs2_cluster_bitmap_new(ocfs2_filesys *fs,
-				   const char *description,
-				   ocfs2_bitmap **ret_bitmap)
+static errcode_t flat_cluster_bitmap_new(ocfs2_filesys *fs,
+					 const char *description,
+					 ocfs2_bitmap **ret_bitmap)
 {
 	errcode_t ret;
 	ocfs2_bitmap *bitmap;
@@ -900,9 +1030,16 @@ errcode_t ocfs2_cluster_bitmap_new(ocfs2_filesys *fs,
 
 	bitoff = 0;
 	max_bits = INT_MAX - (fs->fs_clustersize - 1);
+	if (num_bits > max_bits) {
+		ret = ocfs2_bitmap_set_index(bitmap, max_bits);
+		if (ret) {
+			ocfs2_bitmap_free(&bitmap);
+			return ret;
+		}
+	}
 	while (bitoff < num_bits) {
-		alloc_bits = num_bits;
-		if (num_bits > max_bits)
+		alloc_bits = num_bits - bitoff;
+		if (alloc_bits > max_bits)
 			alloc_bits = max_bits;
 		ret = ocfs2_bitmap_alloc_region(bitmap, bitoff, 0,
 						alloc_bits, &br);
@@ -926,6 +1063,18 @@ errcode_t ocfs2_cluster_bitmap_new(ocfs2_filesys *fs,
 	return 0;
 }
 
+errcode_t ocfs2_cluster_bitmap_new(ocfs2_filesys *fs,
+				   const char *description,
+				   ocfs2_bitmap **ret_bitmap)
+{
+	if (fs->fs_clusters >= OCFS2_COMPRESSED_BITMAP_MIN_BITS)
+		return ocfs2_compressed_bitmap_new(fs, fs->fs_clusters,
+						   description ? description :
+						   "Generic cluster bitmap",
+						   ret_bitmap);
+
+	return flat_cluster_bitmap_new(fs, description, ret_bitmap);
+}
 
 static struct ocfs2_bitmap_operations global_block_ops = {
 	.set_bit		= ocfs2_bitmap_set_holes,
@@ -933,6 +1082,7 @@ static struct ocfs2_bitmap_operations global_block_ops = {
 	.test_bit		= ocfs2_bitmap_test_holes,
 	.find_next_set		= ocfs2_bitmap_find_next_set_holes,
 	.find_next_clear	= ocfs2_bitmap_find_next_clear_holes,
+	.merge_region		= ocfs2_bitmap_merge_holes,
 	/* XXX can't allocate a range yet, would need to fill holes and merge
 	 * with adjacent */
 };
@@ -944,6 +1094,12 @@ errcode_t ocfs2_block_bitmap_new(ocfs2_filesys *fs,
 	errcode_t ret;
 	ocfs2_bitmap *bitmap;
 
+	if (fs->fs_blocks >= OCFS2_COMPRESSED_BITMAP_MIN_BITS)
+		return ocfs2_compressed_bitmap_new(fs, fs->fs_blocks,
+						   description ? description :
+						   "Generic block bitmap",
+						   ret_bitmap);
+
 	ret = ocfs2_bitmap_new(fs,
 			       fs->fs_blocks,
 			       description ? description :
@@ -954,6 +1110,12 @@ errcode_t ocfs2_block_bitmap_new(ocfs2_filesys *fs,
 	if (ret)
 		return ret;
 
+	ret = ocfs2_bitmap_set_index(bitmap, OCFS2_BITMAP_HOLE_BITS);
+	if (ret) {
+		ocfs2_bitmap_free(&bitmap);
+		return ret;
+	}
+
 	*ret_bitmap = bitmap;
 
 	return 0;
@@ -964,6 +1126,7 @@ errcode_t ocfs2_block_bitmap_new(ocfs2_filesys *fs,
 #include <stdlib.h>
 #include <getopt.h>
 #include <limits.h>
+#include <time.h>
 
 static uint64_t read_number(const char *num)
 {
@@ -980,7 +1143,8 @@ static uint64_t read_number(const char *num)
 static void print_usage(void)
 {
 	fprintf(stderr,
-		"debug_bitmap [-a] <filename>\n");
+		"debug_bitmap [-a] <filename>\n"
+		"debug_bitmap -B [-s <volume bytes>] [-c <cluster bytes>]\n");
 }
 
 extern int opterr, optind;
@@ -1191,23 +1355,211 @@ static void run_test(ocfs2_bitmap *bitmap)
 	}
 }
 
+/*
+ * Benchmarks for the bit searches and counts on a cluster bitmap the
+ * size of a big volume.  The default is 64TB in 64KB clusters, a
+ * billion bits.  No device is needed.
+ */
+#define BENCH_SPARSE	4096	/* One bit in this many is the odd one */
+
+static double bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+static void bench_report(const char *what, uint64_t nbits, uint64_t ops,
+			 double secs)
+{
+	fprintf(stdout,
+		"%-28s %10"PRIu64" ops %8.3fs %8.1f Gbit/s %10.1f ns/op\n",
+		what, ops, secs, nbits / secs / 1e9,
+		ops ? secs * 1e9 / ops : 0.0);
+}
+
+static errcode_t bench_count_region(struct ocfs2_bitmap_region *br,
+				    void *private_data)
+{
+	uint64_t *set_bits = private_data;
+
+	br->br_set_bits = ocfs2_get_bits_set(br->br_bitmap,
+					     br->br_total_bits,
+					     br->br_bitmap_start);
+	*set_bits += br->br_set_bits;
+
+	return 0;
+}
+
+/* Fill every region with val, then flip one bit in BENCH_SPARSE */
+static errcode_t bench_fill(ocfs2_bitmap *bitmap, int val)
+{
+	errcode_t ret = 0;
+	struct rb_node *node;
+	struct ocfs2_bitmap_region *br;
+	uint64_t bitno, set_bits = 0;
+
+	for (node = rb_first(&bitmap->b_regions); node; node = rb_next(node)) {
+		br = rb_entry(node, struct ocfs2_bitmap_region, br_node);
+		memset(br->br_bitmap, val ? 0xff : 0, br->br_bytes);
+	}
+	ocfs2_bitmap_foreach_region(bitmap, bench_count_region, &set_bits);
+	bitmap->b_set_bits = set_bits;
+
+	srandom(1);
+	for (bitno = random() % BENCH_SPARSE; bitno < bitmap->b_total_bits;
+	     bitno += 1 + (random() % (2 * BENCH_SPARSE))) {
+		if (val)
+			ret = ocfs2_bitmap_clear(bitmap, bitno, NULL);
+		else
+			ret = ocfs2_bitmap_set(bitmap, bitno, NULL);
+		if (ret)
+			break;
+	}
+
+	return ret;
+}
+
+/* Visit every bit that isn't the fill value */
+static void bench_walk(ocfs2_bitmap *bitmap, int val, const char *what)
+{
+	errcode_t (*find)(ocfs2_bitmap *, uint64_t, uint64_t *) =
+		val ? ocfs2_bitmap_find_next_clear :
+		ocfs2_bitmap_find_next_set;
+	uint64_t start = 0, found, ops = 0;
+	double t;
+
+	t = bench_now();
+	while ((start < bitmap->b_total_bits) &&
+	       !find(bitmap, start, &found)) {
+		ops++;
+		start = found + 1;
+	}
+	bench_report(what, bitmap->b_total_bits, ops, bench_now() - t);
+}
+
+static void bench_count(ocfs2_bitmap *bitmap, const char *what)
+{
+	uint64_t set_bits = 0;
+	double t;
+
+	t = bench_now();
+	ocfs2_bitmap_foreach_region(bitmap, bench_count_region, &set_bits);
+	bench_report(what, bitmap->b_total_bits, 1, bench_now() - t);
+
+	if (set_bits != ocfs2_bitmap_get_set_bits(bitmap))
+		fprintf(stdout, "Counted %"PRIu64" bits, expected %"PRIu64"\n",
+			set_bits, ocfs2_bitmap_get_set_bits(bitmap));
+}
+
+/* Grab runs of 8 from a full bitmap until they're all gone */
+static void bench_alloc(ocfs2_bitmap *bitmap, const char *what)
+{
+	uint64_t first, found, ops = 0;
+	double t;
+
+	t = bench_now();
+	while ((ops < 100) &&
+	       !ocfs2_bitmap_alloc_range(bitmap, 1, 8, &first, &found))
+		ops++;
+	bench_report(what, 0, ops, bench_now() - t);
+}
+
+static int run_benchmarks(uint64_t volsize, uint64_t clustersize)
+{
+	errcode_t ret;
+	struct _ocfs2_filesys fake_fs;
+	ocfs2_bitmap *bitmap;
+
+	memset(&fake_fs, 0, sizeof(fake_fs));
+	fake_fs.fs_clustersize = clustersize;
+	if (!clustersize || ((volsize / clustersize) > UINT32_MAX)) {
+		fprintf(stderr, "%"PRIu64" bytes is too many %"PRIu64
+			" byte clusters\n", volsize, clustersize);
+		return 1;
+	}
+	fake_fs.fs_clusters = volsize / clustersize;
+
+	ret = flat_cluster_bitmap_new(&fake_fs, "Benchmark", &bitmap);
+	if (ret) {
+		com_err("run_benchmarks", ret, "while creating bitmap");
+		return 1;
+	}
+	fprintf(stdout, "%"PRIu64" bits, one in %d set or clear\n",
+		bitmap->b_total_bits, BENCH_SPARSE);
+
+	ret = bench_fill(bitmap, 0);
+	if (!ret) {
+		bench_walk(bitmap, 0, "find_next_set (sparse)");
+		bench_count(bitmap, "get_bits_set (sparse)");
+		ret = bench_fill(bitmap, 1);
+	}
+	if (!ret) {
+		bench_walk(bitmap, 1, "find_next_clear (dense)");
+		bench_count(bitmap, "get_bits_set (dense)");
+		bench_alloc(bitmap, "alloc_range 1-8 (dense)");
+	}
+	if (ret)
+		com_err("run_benchmarks", ret, "while filling bitmap");
+
+	ocfs2_bitmap_free(&bitmap);
+	if (ret)
+		return 1;
+
+	/* The same sparse bitmap, compressed */
+	ret = ocfs2_compressed_bitmap_new(&fake_fs, fake_fs.fs_clusters,
+					  "Benchmark", &bitmap);
+	if (ret) {
+		com_err("run_benchmarks", ret, "while creating bitmap");
+		return 1;
+	}
+
+	ret = bench_fill(bitmap, 0);
+	if (!ret) {
+		bench_walk(bitmap, 0, "find_next_set (compressed)");
+		fprintf(stdout, "Compressed to %"PRIu64" bytes, "
+			"%"PRIu64" flat\n",
+			ocfs2_compressed_bitmap_bytes(bitmap, NULL, NULL, NULL),
+			(bitmap->b_total_bits + 7) / 8);
+	} else
+		com_err("run_benchmarks", ret, "while filling bitmap");
+
+	ocfs2_bitmap_free(&bitmap);
+
+	return !!ret;
+}
+
 int main(int argc, char *argv[])
 {
 	errcode_t ret;
 	int c;
-	int alloc = 0;
+	int alloc = 0, bench = 0;
+	uint64_t volsize = 64ULL << 40, clustersize = 64 << 10;
 	char *filename;
 	ocfs2_filesys *fs;
 	ocfs2_bitmap *bitmap;
 
 	initialize_ocfs_error_table();
 
-	while ((c = getopt(argc, argv, "a")) != EOF) {
+	while ((c = getopt(argc, argv, "aBs:c:")) != EOF) {
 		switch (c) {
 			case 'a':
 				alloc = 1;
 				break;
 
+			case 'B':
+				bench = 1;
+				break;
+
+			case 's':
+				volsize = read_number(optarg);
+				break;
+
+			case 'c':
+				clustersize = read_number(optarg);
+				break;
+
 			default:
 				print_usage();
 				return 1;
@@ -1215,6 +1567,9 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (bench)
+		return run_benchmarks(volsize, clustersize);
+
 	if (optind >= argc) {
 		fprintf(stderr, "Missing filename\n");
 		print_usage();
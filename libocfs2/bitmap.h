@@ -82,6 +82,15 @@ struct _ocfs2_bitmap {
 	struct ocfs2_bitmap_operations *b_ops;
 	struct rb_root b_regions;
 	void *b_private;
+	struct ocfs2_bitmap_region *b_last;	/* Last region looked up */
+	/*
+	 * Optional flat index, for bitmaps whose regions are all the
+	 * same size.  Slot i points to the region holding every bit from
+	 * i * b_index_bits up to the next slot, if one does.
+	 */
+	uint64_t b_index_bits;
+	uint64_t b_index_slots;
+	struct ocfs2_bitmap_region **b_index;
 };
 
 
@@ -102,6 +111,9 @@ errcode_t ocfs2_bitmap_realloc_region(ocfs2_bitmap *bitmap,
 				      int total_bits);
 errcode_t ocfs2_bitmap_insert_region(ocfs2_bitmap *bitmap,
 				     struct ocfs2_bitmap_region *br);
+errcode_t ocfs2_bitmap_set_index(ocfs2_bitmap *bitmap, uint64_t slot_bits);
+struct ocfs2_bitmap_region *ocfs2_bitmap_find_region(ocfs2_bitmap *bitmap,
+						     uint64_t bitno);
 typedef errcode_t (*ocfs2_bitmap_foreach_func)(struct ocfs2_bitmap_region *br,
 					       void *private_data);
 errcode_t ocfs2_bitmap_foreach_region(ocfs2_bitmap *bitmap,
@@ -139,4 +151,14 @@ errcode_t ocfs2_bitmap_find_next_set_holes(ocfs2_bitmap *bitmap,
 errcode_t ocfs2_bitmap_find_next_clear_holes(ocfs2_bitmap *bitmap,
 					     uint64_t start,
 					     uint64_t *found);
+
+/*
+ * Cluster and block bitmaps with at least this many bits are
+ * compressed.  Flat, it would be 2MB.
+ */
+#define OCFS2_COMPRESSED_BITMAP_MIN_BITS	(1ULL << 24)
+
+uint64_t ocfs2_compressed_bitmap_bytes(ocfs2_bitmap *bitmap,
+				       uint64_t *nr_array, uint64_t *nr_run,
+				       uint64_t *nr_bitmap);
 #endif  /* _BITMAP_H */
@@ -29,6 +29,20 @@
 #endif
 
 #include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+#if defined(__aarch64__) && defined(__GNUC__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+# ifndef HWCAP_CRC32
+#  define HWCAP_CRC32	(1 << 7)
+# endif
+#endif
 
 #include "ocfs2/ocfs2.h"
 #include "ocfs2/bitops.h"
@@ -37,15 +51,904 @@
 #include "crc32table.h"
 
 
-static inline unsigned int hc_hweight32(unsigned int w)
-{
-	unsigned int res = (w & 0x55555555) + ((w >> 1) & 0x55555555);
-	res = (res & 0x33333333) + ((res >> 2) & 0x33333333);
-	res = (res & 0x0F0F0F0F) + ((res >> 4) & 0x0F0F0F0F);
-	res = (res & 0x00FF00FF) + ((res >> 8) & 0x00FF00FF);
-	return (res & 0x0000FFFF) + ((res >> 16) & 0x0000FFFF);
+/* The encoders are picked for this CPU on first use */
+static pthread_once_t blockcheck_once = PTHREAD_ONCE_INIT;
+static void blockcheck_init(void);
+
+static inline unsigned int hc_hweight32(unsigned int w)
+{
+	unsigned int res = (w & 0x55555555) + ((w >> 1) & 0x55555555);
+	res = (res & 0x33333333) + ((res >> 2) & 0x33333333);
+	res = (res & 0x0F0F0F0F) + ((res >> 4) & 0x0F0F0F0F);
+	res = (res & 0x00FF00FF) + ((res >> 8) & 0x00FF00FF);
+	return (res & 0x0000FFFF) + ((res >> 16) & 0x0000FFFF);
+}
+
+/*
+ * Hamming code bit numbers are 1-based, and every power of two is a
+ * parity bit.  Data bit k (0-based) is code bit k + 1 + P, where P is
+ * the number of parity bits before it.  P is j + 1 for the data bits
+ * between code bits 2^j and 2^(j+1), which are data bits
+ * [2^j - j - 1, 2^(j+1) - j - 2).  We call that run segment j.
+ *
+ * The ecc is the xor of the code bit numbers of all the set data bits.
+ * Going bit by bit is slow, so we go a 64-bit word at a time.  Within
+ * a segment, bit r of data word w (hunk-relative, so nr is folded into
+ * c) is code bit 64 * w + r + c.  Split c into c_hi = c / 64 and
+ * c_lo = c % 64.  Then the code bit is
+ *
+ *	64 * (w + c_hi)     + (r + c_lo)	if r + c_lo < 64
+ *	64 * (w + c_hi + 1) + (r + c_lo - 64)	otherwise
+ *
+ * The low six bits are just the word rotated left by c_lo.  Rotated
+ * words from everywhere can be xored together, and the xor of the bit
+ * numbers set in the result is the low six bits of the ecc.  The high
+ * bits are 64 * (w + c_hi) for each set bit below the wrap, and one
+ * more word for each above it.  Only the parity of each count matters.
+ *
+ * That is a rotate, two parities, and a few xors per word.  Runs of
+ * whole words go through hamming_words_impl, which is AVX2 on CPUs
+ * that have it.
+ */
+static void (*hamming_words_impl)(const unsigned char *data, unsigned int w,
+				  unsigned int end, unsigned int c,
+				  uint64_t *rot, uint32_t *hi);
+
+static inline uint64_t hamming_load(const unsigned char *data,
+				    unsigned int w)
+{
+	uint64_t v;
+
+	memcpy(&v, data + ((size_t)w * 8), sizeof(v));
+	return le64_to_cpu(v);
+}
+
+/* Word w of a d-bit hunk.  The last one may be short. */
+static inline uint64_t hamming_load_last(const unsigned char *data,
+					 unsigned int d, unsigned int w)
+{
+	size_t bytes = ((size_t)d + 7) / 8 - ((size_t)w * 8);
+	unsigned char tmp[8] = { 0, };
+
+	if (bytes >= 8)
+		return hamming_load(data, w);
+	memcpy(tmp, data + ((size_t)w * 8), bytes);
+	return hamming_load(tmp, 0);
+}
+
+static inline void hamming_word(uint64_t x, unsigned int w, unsigned int c,
+				uint64_t *rot, uint32_t *hi)
+{
+	unsigned int sh = c & 63;
+	uint32_t high = (w + (c >> 6)) << 6;
+	uint64_t lo = sh ? x & ((1ULL << (64 - sh)) - 1) : x;
+
+	*rot ^= sh ? (x << sh) | (x >> (64 - sh)) : x;
+	*hi ^= high & -(uint32_t)__builtin_parityll(lo);
+	*hi ^= (high + 64) & -(uint32_t)__builtin_parityll(x ^ lo);
+}
+
+static void hamming_words(const unsigned char *data, unsigned int w,
+			  unsigned int end, unsigned int c, uint64_t *rot,
+			  uint32_t *hi)
+{
+	for (; w < end; w++)
+		hamming_word(hamming_load(data, w), w, c, rot, hi);
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+/* Each 64-bit lane becomes all ones if it has odd parity, else zero */
+static inline __m256i hamming_parity_avx2(__m256i x, __m256i nibbles)
+	__attribute__((target("avx2")));
+static inline __m256i hamming_parity_avx2(__m256i x, __m256i nibbles)
+{
+	x = _mm256_xor_si256(x, _mm256_srli_epi64(x, 32));
+	x = _mm256_xor_si256(x, _mm256_srli_epi64(x, 16));
+	x = _mm256_xor_si256(x, _mm256_srli_epi64(x, 8));
+	x = _mm256_xor_si256(x, _mm256_srli_epi64(x, 4));
+	x = _mm256_and_si256(x, _mm256_set1_epi64x(0xf));
+	x = _mm256_shuffle_epi8(nibbles, x);
+	return _mm256_sub_epi64(_mm256_setzero_si256(), x);
+}
+
+/* hamming_words() four words at a time */
+static void hamming_words_avx2(const unsigned char *data, unsigned int w,
+			       unsigned int end, unsigned int c,
+			       uint64_t *rot, uint32_t *hi)
+	__attribute__((target("avx2")));
+static void hamming_words_avx2(const unsigned char *data, unsigned int w,
+			       unsigned int end, unsigned int c,
+			       uint64_t *rot, uint32_t *hi)
+{
+	unsigned int sh = c & 63;
+	const __m256i nibbles = _mm256_setr_epi8(0, 1, 1, 0, 1, 0, 0, 1,
+						 1, 0, 0, 1, 0, 1, 1, 0,
+						 0, 1, 1, 0, 1, 0, 0, 1,
+						 1, 0, 0, 1, 0, 1, 1, 0);
+	const __m256i lomask = _mm256_set1_epi64x(sh ?
+						  (1ULL << (64 - sh)) - 1 :
+						  ~0ULL);
+	const __m256i step = _mm256_set1_epi64x(4 << 6);
+	const __m128i shl = _mm_cvtsi32_si128(sh);
+	const __m128i shr = _mm_cvtsi32_si128(64 - sh);
+	__m256i x, lo, high, vrot, vhi;
+	uint64_t lanes[4];
+	uint32_t h;
+
+	if ((end - w) < 4) {
+		hamming_words(data, w, end, c, rot, hi);
+		return;
+	}
+
+	h = (w + (c >> 6)) << 6;
+	high = _mm256_setr_epi64x(h, h + 64, h + 128, h + 192);
+	vrot = _mm256_setzero_si256();
+	vhi = _mm256_setzero_si256();
+
+	for (; (end - w) >= 4; w += 4) {
+		x = _mm256_loadu_si256((const __m256i *)(data + ((size_t)w * 8)));
+		vrot = _mm256_xor_si256(vrot,
+					_mm256_or_si256(_mm256_sll_epi64(x, shl),
+							_mm256_srl_epi64(x, shr)));
+		lo = _mm256_and_si256(x, lomask);
+		vhi = _mm256_xor_si256(vhi,
+				       _mm256_and_si256(high,
+					hamming_parity_avx2(lo, nibbles)));
+		vhi = _mm256_xor_si256(vhi,
+				       _mm256_and_si256(
+					_mm256_add_epi64(high,
+							 _mm256_set1_epi64x(64)),
+					hamming_parity_avx2(_mm256_xor_si256(x, lo),
+							    nibbles)));
+		high = _mm256_add_epi64(high, step);
+	}
+
+	_mm256_storeu_si256((__m256i *)lanes, vrot);
+	*rot ^= lanes[0] ^ lanes[1] ^ lanes[2] ^ lanes[3];
+	_mm256_storeu_si256((__m256i *)lanes, vhi);
+	*hi ^= (uint32_t)(lanes[0] ^ lanes[1] ^ lanes[2] ^ lanes[3]);
+
+	hamming_words(data, w, end, c, rot, hi);
+}
+#endif
+
+/* The xor of the numbers of the bits set in x */
+static inline uint32_t hamming_xor_index(uint64_t x)
+{
+	return __builtin_parityll(x & 0xAAAAAAAAAAAAAAAAULL) |
+		(__builtin_parityll(x & 0xCCCCCCCCCCCCCCCCULL) << 1) |
+		(__builtin_parityll(x & 0xF0F0F0F0F0F0F0F0ULL) << 2) |
+		(__builtin_parityll(x & 0xFF00FF00FF00FF00ULL) << 3) |
+		(__builtin_parityll(x & 0xFFFF0000FFFF0000ULL) << 4) |
+		(__builtin_parityll(x & 0xFFFFFFFF00000000ULL) << 5);
+}
+
+/* Bits [a, b) of a d-bit hunk, where code bit = bit + c */
+static void hamming_range(const unsigned char *data, unsigned int d,
+			  unsigned int a, unsigned int b, unsigned int c,
+			  uint64_t *rot, uint32_t *hi)
+{
+	unsigned int wa = a / 64, wb = (b - 1) / 64;
+	uint64_t first = ~0ULL << (a % 64);
+	uint64_t last = ~0ULL >> (63 - ((b - 1) % 64));
+
+	if (wa == wb) {
+		hamming_word(hamming_load_last(data, d, wa) & first & last,
+			     wa, c, rot, hi);
+		return;
+	}
+
+	hamming_word(hamming_load(data, wa) & first, wa, c, rot, hi);
+	hamming_words_impl(data, wa + 1, wb, c, rot, hi);
+	hamming_word(hamming_load_last(data, d, wb) & last, wb, c, rot, hi);
+}
+
+/*
+ * This is the low level encoder function.  It can be called across
+ * multiple hunks just like the crc32 code.  'd' is the number of bits
+ * _in_this_hunk_.  nr is the bit offset of this hunk.  So, if you had
+ * two 512B buffers, you would do it like so:
+ *
+ * parity = ocfs2_hamming_encode(0, buf1, 512 * 8, 0);
+ * parity = ocfs2_hamming_encode(parity, buf2, 512 * 8, 512 * 8);
+ *
+ * If you just have one buffer, use ocfs2_hamming_encode_block().
+ */
+uint32_t ocfs2_hamming_encode(uint32_t parity, void *data, unsigned int d,
+			      unsigned int nr)
+{
+	uint64_t seg_start, seg_end, rot = 0;
+	uint64_t hunk_end = (uint64_t)nr + d;
+	uint32_t hi = 0;
+	unsigned int j, a, b;
+
+	if (!d)
+		abort();
+
+	pthread_once(&blockcheck_once, blockcheck_init);
+
+	/* Segment j holds the data bits between code bits 2^j and 2^(j+1) */
+	for (j = 1; j < 32; j++) {
+		seg_start = (1ULL << j) - j - 1;
+		seg_end = (1ULL << (j + 1)) - j - 2;
+		if (seg_end <= nr)
+			continue;
+		if (seg_start >= hunk_end)
+			break;
+
+		a = (seg_start > nr) ? seg_start - nr : 0;
+		b = ((seg_end < hunk_end) ? seg_end : hunk_end) - nr;
+		hamming_range(data, d, a, b, nr + j + 2, &rot, &hi);
+	}
+
+	/* While the data buffer was treated as little endian, the
+	 * return value is in host endian. */
+	return parity ^ hi ^ hamming_xor_index(rot);
+}
+
+uint32_t ocfs2_hamming_encode_block(void *data, unsigned int blocksize)
+{
+	return ocfs2_hamming_encode(0, data, blocksize * 8, 0);
+}
+
+/*
+ * Like ocfs2_hamming_encode(), this can handle hunks.  nr is the bit
+ * offset of the current hunk.  If bit to be fixed is not part of the
+ * current hunk, this does nothing.
+ *
+ * If you only have one hunk, use ocfs2_hamming_fix_block().
+ */
+void ocfs2_hamming_fix(void *data, unsigned int d, unsigned int nr,
+		       unsigned int fix)
+{
+	unsigned int i;
+
+	if (!d)
+		abort();
+
+	/*
+	 * If the bit to fix has an hweight of 1, it's a parity bit.  One
+	 * busted parity bit is its own error.  Nothing to do here.
+	 */
+	if (!fix || (hc_hweight32(fix) == 1))
+		return;
+
+	/*
+	 * Below code bit fix are the parity bits 1, 2, 4, ... up to its
+	 * highest bit.  The rest are data bits, and fix is the next.
+	 */
+	i = fix - 1 - (32 - __builtin_clz(fix));
+
+	/* If the fix is outside this hunk, nothing to do */
+	if ((i < nr) || ((i - nr) >= d))
+		return;
+
+	i -= nr;
+	if (ocfs2_test_bit(i, data))
+		ocfs2_clear_bit(i, data);
+	else
+		ocfs2_set_bit(i, data);
+}
+
+void ocfs2_hamming_fix_block(void *data, unsigned int blocksize,
+			     unsigned int fix)
+{
+	ocfs2_hamming_fix(data, blocksize * 8, 0, fix);
+}
+
+/*
+ * table-based crc32_le() stolen from the kernel.  This is the one we know
+ * the filesystem is using.
+ *
+ * RFC 3385 shows that the 802.3 crc32 (this one) has the same properties
+ * and probabilities as crc32c (which iSCSI uses) for data blocks < 2^16
+ * bits.  We fit.
+ *
+ * Every metadata block read or written on a metaecc filesystem goes
+ * through here, so there is more than one implementation.  The portable
+ * one is slicing-by-8: eight 256-entry tables let us fold in eight bytes
+ * with eight independent lookups instead of one dependent lookup per
+ * byte.  The tables are built from crc32table_le on first use.  Where
+ * the CPU can do better, crc32_le() uses that instead:
+ *
+ *  - x86-64 with PCLMULQDQ folds 64 bytes at a time with carry-less
+ *    multiplies, as the kernel's crc32-pclmul does.
+ *  - aarch64 with the CRC32 extension has instructions that compute
+ *    this very crc eight bytes at a time.
+ *
+ * All of them return the same answer; the DEBUG_EXE main() checks that.
+ */
+static uint32_t crc32_slice_table[8][256];
+static uint32_t (*crc32_le_impl)(uint32_t crc, unsigned char const *p,
+				 size_t len);
+
+/* Unaligned and host endian, whatever the host */
+static inline uint32_t crc32_load_le32(unsigned char const *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return le32_to_cpu(v);
+}
+
+static uint32_t crc32_le_sb8(uint32_t crc, unsigned char const *p,
+			     size_t len)
+{
+	uint32_t (*t)[256] = crc32_slice_table;
+	uint32_t q, r;
+
+	/* Get aligned for the loads */
+	while (len && ((unsigned long)p & 7)) {
+		crc = t[0][(crc ^ *p++) & 255] ^ (crc >> 8);
+		len--;
+	}
+
+	while (len >= 8) {
+		q = crc ^ crc32_load_le32(p);
+		r = crc32_load_le32(p + 4);
+		crc = t[7][q & 255] ^ t[6][(q >> 8) & 255] ^
+			t[5][(q >> 16) & 255] ^ t[4][q >> 24] ^
+			t[3][r & 255] ^ t[2][(r >> 8) & 255] ^
+			t[1][(r >> 16) & 255] ^ t[0][r >> 24];
+		p += 8;
+		len -= 8;
+	}
+
+	while (len--)
+		crc = t[0][(crc ^ *p++) & 255] ^ (crc >> 8);
+
+	return crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+/*
+ * Folding with PCLMULQDQ, after Intel's "Fast CRC Computation for
+ * Generic Polynomials Using PCLMULQDQ Instruction" and the kernel's
+ * arch/x86/crypto/crc32-pclmul_asm.S, where the constants come from.
+ * Four 128-bit lanes are folded 64 bytes ahead until the data runs
+ * out, then into one lane, then down to 32 bits with a Barrett
+ * reduction.  Whatever is left over, less than 16 bytes, goes through
+ * slicing-by-8.
+ */
+static inline __m128i crc32_fold(__m128i x, __m128i k, __m128i data)
+	__attribute__((target("pclmul")));
+static inline __m128i crc32_fold(__m128i x, __m128i k, __m128i data)
+{
+	return _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00),
+					   _mm_clmulepi64_si128(x, k, 0x11)),
+			     data);
+}
+
+static uint32_t crc32_le_pclmul(uint32_t crc, unsigned char const *p,
+				size_t len) __attribute__((target("pclmul")));
+static uint32_t crc32_le_pclmul(uint32_t crc, unsigned char const *p,
+				size_t len)
+{
+	const __m128i r2r1 = _mm_set_epi64x(0x00000001c6e41596ULL,
+					    0x0000000154442bd4ULL);
+	const __m128i r4r3 = _mm_set_epi64x(0x00000000ccaa009eULL,
+					    0x00000001751997d0ULL);
+	const __m128i r5 = _mm_set_epi64x(0, 0x0000000163cd6124ULL);
+	const __m128i ru_poly = _mm_set_epi64x(0x00000001f7011641ULL,
+					       0x00000001db710641ULL);
+	const __m128i mask32 = _mm_set_epi32(0, 0, 0, ~0);
+	const __m128i *b = (const __m128i *)p;
+	__m128i x1, x2, x3, x4, t;
+
+	if (len < 64)
+		return crc32_le_sb8(crc, p, len);
+
+	x1 = _mm_xor_si128(_mm_loadu_si128(b), _mm_cvtsi32_si128(crc));
+	x2 = _mm_loadu_si128(b + 1);
+	x3 = _mm_loadu_si128(b + 2);
+	x4 = _mm_loadu_si128(b + 3);
+	b += 4;
+	len -= 64;
+
+	while (len >= 64) {
+		x1 = crc32_fold(x1, r2r1, _mm_loadu_si128(b));
+		x2 = crc32_fold(x2, r2r1, _mm_loadu_si128(b + 1));
+		x3 = crc32_fold(x3, r2r1, _mm_loadu_si128(b + 2));
+		x4 = crc32_fold(x4, r2r1, _mm_loadu_si128(b + 3));
+		b += 4;
+		len -= 64;
+	}
+
+	x1 = crc32_fold(x1, r4r3, x2);
+	x1 = crc32_fold(x1, r4r3, x3);
+	x1 = crc32_fold(x1, r4r3, x4);
+
+	while (len >= 16) {
+		x1 = crc32_fold(x1, r4r3, _mm_loadu_si128(b));
+		b++;
+		len -= 16;
+	}
+
+	/* 128 bits down to 64, then 32 */
+	t = _mm_clmulepi64_si128(r4r3, x1, 0x01);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), t);
+
+	t = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), r5, 0x00);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 4), t);
+
+	/* Barrett reduction */
+	t = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), ru_poly, 0x10);
+	t = _mm_clmulepi64_si128(_mm_and_si128(t, mask32), ru_poly, 0x00);
+	x1 = _mm_xor_si128(x1, t);
+	crc = _mm_cvtsi128_si32(_mm_srli_si128(x1, 4));
+
+	return crc32_le_sb8(crc, (unsigned char const *)b, len);
+}
+
+static int crc32_have_pclmul(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return 0;
+	return !!(ecx & bit_PCLMUL);
+}
+#endif
+
+#if defined(__aarch64__) && defined(__GNUC__) && \
+	(__BYTE_ORDER == __LITTLE_ENDIAN)
+/*
+ * The ARMv8 CRC32 instructions use our polynomial, bit-reflected, with
+ * no inversion.  That is crc32_le() exactly.
+ */
+static uint32_t crc32_le_arm64(uint32_t crc, unsigned char const *p,
+			       size_t len) __attribute__((target("+crc")));
+static uint32_t crc32_le_arm64(uint32_t crc, unsigned char const *p,
+			       size_t len)
+{
+	uint64_t v;
+
+	while (len && ((unsigned long)p & 7)) {
+		crc = __crc32b(crc, *p++);
+		len--;
+	}
+
+	while (len >= 8) {
+		memcpy(&v, p, sizeof(v));
+		crc = __crc32d(crc, v);
+		p += 8;
+		len -= 8;
+	}
+
+	while (len--)
+		crc = __crc32b(crc, *p++);
+
+	return crc;
+}
+
+static int crc32_have_arm64(void)
+{
+	return !!(getauxval(AT_HWCAP) & HWCAP_CRC32);
+}
+#endif
+
+static void blockcheck_init(void)
+{
+	uint32_t c;
+	int i, j;
+
+	/* crc32table_le is stored little endian */
+	for (i = 0; i < 256; i++)
+		crc32_slice_table[0][i] = le32_to_cpu(crc32table_le[i]);
+
+	for (i = 0; i < 256; i++) {
+		c = crc32_slice_table[0][i];
+		for (j = 1; j < 8; j++) {
+			c = crc32_slice_table[0][c & 255] ^ (c >> 8);
+			crc32_slice_table[j][i] = c;
+		}
+	}
+
+	crc32_le_impl = crc32_le_sb8;
+#if defined(__x86_64__) && defined(__GNUC__)
+	if (crc32_have_pclmul())
+		crc32_le_impl = crc32_le_pclmul;
+#endif
+#if defined(__aarch64__) && defined(__GNUC__) && \
+	(__BYTE_ORDER == __LITTLE_ENDIAN)
+	if (crc32_have_arm64())
+		crc32_le_impl = crc32_le_arm64;
+#endif
+
+	hamming_words_impl = hamming_words;
+#if defined(__x86_64__) && defined(__GNUC__)
+	if (__builtin_cpu_supports("avx2"))
+		hamming_words_impl = hamming_words_avx2;
+#endif
+}
+
+/**
+ * crc32_le() - Calculate bitwise little-endian Ethernet AUTODIN II CRC32
+ * @crc - seed value for computation.  ~0 for Ethernet, sometimes 0 for
+ *        other uses, or the previous crc32 value if computing incrementally.
+ * @p   - pointer to buffer over which CRC is run
+ * @len - length of buffer @p
+ *
+ */
+uint32_t crc32_le(uint32_t crc, unsigned char const *p, size_t len)
+{
+	pthread_once(&blockcheck_once, blockcheck_init);
+	return crc32_le_impl(crc, p, len);
+}
+
+/*
+ * This function generates check information for a block.
+ * data is the block to be checked.  bc is a pointer to the
+ * ocfs2_block_check structure describing the crc32 and the ecc.
+ *
+ * bc should be a pointer inside data, as the function will
+ * take care of zeroing it before calculating the check information.  If
+ * bc does not point inside data, the caller must make sure any inline
+ * ocfs2_block_check structures are zeroed.
+ *
+ * The data buffer must be in on-disk endian (little endian for ocfs2).
+ * bc will be filled with little-endian values and will be ready to go to
+ * disk.
+ */
+void ocfs2_block_check_compute(void *data, size_t blocksize,
+			       struct ocfs2_block_check *bc)
+{
+	uint32_t crc;
+	uint16_t ecc;
+
+	memset(bc, 0, sizeof(struct ocfs2_block_check));
+
+	crc = crc32_le(~0, data, blocksize);
+	/* We know this will return max 16 bits */
+	ecc = (uint16_t)ocfs2_hamming_encode_block(data, blocksize);
+
+	bc->bc_crc32e = cpu_to_le32(crc);
+	bc->bc_ecc = cpu_to_le16(ecc);  /* We know it's max 16 bits */
+}
+
+/*
+ * This function validates existing check information.  Like _compute,
+ * the function will take care of zeroing bc before calculating check codes.
+ * If bc is not a pointer inside data, the caller must have zeroed any
+ * inline ocfs2_block_check structures.
+ *
+ * Again, the data passed in should be the on-disk endian.
+ */
+errcode_t ocfs2_block_check_validate(void *data, size_t blocksize,
+				     struct ocfs2_block_check *bc)
+{
+	errcode_t err = 0;
+	struct ocfs2_block_check check;
+	uint32_t crc, ecc;
+
+	check.bc_crc32e = le32_to_cpu(bc->bc_crc32e);
+	check.bc_ecc = le16_to_cpu(bc->bc_ecc);
+
+	memset(bc, 0, sizeof(struct ocfs2_block_check));
+
+	/* Fast path - if the crc32 validates, we're good to go */
+	crc = crc32_le(~0, data, blocksize);
+	if (crc == check.bc_crc32e)
+		goto out;
+
+	/* Ok, try ECC fixups */
+	ecc = ocfs2_hamming_encode_block(data, blocksize);
+	ocfs2_hamming_fix_block(data, blocksize, ecc ^ check.bc_ecc);
+
+	/* And check the crc32 again */
+	crc = crc32_le(~0, data, blocksize);
+	if (crc == check.bc_crc32e)
+		goto out;
+
+	err = OCFS2_ET_BAD_CRC32;
+
+out:
+	bc->bc_crc32e = cpu_to_le32(check.bc_crc32e);
+	bc->bc_ecc = cpu_to_le16(check.bc_ecc);
+
+	return err;
+}
+
+/*
+ * These are the main API.  They check the superblock flag before
+ * calling the underlying operations.
+ *
+ * They expect the buffer to be in disk format.
+ */
+void ocfs2_compute_meta_ecc(ocfs2_filesys *fs, void *data,
+			    struct ocfs2_block_check *bc)
+{
+	if (ocfs2_meta_ecc(OCFS2_RAW_SB(fs->fs_super)))
+		ocfs2_block_check_compute(data, fs->fs_blocksize, bc);
+}
+
+errcode_t ocfs2_validate_meta_ecc(ocfs2_filesys *fs, void *data,
+				  struct ocfs2_block_check *bc)
+{
+	errcode_t err = 0;
+
+	if (ocfs2_meta_ecc(OCFS2_RAW_SB(fs->fs_super)) &&
+	    !(fs->fs_flags & OCFS2_FLAG_NO_ECC_CHECKS))
+		err = ocfs2_block_check_validate(data, fs->fs_blocksize, bc);
+
+	return err;
+}
+
+/*
+ * Batch versions of the above for tools that check thousands of blocks
+ * at a time.  The blocks are shared out among the threads of an
+ * ocfs2_ecc_pool in chunks of ECC_BATCH_CHUNK, with the calling thread
+ * taking its share.  Without a pool, or for a batch too small to be
+ * worth waking anyone, the caller does the whole batch itself.
+ */
+#define ECC_BATCH_CHUNK		(OCFS2_ECC_POOL_MIN_BATCH / 2)
+#define ECC_POOL_MAX_THREADS	64
+
+struct ecc_batch {
+	size_t b_blocksize;
+	int b_validate;
+	void **b_blocks;
+	struct ocfs2_block_check **b_bcs;
+	errcode_t *b_errs;
+	int b_count;
+	int b_next;		/* Next unclaimed block */
+	errcode_t b_ret;	/* Set if any block failed, under ep_lock */
+};
+
+struct _ocfs2_ecc_pool {
+	pthread_mutex_t ep_lock;
+	pthread_cond_t ep_work;		/* Workers wait here for a batch */
+	pthread_cond_t ep_done;		/* The submitter waits here */
+	pthread_t *ep_threads;
+	int ep_nr_threads;
+	int ep_busy;			/* Workers not done with ep_batch */
+	int ep_shutdown;
+	unsigned long ep_generation;	/* Bumped for each batch */
+	struct ecc_batch *ep_batch;
+};
+
+static errcode_t ecc_batch_run(struct ecc_batch *b)
+{
+	int i, end;
+	errcode_t err, ret = 0;
+
+	for (;;) {
+		i = __sync_fetch_and_add(&b->b_next, ECC_BATCH_CHUNK);
+		if (i >= b->b_count)
+			break;
+		end = i + ECC_BATCH_CHUNK;
+		if (end > b->b_count)
+			end = b->b_count;
+
+		for (; i < end; i++) {
+			if (!b->b_validate) {
+				ocfs2_block_check_compute(b->b_blocks[i],
+							  b->b_blocksize,
+							  b->b_bcs[i]);
+				continue;
+			}
+
+			err = ocfs2_block_check_validate(b->b_blocks[i],
+							 b->b_blocksize,
+							 b->b_bcs[i]);
+			if (b->b_errs)
+				b->b_errs[i] = err;
+			if (err)
+				ret = err;
+		}
+	}
+
+	return ret;
+}
+
+static void *ecc_pool_worker(void *arg)
+{
+	ocfs2_ecc_pool *pool = arg;
+	unsigned long seen = 0;
+	struct ecc_batch *b;
+	errcode_t err;
+
+	pthread_mutex_lock(&pool->ep_lock);
+	for (;;) {
+		while (!pool->ep_shutdown && (pool->ep_generation == seen))
+			pthread_cond_wait(&pool->ep_work, &pool->ep_lock);
+		if (pool->ep_shutdown)
+			break;
+
+		seen = pool->ep_generation;
+		b = pool->ep_batch;
+		pthread_mutex_unlock(&pool->ep_lock);
+
+		err = ecc_batch_run(b);
+
+		pthread_mutex_lock(&pool->ep_lock);
+		if (err)
+			b->b_ret = err;
+		if (!--pool->ep_busy)
+			pthread_cond_signal(&pool->ep_done);
+	}
+	pthread_mutex_unlock(&pool->ep_lock);
+
+	return NULL;
+}
+
+static void ecc_batch_submit(ocfs2_ecc_pool *pool, struct ecc_batch *b)
+{
+	errcode_t err;
+
+	pthread_once(&blockcheck_once, blockcheck_init);
+
+	if (!pool || !pool->ep_nr_threads ||
+	    (b->b_count < OCFS2_ECC_POOL_MIN_BATCH)) {
+		b->b_ret = ecc_batch_run(b);
+		return;
+	}
+
+	pthread_mutex_lock(&pool->ep_lock);
+	pool->ep_batch = b;
+	pool->ep_busy = pool->ep_nr_threads;
+	pool->ep_generation++;
+	pthread_cond_broadcast(&pool->ep_work);
+	pthread_mutex_unlock(&pool->ep_lock);
+
+	err = ecc_batch_run(b);
+
+	/* Every worker must be out of the batch before it goes away */
+	pthread_mutex_lock(&pool->ep_lock);
+	if (err)
+		b->b_ret = err;
+	while (pool->ep_busy)
+		pthread_cond_wait(&pool->ep_done, &pool->ep_lock);
+	pool->ep_batch = NULL;
+	pthread_mutex_unlock(&pool->ep_lock);
+}
+
+static void ecc_pool_stop(ocfs2_ecc_pool *pool)
+{
+	int i;
+
+	pthread_mutex_lock(&pool->ep_lock);
+	pool->ep_shutdown = 1;
+	pthread_cond_broadcast(&pool->ep_work);
+	pthread_mutex_unlock(&pool->ep_lock);
+
+	for (i = 0; i < pool->ep_nr_threads; i++)
+		pthread_join(pool->ep_threads[i], NULL);
+	pool->ep_nr_threads = 0;
+}
+
+/*
+ * Start a pool of nr_threads workers.  The thread submitting a batch
+ * works on it too, so zero asks for one worker per online CPU but
+ * one.  On a single CPU that leaves an empty pool, which is fine; the
+ * batch calls just run serially.
+ */
+errcode_t ocfs2_ecc_pool_create(int nr_threads, ocfs2_ecc_pool **ret_pool)
+{
+	errcode_t ret;
+	ocfs2_ecc_pool *pool;
+	long cpus;
+
+	if (nr_threads <= 0) {
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		nr_threads = (cpus > 1) ? cpus - 1 : 0;
+	}
+	if (nr_threads > ECC_POOL_MAX_THREADS)
+		nr_threads = ECC_POOL_MAX_THREADS;
+
+	ret = ocfs2_malloc0(sizeof(struct _ocfs2_ecc_pool), &pool);
+	if (ret)
+		return ret;
+
+	if (nr_threads) {
+		ret = ocfs2_malloc0(sizeof(pthread_t) * nr_threads,
+				    &pool->ep_threads);
+		if (ret) {
+			ocfs2_free(&pool);
+			return ret;
+		}
+	}
+
+	pthread_mutex_init(&pool->ep_lock, NULL);
+	pthread_cond_init(&pool->ep_work, NULL);
+	pthread_cond_init(&pool->ep_done, NULL);
+
+	while (pool->ep_nr_threads < nr_threads) {
+		if (pthread_create(&pool->ep_threads[pool->ep_nr_threads],
+				   NULL, ecc_pool_worker, pool))
+			break;
+		pool->ep_nr_threads++;
+	}
+
+	/* A pool short a few threads still works, one with none does not */
+	if (!pool->ep_nr_threads && nr_threads) {
+		ocfs2_ecc_pool_destroy(pool);
+		return OCFS2_ET_NO_MEMORY;
+	}
+
+	*ret_pool = pool;
+	return 0;
+}
+
+void ocfs2_ecc_pool_destroy(ocfs2_ecc_pool *pool)
+{
+	if (!pool)
+		return;
+
+	ecc_pool_stop(pool);
+	pthread_cond_destroy(&pool->ep_done);
+	pthread_cond_destroy(&pool->ep_work);
+	pthread_mutex_destroy(&pool->ep_lock);
+	ocfs2_free(&pool->ep_threads);
+	ocfs2_free(&pool);
+}
+
+/*
+ * Compute the check codes of count blocks.  blocks[i] is in disk format
+ * and bcs[i] points at its ocfs2_block_check, as for
+ * ocfs2_compute_meta_ecc().  pool may be NULL.
+ */
+void ocfs2_compute_meta_ecc_batch(ocfs2_filesys *fs, ocfs2_ecc_pool *pool,
+				  void **blocks,
+				  struct ocfs2_block_check **bcs, int count)
+{
+	struct ecc_batch b = {
+		.b_blocksize = fs->fs_blocksize,
+		.b_blocks = blocks,
+		.b_bcs = bcs,
+		.b_count = count,
+	};
+
+	if (ocfs2_meta_ecc(OCFS2_RAW_SB(fs->fs_super)))
+		ecc_batch_submit(pool, &b);
+}
+
+/*
+ * Validate count blocks, fixing what the ECC can fix.  If errs is not
+ * NULL, errs[i] gets the result for blocks[i].  Returns
+ * OCFS2_ET_BAD_CRC32 if any block could not be fixed.
+ */
+errcode_t ocfs2_validate_meta_ecc_batch(ocfs2_filesys *fs,
+					ocfs2_ecc_pool *pool, void **blocks,
+					struct ocfs2_block_check **bcs,
+					int count, errcode_t *errs)
+{
+	struct ecc_batch b = {
+		.b_blocksize = fs->fs_blocksize,
+		.b_validate = 1,
+		.b_blocks = blocks,
+		.b_bcs = bcs,
+		.b_errs = errs,
+		.b_count = count,
+	};
+
+	if (ocfs2_meta_ecc(OCFS2_RAW_SB(fs->fs_super)) &&
+	    !(fs->fs_flags & OCFS2_FLAG_NO_ECC_CHECKS))
+		ecc_batch_submit(pool, &b);
+	else if (errs)
+		memset(errs, 0, sizeof(errcode_t) * count);
+
+	return b.b_ret;
 }
 
+#ifdef DEBUG_EXE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <assert.h>
+#include <errno.h>
+
+/*
+ * hamming_encode_bitwise() and hamming_fix_bitwise() are the bit at a
+ * time versions that ocfs2_hamming_encode() and ocfs2_hamming_fix()
+ * replaced.
+ */
 /*
  * Calculate the bit offset in the hamming code buffer based on the bit's
  * offset in the data buffer.  Since the hamming code reserves all
@@ -96,19 +999,8 @@ static unsigned int calc_code_bit(unsigned int i, unsigned int *p_cache)
 	return b;
 }
 
-/*
- * This is the low level encoder function.  It can be called across
- * multiple hunks just like the crc32 code.  'd' is the number of bits
- * _in_this_hunk_.  nr is the bit offset of this hunk.  So, if you had
- * two 512B buffers, you would do it like so:
- *
- * parity = ocfs2_hamming_encode(0, buf1, 512 * 8, 0);
- * parity = ocfs2_hamming_encode(parity, buf2, 512 * 8, 512 * 8);
- *
- * If you just have one buffer, use ocfs2_hamming_encode_block().
- */
-uint32_t ocfs2_hamming_encode(uint32_t parity, void *data, unsigned int d,
-			      unsigned int nr)
+static uint32_t hamming_encode_bitwise(uint32_t parity, void *data,
+				       unsigned int d, unsigned int nr)
 {
 	unsigned int i, b, p = 0;
 
@@ -156,20 +1048,8 @@ uint32_t ocfs2_hamming_encode(uint32_t parity, void *data, unsigned int d,
 	return parity;
 }
 
-uint32_t ocfs2_hamming_encode_block(void *data, unsigned int blocksize)
-{
-	return ocfs2_hamming_encode(0, data, blocksize * 8, 0);
-}
-
-/*
- * Like ocfs2_hamming_encode(), this can handle hunks.  nr is the bit
- * offset of the current hunk.  If bit to be fixed is not part of the
- * current hunk, this does nothing.
- *
- * If you only have one hunk, use ocfs2_hamming_fix_block().
- */
-void ocfs2_hamming_fix(void *data, unsigned int d, unsigned int nr,
-		       unsigned int fix)
+static void hamming_fix_bitwise(void *data, unsigned int d, unsigned int nr,
+				unsigned int fix)
 {
 	unsigned int i, b;
 
@@ -225,30 +1105,12 @@ void ocfs2_hamming_fix(void *data, unsigned int d, unsigned int nr,
 	}
 }
 
-void ocfs2_hamming_fix_block(void *data, unsigned int blocksize,
-			     unsigned int fix)
-{
-	ocfs2_hamming_fix(data, blocksize * 8, 0, fix);
-}
-
 /*
- * table-based crc32_le() stolen from the kernel.  This is the one we know
- * the filesystem is using.
- *
- * RFC 3385 shows that the 802.3 crc32 (this one) has the same properties
- * and probabilities as crc32c (which iSCSI uses) for data blocks < 2^16
- * bits.  We fit.
- */
-
-/**
- * crc32_le() - Calculate bitwise little-endian Ethernet AUTODIN II CRC32
- * @crc - seed value for computation.  ~0 for Ethernet, sometimes 0 for
- *        other uses, or the previous crc32 value if computing incrementally.
- * @p   - pointer to buffer over which CRC is run
- * @len - length of buffer @p
- *
+ * crc32_le_orig() is the byte-at-a-time crc32_le() from the kernel that
+ * we started with.  Every faster one has to agree with it.
  */
-uint32_t crc32_le(uint32_t crc, unsigned char const *p, size_t len)
+static uint32_t crc32_le_orig(uint32_t crc, unsigned char const *p,
+			      size_t len)
 {
 	const uint32_t      *b =(uint32_t *)p;
 	const uint32_t      *tab = crc32table_le;
@@ -296,117 +1158,6 @@ uint32_t crc32_le(uint32_t crc, unsigned char const *p, size_t len)
 #undef DO_CRC
 }
 
-/*
- * This function generates check information for a block.
- * data is the block to be checked.  bc is a pointer to the
- * ocfs2_block_check structure describing the crc32 and the ecc.
- *
- * bc should be a pointer inside data, as the function will
- * take care of zeroing it before calculating the check information.  If
- * bc does not point inside data, the caller must make sure any inline
- * ocfs2_block_check structures are zeroed.
- *
- * The data buffer must be in on-disk endian (little endian for ocfs2).
- * bc will be filled with little-endian values and will be ready to go to
- * disk.
- */
-void ocfs2_block_check_compute(void *data, size_t blocksize,
-			       struct ocfs2_block_check *bc)
-{
-	uint32_t crc;
-	uint16_t ecc;
-
-	memset(bc, 0, sizeof(struct ocfs2_block_check));
-
-	crc = crc32_le(~0, data, blocksize);
-	/* We know this will return max 16 bits */
-	ecc = (uint16_t)ocfs2_hamming_encode_block(data, blocksize);
-
-	bc->bc_crc32e = cpu_to_le32(crc);
-	bc->bc_ecc = cpu_to_le16(ecc);  /* We know it's max 16 bits */
-}
-
-/*
- * This function validates existing check information.  Like _compute,
- * the function will take care of zeroing bc before calculating check codes.
- * If bc is not a pointer inside data, the caller must have zeroed any
- * inline ocfs2_block_check structures.
- *
- * Again, the data passed in should be the on-disk endian.
- */
-errcode_t ocfs2_block_check_validate(void *data, size_t blocksize,
-				     struct ocfs2_block_check *bc)
-{
-	errcode_t err = 0;
-	struct ocfs2_block_check check;
-	uint32_t crc, ecc;
-
-	check.bc_crc32e = le32_to_cpu(bc->bc_crc32e);
-	check.bc_ecc = le16_to_cpu(bc->bc_ecc);
-
-	memset(bc, 0, sizeof(struct ocfs2_block_check));
-
-	/* Fast path - if the crc32 validates, we're good to go */
-	crc = crc32_le(~0, data, blocksize);
-	if (crc == check.bc_crc32e)
-		goto out;
-
-	/* Ok, try ECC fixups */
-	ecc = ocfs2_hamming_encode_block(data, blocksize);
-	ocfs2_hamming_fix_block(data, blocksize, ecc ^ check.bc_ecc);
-
-	/* And check the crc32 again */
-	crc = crc32_le(~0, data, blocksize);
-	if (crc == check.bc_crc32e)
-		goto out;
-
-	err = OCFS2_ET_BAD_CRC32;
-
-out:
-	bc->bc_crc32e = cpu_to_le32(check.bc_crc32e);
-	bc->bc_ecc = cpu_to_le16(check.bc_ecc);
-
-	return err;
-}
-
-/*
- * These are the main API.  They check the superblock flag before
- * calling the underlying operations.
- *
- * They expect the buffer to be in disk format.
- */
-void ocfs2_compute_meta_ecc(ocfs2_filesys *fs, void *data,
-			    struct ocfs2_block_check *bc)
-{
-	if (ocfs2_meta_ecc(OCFS2_RAW_SB(fs->fs_super)))
-		ocfs2_block_check_compute(data, fs->fs_blocksize, bc);
-}
-
-errcode_t ocfs2_validate_meta_ecc(ocfs2_filesys *fs, void *data,
-				  struct ocfs2_block_check *bc)
-{
-	errcode_t err = 0;
-
-	if (ocfs2_meta_ecc(OCFS2_RAW_SB(fs->fs_super)) &&
-	    !(fs->fs_flags & OCFS2_FLAG_NO_ECC_CHECKS))
-		err = ocfs2_block_check_validate(data, fs->fs_blocksize, bc);
-
-	return err;
-}
-
-#ifdef DEBUG_EXE
-#include <stdio.h>
-#include <string.h>
-#include <stdlib.h>
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <unistd.h>
-#include <fcntl.h>
-#include <sys/time.h>
-#include <sys/resource.h>
-#include <assert.h>
-#include <errno.h>
-
 /*
  * The function hamming_encode_orig() is my original, tested version.  It's
  * slow.  We work from it to make a faster one.
@@ -777,24 +1528,118 @@ static void timeme(struct run_context *ct)
 		sys_diff.tv_sec, sys_diff.tv_usec);
 }
 
+struct crc32_context {
+	struct run_context cc_rc;
+	uint32_t cc_crc;
+	int cc_crc_valid;
+	uint32_t (*cc_crc32)(uint32_t crc, unsigned char const *p,
+			     size_t len);
+};
+
+#define rc_to_cc(_rc) ((struct crc32_context *)(_rc))
+
 static void crc32_func(struct run_context *ct, int nr)
 {
 	uint32_t crc = ~0;
+	struct crc32_context *cc = rc_to_cc(ct);
+
+	crc = cc->cc_crc32(crc, ct->rc_data, ct->rc_size);
+
+	if (cc->cc_crc_valid) {
+		if (cc->cc_crc != crc) {
+			fprintf(stderr,
+				"Calculated crc %"PRIu32" != saved crc %"PRIu32"\n",
+				crc, cc->cc_crc);
+			exit(1);
+		}
+	} else {
+		assert(!nr);
+		cc->cc_crc = crc;
+		cc->cc_crc_valid = 1;
+	}
+}
 
-	crc = crc32_le(crc, ct->rc_data, ct->rc_size);
+/*
+ * Every length up to 1K at every alignment up to 16, then the whole
+ * buffer.  That covers the head, body and tail of each implementation.
+ */
+static void check_crc32(const char *name, char *buf, int size,
+			uint32_t (*crc32)(uint32_t crc, unsigned char const *p,
+					  size_t len))
+{
+	int off, len;
+	uint32_t seed, want, got;
+
+	for (off = 0; off < 16; off++) {
+		for (len = 0; ((off + len) <= size) && (len <= 1024); len++) {
+			seed = ~0 - off;
+			want = crc32_le_orig(seed, (unsigned char *)buf + off,
+					     len);
+			got = crc32(seed, (unsigned char *)buf + off, len);
+			if (want != got) {
+				fprintf(stderr,
+					"%s: crc %"PRIu32" != %"PRIu32" at "
+					"offset %d, length %d\n",
+					name, got, want, off, len);
+				exit(1);
+			}
+		}
+	}
 }
 
 static void run_crc32(char *buf, int size, int count)
 {
-	struct run_context ct = {
-		.rc_name = "CRC32",
-		.rc_data = buf,
-		.rc_size = size,
-		.rc_count = count,
-		.rc_func = crc32_func,
+	struct crc32_context cc = {
+		.cc_rc = {
+			.rc_name = "Original CRC32",
+			.rc_data = buf,
+			.rc_size = size,
+			.rc_count = count,
+			.rc_func = crc32_func,
+		},
+		.cc_crc32 = crc32_le_orig,
 	};
 
-	timeme(&ct);
+	/* Builds the tables */
+	crc32_le(~0, (unsigned char *)buf, size);
+
+	check_crc32("Slicing-by-8 CRC32", buf, size, crc32_le_sb8);
+	check_crc32("Current CRC32", buf, size, crc32_le);
+#if defined(__x86_64__) && defined(__GNUC__)
+	if (crc32_have_pclmul())
+		check_crc32("PCLMULQDQ CRC32", buf, size, crc32_le_pclmul);
+#endif
+#if defined(__aarch64__) && defined(__GNUC__) && \
+	(__BYTE_ORDER == __LITTLE_ENDIAN)
+	if (crc32_have_arm64())
+		check_crc32("ARMv8 CRC32", buf, size, crc32_le_arm64);
+#endif
+
+	timeme(&cc.cc_rc);
+
+	cc.cc_rc.rc_name = "Slicing-by-8 CRC32";
+	cc.cc_crc32 = crc32_le_sb8;
+	timeme(&cc.cc_rc);
+
+#if defined(__x86_64__) && defined(__GNUC__)
+	if (crc32_have_pclmul()) {
+		cc.cc_rc.rc_name = "PCLMULQDQ CRC32";
+		cc.cc_crc32 = crc32_le_pclmul;
+		timeme(&cc.cc_rc);
+	}
+#endif
+#if defined(__aarch64__) && defined(__GNUC__) && \
+	(__BYTE_ORDER == __LITTLE_ENDIAN)
+	if (crc32_have_arm64()) {
+		cc.cc_rc.rc_name = "ARMv8 CRC32";
+		cc.cc_crc32 = crc32_le_arm64;
+		timeme(&cc.cc_rc);
+	}
+#endif
+
+	cc.cc_rc.rc_name = "Current CRC32";
+	cc.cc_crc32 = crc32_le;
+	timeme(&cc.cc_rc);
 }
 
 struct hamming_context {
@@ -828,6 +1673,130 @@ static void hamming_func(struct run_context *ct, int nr)
 	};
 }
 
+/* ocfs2_hamming_encode() without the SIMD */
+static uint32_t hamming_encode_scalar(uint32_t parity, void *data,
+				      unsigned int d, unsigned int nr)
+{
+	void (*impl)(const unsigned char *data, unsigned int w,
+		     unsigned int end, unsigned int c, uint64_t *rot,
+		     uint32_t *hi) = hamming_words_impl;
+
+	hamming_words_impl = hamming_words;
+	parity = ocfs2_hamming_encode(parity, data, d, nr);
+	hamming_words_impl = impl;
+
+	return parity;
+}
+
+/*
+ * hamming_encode_orig() only keeps as many parity bits as a d-bit
+ * buffer needs, so it can't check hunks past the start.  The bit at a
+ * time encoder can.
+ */
+static void check_hamming_one(char *data, unsigned int d, unsigned int nr)
+{
+	uint32_t want, got, scalar;
+
+	if (nr)
+		want = hamming_encode_bitwise(0, data, d, nr);
+	else
+		want = hamming_encode_orig(0, data, d, nr);
+	got = ocfs2_hamming_encode(0, data, d, nr);
+	scalar = hamming_encode_scalar(0, data, d, nr);
+	if ((got != want) || (scalar != want)) {
+		fprintf(stderr,
+			"Hamming code %"PRIu32" (scalar %"PRIu32") != "
+			"%"PRIu32" for %u bits at bit %u, offset %d\n",
+			got, scalar, want, d, nr, (int)((long)data & 31));
+		exit(1);
+	}
+}
+
+/*
+ * Compare ocfs2_hamming_encode() with the old encoders on short
+ * hunks at every alignment and at offsets around the segment and word
+ * boundaries, then on whole blocks in one and two hunks.  Then break
+ * bits and make sure ocfs2_hamming_fix() puts them back.
+ */
+static void check_hamming(char *buf, int size)
+{
+	static const unsigned int offsets[] = {
+		0, 1, 2, 5, 11, 57, 63, 64, 65, 120, 247, 1000, 4083, 32752,
+	};
+	unsigned int i, off, d, nr, split, bits, bit, fix;
+	uint32_t ecc, parity;
+	char *copy;
+
+	for (off = 0; off < 32; off++) {
+		for (i = 0; i < sizeof(offsets) / sizeof(offsets[0]); i++) {
+			nr = offsets[i];
+			for (d = 1; (d <= 300) && ((off + (d + 7) / 8) <= size);
+			     d++)
+				check_hamming_one(buf + off, d, nr);
+		}
+	}
+
+	bits = ((size > 4096) ? 4096 : size) * 8;
+	for (d = 8; d <= bits; d <<= 1)
+		check_hamming_one(buf, d, 0);
+	check_hamming_one(buf, bits, 0);
+	if (bits > 8)
+		check_hamming_one(buf + 1, bits - 8, 3);
+
+	for (split = 8; split < bits; split += bits / 5 + 8) {
+		split &= ~7;
+		parity = ocfs2_hamming_encode(0, buf, split, 0);
+		parity = ocfs2_hamming_encode(parity, buf + split / 8,
+					      bits - split, split);
+		if (parity != hamming_encode_orig(0, buf, bits, 0)) {
+			fprintf(stderr,
+				"Hamming code split at bit %u is wrong\n",
+				split);
+			exit(1);
+		}
+	}
+
+	copy = malloc(bits / 8);
+	if (!copy) {
+		fprintf(stderr, "Unable to allocate buffer: %s\n",
+			strerror(errno));
+		exit(1);
+	}
+	ecc = ocfs2_hamming_encode(0, buf, bits, 0);
+	for (i = 0; i < 1000; i++) {
+		memcpy(copy, buf, bits / 8);
+		bit = ((unsigned int)rand()) % bits;
+		if (ocfs2_test_bit(bit, copy))
+			ocfs2_clear_bit(bit, copy);
+		else
+			ocfs2_set_bit(bit, copy);
+
+		fix = ecc ^ ocfs2_hamming_encode(0, copy, bits, 0);
+		split = (bits / 2) & ~7;
+		if (split) {
+			ocfs2_hamming_fix(copy, split, 0, fix);
+			ocfs2_hamming_fix(copy + split / 8, bits - split,
+					  split, fix);
+		} else
+			ocfs2_hamming_fix(copy, bits, 0, fix);
+		if (memcmp(copy, buf, bits / 8)) {
+			fprintf(stderr, "Hamming fix of bit %u failed\n",
+				bit);
+			exit(1);
+		}
+
+		/* The old fix agrees */
+		ocfs2_hamming_fix(copy, bits, 0, fix);
+		hamming_fix_bitwise(copy, bits, 0, fix);
+		if (memcmp(copy, buf, bits / 8)) {
+			fprintf(stderr, "Hamming fixes of bit %u differ\n",
+				bit);
+			exit(1);
+		}
+	}
+	free(copy);
+}
+
 static void run_hamming(char *buf, int size, int count)
 {
 	struct hamming_context hc = {
@@ -859,8 +1828,12 @@ static void run_hamming(char *buf, int size, int count)
 	hc.hc_encode = ocfs2_hamming_encode_cheat_code_bit;
 	timeme(&hc.hc_rc);
 
-	hc.hc_rc.rc_name = "Current hamming code";
-	hc.hc_encode = ocfs2_hamming_encode;
+	hc.hc_rc.rc_name = "Bit at a time hamming code";
+	hc.hc_encode = hamming_encode_bitwise;
+	timeme(&hc.hc_rc);
+
+	hc.hc_rc.rc_name = "Word at a time hamming code";
+	hc.hc_encode = hamming_encode_scalar;
 	timeme(&hc.hc_rc);
 }
 
@@ -959,6 +1932,7 @@ int main(int argc, char *argv[])
 
 	get_file(filename, &buf, &size);
 	run_crc32(buf, size, count);
+	check_hamming(buf, size);
 	run_hamming(buf, size, count);
 
 
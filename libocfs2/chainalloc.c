@@ -40,12 +40,16 @@ struct chainalloc_bitmap_private {
 	errcode_t		cb_errcode;
 	int			cb_dirty;
 	int			cb_suballoc;
+	/* Regions with changes to write, in the order they changed */
+	struct list_head	cb_dirty_regions;
 };
 
 struct chainalloc_region_private {
 	struct chainalloc_bitmap_private	*cr_cb;
 	struct ocfs2_group_desc			*cr_ag;
+	struct ocfs2_bitmap_region		*cr_br;
 	int					cr_dirty;
+	struct list_head			cr_dirty_item;
 
 	/* In discontiguous group block, it is set as
 	 * the bit offset of this region in the whole group.
@@ -191,6 +195,8 @@ static errcode_t create_chainalloc_region(ocfs2_filesys *fs,
 			break;
 
 		br->br_private = cr;
+		cr->cr_br = br;
+		INIT_LIST_HEAD(&cr->cr_dirty_item);
 		memcpy(br->br_bitmap, cr->cr_ag->bg_bitmap + bit_offset / 8,
 		       br->br_bytes);
 		br->br_set_bits = set_bits;
@@ -303,8 +309,10 @@ static errcode_t chainalloc_write_group(struct ocfs2_bitmap_region *br,
 
 	ret = ocfs2_write_group_desc(fs, cr->cr_ag->bg_blkno, 
 				     (char *)cr->cr_ag);
-	if (ret == 0)
+	if (ret == 0) {
 		cr->cr_dirty = 0;
+		list_del(&cr->cr_dirty_item);
+	}
 
 	return ret;
 }
@@ -312,6 +320,8 @@ static errcode_t chainalloc_write_group(struct ocfs2_bitmap_region *br,
 static errcode_t chainalloc_write_bitmap(ocfs2_bitmap *bitmap)
 {
 	struct chainalloc_bitmap_private *cb = bitmap->b_private;
+	struct chainalloc_region_private *cr;
+	struct list_head *pos, *next;
 	ocfs2_filesys *fs;
 	errcode_t ret;
 
@@ -323,9 +333,14 @@ static errcode_t chainalloc_write_bitmap(ocfs2_bitmap *bitmap)
 
 	fs = cb->cb_cinode->ci_fs;
 
-	ret = ocfs2_bitmap_foreach_region(bitmap, chainalloc_write_group, fs);
-	if (ret)
-		goto out;
+	/* Only the groups that changed, not every group of the allocator */
+	list_for_each_safe(pos, next, &cb->cb_dirty_regions) {
+		cr = list_entry(pos, struct chainalloc_region_private,
+				cr_dirty_item);
+		ret = chainalloc_write_group(cr->cr_br, fs);
+		if (ret)
+			goto out;
+	}
 
 	ret = ocfs2_write_cached_inode(fs, cb->cb_cinode);
 	if (ret == 0)
@@ -367,7 +382,10 @@ static void chainalloc_bit_change_notify(ocfs2_bitmap *bitmap,
 		di->id1.bitmap1.i_used--;
 	}
 
-	cr->cr_dirty = 1;
+	if (!cr->cr_dirty) {
+		cr->cr_dirty = 1;
+		list_add_tail(&cr->cr_dirty_item, &cb->cb_dirty_regions);
+	}
 	cb->cb_dirty = 1;
 }
 
@@ -399,6 +417,7 @@ static errcode_t ocfs2_chainalloc_bitmap_new(ocfs2_filesys *fs,
 			    &cb);
 	if (ret)
 		return ret;
+	INIT_LIST_HEAD(&cb->cb_dirty_regions);
 
 	ret = ocfs2_bitmap_new(fs,
 			       total_bits,
@@ -458,6 +477,20 @@ errcode_t ocfs2_load_chain_allocator(ocfs2_filesys *fs,
 		return ret;
 	}
 
+	/*
+	 * Every group of the global bitmap is cl_cpg clusters and starts
+	 * on a multiple of cl_cpg, so a bit's group can be indexed.
+	 * Suballocator groups can be anywhere.
+	 */
+	if (gb_blkno == cinode->ci_blkno) {
+		ret = ocfs2_bitmap_set_index(cinode->ci_chains,
+				cinode->ci_inode->id2.i_chain.cl_cpg);
+		if (ret) {
+			ocfs2_bitmap_free(&cinode->ci_chains);
+			return ret;
+		}
+	}
+
 	return 0;
 }
 
@@ -534,6 +567,7 @@ errcode_t ocfs2_chain_alloc(ocfs2_filesys *fs,
 	errcode_t ret;
 	int oldval;
 	struct find_gd_state state;
+	struct ocfs2_bitmap_region *br;
 
 	if (!cinode->ci_chains)
 		return OCFS2_ET_INVALID_ARGUMENT;
@@ -552,16 +586,15 @@ errcode_t ocfs2_chain_alloc(ocfs2_filesys *fs,
 	       .fs	= fs,
 	       .bitno	= *bitno,
 	};
-	ret = ocfs2_bitmap_foreach_region(cinode->ci_chains,
-					  chainalloc_find_gd, &state);
-	if (!ret) {
-		if (state.found) {
-			*gd_blkno = state.gd_blkno;
-			*suballoc_bit = state.suballoc_bit;
-		} else
-			ret = OCFS2_ET_INTERNAL_FAILURE;
-	}
-	return ret;
+	br = ocfs2_bitmap_find_region(cinode->ci_chains, *bitno);
+	if (br)
+		chainalloc_find_gd(br, &state);
+	if (!state.found)
+		return OCFS2_ET_INTERNAL_FAILURE;
+
+	*gd_blkno = state.gd_blkno;
+	*suballoc_bit = state.suballoc_bit;
+	return 0;
 }
 
 errcode_t ocfs2_chain_free(ocfs2_filesys *fs,
@@ -36,6 +36,12 @@ errcode_t ocfs2_flush(ocfs2_filesys *fs)
 	int type;
 	errcode_t ret;
 
+	if (fs->fs_alloc_batch) {
+		ret = ocfs2_write_allocators(fs);
+		if (ret)
+			return ret;
+	}
+
 	for (type = 0; type < MAXQUOTAS; type++)
 		if (fs->qinfo[type].flags & OCFS2_QF_INFO_DIRTY) {
 			ret = ocfs2_write_global_quota_info(fs, type);
@@ -47,18 +53,23 @@ errcode_t ocfs2_flush(ocfs2_filesys *fs)
 				return ret;
 		}
 
-	return 0;
+	return io_flush(fs->fs_io);
 }
 
 errcode_t ocfs2_close(ocfs2_filesys *fs)
 {
 	errcode_t ret;
 
-	if (fs->fs_flags & OCFS2_FLAG_DIRTY) {
+	if (fs->fs_flags & OCFS2_FLAG_DIRTY)
 		ret = ocfs2_flush(fs);
-		if (ret)
-			return ret;
-	}
+	else if (fs->fs_alloc_batch) {
+		ret = ocfs2_write_allocators(fs);
+		if (!ret)
+			ret = io_flush(fs->fs_io);
+	} else
+		ret = io_flush(fs->fs_io);
+	if (ret)
+		return ret;
 
 	ocfs2_freefs(fs);
 	return 0;
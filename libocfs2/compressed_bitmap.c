@@ -0,0 +1,874 @@
+/* -*- mode: c; c-basic-offset: 8; -*-
+ * vim: noexpandtab sw=8 ts=8 sts=0:
+ *
+ * compressed_bitmap.c
+ *
+ * A compressed bitmap for the OCFS2 userspace library, for tracking
+ * clusters and blocks on very large volumes.
+ *
+ * Copyright (C) 2004 Oracle.  All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License, version 2,  as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#define _XOPEN_SOURCE 600 /* Triggers magic in features.h */
+#define _LARGEFILE64_SOURCE
+
+#include <string.h>
+#include <inttypes.h>
+
+#include "ocfs2/ocfs2.h"
+#include "ocfs2/bitops.h"
+
+#include "bitmap.h"
+
+
+/*
+ * The bitmap is cut into chunks of 64K bits.  A chunk with no bits set
+ * has no container at all.  The others are held in whichever container
+ * is smallest for what they hold:
+ *
+ *   array	- a sorted list of the set bits, for sparse chunks
+ *   run	- a sorted list of runs of set bits, for chunks that are
+ *		  mostly long runs, such as allocated extents
+ *   bitmap	- a plain 8K bitmap, for everything else
+ *
+ * Containers are reconsidered when they have to grow, and every
+ * CB_RECHECK changes for bitmap containers, so the cost of choosing
+ * is spread over many set and clear calls.  A full chunk is a single
+ * run.  The region tree of the ocfs2_bitmap is not used.
+ */
+#define CB_CHUNK_SHIFT		16
+#define CB_CHUNK_BITS		(1 << CB_CHUNK_SHIFT)
+#define CB_CHUNK_MASK		(CB_CHUNK_BITS - 1)
+#define CB_BITMAP_BYTES		(CB_CHUNK_BITS / 8)
+#define CB_ARRAY_MAX		(CB_BITMAP_BYTES / sizeof(uint16_t))
+#define CB_RUN_MAX		(CB_BITMAP_BYTES / sizeof(struct cb_run))
+#define CB_RECHECK		1024
+
+enum cb_type {
+	CB_ARRAY = 0,
+	CB_RUN,
+	CB_BITMAP,
+};
+
+/* Bits r_start through r_last, inclusive, are set */
+struct cb_run {
+	uint16_t r_start;
+	uint16_t r_last;
+};
+
+struct cb_container {
+	int c_type;
+	uint32_t c_card;		/* Bits set */
+	uint32_t c_nr;			/* Entries in c_array or c_runs */
+	uint32_t c_alloc;		/* Entries allocated */
+	union {
+		uint16_t *c_array;
+		struct cb_run *c_runs;
+		uint8_t *c_bitmap;
+	};
+};
+
+struct cb_private {
+	uint64_t cp_nr_chunks;
+	struct cb_container **cp_chunks;
+};
+
+
+static size_t cb_type_bytes(int type, uint32_t card, uint32_t nr_runs)
+{
+	switch (type) {
+		case CB_ARRAY:
+			if (card > CB_ARRAY_MAX)
+				return SIZE_MAX;
+			return card * sizeof(uint16_t);
+		case CB_RUN:
+			if (nr_runs > CB_RUN_MAX)
+				return SIZE_MAX;
+			return nr_runs * sizeof(struct cb_run);
+		default:
+			return CB_BITMAP_BYTES;
+	}
+}
+
+/* The index of the first entry >= x */
+static uint32_t cb_array_search(struct cb_container *c, uint32_t x)
+{
+	uint32_t lo = 0, hi = c->c_nr, mid;
+
+	while (lo < hi) {
+		mid = lo + ((hi - lo) / 2);
+		if (c->c_array[mid] < x)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/* The index of the first run ending at or after x */
+static uint32_t cb_run_search(struct cb_container *c, uint32_t x)
+{
+	uint32_t lo = 0, hi = c->c_nr, mid;
+
+	while (lo < hi) {
+		mid = lo + ((hi - lo) / 2);
+		if (c->c_runs[mid].r_last < x)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static uint32_t cb_count_runs(struct cb_container *c)
+{
+	uint32_t i, runs = 0;
+	int start, end;
+
+	switch (c->c_type) {
+		case CB_ARRAY:
+			for (i = 0; i < c->c_nr; i++) {
+				if (!i || (c->c_array[i] != c->c_array[i - 1] + 1))
+					runs++;
+			}
+			break;
+		case CB_RUN:
+			runs = c->c_nr;
+			break;
+		default:
+			for (start = 0; ; start = end) {
+				start = ocfs2_find_next_bit_set(c->c_bitmap,
+								CB_CHUNK_BITS,
+								start);
+				if (start >= CB_CHUNK_BITS)
+					break;
+				runs++;
+				end = ocfs2_find_next_bit_clear(c->c_bitmap,
+								CB_CHUNK_BITS,
+								start);
+			}
+			break;
+	}
+
+	return runs;
+}
+
+/* Make room for one more entry in c_array or c_runs */
+static errcode_t cb_grow(struct cb_container *c, size_t entry_size)
+{
+	errcode_t ret;
+	uint32_t alloc = c->c_alloc ? c->c_alloc * 2 : 4;
+
+	ret = ocfs2_realloc(alloc * entry_size, &c->c_array);
+	if (!ret)
+		c->c_alloc = alloc;
+
+	return ret;
+}
+
+static int cb_test(struct cb_container *c, uint32_t x)
+{
+	uint32_t i;
+
+	switch (c->c_type) {
+		case CB_ARRAY:
+			i = cb_array_search(c, x);
+			return (i < c->c_nr) && (c->c_array[i] == x);
+		case CB_RUN:
+			i = cb_run_search(c, x);
+			return (i < c->c_nr) && (c->c_runs[i].r_start <= x);
+		default:
+			return ocfs2_test_bit(x, c->c_bitmap);
+	}
+}
+
+static uint32_t cb_next_set(struct cb_container *c, uint32_t x);
+static uint32_t cb_next_clear(struct cb_container *c, uint32_t x);
+
+/* Rebuild c as type, a run of set bits at a time */
+static errcode_t cb_convert(struct cb_container *c, int type,
+			    uint32_t nr_runs)
+{
+	errcode_t ret;
+	struct cb_container new_c;
+	uint32_t start, end;
+
+	memset(&new_c, 0, sizeof(new_c));
+	new_c.c_type = type;
+	new_c.c_card = c->c_card;
+
+	if (type == CB_ARRAY) {
+		new_c.c_alloc = c->c_card;
+		ret = ocfs2_malloc(new_c.c_alloc * sizeof(uint16_t),
+				   &new_c.c_array);
+	} else if (type == CB_RUN) {
+		new_c.c_alloc = nr_runs;
+		ret = ocfs2_malloc(new_c.c_alloc * sizeof(struct cb_run),
+				   &new_c.c_runs);
+	} else
+		ret = ocfs2_malloc0(CB_BITMAP_BYTES, &new_c.c_bitmap);
+	if (ret)
+		return ret;
+
+	for (start = cb_next_set(c, 0); start < CB_CHUNK_BITS;
+	     start = (end < CB_CHUNK_BITS) ? cb_next_set(c, end) : end) {
+		end = cb_next_clear(c, start);
+
+		if (type == CB_RUN) {
+			new_c.c_runs[new_c.c_nr].r_start = start;
+			new_c.c_runs[new_c.c_nr].r_last = end - 1;
+			new_c.c_nr++;
+			continue;
+		}
+
+		for (; start < end; start++) {
+			if (type == CB_ARRAY)
+				new_c.c_array[new_c.c_nr++] = start;
+			else
+				ocfs2_set_bit(start, new_c.c_bitmap);
+		}
+	}
+
+	ocfs2_free(&c->c_array);
+	*c = new_c;
+
+	return 0;
+}
+
+/*
+ * Move c to whichever type is smallest for what it holds.  When force
+ * is set, c can't stay as it is.  Otherwise it only moves if that at
+ * least halves its size, so it doesn't flip back and forth.  An empty
+ * container is about to be freed and is left alone.
+ */
+static errcode_t cb_optimize(struct cb_container *c, int force)
+{
+	uint32_t nr_runs = cb_count_runs(c);
+	size_t cur, best_bytes = SIZE_MAX, bytes;
+	int type, best = c->c_type;
+
+	cur = force ? SIZE_MAX : cb_type_bytes(c->c_type, c->c_card, nr_runs);
+	for (type = CB_ARRAY; type <= CB_BITMAP; type++) {
+		if (type == c->c_type)
+			continue;
+		bytes = cb_type_bytes(type, c->c_card, nr_runs);
+		if (bytes < best_bytes) {
+			best_bytes = bytes;
+			best = type;
+		}
+	}
+
+	if ((best == c->c_type) || !c->c_card ||
+	    (!force && ((best_bytes * 2) > cur)))
+		return 0;
+
+	return cb_convert(c, best, nr_runs);
+}
+
+static errcode_t cb_set(struct cb_container *c, uint32_t x, int *oldval)
+{
+	errcode_t ret;
+	uint32_t i;
+	int prev, next;
+
+	*oldval = cb_test(c, x);
+	if (*oldval)
+		return 0;
+
+	switch (c->c_type) {
+		case CB_ARRAY:
+			if (c->c_nr == c->c_alloc) {
+				ret = cb_optimize(c, c->c_nr >= CB_ARRAY_MAX);
+				if (ret)
+					return ret;
+				if (c->c_type != CB_ARRAY)
+					return cb_set(c, x, oldval);
+				ret = cb_grow(c, sizeof(uint16_t));
+				if (ret)
+					return ret;
+			}
+			i = cb_array_search(c, x);
+			memmove(&c->c_array[i + 1], &c->c_array[i],
+				(c->c_nr - i) * sizeof(uint16_t));
+			c->c_array[i] = x;
+			c->c_nr++;
+			break;
+
+		case CB_RUN:
+			i = cb_run_search(c, x);
+			prev = (i > 0) && (c->c_runs[i - 1].r_last + 1 == x);
+			next = (i < c->c_nr) && (c->c_runs[i].r_start == x + 1);
+			if (prev && next) {
+				c->c_runs[i - 1].r_last = c->c_runs[i].r_last;
+				memmove(&c->c_runs[i], &c->c_runs[i + 1],
+					(c->c_nr - i - 1) *
+					sizeof(struct cb_run));
+				c->c_nr--;
+			} else if (prev)
+				c->c_runs[i - 1].r_last = x;
+			else if (next)
+				c->c_runs[i].r_start = x;
+			else {
+				if (c->c_nr == c->c_alloc) {
+					ret = cb_optimize(c,
+							  c->c_nr >= CB_RUN_MAX);
+					if (ret)
+						return ret;
+					if (c->c_type != CB_RUN)
+						return cb_set(c, x, oldval);
+					ret = cb_grow(c, sizeof(struct cb_run));
+					if (ret)
+						return ret;
+				}
+				memmove(&c->c_runs[i + 1], &c->c_runs[i],
+					(c->c_nr - i) * sizeof(struct cb_run));
+				c->c_runs[i].r_start = x;
+				c->c_runs[i].r_last = x;
+				c->c_nr++;
+			}
+			break;
+
+		default:
+			ocfs2_set_bit(x, c->c_bitmap);
+			break;
+	}
+
+	c->c_card++;
+	if ((c->c_type == CB_BITMAP) && !(c->c_card % CB_RECHECK))
+		return cb_optimize(c, 0);
+
+	return 0;
+}
+
+static errcode_t cb_clear(struct cb_container *c, uint32_t x, int *oldval)
+{
+	errcode_t ret;
+	uint32_t i;
+	struct cb_run *r;
+
+	*oldval = cb_test(c, x);
+	if (!*oldval)
+		return 0;
+
+	switch (c->c_type) {
+		case CB_ARRAY:
+			i = cb_array_search(c, x);
+			memmove(&c->c_array[i], &c->c_array[i + 1],
+				(c->c_nr - i - 1) * sizeof(uint16_t));
+			c->c_nr--;
+			break;
+
+		case CB_RUN:
+			i = cb_run_search(c, x);
+			r = &c->c_runs[i];
+			if (r->r_start == r->r_last) {
+				memmove(r, r + 1,
+					(c->c_nr - i - 1) *
+					sizeof(struct cb_run));
+				c->c_nr--;
+			} else if (r->r_start == x)
+				r->r_start++;
+			else if (r->r_last == x)
+				r->r_last--;
+			else {
+				/* Splitting a run needs another one */
+				if (c->c_nr == c->c_alloc) {
+					ret = cb_optimize(c,
+							  c->c_nr >= CB_RUN_MAX);
+					if (ret)
+						return ret;
+					if (c->c_type != CB_RUN)
+						return cb_clear(c, x, oldval);
+					ret = cb_grow(c, sizeof(struct cb_run));
+					if (ret)
+						return ret;
+					r = &c->c_runs[i];
+				}
+				memmove(r + 2, r + 1,
+					(c->c_nr - i - 1) *
+					sizeof(struct cb_run));
+				r[1].r_start = x + 1;
+				r[1].r_last = r->r_last;
+				r->r_last = x - 1;
+				c->c_nr++;
+			}
+			break;
+
+		default:
+			ocfs2_clear_bit(x, c->c_bitmap);
+			break;
+	}
+
+	c->c_card--;
+	if ((c->c_type == CB_BITMAP) && !(c->c_card % CB_RECHECK))
+		return cb_optimize(c, 0);
+
+	return 0;
+}
+
+/* The first set bit at or after x, or CB_CHUNK_BITS */
+static uint32_t cb_next_set(struct cb_container *c, uint32_t x)
+{
+	uint32_t i;
+
+	switch (c->c_type) {
+		case CB_ARRAY:
+			i = cb_array_search(c, x);
+			return (i < c->c_nr) ? c->c_array[i] : CB_CHUNK_BITS;
+		case CB_RUN:
+			i = cb_run_search(c, x);
+			if (i >= c->c_nr)
+				return CB_CHUNK_BITS;
+			return (c->c_runs[i].r_start > x) ?
+				c->c_runs[i].r_start : x;
+		default:
+			return ocfs2_find_next_bit_set(c->c_bitmap,
+						       CB_CHUNK_BITS, x);
+	}
+}
+
+/* The first clear bit at or after x, or CB_CHUNK_BITS */
+static uint32_t cb_next_clear(struct cb_container *c, uint32_t x)
+{
+	uint32_t i;
+
+	switch (c->c_type) {
+		case CB_ARRAY:
+			for (i = cb_array_search(c, x);
+			     (i < c->c_nr) && (c->c_array[i] == x); i++)
+				x++;
+			return x;
+		case CB_RUN:
+			/* Runs never touch, so the bit after one is clear */
+			i = cb_run_search(c, x);
+			if ((i < c->c_nr) && (c->c_runs[i].r_start <= x))
+				return c->c_runs[i].r_last + 1;
+			return x;
+		default:
+			return ocfs2_find_next_bit_clear(c->c_bitmap,
+							 CB_CHUNK_BITS, x);
+	}
+}
+
+static void cb_free_container(struct cb_container **c)
+{
+	ocfs2_free(&(*c)->c_array);
+	ocfs2_free(c);
+}
+
+static errcode_t compressed_set_bit(ocfs2_bitmap *bitmap, uint64_t bitno,
+				    int *oldval)
+{
+	errcode_t ret;
+	struct cb_private *cp = bitmap->b_private;
+	struct cb_container **c = &cp->cp_chunks[bitno >> CB_CHUNK_SHIFT];
+
+	if (!*c) {
+		ret = ocfs2_malloc0(sizeof(struct cb_container), c);
+		if (ret)
+			return ret;
+	}
+
+	ret = cb_set(*c, bitno & CB_CHUNK_MASK, oldval);
+	if (!(*c)->c_card)
+		cb_free_container(c);
+
+	return ret;
+}
+
+static errcode_t compressed_clear_bit(ocfs2_bitmap *bitmap, uint64_t bitno,
+				      int *oldval)
+{
+	errcode_t ret;
+	struct cb_private *cp = bitmap->b_private;
+	struct cb_container **c = &cp->cp_chunks[bitno >> CB_CHUNK_SHIFT];
+
+	if (!*c) {
+		*oldval = 0;
+		return 0;
+	}
+
+	ret = cb_clear(*c, bitno & CB_CHUNK_MASK, oldval);
+	if (!(*c)->c_card)
+		cb_free_container(c);
+
+	return ret;
+}
+
+static errcode_t compressed_test_bit(ocfs2_bitmap *bitmap, uint64_t bitno,
+				     int *val)
+{
+	struct cb_private *cp = bitmap->b_private;
+	struct cb_container *c = cp->cp_chunks[bitno >> CB_CHUNK_SHIFT];
+
+	*val = c ? cb_test(c, bitno & CB_CHUNK_MASK) : 0;
+
+	return 0;
+}
+
+static errcode_t compressed_find_next_set(ocfs2_bitmap *bitmap,
+					  uint64_t start, uint64_t *found)
+{
+	struct cb_private *cp = bitmap->b_private;
+	struct cb_container *c;
+	uint64_t chunk = start >> CB_CHUNK_SHIFT;
+	uint32_t x = start & CB_CHUNK_MASK;
+
+	for (; chunk < cp->cp_nr_chunks; chunk++, x = 0) {
+		c = cp->cp_chunks[chunk];
+		if (!c)
+			continue;
+
+		x = cb_next_set(c, x);
+		if (x < CB_CHUNK_BITS) {
+			*found = (chunk << CB_CHUNK_SHIFT) + x;
+			return 0;
+		}
+	}
+
+	return OCFS2_ET_BIT_NOT_FOUND;
+}
+
+static errcode_t compressed_find_next_clear(ocfs2_bitmap *bitmap,
+					    uint64_t start, uint64_t *found)
+{
+	struct cb_private *cp = bitmap->b_private;
+	struct cb_container *c;
+	uint64_t chunk = start >> CB_CHUNK_SHIFT;
+	uint32_t x = start & CB_CHUNK_MASK;
+
+	for (; chunk < cp->cp_nr_chunks; chunk++, x = 0) {
+		c = cp->cp_chunks[chunk];
+		if (c)
+			x = cb_next_clear(c, x);
+		if (x < CB_CHUNK_BITS)
+			break;
+	}
+
+	if ((chunk >= cp->cp_nr_chunks) ||
+	    (((chunk << CB_CHUNK_SHIFT) + x) >= bitmap->b_total_bits))
+		return OCFS2_ET_BIT_NOT_FOUND;
+
+	*found = (chunk << CB_CHUNK_SHIFT) + x;
+	return 0;
+}
+
+/*
+ * Like ocfs2_bitmap_alloc_range_generic(), take the first clear run of
+ * len bits, or else the largest one of at least min_len.
+ */
+static errcode_t compressed_alloc_range(ocfs2_bitmap *bitmap,
+					uint64_t min_len, uint64_t len,
+					uint64_t *first_bit,
+					uint64_t *bits_found)
+{
+	errcode_t ret;
+	uint64_t start = 0, end, best_start = 0, best_len = 0;
+
+	while ((start < bitmap->b_total_bits) &&
+	       !compressed_find_next_clear(bitmap, start, &start)) {
+		if (compressed_find_next_set(bitmap, start, &end))
+			end = bitmap->b_total_bits;
+
+		if ((end - start) >= len) {
+			best_start = start;
+			best_len = len;
+			break;
+		}
+		if ((end - start) > best_len) {
+			best_start = start;
+			best_len = end - start;
+		}
+
+		start = end;
+	}
+
+	if (!best_len || (best_len < min_len))
+		return OCFS2_ET_BIT_NOT_FOUND;
+
+	for (end = best_start; end < best_start + best_len; end++) {
+		ret = ocfs2_bitmap_set(bitmap, end, NULL);
+		if (ret)
+			return ret;
+	}
+
+	*first_bit = best_start;
+	*bits_found = best_len;
+
+	return 0;
+}
+
+static errcode_t compressed_clear_range(ocfs2_bitmap *bitmap, uint64_t len,
+					uint64_t first_bit)
+{
+	errcode_t ret = 0;
+	uint64_t end = first_bit + len;
+
+	for (; !ret && (first_bit < end); first_bit++)
+		ret = ocfs2_bitmap_clear(bitmap, first_bit, NULL);
+
+	return ret;
+}
+
+static void compressed_destroy_notify(ocfs2_bitmap *bitmap)
+{
+	struct cb_private *cp = bitmap->b_private;
+	uint64_t i;
+
+	for (i = 0; i < cp->cp_nr_chunks; i++) {
+		if (cp->cp_chunks[i])
+			cb_free_container(&cp->cp_chunks[i]);
+	}
+
+	ocfs2_free(&cp->cp_chunks);
+	ocfs2_free(&bitmap->b_private);
+}
+
+static struct ocfs2_bitmap_operations compressed_ops = {
+	.set_bit		= compressed_set_bit,
+	.clear_bit		= compressed_clear_bit,
+	.test_bit		= compressed_test_bit,
+	.find_next_set		= compressed_find_next_set,
+	.find_next_clear	= compressed_find_next_clear,
+	.destroy_notify		= compressed_destroy_notify,
+	.alloc_range		= compressed_alloc_range,
+	.clear_range		= compressed_clear_range,
+};
+
+errcode_t ocfs2_compressed_bitmap_new(ocfs2_filesys *fs,
+				      uint64_t total_bits,
+				      const char *description,
+				      ocfs2_bitmap **ret_bitmap)
+{
+	errcode_t ret;
+	struct cb_private *cp;
+
+	ret = ocfs2_malloc0(sizeof(struct cb_private), &cp);
+	if (ret)
+		return ret;
+
+	cp->cp_nr_chunks = (total_bits + CB_CHUNK_MASK) >> CB_CHUNK_SHIFT;
+	ret = ocfs2_malloc0(cp->cp_nr_chunks * sizeof(struct cb_container *),
+			    &cp->cp_chunks);
+	if (ret)
+		goto out_free;
+
+	ret = ocfs2_bitmap_new(fs, total_bits,
+			       description ? description :
+			       "Compressed bitmap",
+			       &compressed_ops, cp, ret_bitmap);
+	if (!ret)
+		return 0;
+
+	ocfs2_free(&cp->cp_chunks);
+out_free:
+	ocfs2_free(&cp);
+
+	return ret;
+}
+
+/* Bytes used by the containers, and how many there are of each type */
+uint64_t ocfs2_compressed_bitmap_bytes(ocfs2_bitmap *bitmap,
+				       uint64_t *nr_array, uint64_t *nr_run,
+				       uint64_t *nr_bitmap)
+{
+	struct cb_private *cp = bitmap->b_private;
+	struct cb_container *c;
+	uint64_t i, bytes, counts[CB_BITMAP + 1] = { 0, };
+
+	bytes = sizeof(struct cb_private) +
+		(cp->cp_nr_chunks * sizeof(struct cb_container *));
+	for (i = 0; i < cp->cp_nr_chunks; i++) {
+		c = cp->cp_chunks[i];
+		if (!c)
+			continue;
+
+		counts[c->c_type]++;
+		bytes += sizeof(struct cb_container);
+		if (c->c_type == CB_ARRAY)
+			bytes += c->c_alloc * sizeof(uint16_t);
+		else if (c->c_type == CB_RUN)
+			bytes += c->c_alloc * sizeof(struct cb_run);
+		else
+			bytes += CB_BITMAP_BYTES;
+	}
+
+	if (nr_array)
+		*nr_array = counts[CB_ARRAY];
+	if (nr_run)
+		*nr_run = counts[CB_RUN];
+	if (nr_bitmap)
+		*nr_bitmap = counts[CB_BITMAP];
+
+	return bytes;
+}
+
+
+#ifdef DEBUG_EXE
+#include <stdlib.h>
+#include <getopt.h>
+
+/*
+ * Drive a compressed bitmap and a plain one the same way and make sure
+ * they agree.  Each pass sets and clears bits in a different pattern:
+ * scattered, in runs, and dense enough to need bitmap containers.
+ */
+static uint64_t nr_bad;
+
+static void check(ocfs2_bitmap *cb, ocfs2_bitmap *fb, const char *what,
+		  uint64_t bitno)
+{
+	errcode_t cret, fret;
+	uint64_t cfound = 0, ffound = 0;
+
+	cret = ocfs2_bitmap_find_next_set(cb, bitno, &cfound);
+	fret = ocfs2_bitmap_find_next_set(fb, bitno, &ffound);
+	if ((cret != fret) || (!cret && (cfound != ffound))) {
+		fprintf(stdout, "%s: find_next_set(%"PRIu64") gave %"PRIu64
+			", expected %"PRIu64"\n", what, bitno, cfound, ffound);
+		nr_bad++;
+	}
+
+	cret = ocfs2_bitmap_find_next_clear(cb, bitno, &cfound);
+	fret = ocfs2_bitmap_find_next_clear(fb, bitno, &ffound);
+	if ((cret != fret) || (!cret && (cfound != ffound))) {
+		fprintf(stdout, "%s: find_next_clear(%"PRIu64") gave %"PRIu64
+			", expected %"PRIu64"\n", what, bitno, cfound, ffound);
+		nr_bad++;
+	}
+}
+
+static void apply(ocfs2_bitmap *cb, ocfs2_bitmap *fb, const char *what,
+		  uint64_t bitno, int set)
+{
+	int cold, fold;
+
+	if (set) {
+		ocfs2_bitmap_set(cb, bitno, &cold);
+		ocfs2_bitmap_set(fb, bitno, &fold);
+	} else {
+		ocfs2_bitmap_clear(cb, bitno, &cold);
+		ocfs2_bitmap_clear(fb, bitno, &fold);
+	}
+	if (cold != fold) {
+		fprintf(stdout, "%s: bit %"PRIu64" was %d, expected %d\n",
+			what, bitno, cold, fold);
+		nr_bad++;
+	}
+}
+
+static void run_pass(ocfs2_bitmap *cb, ocfs2_bitmap *fb, const char *what,
+		     int pass)
+{
+	uint64_t i, bitno, len, total = cb->b_total_bits;
+	uint64_t nr_array, nr_run, nr_bitmap, bytes;
+	int val, fval;
+
+	for (i = 0; i < 20000; i++) {
+		switch (pass) {
+			case 0:
+				/* Scattered */
+				bitno = random() % total;
+				len = 1;
+				break;
+			case 1:
+				/* Runs, like extents */
+				bitno = random() % total;
+				len = 1 + (random() % 5000);
+				break;
+			default:
+				/* Dense within a few chunks */
+				bitno = random() % (4 * CB_CHUNK_BITS);
+				len = 1 + (random() % 8);
+				break;
+		}
+		val = (random() % 4) != 0;
+		for (; len-- && (bitno < total); bitno++)
+			apply(cb, fb, what, bitno, val);
+
+		if (!(i % 97))
+			check(cb, fb, what, random() % total);
+	}
+
+	for (bitno = 0; bitno < total; bitno += 1 + (random() % 1000)) {
+		ocfs2_bitmap_test(cb, bitno, &val);
+		ocfs2_bitmap_test(fb, bitno, &fval);
+		if (val != fval) {
+			fprintf(stdout, "%s: test(%"PRIu64") gave %d\n",
+				what, bitno, val);
+			nr_bad++;
+		}
+		check(cb, fb, what, bitno);
+	}
+	check(cb, fb, what, total - 1);
+
+	if (ocfs2_bitmap_get_set_bits(cb) != ocfs2_bitmap_get_set_bits(fb)) {
+		fprintf(stdout, "%s: %"PRIu64" bits set, expected %"PRIu64"\n",
+			what, ocfs2_bitmap_get_set_bits(cb),
+			ocfs2_bitmap_get_set_bits(fb));
+		nr_bad++;
+	}
+
+	bytes = ocfs2_compressed_bitmap_bytes(cb, &nr_array, &nr_run,
+					      &nr_bitmap);
+	fprintf(stdout, "%s: %"PRIu64" bits set, %"PRIu64" bytes "
+		"(%"PRIu64" flat), %"PRIu64" array, %"PRIu64" run, "
+		"%"PRIu64" bitmap containers\n", what,
+		ocfs2_bitmap_get_set_bits(cb), bytes, (total + 7) / 8,
+		nr_array, nr_run, nr_bitmap);
+}
+
+int main(int argc, char *argv[])
+{
+	errcode_t ret;
+	struct _ocfs2_filesys fake_fs;
+	ocfs2_bitmap *cb, *fb;
+	const char *names[] = { "scattered", "runs", "dense" };
+	int pass;
+
+	initialize_ocfs_error_table();
+
+	memset(&fake_fs, 0, sizeof(fake_fs));
+	fake_fs.fs_clustersize = 4096;
+	fake_fs.fs_clusters = (16 * CB_CHUNK_BITS) + 12345;
+
+	srandom(argc > 1 ? atoi(argv[1]) : 1);
+	for (pass = 0; pass < 3; pass++) {
+		ret = ocfs2_compressed_bitmap_new(&fake_fs,
+						  fake_fs.fs_clusters,
+						  NULL, &cb);
+		if (!ret)
+			ret = ocfs2_cluster_bitmap_new(&fake_fs, NULL, &fb);
+		if (ret) {
+			com_err(argv[0], ret, "while creating bitmaps");
+			return 1;
+		}
+
+		run_pass(cb, fb, names[pass], pass);
+
+		ocfs2_bitmap_free(&cb);
+		ocfs2_bitmap_free(&fb);
+	}
+
+	fprintf(stdout, "compressed bitmap: %s\n",
+		nr_bad ? "_incorrect_" : "correct");
+
+	return !!nr_bad;
+}
+#endif  /* DEBUG_EXE */
@@ -27,11 +27,48 @@
 #include <string.h>
 #include <stdlib.h>
 #include <inttypes.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "ocfs2/ocfs2.h"
+#include "ocfs2/bitops.h"
 
 #include "extent_map.h"
 
+/* Batch metaecc validation of a buffer of inode blocks */
+struct scan_ecc {
+	int se_use_pool;		/* Start se_pool when it's worth it */
+	ocfs2_ecc_pool *se_pool;
+	void **se_blocks;		/* Inodes in the buffer to validate */
+	struct ocfs2_block_check **se_bcs;
+	errcode_t *se_batch_errs;	/* Results, in se_blocks order */
+	errcode_t *se_errs;		/* Results, one per buffer block */
+};
+
+/*
+ * Reads are planned ahead of the caller.  Each has its own buffer, and
+ * up to readahead of them are in flight while the caller works through
+ * the current one.  The buffers form a ring of readahead + 1.
+ */
+#define INODE_SCAN_DEFAULT_READAHEAD	1
+#define INODE_SCAN_READS		(OCFS2_INODE_SCAN_MAX_READAHEAD + 1)
+
+/*
+ * With OCFS2_INODE_SCAN_ALLOCATED, only the allocated runs of each
+ * group's bitmap are read.  A free gap smaller than this many bytes is
+ * read through rather than splitting the read in two.
+ */
+#define INODE_SCAN_MAX_GAP		(256 * 1024)
+
+struct scan_read {
+	uint64_t sr_blkno;
+	int sr_count;
+	char *sr_buf;
+	struct io_async_read sr_iar;
+	errcode_t sr_ret;		/* Image files read synchronously */
+};
+
 struct _ocfs2_inode_scan {
 	ocfs2_filesys *fs;
 	int num_inode_alloc;
@@ -42,25 +79,124 @@ struct _ocfs2_inode_scan {
 	int next_rec;
 	struct ocfs2_group_desc *cur_desc;
 	unsigned int count;
-	uint64_t cur_blkno;
-	char *group_buffer;
+	uint64_t cur_blkno;		/* Next block to plan */
+	char *group_buffer;		/* The first read's buffer */
+	char *cur_buffer;		/* The read being returned */
 	char *cur_block;
+	uint64_t buf_blkno;		/* Block number of cur_block */
 	int buffer_blocks;
 	int blocks_in_buffer;
-	unsigned int blocks_left;
+	unsigned int blocks_left;	/* Left to plan in this inode alloc */
 	uint64_t b_offset;		/* bit offset in the group bitmap. */
 	uint16_t cur_discontig_rec;	/* Only valid in discontig group. */
+	struct scan_read reads[INODE_SCAN_READS];
+	int nr_bufs;			/* Zero until the first fill */
+	int read_head;
+	int nr_reads;			/* Started and not yet returned */
+	int readahead;
+	int flags;
+	int planned_all;
+	errcode_t plan_ret;		/* Why planning stopped early */
+	struct ocfs2_inode_scan_stats stats;
+	struct scan_ecc ecc;
+	errcode_t cur_ecc;		/* Result for the last inode returned */
 };
 
+static inline uint64_t scan_time_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+/* A descriptor whose bitmap doesn't cover its bits is read in full */
+static inline int scan_only_allocated(int flags, struct ocfs2_group_desc *gd)
+{
+	return (flags & OCFS2_INODE_SCAN_ALLOCATED) &&
+		(gd->bg_bits <= (gd->bg_size * 8));
+}
+
+/*
+ * Find the next run worth reading in bits [start, end) of gd.  It runs
+ * from the first allocated bit through every allocated bit that comes
+ * after a free gap smaller than INODE_SCAN_MAX_GAP.  Returns 0 if
+ * nothing from start on is allocated.
+ */
+static int next_allocated_run(ocfs2_filesys *fs, struct ocfs2_group_desc *gd,
+			      int start, int end, int *run_start,
+			      int *run_end)
+{
+	int set, clear;
+	int max_gap = INODE_SCAN_MAX_GAP / fs->fs_blocksize;
+
+	set = ocfs2_find_next_bit_set(gd->bg_bitmap, end, start);
+	if (set >= end)
+		return 0;
+
+	*run_start = set;
+	do {
+		clear = ocfs2_find_next_bit_clear(gd->bg_bitmap, end, set);
+		if (clear >= end) {
+			clear = end;
+			break;
+		}
+		set = ocfs2_find_next_bit_set(gd->bg_bitmap, end, clear);
+	} while ((set < end) && ((set - clear) < max_gap));
+	*run_end = clear;
+
+	return 1;
+}
+
+/* Prefetch blocks we'll want soon.  Image files map their blocks. */
+static void scan_prefetch(ocfs2_inode_scan *scan, uint64_t blkno, int count)
+{
+	if (!scan->readahead || !count ||
+	    (scan->fs->fs_flags & OCFS2_FLAG_IMAGE_FILE))
+		return;
+
+	io_prefetch_blocks(scan->fs->fs_io, blkno, count);
+}
+
+/* Image files need their blocks translated, so they read right away */
+static void scan_start_read(ocfs2_inode_scan *scan, struct scan_read *sr)
+{
+	uint64_t start = scan_time_us();
+
+	if (scan->fs->fs_flags & OCFS2_FLAG_IMAGE_FILE)
+		sr->sr_ret = ocfs2_read_blocks(scan->fs, sr->sr_blkno,
+					       sr->sr_count, sr->sr_buf);
+	else
+		io_start_read(scan->fs->fs_io, &sr->sr_iar, sr->sr_blkno,
+			      sr->sr_count, sr->sr_buf);
+	scan->stats.ss_wait_us += scan_time_us() - start;
+}
+
+static errcode_t scan_finish_read(ocfs2_inode_scan *scan,
+				  struct scan_read *sr)
+{
+	uint64_t start = scan_time_us();
+	errcode_t ret;
+
+	if (scan->fs->fs_flags & OCFS2_FLAG_IMAGE_FILE)
+		ret = sr->sr_ret;
+	else
+		ret = io_finish_read(scan->fs->fs_io, &sr->sr_iar);
+	scan->stats.ss_wait_us += scan_time_us() - start;
+
+	return ret;
+}
+
 
 /*
- * This function is called by fill_group_buffer when an alloc group has
- * been completely read.  It must not be called from the last group.
- * ocfs2_get_next_inode() should have detected that condition.
+ * This function is called by plan_next_read when an alloc group has
+ * been completely planned.  It must not be called from the last group.
+ * plan_next_read() should have detected that condition.
  */
 static errcode_t get_next_group(ocfs2_inode_scan *scan)
 {
 	errcode_t ret;
+	uint64_t start;
 
 	if (!scan->cur_desc) {
 		if (scan->b_offset)
@@ -82,14 +218,21 @@ static errcode_t get_next_group(ocfs2_inode_scan *scan)
 	if (!scan->cur_blkno)
 		abort();
 
+	start = scan_time_us();
 	ret = ocfs2_read_group_desc(scan->fs, scan->cur_blkno,
 				    (char *)scan->cur_desc);
+	scan->stats.ss_wait_us += scan_time_us() - start;
+	scan->stats.ss_desc_reads++;
 	if (ret)
 		return (ret);
 
 	if (scan->cur_desc->bg_blkno != scan->cur_blkno)
 		return OCFS2_ET_CORRUPT_GROUP_DESC;
 
+	/* We'll want the next one when this one is planned */
+	scan_prefetch(scan, scan->cur_desc->bg_next_group,
+		      scan->cur_desc->bg_next_group ? 1 : 0);
+
 	/* Skip past group descriptor block */
 	scan->cur_blkno++;
 	scan->count++;
@@ -101,10 +244,10 @@ static errcode_t get_next_group(ocfs2_inode_scan *scan)
 }
 
 /*
- * This function is called by fill_group_buffer when an alloc chain
- * has been completely read.  It must not be called  when the current
- * inode alloc file has been read in its entirety.  This condition
- * should have been detected by ocfs2_get_next_inode().
+ * This function is called by plan_next_read when an alloc chain
+ * has been completely planned.  It must not be called  when the current
+ * inode alloc file has been planned in its entirety.  This condition
+ * should have been detected by plan_next_read().
  */
 static errcode_t get_next_chain(ocfs2_inode_scan *scan)
 {
@@ -181,47 +324,58 @@ out:
 }
 
 /*
- * This function is called by ocfs2_get_next_inode when it needs
- * to read in more clusters from the current inode alloc file.  It
- * must not be called when the current inode alloc file has been read
- * in its entirety.  This condition is detected by
- * ocfs2_get_next_inode().
+ * On a metaecc filesystem, validate every block in the freshly read
+ * buffer that claims to be an inode, all in one batch.  Blocks without
+ * a signature are free space and are left alone.  As with
+ * ocfs2_read_inode(), anything the ECC can fix is fixed in the buffer.
+ * What it can't fix is remembered in se_errs for
+ * ocfs2_inode_scan_ecc_status().
  */
-static errcode_t fill_group_buffer(ocfs2_inode_scan *scan)
+static void validate_inode_blocks(ocfs2_filesys *fs, struct scan_ecc *ecc,
+				  char *buffer, int num_blocks)
 {
-	errcode_t ret;
-	int num_blocks;
+	int i, nr = 0;
+	char *blk = buffer;
+	struct ocfs2_dinode *di;
 
-	if (scan->cur_rec && (scan->count > scan->cur_rec->c_total))
-		abort();
+	if (!ecc->se_errs)
+		return;
 
-	if (scan->cur_rec && (scan->b_offset > scan->cur_desc->bg_bits))
-		abort();
+	for (i = 0; i < num_blocks; i++, blk += fs->fs_blocksize) {
+		ecc->se_errs[i] = 0;
+		di = (struct ocfs2_dinode *)blk;
+		if (memcmp(di->i_signature, OCFS2_INODE_SIGNATURE,
+			   strlen(OCFS2_INODE_SIGNATURE)))
+			continue;
 
-	if (!scan->cur_rec || (scan->count == scan->cur_rec->c_total)) {
-		ret = get_next_chain(scan);
-		if (ret)
-			return ret;
-	}
-	
-	if (!scan->b_offset || (scan->b_offset == scan->cur_desc->bg_bits)) {
-		ret = get_next_group(scan);
-		if (ret)
-			return ret;
+		ecc->se_blocks[nr] = blk;
+		ecc->se_bcs[nr] = &di->i_check;
+		nr++;
 	}
 
-	num_blocks = get_next_read_blocks(scan);
-
-	ret = ocfs2_read_blocks(scan->fs, scan->cur_blkno, num_blocks,
-				scan->group_buffer);
-	if (ret)
-		return ret;
+	/*
+	 * Most scans are over small allocators, or allocators mostly
+	 * free, and never see a batch the pool would share out.  Only
+	 * start the threads once one does.  Without them, we just
+	 * validate in this thread.
+	 */
+	if (ecc->se_use_pool && !ecc->se_pool &&
+	    (nr >= OCFS2_ECC_POOL_MIN_BATCH)) {
+		ecc->se_use_pool = 0;
+		ocfs2_ecc_pool_create(0, &ecc->se_pool);
+	}
 
-	scan->b_offset += num_blocks;
-	scan->blocks_in_buffer = num_blocks;
-	scan->cur_block = scan->group_buffer;
+	if (!ocfs2_validate_meta_ecc_batch(fs, ecc->se_pool,
+					   ecc->se_blocks, ecc->se_bcs,
+					   nr, ecc->se_batch_errs))
+		return;
 
-	return 0;
+	/* Someone failed, hand the results back to their blocks */
+	for (i = 0; i < nr; i++) {
+		blk = ecc->se_blocks[i];
+		ecc->se_errs[(blk - buffer) / fs->fs_blocksize] =
+			ecc->se_batch_errs[i];
+	}
 }
 
 /* This function sets the starting points for a given cached inode */
@@ -253,6 +407,166 @@ static int get_next_inode_alloc(ocfs2_inode_scan *scan)
 	return 0;
 }
 
+/* Move the planner past num blocks of the current group */
+static inline void plan_advance(ocfs2_inode_scan *scan, int num)
+{
+	scan->cur_blkno += num;
+	scan->count += num;
+	scan->blocks_left -= num;
+	scan->b_offset += num;
+}
+
+/*
+ * Plan the next read from the current inode alloc file, moving on to
+ * the next group, chain, or inode alloc file as needed.  Sets *done
+ * once every inode alloc file has been planned.
+ */
+static errcode_t plan_next_read(ocfs2_inode_scan *scan,
+				struct scan_read *sr, int *done)
+{
+	errcode_t ret;
+	int num_blocks, start, run_start, run_end;
+
+	*done = 0;
+	if (!scan->blocks_left && get_next_inode_alloc(scan)) {
+		*done = 1;
+		return 0;
+	}
+
+	if (scan->cur_rec && (scan->count > scan->cur_rec->c_total))
+		abort();
+
+	if (scan->cur_rec && (scan->b_offset > scan->cur_desc->bg_bits))
+		abort();
+
+	if (!scan->cur_rec || (scan->count == scan->cur_rec->c_total)) {
+		ret = get_next_chain(scan);
+		if (ret)
+			return ret;
+	}
+
+	if (!scan->b_offset || (scan->b_offset == scan->cur_desc->bg_bits)) {
+		ret = get_next_group(scan);
+		if (ret)
+			return ret;
+	}
+
+	num_blocks = get_next_read_blocks(scan);
+	if (num_blocks > scan->blocks_left)
+		num_blocks = scan->blocks_left;
+
+	/* Step over free blocks; a zero count reads nothing */
+	if (scan_only_allocated(scan->flags, scan->cur_desc)) {
+		start = scan->b_offset;
+		if (!next_allocated_run(scan->fs, scan->cur_desc, start,
+					start + num_blocks, &run_start,
+					&run_end))
+			run_start = run_end = start + num_blocks;
+		plan_advance(scan, run_start - start);
+		scan->stats.ss_skipped += run_start - start;
+		num_blocks = run_end - run_start;
+	}
+
+	sr->sr_blkno = scan->cur_blkno;
+	sr->sr_count = num_blocks;
+	plan_advance(scan, num_blocks);
+
+	return 0;
+}
+
+/* The first fill gives every read in the ring its buffer */
+static errcode_t alloc_read_buffers(ocfs2_inode_scan *scan)
+{
+	errcode_t ret;
+	int i, nr = scan->readahead + 1;
+
+	scan->reads[0].sr_buf = scan->group_buffer;
+	for (i = 1; i < nr; i++) {
+		ret = ocfs2_malloc_blocks(scan->fs->fs_io, scan->buffer_blocks,
+					  &scan->reads[i].sr_buf);
+		if (ret)
+			return ret;
+	}
+
+	scan->nr_bufs = nr;
+	return 0;
+}
+
+/*
+ * Plan and start reads until every free buffer has one.  An error is
+ * held back until the caller has had every read planned before it.
+ */
+static void plan_reads(ocfs2_inode_scan *scan)
+{
+	struct scan_read *sr;
+	errcode_t ret;
+	int done;
+
+	while (!scan->planned_all && (scan->nr_reads < scan->nr_bufs)) {
+		sr = &scan->reads[(scan->read_head + scan->nr_reads) %
+				  scan->nr_bufs];
+		ret = plan_next_read(scan, sr, &done);
+		if (ret || done) {
+			scan->plan_ret = ret;
+			scan->planned_all = 1;
+			break;
+		}
+
+		if (!sr->sr_count)
+			continue;
+
+		scan_start_read(scan, sr);
+		scan->nr_reads++;
+	}
+}
+
+/*
+ * This function is called by ocfs2_get_next_inode when it needs
+ * to read in more blocks.  It leaves blocks_in_buffer at zero when
+ * every inode alloc file has been read in its entirety.
+ *
+ * The caller is done with the current buffer, so it can take the next
+ * read before we wait on the oldest one.  The oldest one's buffer then
+ * stays put until the next fill.
+ */
+static errcode_t fill_group_buffer(ocfs2_inode_scan *scan)
+{
+	errcode_t ret;
+	struct scan_read *sr;
+
+	if (!scan->nr_bufs) {
+		ret = alloc_read_buffers(scan);
+		if (ret)
+			return ret;
+	}
+
+	plan_reads(scan);
+	if (!scan->nr_reads)
+		return scan->plan_ret;
+
+	sr = &scan->reads[scan->read_head];
+	scan->read_head = (scan->read_head + 1) % scan->nr_bufs;
+	scan->nr_reads--;
+
+	ret = scan_finish_read(scan, sr);
+	if (ret)
+		return ret;
+
+	scan->stats.ss_reads++;
+	scan->stats.ss_blocks += sr->sr_count;
+
+	/* The ECC work overlaps the reads still in flight */
+	validate_inode_blocks(scan->fs, &scan->ecc, sr->sr_buf,
+			      sr->sr_count);
+
+	scan->blocks_in_buffer = sr->sr_count;
+	scan->cur_buffer = sr->sr_buf;
+	scan->cur_block = sr->sr_buf;
+	scan->buf_blkno = sr->sr_blkno;
+
+	return 0;
+}
+
 uint64_t ocfs2_get_max_inode_count(ocfs2_inode_scan *scan)
 {
 	struct ocfs2_dinode *di = NULL;
@@ -279,48 +593,166 @@ errcode_t ocfs2_get_next_inode(ocfs2_inode_scan *scan,
 {
 	errcode_t ret;
 
-	if (!scan->blocks_left) {
-		if (scan->blocks_in_buffer)
-			abort();
+	if (!scan->blocks_in_buffer) {
+		ret = fill_group_buffer(scan);
+		if (ret)
+			return ret;
 
-		if (get_next_inode_alloc(scan)) {
+		if (!scan->blocks_in_buffer) {
 			*blkno = 0;
 			return 0;
 		}
 	}
 
-	if (!scan->blocks_in_buffer) {
-		ret = fill_group_buffer(scan);
-		if (ret)
-			return ret;
-	}
-	
+
 	/* the caller swap after verifying the inode's signature */
 	memcpy(inode, scan->cur_block, scan->fs->fs_blocksize);
+	if (scan->ecc.se_errs)
+		scan->cur_ecc = scan->ecc.se_errs[(scan->cur_block -
+						   scan->cur_buffer) /
+						  scan->fs->fs_blocksize];
 
 	scan->cur_block += scan->fs->fs_blocksize;
 	scan->blocks_in_buffer--;
-	scan->blocks_left--;
-	*blkno = scan->cur_blkno;
-	scan->cur_blkno++;
-	scan->count++;
+	*blkno = scan->buf_blkno++;
+
+	return 0;
+}
+
+/*
+ * The metaecc result for the inode ocfs2_get_next_inode() last
+ * returned.  Zero if it was fine, if it had no inode signature, or if
+ * the filesystem isn't checking ECC.
+ */
+errcode_t ocfs2_inode_scan_ecc_status(ocfs2_inode_scan *scan)
+{
+	return scan->cur_ecc;
+}
+
+/*
+ * Keep depth reads in flight ahead of the one the caller is working
+ * through.  Zero turns readahead off; every read waits on the disk.
+ * The buffers are sized on the first ocfs2_get_next_inode(), so the
+ * depth can't change after that.
+ */
+errcode_t ocfs2_inode_scan_set_readahead(ocfs2_inode_scan *scan, int depth)
+{
+	if ((depth < 0) || (depth > OCFS2_INODE_SCAN_MAX_READAHEAD) ||
+	    scan->nr_bufs)
+		return OCFS2_ET_INVALID_ARGUMENT;
+
+	scan->readahead = depth;
+	return 0;
+}
+
+/*
+ * Flags change how reads are planned from then on, so set them before
+ * the first ocfs2_get_next_inode().
+ */
+errcode_t ocfs2_inode_scan_set_flags(ocfs2_inode_scan *scan, int flags)
+{
+	if (flags & ~OCFS2_INODE_SCAN_ALLOCATED)
+		return OCFS2_ET_INVALID_ARGUMENT;
+
+	scan->flags = flags;
+	return 0;
+}
+
+void ocfs2_inode_scan_get_stats(ocfs2_inode_scan *scan,
+				struct ocfs2_inode_scan_stats *stats)
+{
+	*stats = scan->stats;
+}
+
+/*
+ * Read the global inode alloc into allocs[0], and the slots' into the
+ * rest.  The caller frees them, even on error.
+ */
+static errcode_t read_inode_allocs(ocfs2_filesys *fs,
+				   ocfs2_cached_inode **allocs, int num)
+{
+	uint64_t blkno;
+	errcode_t ret;
+	int i, slot_num;
+
+	ret = ocfs2_lookup_system_inode(fs,
+					GLOBAL_INODE_ALLOC_SYSTEM_INODE,
+					0, &blkno);
+	if (ret)
+		return ret;
+
+	ret = ocfs2_read_cached_inode(fs, blkno, &allocs[0]);
+	if (ret)
+		return ret;
+
+	for (i = 1; i < num; i++) {
+		slot_num = i - 1;
+		ret = ocfs2_lookup_system_inode(fs,
+						INODE_ALLOC_SYSTEM_INODE,
+						slot_num,
+						&blkno);
+		if (ret)
+			return ret;
+
+		ret = ocfs2_read_cached_inode(fs, blkno, &allocs[i]);
+		if (ret)
+			return ret;
+	}
 
 	return 0;
 }
 
+/*
+ * Set up batch validation of a buffer of nr blocks on metaecc
+ * filesystems.  With use_pool, big enough batches are shared out
+ * among a pool of threads, started by validate_inode_blocks() when
+ * the first one comes along.
+ */
+static errcode_t init_scan_ecc(ocfs2_filesys *fs, struct scan_ecc *ecc,
+			       int nr, int use_pool)
+{
+	errcode_t ret;
+
+	if (!ocfs2_meta_ecc(OCFS2_RAW_SB(fs->fs_super)) ||
+	    (fs->fs_flags & OCFS2_FLAG_NO_ECC_CHECKS))
+		return 0;
+
+	ret = ocfs2_malloc0(sizeof(void *) * nr, &ecc->se_blocks);
+	if (!ret)
+		ret = ocfs2_malloc0(sizeof(struct ocfs2_block_check *) * nr,
+				    &ecc->se_bcs);
+	if (!ret)
+		ret = ocfs2_malloc0(sizeof(errcode_t) * nr,
+				    &ecc->se_batch_errs);
+	if (!ret)
+		ret = ocfs2_malloc0(sizeof(errcode_t) * nr, &ecc->se_errs);
+	if (!ret)
+		ecc->se_use_pool = use_pool;
+
+	return ret;
+}
+
+static void free_scan_ecc(struct scan_ecc *ecc)
+{
+	ocfs2_ecc_pool_destroy(ecc->se_pool);
+	ocfs2_free(&ecc->se_blocks);
+	ocfs2_free(&ecc->se_bcs);
+	ocfs2_free(&ecc->se_batch_errs);
+	ocfs2_free(&ecc->se_errs);
+}
+
 errcode_t ocfs2_open_inode_scan(ocfs2_filesys *fs,
 				ocfs2_inode_scan **ret_scan)
 {
 	ocfs2_inode_scan *scan;
-	uint64_t blkno;
 	errcode_t ret;
-	int i, slot_num;
 
 	ret = ocfs2_malloc0(sizeof(struct _ocfs2_inode_scan), &scan);
 	if (ret)
 		return ret;
 
 	scan->fs = fs;
+	scan->readahead = INODE_SCAN_DEFAULT_READAHEAD;
 
 	/* One inode alloc per slot, one global inode alloc */
 	scan->num_inode_alloc =
@@ -344,31 +776,14 @@ errcode_t ocfs2_open_inode_scan(ocfs2_filesys *fs,
 	if (ret)
 		goto out_inode_files;
 
-	ret = ocfs2_lookup_system_inode(fs,
-					GLOBAL_INODE_ALLOC_SYSTEM_INODE,
-					0, &blkno);
+	ret = init_scan_ecc(fs, &scan->ecc, scan->buffer_blocks, 1);
 	if (ret)
 		goto out_cleanup;
 
-	ret = ocfs2_read_cached_inode(fs, blkno, &scan->inode_alloc[0]);
+	ret = read_inode_allocs(fs, scan->inode_alloc, scan->num_inode_alloc);
 	if (ret)
 		goto out_cleanup;
 
-	for (i = 1; i < scan->num_inode_alloc; i++) {
-		slot_num = i - 1;
-		ret = ocfs2_lookup_system_inode(fs,
-						INODE_ALLOC_SYSTEM_INODE,
-						slot_num,
-						&blkno);
-		if (ret)
-			goto out_cleanup;
-
-		ret = ocfs2_read_cached_inode(fs, blkno,
-					      &scan->inode_alloc[i]);
-		if (ret)
-			goto out_cleanup;
-	}
-
 	/*
 	 * FIXME: Should this pre-read all the group descriptors like
 	 * the old code read all the extent maps?
@@ -398,6 +813,15 @@ void ocfs2_close_inode_scan(ocfs2_inode_scan *scan)
 	if (!scan)
 		return;
 
+	/* Reads still in flight are going into our buffers */
+	while (scan->nr_reads) {
+		scan_finish_read(scan, &scan->reads[scan->read_head]);
+		scan->read_head = (scan->read_head + 1) % scan->nr_bufs;
+		scan->nr_reads--;
+	}
+	for (i = 1; i < scan->nr_bufs; i++)
+		ocfs2_free(&scan->reads[i].sr_buf);
+
 	for (i = 0; i < scan->num_inode_alloc; i++) {
 		if (scan->inode_alloc[i]) {
 			ocfs2_free_cached_inode(scan->fs,
@@ -405,6 +829,7 @@ void ocfs2_close_inode_scan(ocfs2_inode_scan *scan)
 		}
 	}
 
+	free_scan_ecc(&scan->ecc);
 	ocfs2_free(&scan->group_buffer);
 	ocfs2_free(&scan->cur_desc);
 	ocfs2_free(&scan->inode_alloc);
@@ -414,38 +839,658 @@ void ocfs2_close_inode_scan(ocfs2_inode_scan *scan)
 }
 
 
+/*
+ * The parallel scan.  Each iterate makes two passes, with the workers
+ * claiming work from a shared counter, as the ecc_pool does.  The
+ * first walks the chains, a chain to a worker at a time, and records
+ * where each group's inodes are.  The second reads the groups, a group
+ * to a worker at a time and a buffer at a time, and hands the blocks
+ * to func.  A worker validates its own buffer; the workers are already
+ * using the CPUs an ecc_pool would.
+ */
+#define PARALLEL_SCAN_MAX_THREADS	64
+#define PARALLEL_SCAN_BUFFER_SIZE	(1024 * 1024)
+
+/* A run of inode blocks in a group */
+struct pscan_extent {
+	uint64_t pe_blkno;
+	int pe_count;
+};
+
+struct pscan_group {
+	struct pscan_extent *pg_extents;
+	int pg_nr_extents;
+	int pg_alloc_extents;
+};
+
+struct pscan_chain {
+	uint64_t pc_blkno;		/* c_blkno */
+	uint32_t pc_total;		/* c_total */
+	struct pscan_group *pc_groups;
+	int pc_nr_groups;
+	int pc_alloc_groups;
+};
+
+struct pscan_worker {
+	ocfs2_parallel_inode_scan *pw_scan;
+	int pw_id;
+	pthread_t pw_thread;
+	char *pw_desc;
+	char *pw_buffer;
+	struct scan_ecc pw_ecc;
+};
+
+struct _ocfs2_parallel_inode_scan {
+	ocfs2_filesys *ps_fs;
+	int ps_num_inode_alloc;
+	ocfs2_cached_inode **ps_inode_alloc;
+	int ps_set_threaded;		/* We put fs_io in threaded mode */
+	int ps_flags;
+	int ps_buffer_blocks;
+	int ps_nr_workers;
+	struct pscan_worker *ps_workers;
+	struct pscan_chain *ps_chains;
+	int ps_nr_chains;
+
+	/* Per iterate */
+	struct pscan_group **ps_groups;	/* NULL during the chain pass */
+	int ps_nr_groups;
+	int ps_next;			/* Next unclaimed chain or group */
+	ocfs2_inode_scan_func ps_func;
+	void *ps_priv_data;
+	pthread_mutex_t ps_lock;
+	errcode_t ps_ret;		/* First error, under ps_lock */
+	volatile int ps_stop;
+};
+
+static void pscan_stop(ocfs2_parallel_inode_scan *scan, errcode_t ret)
+{
+	pthread_mutex_lock(&scan->ps_lock);
+	if (!scan->ps_ret)
+		scan->ps_ret = ret;
+	scan->ps_stop = 1;
+	pthread_mutex_unlock(&scan->ps_lock);
+}
+
+static errcode_t pscan_add_extent(struct pscan_group *pg, uint64_t blkno,
+				  int count)
+{
+	errcode_t ret;
+	int nr;
+	struct pscan_extent *pe;
+
+	if (pg->pg_nr_extents == pg->pg_alloc_extents) {
+		nr = pg->pg_alloc_extents ? pg->pg_alloc_extents * 2 : 4;
+		ret = ocfs2_realloc0(sizeof(struct pscan_extent) * nr,
+				     &pg->pg_extents,
+				     sizeof(struct pscan_extent) *
+				     pg->pg_alloc_extents);
+		if (ret)
+			return ret;
+		pg->pg_alloc_extents = nr;
+	}
+
+	pe = &pg->pg_extents[pg->pg_nr_extents++];
+	pe->pe_blkno = blkno;
+	pe->pe_count = count;
+
+	return 0;
+}
+
+/*
+ * Add bits [first, end) of gd, which start at blkno on disk.  With
+ * OCFS2_INODE_SCAN_ALLOCATED, only their allocated runs are added.
+ */
+static errcode_t pscan_add_bits(ocfs2_parallel_inode_scan *scan,
+				struct pscan_group *pg,
+				struct ocfs2_group_desc *gd, uint64_t blkno,
+				int first, int end)
+{
+	errcode_t ret;
+	int run_start, run_end, start = first;
+
+	if (!scan_only_allocated(scan->ps_flags, gd))
+		return pscan_add_extent(pg, blkno, end - first);
+
+	while (next_allocated_run(scan->ps_fs, gd, start, end, &run_start,
+				  &run_end)) {
+		ret = pscan_add_extent(pg, blkno + (run_start - first),
+				       run_end - run_start);
+		if (ret)
+			return ret;
+		start = run_end;
+	}
+
+	return 0;
+}
+
+/*
+ * Record where the inode blocks of a group are.  Bit N of a group is
+ * its Nth block, counting through its extents if it is discontiguous,
+ * and bit 0 is the descriptor.
+ */
+static errcode_t pscan_add_group(ocfs2_parallel_inode_scan *scan,
+				 struct pscan_chain *pc,
+				 struct ocfs2_group_desc *gd)
+{
+	errcode_t ret;
+	int i, nr;
+	uint64_t start, first, end;
+	struct pscan_group *pg;
+	struct ocfs2_extent_rec *rec;
+
+	if (pc->pc_nr_groups == pc->pc_alloc_groups) {
+		nr = pc->pc_alloc_groups ? pc->pc_alloc_groups * 2 : 16;
+		ret = ocfs2_realloc0(sizeof(struct pscan_group) * nr,
+				     &pc->pc_groups,
+				     sizeof(struct pscan_group) *
+				     pc->pc_alloc_groups);
+		if (ret)
+			return ret;
+		pc->pc_alloc_groups = nr;
+	}
+
+	nr = gd->bg_list.l_next_free_rec;
+	if (nr > gd->bg_list.l_count)
+		return OCFS2_ET_CORRUPT_GROUP_DESC;
+
+	pg = &pc->pc_groups[pc->pc_nr_groups++];
+
+	if (!nr) {
+		if (gd->bg_bits <= 1)
+			return 0;
+		return pscan_add_bits(scan, pg, gd, gd->bg_blkno + 1, 1,
+				      gd->bg_bits);
+	}
+
+	for (i = 0; i < nr; i++) {
+		rec = &gd->bg_list.l_recs[i];
+		start = ocfs2_clusters_to_blocks(scan->ps_fs, rec->e_cpos);
+		end = ocfs2_clusters_to_blocks(scan->ps_fs, rec->e_cpos +
+					       rec->e_leaf_clusters);
+		if (end > gd->bg_bits)
+			end = gd->bg_bits;
+		first = start ? start : 1;
+		if (end <= first)
+			continue;
+
+		ret = pscan_add_bits(scan, pg, gd,
+				     rec->e_blkno + (first - start),
+				     first, end);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/* As in the serial scan, a chain ends after c_total blocks */
+static errcode_t pscan_walk_chain(struct pscan_worker *pw,
+				  struct pscan_chain *pc)
+{
+	errcode_t ret;
+	uint64_t blocks = 0, blkno = pc->pc_blkno;
+	ocfs2_filesys *fs = pw->pw_scan->ps_fs;
+	struct ocfs2_group_desc *gd = (struct ocfs2_group_desc *)pw->pw_desc;
+
+	while ((blocks < pc->pc_total) && !pw->pw_scan->ps_stop) {
+		if (!blkno)
+			return OCFS2_ET_CORRUPT_CHAIN;
+
+		ret = ocfs2_read_group_desc(fs, blkno, pw->pw_desc);
+		if (ret)
+			return ret;
+
+		if ((gd->bg_blkno != blkno) || !gd->bg_bits)
+			return OCFS2_ET_CORRUPT_GROUP_DESC;
+
+		ret = pscan_add_group(pw->pw_scan, pc, gd);
+		if (ret)
+			return ret;
+
+		blocks += gd->bg_bits;
+		blkno = gd->bg_next_group;
+	}
+
+	return 0;
+}
+
+static errcode_t pscan_read_group(struct pscan_worker *pw,
+				  struct pscan_group *pg)
+{
+	errcode_t ret;
+	int i, j, num;
+	int left;
+	uint64_t blkno;
+	char *blk;
+	ocfs2_parallel_inode_scan *scan = pw->pw_scan;
+	ocfs2_filesys *fs = scan->ps_fs;
+
+	for (i = 0; i < pg->pg_nr_extents; i++) {
+		blkno = pg->pg_extents[i].pe_blkno;
+		left = pg->pg_extents[i].pe_count;
+
+		while (left && !scan->ps_stop) {
+			num = left;
+			if (num > scan->ps_buffer_blocks)
+				num = scan->ps_buffer_blocks;
+
+			ret = ocfs2_read_blocks(fs, blkno, num, pw->pw_buffer);
+			if (ret)
+				return ret;
+
+			validate_inode_blocks(fs, &pw->pw_ecc, pw->pw_buffer,
+					      num);
+
+			blk = pw->pw_buffer;
+			for (j = 0; j < num; j++, blk += fs->fs_blocksize) {
+				ret = scan->ps_func(fs, pw->pw_id, blkno + j,
+						    blk,
+						    pw->pw_ecc.se_errs ?
+						    pw->pw_ecc.se_errs[j] : 0,
+						    scan->ps_priv_data);
+				if (ret)
+					return ret;
+			}
+
+			blkno += num;
+			left -= num;
+		}
+	}
+
+	return 0;
+}
+
+static void *pscan_worker(void *arg)
+{
+	struct pscan_worker *pw = arg;
+	ocfs2_parallel_inode_scan *scan = pw->pw_scan;
+	errcode_t ret = 0;
+	int i;
+
+	while (!ret && !scan->ps_stop) {
+		i = __sync_fetch_and_add(&scan->ps_next, 1);
+		if (scan->ps_groups) {
+			if (i >= scan->ps_nr_groups)
+				break;
+			ret = pscan_read_group(pw, scan->ps_groups[i]);
+		} else {
+			if (i >= scan->ps_nr_chains)
+				break;
+			ret = pscan_walk_chain(pw, &scan->ps_chains[i]);
+		}
+	}
+
+	if (ret)
+		pscan_stop(scan, ret);
+
+	return NULL;
+}
+
+/*
+ * Run a pass on every worker, the calling thread as worker 0.  A
+ * worker that can't be started just leaves more for the others.
+ */
+static errcode_t pscan_run(ocfs2_parallel_inode_scan *scan)
+{
+	int i, started;
+
+	scan->ps_next = 0;
+	for (i = 1; i < scan->ps_nr_workers; i++) {
+		if (pthread_create(&scan->ps_workers[i].pw_thread, NULL,
+				   pscan_worker, &scan->ps_workers[i]))
+			break;
+	}
+	started = i;
+
+	pscan_worker(&scan->ps_workers[0]);
+
+	for (i = 1; i < started; i++)
+		pthread_join(scan->ps_workers[i].pw_thread, NULL);
+
+	return scan->ps_ret;
+}
+
+static void pscan_free_groups(ocfs2_parallel_inode_scan *scan)
+{
+	int i, j;
+	struct pscan_chain *pc;
+
+	for (i = 0; i < scan->ps_nr_chains; i++) {
+		pc = &scan->ps_chains[i];
+		for (j = 0; j < pc->pc_nr_groups; j++)
+			ocfs2_free(&pc->pc_groups[j].pg_extents);
+		ocfs2_free(&pc->pc_groups);
+		pc->pc_nr_groups = 0;
+		pc->pc_alloc_groups = 0;
+	}
+
+	if (scan->ps_groups)
+		ocfs2_free(&scan->ps_groups);
+	scan->ps_nr_groups = 0;
+}
+
+errcode_t ocfs2_inode_scan_parallel_iterate(ocfs2_parallel_inode_scan *scan,
+					    ocfs2_inode_scan_func func,
+					    void *priv_data)
+{
+	errcode_t ret;
+	int i, j, nr = 0;
+	struct pscan_chain *pc;
+
+	scan->ps_func = func;
+	scan->ps_priv_data = priv_data;
+	scan->ps_ret = 0;
+	scan->ps_stop = 0;
+
+	ret = pscan_run(scan);
+	if (ret)
+		goto out;
+
+	for (i = 0; i < scan->ps_nr_chains; i++)
+		nr += scan->ps_chains[i].pc_nr_groups;
+	if (!nr)
+		goto out;
+
+	ret = ocfs2_malloc0(sizeof(struct pscan_group *) * nr,
+			    &scan->ps_groups);
+	if (ret)
+		goto out;
+
+	for (i = 0; i < scan->ps_nr_chains; i++) {
+		pc = &scan->ps_chains[i];
+		for (j = 0; j < pc->pc_nr_groups; j++)
+			scan->ps_groups[scan->ps_nr_groups++] =
+				&pc->pc_groups[j];
+	}
+
+	ret = pscan_run(scan);
+
+out:
+	pscan_free_groups(scan);
+	if (ret == OCFS2_ET_ITERATION_COMPLETE)
+		ret = 0;
+
+	return ret;
+}
+
+int ocfs2_inode_scan_parallel_workers(ocfs2_parallel_inode_scan *scan)
+{
+	return scan->ps_nr_workers;
+}
+
+/* The groups are walked afresh by every iterate, which sees new flags */
+errcode_t ocfs2_inode_scan_parallel_set_flags(ocfs2_parallel_inode_scan *scan,
+					      int flags)
+{
+	if (flags & ~OCFS2_INODE_SCAN_ALLOCATED)
+		return OCFS2_ET_INVALID_ARGUMENT;
+
+	scan->ps_flags = flags;
+	return 0;
+}
+
+/* One pscan_chain per chain with blocks, in the serial scan's order */
+static errcode_t pscan_init_chains(ocfs2_parallel_inode_scan *scan)
+{
+	errcode_t ret;
+	int i, j, nr = 0;
+	struct ocfs2_dinode *di;
+	struct ocfs2_chain_list *cl;
+	struct pscan_chain *pc;
+
+	for (i = 0; i < scan->ps_num_inode_alloc; i++) {
+		di = scan->ps_inode_alloc[i]->ci_inode;
+		if (!di->id1.bitmap1.i_total)
+			continue;
+		cl = &di->id2.i_chain;
+		if (!cl->cl_next_free_rec ||
+		    (cl->cl_next_free_rec > cl->cl_count))
+			return OCFS2_ET_CORRUPT_CHAIN;
+		nr += cl->cl_next_free_rec;
+	}
+
+	if (!nr)
+		return 0;
+
+	ret = ocfs2_malloc0(sizeof(struct pscan_chain) * nr,
+			    &scan->ps_chains);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < scan->ps_num_inode_alloc; i++) {
+		di = scan->ps_inode_alloc[i]->ci_inode;
+		if (!di->id1.bitmap1.i_total)
+			continue;
+		cl = &di->id2.i_chain;
+		for (j = 0; j < cl->cl_next_free_rec; j++) {
+			if (!cl->cl_recs[j].c_total)
+				continue;
+			pc = &scan->ps_chains[scan->ps_nr_chains++];
+			pc->pc_blkno = cl->cl_recs[j].c_blkno;
+			pc->pc_total = cl->cl_recs[j].c_total;
+		}
+	}
+
+	return 0;
+}
+
+static errcode_t pscan_init_workers(ocfs2_parallel_inode_scan *scan,
+				    int nr_threads)
+{
+	errcode_t ret;
+	int i;
+	long cpus;
+	ocfs2_filesys *fs = scan->ps_fs;
+	struct pscan_worker *pw;
+
+	if (nr_threads <= 0) {
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		nr_threads = (cpus > 1) ? cpus : 1;
+	}
+	if (nr_threads > PARALLEL_SCAN_MAX_THREADS)
+		nr_threads = PARALLEL_SCAN_MAX_THREADS;
+
+	/* Without a threaded channel, we're down to the calling thread */
+	if ((nr_threads > 1) && !io_is_threaded(fs->fs_io)) {
+		if (io_set_threaded(fs->fs_io, true))
+			nr_threads = 1;
+		else
+			scan->ps_set_threaded = 1;
+	}
+
+	ret = ocfs2_malloc0(sizeof(struct pscan_worker) * nr_threads,
+			    &scan->ps_workers);
+	if (ret)
+		return ret;
+
+	scan->ps_buffer_blocks = PARALLEL_SCAN_BUFFER_SIZE / fs->fs_blocksize;
+	for (i = 0; i < nr_threads; i++) {
+		pw = &scan->ps_workers[i];
+		pw->pw_scan = scan;
+		pw->pw_id = i;
+		scan->ps_nr_workers++;
+
+		ret = ocfs2_malloc_block(fs->fs_io, &pw->pw_desc);
+		if (!ret)
+			ret = ocfs2_malloc_blocks(fs->fs_io,
+						  scan->ps_buffer_blocks,
+						  &pw->pw_buffer);
+		if (!ret)
+			ret = init_scan_ecc(fs, &pw->pw_ecc,
+					    scan->ps_buffer_blocks, 0);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+errcode_t ocfs2_open_inode_scan_parallel(ocfs2_filesys *fs, int nr_threads,
+					 ocfs2_parallel_inode_scan **ret_scan)
+{
+	ocfs2_parallel_inode_scan *scan;
+	errcode_t ret;
+
+	ret = ocfs2_malloc0(sizeof(struct _ocfs2_parallel_inode_scan),
+			    &scan);
+	if (ret)
+		return ret;
+
+	scan->ps_fs = fs;
+	pthread_mutex_init(&scan->ps_lock, NULL);
+
+	scan->ps_num_inode_alloc =
+		OCFS2_RAW_SB(fs->fs_super)->s_max_slots + 1;
+	ret = ocfs2_malloc0(sizeof(ocfs2_cached_inode *) *
+			    scan->ps_num_inode_alloc,
+			    &scan->ps_inode_alloc);
+	if (!ret)
+		ret = read_inode_allocs(fs, scan->ps_inode_alloc,
+					scan->ps_num_inode_alloc);
+	if (!ret)
+		ret = pscan_init_chains(scan);
+	if (!ret)
+		ret = pscan_init_workers(scan, nr_threads);
+	if (ret) {
+		ocfs2_close_inode_scan_parallel(scan);
+		return ret;
+	}
+
+	*ret_scan = scan;
+	return 0;
+}
+
+void ocfs2_close_inode_scan_parallel(ocfs2_parallel_inode_scan *scan)
+{
+	int i;
+	struct pscan_worker *pw;
+
+	if (!scan)
+		return;
+
+	for (i = 0; i < scan->ps_nr_workers; i++) {
+		pw = &scan->ps_workers[i];
+		free_scan_ecc(&pw->pw_ecc);
+		ocfs2_free(&pw->pw_buffer);
+		ocfs2_free(&pw->pw_desc);
+	}
+	ocfs2_free(&scan->ps_workers);
+
+	if (scan->ps_set_threaded)
+		io_set_threaded(scan->ps_fs->fs_io, false);
+
+	for (i = 0; i < scan->ps_num_inode_alloc; i++) {
+		if (scan->ps_inode_alloc && scan->ps_inode_alloc[i])
+			ocfs2_free_cached_inode(scan->ps_fs,
+						scan->ps_inode_alloc[i]);
+	}
+
+	pscan_free_groups(scan);
+	ocfs2_free(&scan->ps_chains);
+	ocfs2_free(&scan->ps_inode_alloc);
+	pthread_mutex_destroy(&scan->ps_lock);
+	ocfs2_free(&scan);
+}
+
+
 
 #ifdef DEBUG_EXE
 #include <string.h>
 #include <stdlib.h>
+#include <getopt.h>
 
 static void print_usage(void)
 {
 	fprintf(stderr,
-		"Usage: debug_inode_scan <filename>\n");
+		"Usage: debug_inode_scan [-a] [-t <threads>] "
+		"[-r <readahead>] <filename>\n");
 }
 
 extern int opterr, optind;
 extern char *optarg;
 
+static void print_inode(uint64_t blkno, struct ocfs2_dinode *di)
+{
+	if (memcmp(di->i_signature, OCFS2_INODE_SIGNATURE,
+		   strlen(OCFS2_INODE_SIGNATURE)))
+		return;
+
+	if (!(di->i_flags & OCFS2_VALID_FL))
+		return;
+
+	fprintf(stdout,
+		"%snode %"PRIu64" with size %"PRIu64"\n",
+		(di->i_flags & OCFS2_SYSTEM_FL) ?
+		"System i" : "I",
+		blkno, di->i_size);
+}
+
+static errcode_t print_func(ocfs2_filesys *fs, int worker, uint64_t blkno,
+			    char *inode, errcode_t ecc_status,
+			    void *priv_data)
+{
+	print_inode(blkno, (struct ocfs2_dinode *)inode);
+	return 0;
+}
+
+static errcode_t parallel_scan(ocfs2_filesys *fs, int threads, int flags)
+{
+	errcode_t ret;
+	ocfs2_parallel_inode_scan *pscan;
+
+	ret = ocfs2_open_inode_scan_parallel(fs, threads, &pscan);
+	if (ret)
+		return ret;
+	ocfs2_inode_scan_parallel_set_flags(pscan, flags);
+
+	fprintf(stderr, "Scanning with %d workers\n",
+		ocfs2_inode_scan_parallel_workers(pscan));
+	ret = ocfs2_inode_scan_parallel_iterate(pscan, print_func, NULL);
+	ocfs2_close_inode_scan_parallel(pscan);
+
+	return ret;
+}
+
 int main(int argc, char *argv[])
 {
 	errcode_t ret;
-	int done;
+	int c, done, threads = -1, readahead = -1, flags = 0;
 	uint64_t blkno;
 	char *filename, *buf;
 	ocfs2_filesys *fs;
 	struct ocfs2_dinode *di;
 	ocfs2_inode_scan *scan;
+	struct ocfs2_inode_scan_stats stats;
 
 	initialize_ocfs_error_table();
 
-	if (argc < 2) {
+	while ((c = getopt(argc, argv, "at:r:")) != EOF) {
+		switch (c) {
+		case 'a':
+			flags |= OCFS2_INODE_SCAN_ALLOCATED;
+			break;
+
+		case 't':
+			threads = atoi(optarg);
+			break;
+
+		case 'r':
+			readahead = atoi(optarg);
+			break;
+
+		default:
+			print_usage();
+			return 1;
+		}
+	}
+
+	if (optind >= argc) {
 		fprintf(stderr, "Missing filename\n");
 		print_usage();
 		return 1;
 	}
-	filename = argv[1];
+	filename = argv[optind];
 
 	ret = ocfs2_open(filename, OCFS2_FLAG_RO|OCFS2_FLAG_BUFFERED, 0, 0, &fs);
 	if (ret) {
@@ -454,6 +1499,13 @@ int main(int argc, char *argv[])
 		goto out;
 	}
 
+	if (threads >= 0) {
+		ret = parallel_scan(fs, threads, flags);
+		if (ret)
+			com_err(argv[0], ret, "while scanning in parallel");
+		goto out_close;
+	}
+
 	ret = ocfs2_malloc_block(fs->fs_io, &buf);
 	if (ret) {
 		com_err(argv[0], ret,
@@ -470,6 +1522,16 @@ int main(int argc, char *argv[])
 		goto out_free;
 	}
 
+	if (readahead >= 0) {
+		ret = ocfs2_inode_scan_set_readahead(scan, readahead);
+		if (ret) {
+			com_err(argv[0], ret,
+				"while setting up readahead");
+			goto out_close_scan;
+		}
+	}
+	ocfs2_inode_scan_set_flags(scan, flags);
+
 	done = 0;
 	while (!done) {
 		ret = ocfs2_get_next_inode(scan, &blkno, buf);
@@ -478,25 +1540,20 @@ int main(int argc, char *argv[])
 				"while getting next inode");
 			goto out_close_scan;
 		}
-		if (blkno) {
-			if (memcmp(di->i_signature,
-				   OCFS2_INODE_SIGNATURE,
-				   strlen(OCFS2_INODE_SIGNATURE)))
-				continue;
-
-			if (!(di->i_flags & OCFS2_VALID_FL))
-				continue;
-
-			fprintf(stdout, 
-				"%snode %"PRIu64" with size %"PRIu64"\n",
-				(di->i_flags & OCFS2_SYSTEM_FL) ?
-				"System i" : "I",
-				blkno, di->i_size);
-		}
+		if (blkno)
+			print_inode(blkno, di);
 		else
 			done = 1;
 	}
 
+	ocfs2_inode_scan_get_stats(scan, &stats);
+	fprintf(stderr,
+		"%"PRIu64" reads of %"PRIu64" blocks, %"PRIu64" group "
+		"descriptors, %"PRIu64"us waiting, %"PRIu64" blocks "
+		"skipped\n",
+		stats.ss_reads, stats.ss_blocks, stats.ss_desc_reads,
+		stats.ss_wait_us, stats.ss_skipped);
+
 out_close_scan:
 	ocfs2_close_inode_scan(scan);
 
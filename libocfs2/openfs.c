@@ -201,10 +201,23 @@ errcode_t ocfs2_write_primary_super(ocfs2_filesys *fs)
 		   strlen(OCFS2_SUPER_BLOCK_SIGNATURE)))
 		goto out_blk;
 
+	/*
+	 * With write-back, the blocks the superblock describes must reach
+	 * the disk before it does, and it must reach the disk before
+	 * anything that depends on it.
+	 */
+	ret = io_barrier(fs->fs_io);
+	if (ret)
+		goto out_blk;
+
 	ret = ocfs2_write_inode(fs, OCFS2_SUPER_BLOCK_BLKNO, blk);
 	if (ret)
 		goto out_blk;
 
+	ret = io_barrier(fs->fs_io);
+	if (ret)
+		goto out_blk;
+
 	return 0;
 
 out_blk:
@@ -23,6 +23,7 @@
  */
 
 #include <inttypes.h>
+#include <pthread.h>
 
 #include "ocfs2/byteorder.h"
 #include "ocfs2/ocfs2.h"
@@ -253,70 +254,92 @@ errcode_t ocfs2_find_read_quota_hash(ocfs2_filesys *fs, ocfs2_quota_hash *hash,
 	return 0;
 }
 
-errcode_t ocfs2_compute_quota_usage(ocfs2_filesys *fs,
-				    ocfs2_quota_hash *usr_hash,
-				    ocfs2_quota_hash *grp_hash)
+struct quota_usage_ctxt {
+	ocfs2_quota_hash *usr_hash;
+	ocfs2_quota_hash *grp_hash;
+	pthread_mutex_t lock;		/* Around the hashes */
+};
+
+static errcode_t quota_usage_add(ocfs2_quota_hash *hash, qid_t id,
+				 uint64_t bytes)
 {
-	errcode_t err = 0;
-	ocfs2_inode_scan *scan;
-	uint64_t blkno;
-	char *buf;
-	int close_scan = 0;
-	struct ocfs2_dinode *di;
+	errcode_t err;
 	ocfs2_cached_dquot *dquot;
 
-	err = ocfs2_malloc_block(fs->fs_io, &buf);
+	err = ocfs2_find_create_quota_hash(hash, id, &dquot);
 	if (err)
 		return err;
-	di = (struct ocfs2_dinode *)buf;
+	dquot->d_ddquot.dqb_curspace += bytes;
+	dquot->d_ddquot.dqb_curinodes++;
+
+	return 0;
+}
+
+/* Called from the inode scan's workers, several at once */
+static errcode_t quota_usage_inode(ocfs2_filesys *fs, int worker,
+				   uint64_t blkno, char *inode,
+				   errcode_t ecc_status, void *priv_data)
+{
+	struct quota_usage_ctxt *ctxt = priv_data;
+	struct ocfs2_dinode *di = (struct ocfs2_dinode *)inode;
+	uint64_t bytes;
+	errcode_t err = 0;
+
+	/*
+	 * Check whether the inode looks reasonable and interesting
+	 * for quota
+	 */
+	if (memcmp(di->i_signature, OCFS2_INODE_SIGNATURE,
+		   strlen(OCFS2_INODE_SIGNATURE)))
+		return 0;
+	ocfs2_swap_inode_to_cpu(fs, di);
+	if (di->i_fs_generation != fs->fs_super->i_fs_generation)
+		return 0;
+	if (!(di->i_flags & OCFS2_VALID_FL))
+		return 0;
+	if (di->i_flags & OCFS2_SYSTEM_FL &&
+	    blkno != OCFS2_RAW_SB(fs->fs_super)->s_root_blkno)
+		return 0;
 
-	err = ocfs2_open_inode_scan(fs, &scan);
+	bytes = ocfs2_clusters_to_bytes(fs, di->i_clusters);
+	pthread_mutex_lock(&ctxt->lock);
+	if (ctxt->usr_hash)
+		err = quota_usage_add(ctxt->usr_hash, di->i_uid, bytes);
+	if (!err && ctxt->grp_hash)
+		err = quota_usage_add(ctxt->grp_hash, di->i_gid, bytes);
+	pthread_mutex_unlock(&ctxt->lock);
+
+	return err;
+}
+
+errcode_t ocfs2_compute_quota_usage(ocfs2_filesys *fs,
+				    ocfs2_quota_hash *usr_hash,
+				    ocfs2_quota_hash *grp_hash,
+				    int scan_flags)
+{
+	errcode_t err;
+	ocfs2_parallel_inode_scan *scan;
+	struct quota_usage_ctxt ctxt = {
+		.usr_hash = usr_hash,
+		.grp_hash = grp_hash,
+	};
+
+	err = ocfs2_open_inode_scan_parallel(fs, 0, &scan);
 	if (err)
-		goto out;
-	close_scan = 1;
+		return err;
 
-	while (1) {
-		err = ocfs2_get_next_inode(scan, &blkno, buf);
-		if (err || !blkno)
-			break;
-		/*
-		 * Check whether the inode looks reasonable and interesting
-		 * for quota
-		 */
-		if (memcmp(di->i_signature, OCFS2_INODE_SIGNATURE,
-			   strlen(OCFS2_INODE_SIGNATURE)))
-			continue;
-		ocfs2_swap_inode_to_cpu(fs, di);
-		if (di->i_fs_generation != fs->fs_super->i_fs_generation)
-			continue;
-		if (!(di->i_flags & OCFS2_VALID_FL))
-			continue;
-		if (di->i_flags & OCFS2_SYSTEM_FL &&
-		    blkno != OCFS2_RAW_SB(fs->fs_super)->s_root_blkno)
-			continue;
-		if (usr_hash) {
-			err = ocfs2_find_create_quota_hash(usr_hash, di->i_uid,
-							   &dquot);
-			if (err)
-				break;
-			dquot->d_ddquot.dqb_curspace +=
-				ocfs2_clusters_to_bytes(fs, di->i_clusters);
-			dquot->d_ddquot.dqb_curinodes++;
-		}
-		if (grp_hash) {
-			err = ocfs2_find_create_quota_hash(grp_hash, di->i_gid,
-							   &dquot);
-			if (err)
-				break;
-			dquot->d_ddquot.dqb_curspace +=
-				ocfs2_clusters_to_bytes(fs, di->i_clusters);
-			dquot->d_ddquot.dqb_curinodes++;
-		}
+	err = ocfs2_inode_scan_parallel_set_flags(scan, scan_flags);
+	if (err) {
+		ocfs2_close_inode_scan_parallel(scan);
+		return err;
 	}
-out:
-	if (close_scan)
-		ocfs2_close_inode_scan(scan);
-	ocfs2_free(&buf);
+
+	pthread_mutex_init(&ctxt.lock, NULL);
+	err = ocfs2_inode_scan_parallel_iterate(scan, quota_usage_inode,
+						&ctxt);
+	pthread_mutex_destroy(&ctxt.lock);
+	ocfs2_close_inode_scan_parallel(scan);
+
 	return err;
 }
 
@@ -31,9 +31,11 @@
 #define _GNU_SOURCE /* Because libc really doesn't want us using O_DIRECT? */
 
 #include <assert.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -42,14 +44,22 @@
 #include <sys/resource.h>
 #include <sys/utsname.h>
 #include <linux/fs.h>
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
 #include <libaio.h>
 #endif
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
 #include <sys/mman.h>
 #include <inttypes.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "ocfs2/kernel-rbtree.h"
 
 #include "ocfs2/ocfs2.h"
+#include "ocfs2/byteorder.h"
 
 
 /*
@@ -59,57 +69,376 @@
 # define ONE_MEGABYTE (1024 * 1024)
 #endif
 
+/* How many cached blocks io_cache_read_blocks() probes for at once */
+#define IO_CACHE_RUN	64
+
+/* Trace records buffered before each write(2) */
+#define IO_TRACE_BUFFER		4096
+
+/* Most blocks io_cache_flush() hands to a single pwritev() */
+#define IO_FLUSH_MAX_IOVS	1024
+
+/*
+ * Sharding.  Runs of IO_CACHE_SHARD_RUN blocks go to the shards in turn.
+ * There are at most IO_CACHE_MAX_SHARDS shards of at least
+ * IO_CACHE_SHARD_MIN blocks each.
+ */
+#define IO_CACHE_SHARD_RUN	64
+#define IO_CACHE_SHARD_MIN	256
+#define IO_CACHE_MAX_SHARDS	64
+
 
 /*
  * The cache looks up blocks in two ways:
  *
- * 1) If it needs a new block, it gets one off of ic->ic_lru.  The blocks
- *    attach to that list via icb->icb_list.
+ * 1) If it needs a new block, it asks io_cache_pop() for one.  Every
+ *    block sits on one of the ic_lists, attached via icb->icb_list.
+ *    Which lists are used, and which one gives up a block, depends on
+ *    the replacement policy (see below).
+ *
+ * 2) If it wants to look up an existing block, it goes through the
+ *    index.  The index stores the position of the icb in
+ *    ic_metadata_buffer, plus one, so that zero means "empty".
+ *
+ * The index comes in two flavors:
+ *
+ * a) If the cache can hold every block of the device, ic_direct has one
+ *    entry per device block, and a lookup is a single array access.
+ *    ic_direct grows if a block past the end of the device shows up.
+ *
+ * b) Otherwise ic_hash is an open-addressed hash with linear probing.
+ *    It has at least twice as many slots as the cache has blocks, so
+ *    probe chains stay short.  Each slot carries the block number, so a
+ *    probe doesn't have to touch the icb.  Removal shifts later entries
+ *    of the chain back rather than leaving tombstones.
+ *
+ * Replacement:
+ *
+ * Free blocks, and blocks read with nocache, go on IO_CACHE_COLD.  They
+ * are always stolen first, whatever the policy.  Each list has its
+ * oldest block at the head and its newest at the tail.
+ *
+ * a) LRU keeps everything else on IO_CACHE_RECENT in the order it was
+ *    last seen.
+ *
+ * b) 2Q puts new blocks on IO_CACHE_RECENT (A1in) in FIFO order, and
+ *    does not move them when they are seen again.  When A1in grows past
+ *    a quarter of the cache, its oldest block is stolen and its block
+ *    number goes on the IO_GHOST_RECENT ghost list (A1out).  A block
+ *    that is read again while it is in A1out goes on IO_CACHE_FREQUENT
+ *    (Am), which is an LRU.  A scan that reads each block once thus
+ *    only ever churns A1in.
  *
- * 2) If it wants to look up an existing block, it gets it from
- *    ic->ic_lookup.  The blocks are attached vai icb->icb_node.
+ * c) ARC keeps blocks seen once on IO_CACHE_RECENT (T1) and blocks seen
+ *    more than once on IO_CACHE_FREQUENT (T2), both in LRU order.
+ *    Blocks stolen from each go on the matching ghost list (B1 and B2).
+ *    ic_arc_target is the size T1 is aiming for.  A read that hits B1
+ *    means T1 was too small, so the target grows; a read that hits B2
+ *    shrinks it.
+ *
+ * The ghost lists only hold block numbers.  They are found through
+ * ic_ghost_hash, which is built just like ic_hash.
+ *
+ * Write-back:
+ *
+ * In write-back mode, written blocks go on IO_CACHE_DIRTY until
+ * io_cache_flush() writes them out.  The policy never steals from that
+ * list, and seeing a dirty block doesn't move it.
+ *
+ * Prefetch:
+ *
+ * io_prefetch_blocks() puts each block it is asked for on
+ * IO_CACHE_PENDING.  Pending blocks move to IO_CACHE_INFLIGHT as queue
+ * slots free up, and are admitted to the policy when their read
+ * completes.  Their buffers aren't valid until then, so a read or write
+ * that touches one waits for that block alone, reaping whatever else
+ * completes meanwhile.  Dirty, pending, and in-flight blocks can't be
+ * stolen; together they never take more than half the cache.
+ *
+ * Threads:
+ *
+ * Everything above happens within one shard.  An unthreaded channel's
+ * cache is a single shard.  A threaded one splits its blocks into a
+ * shard per CPU and does each shard's I/O under that shard's lock, so a
+ * block is never read and written at once and the cache stays in step
+ * with the disk.  Prefetch and fill are unthreaded only.
  */
+enum io_cache_list {
+	IO_CACHE_COLD = 0,
+	IO_CACHE_RECENT,
+	IO_CACHE_FREQUENT,
+	IO_CACHE_DIRTY,
+	IO_CACHE_PENDING,
+	IO_CACHE_INFLIGHT,
+	IO_CACHE_NR_LISTS,
+};
+
+enum io_ghost_list {
+	IO_GHOST_RECENT = 0,
+	IO_GHOST_FREQUENT,
+	IO_GHOST_NR_LISTS,
+};
+
 struct io_cache_block {
-	struct rb_node icb_node;
 	struct list_head icb_list;
 	uint64_t icb_blkno;
 	char *icb_buf;
+	enum io_cache_list icb_which;
+};
+
+struct io_cache_ghost {
+	struct list_head ig_list;
+	uint64_t ig_blkno;
+	enum io_ghost_list ig_which;
+};
+
+struct io_cache_slot {
+	uint64_t ics_blkno;
+	uint32_t ics_idx;
+};
+
+struct io_cache_hash {
+	struct io_cache_slot *ih_slots;
+	uint64_t ih_mask;
+	int ih_shift;
 };
 
 struct io_cache {
 	size_t ic_nr_blocks;
-	struct list_head ic_lru;
-	struct rb_root ic_lookup;
 
-	/* Housekeeping */
+	/* Replacement */
+	enum io_cache_policy ic_policy;
+	struct list_head ic_lists[IO_CACHE_NR_LISTS];
+	uint32_t ic_list_len[IO_CACHE_NR_LISTS];
+	uint32_t ic_recent_max;		/* 2Q */
+	uint32_t ic_arc_target;		/* ARC */
+
+	/* Ghosts, for 2Q and ARC */
+	struct io_cache_ghost *ic_ghosts;
+	uint32_t ic_nr_ghosts;
+	struct list_head ic_ghost_free;
+	struct list_head ic_ghost_lists[IO_GHOST_NR_LISTS];
+	uint32_t ic_ghost_len[IO_GHOST_NR_LISTS];
+	struct io_cache_hash ic_ghost_hash;
+
+	/* Index */
+	uint32_t *ic_direct;
+	uint64_t ic_direct_len;
+	struct io_cache_hash ic_hash;
+
+	/* This shard's part of cs_metadata_buffer */
 	struct io_cache_block *ic_metadata_buffer;
-	unsigned long ic_metadata_buffer_len;
-	char *ic_data_buffer;
-	unsigned long ic_data_buffer_len;
-	int ic_locked;
-	int ic_use_count;
+	pthread_mutex_t ic_lock;	/* Threaded only */
 
 	/* stats */
 	uint32_t ic_hits;
 	uint32_t ic_misses;
 	uint32_t ic_inserts;
 	uint32_t ic_removes;
+	uint32_t ic_recent_hits;
+	uint32_t ic_frequent_hits;
+	uint32_t ic_ghost_hits;
+};
+
+/*
+ * The whole cache.  An unthreaded cache has a single shard.  A threaded
+ * one has a shard per CPU or so, and every shard is used under its
+ * ic_lock.  Blocks only ever move within their shard, so each one is
+ * just the cache described above, only smaller.  Nothing ever holds two
+ * shard locks at once.
+ */
+struct io_cache_set {
+	struct io_cache *cs_shards;
+	int cs_nr_shards;
+	int cs_threaded;
+	size_t cs_nr_blocks;
+	enum io_cache_policy cs_policy;
+
+	/* Housekeeping */
+	struct io_cache_block *cs_metadata_buffer;
+	unsigned long cs_metadata_buffer_len;
+	char *cs_data_buffer;
+	unsigned long cs_data_buffer_len;
+	int cs_locked;
+	int cs_use_count;
+
+	/* Where cs_data_buffer lives.  See io_cache_alloc_data(). */
+	void *cs_data_map;		/* NULL if from ocfs2_malloc_blocks() */
+	size_t cs_data_map_len;
+	enum io_cache_pages cs_data_pages;
+	int cs_data_node;		/* -1 if not bound */
+};
+
+/*
+ * Vectored reads go through a per-channel submission queue.  It is set
+ * up once at io_open() time and lives until io_close().  Up to q_depth
+ * requests are kept in flight.  As each one completes, the next is
+ * queued, so the device never sits idle while there is work left.
+ *
+ * The queue is backed by io_uring when liburing is available and the
+ * kernel supports it, and by libaio otherwise.  If neither can be set
+ * up, vectored reads are done synchronously.
+ *
+ * With io_uring, the io_cache data buffer is registered with the ring.
+ * Cache misses are then read straight into the cache blocks with
+ * fixed-buffer reads.  The kernel caps the size of a single registered
+ * buffer, so the data buffer is registered as q_reg_nr chunks of
+ * q_reg_chunk bytes.
+ *
+ * q_slots holds the requests in flight.  A slot is handed to the kernel
+ * as the request's user data and comes back with the completion.  Most
+ * slots belong to the vectored read that queued them.  Prefetch slots
+ * (qs_icb is set) and async read slots (qs_iar is set) outlive the call
+ * that queued them, so whoever reaps their completion hands it to
+ * unix_queue_done_other().
+ */
+#define IO_DEFAULT_QUEUE_DEPTH	128
+#define IO_MAX_QUEUE_DEPTH	4096
+#define URING_MAX_REG_CHUNK	(1024UL * ONE_MEGABYTE)
+
+struct unix_queue_slot {
+	struct io_vec_unit *qs_ivu;
+	uint32_t qs_done;		/* Bytes completed so far */
+	struct iocb qs_iocb;		/* libaio only */
+	struct unix_queue_slot *qs_next;	/* Free list */
+	uint64_t qs_start;		/* usecs, when last prepared */
+	uint64_t qs_due;		/* slow: only, when it completes */
+	int qs_res;			/* slow: only, while held */
+
+	/* Prefetch */
+	struct io_cache_block *qs_icb;
+	struct io_vec_unit qs_prefetch;
+
+	/* Async read */
+	struct io_async_read *qs_iar;
+	bool qs_cache;			/* Cache what it read */
+	uint64_t qs_write_gen;		/* io_write_gen when it started */
+};
+
+struct unix_queue {
+	unsigned int q_depth;
+	unsigned int q_queued;		/* Prepared but not yet submitted */
+	unsigned int q_inflight;
+	unsigned int q_prefetches;	/* Slots held by prefetches */
+	struct unix_queue_slot *q_slots;
+	struct unix_queue_slot *q_free;
+
+	/* libaio */
+	io_context_t q_aio_ctx;
+	struct iocb **q_iocbs;		/* Prepared but not yet submitted */
+	int q_nr_iocbs;
+	struct io_event *q_events;	/* Reaped but not yet handled */
+	int q_nr_events;
+	int q_next_event;
+
+	/* slow: completions the emulated device hasn't finished yet */
+	struct unix_queue_slot *q_held;	/* By qs_due */
+	unsigned int q_nr_held;
+
+#ifdef HAVE_LIBURING
+	int q_uring;
+	struct io_uring q_ring;
+
+	/* Registered buffers */
+	char *q_reg_base;
+	unsigned long q_reg_len;
+	unsigned long q_reg_chunk;
+	unsigned int q_reg_nr;
+#endif
+};
+
+/*
+ * The error and stats of a channel.  A threaded channel gives each
+ * thread its own, so the hot paths never share a cache line.
+ * io_get_stats() adds them all up.
+ */
+struct io_counters {
+	int ioc_error;
+	uint64_t ioc_bytes_read;
+	uint64_t ioc_bytes_written;
+	uint64_t ioc_queue_reaps;
+	uint64_t ioc_queue_inflight;	/* Sum of q_inflight at each reap */
+	uint64_t ioc_prefetch_blocks;
+	uint64_t ioc_prefetch_waits;
+	uint64_t ioc_lat_hist[OCFS2_IO_NR_KINDS][OCFS2_IO_HIST_BUCKETS];
+	uint64_t ioc_size_hist[OCFS2_IO_NR_KINDS][OCFS2_IO_HIST_BUCKETS];
+	int ioc_thread;			/* 0 is the channel's own */
+	struct io_counters *ioc_next;	/* io_thread_counters */
+};
+
+/*
+ * An I/O trace in progress.  Records are buffered and written out
+ * IO_TRACE_BUFFER at a time.  Once a write fails, tracing stops and
+ * io_stop_trace() returns the error.
+ */
+struct io_trace {
+	int it_fd;
+	uint64_t it_start;		/* io_time_us() */
+	pthread_mutex_t it_lock;
+	errcode_t it_error;
+	int it_nr;
+	struct ocfs2_io_trace_record it_records[IO_TRACE_BUFFER];
+};
+
+/*
+ * A "slow:" channel stands in for a high-latency device.  It wraps a
+ * plain file or device, opened as
+ *
+ *	slow:/path/to/image?lat=2ms&bw=200M&qd=32
+ *
+ * and holds back each request until a model of the slow device would
+ * have finished it.  The device works on up to sl_qd requests at once.
+ * Each takes sl_lat usecs, and the data then moves over one shared pipe
+ * of sl_bw bytes a second.  A request's due time is fixed when it is
+ * issued, so a run behaves the same on any machine that is faster than
+ * the model.  Without lat= or bw= the device is as fast as what it
+ * wraps, and qd defaults to 32.
+ */
+#define IO_SLOW_DEFAULT_QD	32
+
+struct io_slow {
+	uint64_t sl_lat;		/* usecs per request */
+	uint64_t sl_bw;			/* bytes a second, 0 is unlimited */
+	int sl_qd;
+	pthread_mutex_t sl_lock;
+	uint64_t sl_pipe_idle;		/* usecs, when the pipe is next idle */
+	uint64_t *sl_idle;		/* usecs, when each of sl_qd is idle */
 };
 
 struct _io_channel {
 	char *io_name;
 	int io_blksize;
 	int io_flags;
-	int io_error;
 	int io_fd;
 	bool io_nocache;
-	struct io_cache *io_cache;
-
-	/* stats */
-	uint64_t io_bytes_read;
-	uint64_t io_bytes_written;
+	bool io_writeback;
+	bool io_cache_local_node;
+	struct io_cache_set *io_cache;
+	struct unix_queue *io_queue;
+	struct io_counters io_counters;
+	uint64_t io_write_gen;		/* Bumped by every write */
+
+	/* A read-only regular file, mapped whole.  See io_map_file(). */
+	char *io_map;
+	uint64_t io_map_len;
+
+	/* Threaded mode */
+	bool io_threaded;
+	pthread_mutex_t io_queue_lock;
+	pthread_mutex_t io_counters_lock;
+	pthread_key_t io_counters_key;
+	struct io_counters *io_thread_counters;
+	int io_nr_threads;
+
+	struct io_trace *io_trace;
+	struct io_slow *io_slow;
 };
 
+static void unix_queue_done_other(io_channel *channel,
+				  struct unix_queue_slot *slot, int res);
+static void io_cache_prefetch_cancel(io_channel *channel);
+static void io_async_read_cancel(io_channel *channel);
+
 /*
  * We open code this because we don't have the ocfs2_filesys to call
  * ocfs2_blocks_in_bytes().
@@ -120,61 +449,256 @@ static inline int one_meg_of_blocks(io_channel *channel)
 	return count / channel->io_blksize;
 }
 
-static errcode_t unix_vec_read_blocks(io_channel *channel,
-				      struct io_vec_unit *ivus, int count)
+/*
+ * The calling thread's counters.  If a new thread can't get its own,
+ * it shares the channel's and may lose a few updates.
+ */
+static struct io_counters *io_counters(io_channel *channel)
 {
-	int i;
-	int ret;
-	io_context_t io_ctx;
-	struct iocb *iocb = NULL, **iocbs = NULL;
-	struct io_event *events = NULL;
-	int64_t offset;
-	int submitted, completed = 0;
-
-	ret = OCFS2_ET_NO_MEMORY;
-	iocb = malloc((sizeof(struct iocb) * count));
-	iocbs = malloc((sizeof(struct iocb *) * count));
-	events = malloc((sizeof(struct io_event) * count));
-	if (!iocb || !iocbs || !events)
-		goto out;
+	struct io_counters *ioc;
+
+	if (!channel->io_threaded)
+		return &channel->io_counters;
+
+	ioc = pthread_getspecific(channel->io_counters_key);
+	if (ioc)
+		return ioc;
+
+	if (ocfs2_malloc0(sizeof(struct io_counters), &ioc))
+		return &channel->io_counters;
+
+	pthread_mutex_lock(&channel->io_counters_lock);
+	ioc->ioc_thread = ++channel->io_nr_threads;
+	ioc->ioc_next = channel->io_thread_counters;
+	channel->io_thread_counters = ioc;
+	pthread_mutex_unlock(&channel->io_counters_lock);
+	pthread_setspecific(channel->io_counters_key, ioc);
+
+	return ioc;
+}
+
+/* In usecs, from a clock that doesn't jump */
+static inline uint64_t io_time_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+static inline int io_hist_bucket(uint64_t val)
+{
+	int bucket = 0;
+
+	while ((val >>= 1) && (bucket < (OCFS2_IO_HIST_BUCKETS - 1)))
+		bucket++;
+
+	return bucket;
+}
+
+/* Record one request of len bytes that started at start usecs */
+static void io_account(io_channel *channel, enum ocfs2_io_kind kind,
+		       uint64_t start, size_t len)
+{
+	struct io_counters *ioc = io_counters(channel);
+
+	ioc->ioc_lat_hist[kind][io_hist_bucket(io_time_us() - start)]++;
+	ioc->ioc_size_hist[kind][io_hist_bucket(len)]++;
+}
+
+/*
+ * When the slow device finishes a request of len bytes issued at start.
+ * It goes to whichever of the device's sl_qd slots is idle first.
+ */
+static uint64_t io_slow_due(struct io_slow *sl, uint64_t start, size_t len)
+{
+	uint64_t due;
+	int i, idle = 0;
+
+	pthread_mutex_lock(&sl->sl_lock);
+	for (i = 1; i < sl->sl_qd; i++)
+		if (sl->sl_idle[i] < sl->sl_idle[idle])
+			idle = i;
+
+	due = ((start > sl->sl_idle[idle]) ? start : sl->sl_idle[idle]) +
+		sl->sl_lat;
+	if (sl->sl_bw) {
+		if (due < sl->sl_pipe_idle)
+			due = sl->sl_pipe_idle;
+		due += ((uint64_t)len * 1000000) / sl->sl_bw;
+		sl->sl_pipe_idle = due;
+	}
+	sl->sl_idle[idle] = due;
+	pthread_mutex_unlock(&sl->sl_lock);
+
+	return due;
+}
+
+static void io_slow_wait(uint64_t due)
+{
+	struct timespec ts;
+
+	ts.tv_sec = due / 1000000;
+	ts.tv_nsec = (due % 1000000) * 1000;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+	       EINTR)
+		;
+}
+
+/* Hold a synchronous request of len bytes until the slow device is done */
+static inline void io_slow_delay(io_channel *channel, uint64_t start,
+				 size_t len)
+{
+	if (channel->io_slow)
+		io_slow_wait(io_slow_due(channel->io_slow, start, len));
+}
+
+/* Where a traced request started */
+struct io_trace_mark {
+	uint64_t tm_time;
+	uint64_t tm_bytes;		/* Read and written by this thread */
+};
+
+static inline void io_trace_begin(io_channel *channel,
+				  struct io_trace_mark *tm)
+{
+	struct io_counters *ioc;
+
+	if (!channel->io_trace)
+		return;
 
-	memset(&io_ctx, 0, sizeof(io_ctx));
-	ret = io_queue_init(count, &io_ctx);
+	ioc = io_counters(channel);
+	tm->tm_time = io_time_us();
+	tm->tm_bytes = ioc->ioc_bytes_read + ioc->ioc_bytes_written;
+}
+
+static errcode_t io_trace_write(struct io_trace *it)
+{
+	char *buf = (char *)it->it_records;
+	ssize_t len = it->it_nr * sizeof(struct ocfs2_io_trace_record);
+	ssize_t wr;
+
+	while (len) {
+		wr = write(it->it_fd, buf, len);
+		if (wr < 0) {
+			if (errno == EINTR)
+				continue;
+			return OCFS2_ET_IO;
+		}
+		buf += wr;
+		len -= wr;
+	}
+	it->it_nr = 0;
+
+	return 0;
+}
+
+/*
+ * Record one request, under it_lock.  The disk blocks and time are
+ * taken from tm, and only a record without OCFS2_IO_TRACE_MORE gets
+ * them.
+ */
+static void __io_trace_add(io_channel *channel, struct io_trace_mark *tm,
+			   enum ocfs2_io_trace_op op, int flags,
+			   uint64_t blkno, int count, errcode_t ret)
+{
+	struct io_trace *it = channel->io_trace;
+	struct io_counters *ioc = io_counters(channel);
+	struct ocfs2_io_trace_record *tr;
+	uint64_t disk = 0, usecs = 0;
+
+	if (!(flags & OCFS2_IO_TRACE_MORE)) {
+		usecs = io_time_us() - tm->tm_time;
+		disk = ioc->ioc_bytes_read + ioc->ioc_bytes_written -
+			tm->tm_bytes;
+		disk = (disk + channel->io_blksize - 1) / channel->io_blksize;
+	}
 	if (ret)
-		return ret;
+		flags |= OCFS2_IO_TRACE_ERROR;
+
+	if (it->it_error)
+		return;
+
+	tr = &it->it_records[it->it_nr++];
+	tr->tr_time = cpu_to_le64(tm->tm_time - it->it_start);
+	tr->tr_blkno = cpu_to_le64(blkno);
+	tr->tr_count = cpu_to_le32(count);
+	tr->tr_disk = cpu_to_le32(disk);
+	tr->tr_usecs = cpu_to_le32(usecs);
+	tr->tr_op = op;
+	tr->tr_flags = flags;
+	tr->tr_thread = cpu_to_le16(ioc->ioc_thread);
+
+	if (it->it_nr == IO_TRACE_BUFFER)
+		it->it_error = io_trace_write(it);
+}
+
+static void io_trace_add(io_channel *channel, struct io_trace_mark *tm,
+			 enum ocfs2_io_trace_op op, int flags,
+			 uint64_t blkno, int count, errcode_t ret)
+{
+	pthread_mutex_lock(&channel->io_trace->it_lock);
+	__io_trace_add(channel, tm, op, flags, blkno, count, ret);
+	pthread_mutex_unlock(&channel->io_trace->it_lock);
+}
+
+static inline void io_trace_end(io_channel *channel,
+				struct io_trace_mark *tm,
+				enum ocfs2_io_trace_op op, bool nocache,
+				uint64_t blkno, int count, errcode_t ret)
+{
+	if (channel->io_trace)
+		io_trace_add(channel, tm, op,
+			     nocache ? OCFS2_IO_TRACE_NOCACHE : 0,
+			     blkno, count, ret);
+}
 
-	for (i = 0; i < count; ++i) {
-		offset = ivus[i].ivu_blkno * channel->io_blksize;
-		io_prep_pread(&(iocb[i]), channel->io_fd, ivus[i].ivu_buf,
-			      ivus[i].ivu_buflen, offset);
-		iocbs[i] = &iocb[i];
+/* A record per ivu, in bytes, with no other thread's in between */
+static void io_trace_vec(io_channel *channel, struct io_trace_mark *tm,
+			 enum ocfs2_io_trace_op op, struct io_vec_unit *ivus,
+			 int count, errcode_t ret)
+{
+	int i, flags;
+
+	if (!channel->io_trace)
+		return;
+
+	pthread_mutex_lock(&channel->io_trace->it_lock);
+	for (i = 0; i < count; i++) {
+		flags = channel->io_nocache ? OCFS2_IO_TRACE_NOCACHE : 0;
+		if (i < (count - 1))
+			flags |= OCFS2_IO_TRACE_MORE;
+		__io_trace_add(channel, tm, op, flags, ivus[i].ivu_blkno,
+			       -(int)ivus[i].ivu_buflen, ret);
 	}
+	pthread_mutex_unlock(&channel->io_trace->it_lock);
+}
 
-resubmit:
-	ret = io_submit(io_ctx, count - completed, &iocbs[completed]);
-	if (!ret && (count - completed))
-		ret = OCFS2_ET_SHORT_READ;
-	if (ret < 0)
-		goto out;
-	submitted = ret;
+/*
+ * A mapped channel copies straight out of the mapping.  Past the end of
+ * the file is a short read, as it is for pread64().
+ */
+static errcode_t unix_map_read_block(io_channel *channel, uint64_t location,
+				     ssize_t size, char *data)
+{
+	ssize_t tot = 0;
+	uint64_t start = io_time_us();
+	errcode_t ret = 0;
 
-	ret = io_getevents(io_ctx, submitted, submitted, events, NULL);
-	if (ret < 0)
-		goto out;
+	if (location < channel->io_map_len) {
+		tot = channel->io_map_len - location;
+		if (tot > size)
+			tot = size;
+		memcpy(data, channel->io_map + location, tot);
+	}
+	io_account(channel, OCFS2_IO_READ, start, size);
 
-	completed += submitted;
-	if (completed < count)
-		goto resubmit;
+	if (tot != size) {
+		ret = OCFS2_ET_SHORT_READ;
+		memset(data + tot, 0, size - tot);
+	}
 
-out:
-	if (ret >= 0)
-		ret = 0;
-	if (!ret)
-		channel->io_bytes_read += (count * channel->io_blksize);
-	free(iocb);
-	free(iocbs);
-	free(events);
-	io_queue_release(io_ctx);
+	io_counters(channel)->ioc_bytes_read += tot;
 
 	return ret;
 }
@@ -184,19 +708,25 @@ static errcode_t unix_io_read_block(io_channel *channel, int64_t blkno,
 {
 	int ret;
 	ssize_t size, tot, rd;
-	uint64_t location;
+	uint64_t location, start;
 
 	/* -ative means count is in bytes */
 	size = (count < 0) ? -count : count * channel->io_blksize;
 	location = blkno * channel->io_blksize;
 
+	if (channel->io_map)
+		return unix_map_read_block(channel, location, size, data);
+
 	tot = 0;
 	while (tot < size) {
+		start = io_time_us();
 		rd = pread64(channel->io_fd, data + tot,
 			     size - tot, location + tot);
+		io_slow_delay(channel, start, size - tot);
+		io_account(channel, OCFS2_IO_READ, start, size - tot);
 		ret = OCFS2_ET_IO;
 		if (rd < 0) {
-			channel->io_error = errno;
+			io_counters(channel)->ioc_error = errno;
 			goto out;
 		}
 
@@ -214,7 +744,7 @@ out:
 		memset(data + tot, 0, size - tot);
 	}
 
-	channel->io_bytes_read += tot;
+	io_counters(channel)->ioc_bytes_read += tot;
 
 	return ret;
 }
@@ -225,19 +755,23 @@ static errcode_t unix_io_write_block_full(io_channel *channel, int64_t blkno,
 {
 	int ret;
 	ssize_t size, tot, wr;
-	uint64_t location;
+	uint64_t location, start;
 
 	/* -ative means count is in bytes */
 	size = (count < 0) ? -count : count * channel->io_blksize;
 	location = blkno * channel->io_blksize;
 
+	channel->io_write_gen++;
 	tot = 0;
 	while (tot < size) {
+		start = io_time_us();
 		wr = pwrite64(channel->io_fd, data + tot,
  			      size - tot, location + tot);
+		io_slow_delay(channel, start, size - tot);
+		io_account(channel, OCFS2_IO_WRITE, start, size - tot);
 		ret = OCFS2_ET_IO;
 		if (wr < 0) {
-			channel->io_error = errno;
+			io_counters(channel)->ioc_error = errno;
 			goto out;
 		}
 
@@ -254,7 +788,58 @@ out:
 	if (!ret && (tot != size))
 		ret = OCFS2_ET_SHORT_WRITE;
 
-	channel->io_bytes_written += tot;
+	io_counters(channel)->ioc_bytes_written += tot;
+
+	return ret;
+}
+
+/*
+ * Write nr_iov whole blocks starting at blkno.  iov is consumed as
+ * the write progresses.
+ */
+static errcode_t unix_io_writev_blocks(io_channel *channel, int64_t blkno,
+				       struct iovec *iov, int nr_iov)
+{
+	errcode_t ret = 0;
+	ssize_t size, tot, wr;
+	uint64_t location, start;
+
+	size = (ssize_t)nr_iov * channel->io_blksize;
+	location = blkno * channel->io_blksize;
+
+	channel->io_write_gen++;
+	tot = 0;
+	while (tot < size) {
+		start = io_time_us();
+		wr = pwritev64(channel->io_fd, iov, nr_iov, location + tot);
+		io_slow_delay(channel, start, size - tot);
+		io_account(channel, OCFS2_IO_VEC_WRITE, start, size - tot);
+		if (wr < 0) {
+			io_counters(channel)->ioc_error = errno;
+			ret = OCFS2_ET_IO;
+			break;
+		}
+
+		if (!wr) {
+			ret = OCFS2_ET_SHORT_WRITE;
+			break;
+		}
+
+		tot += wr;
+
+		/* Skip past what made it */
+		while (nr_iov && (wr >= iov->iov_len)) {
+			wr -= iov->iov_len;
+			iov++;
+			nr_iov--;
+		}
+		if (wr) {
+			iov->iov_base = (char *)iov->iov_base + wr;
+			iov->iov_len -= wr;
+		}
+	}
+
+	io_counters(channel)->ioc_bytes_written += tot;
 
 	return ret;
 }
@@ -265,725 +850,3850 @@ static errcode_t unix_io_write_block(io_channel *channel, int64_t blkno,
 	return unix_io_write_block_full(channel, blkno, count, data, NULL);
 }
 
+static void unix_queue_exit(io_channel *channel)
+{
+	struct unix_queue *q = channel->io_queue;
+
+	if (!q)
+		return;
+
+	/* Prefetched blocks and async reads won't be coming in */
+	io_cache_prefetch_cancel(channel);
+	io_async_read_cancel(channel);
+
+	/* Tearing down the context waits for anything still in flight */
+#ifdef HAVE_LIBURING
+	if (q->q_uring)
+		io_uring_queue_exit(&q->q_ring);
+	else
+#endif
+		io_queue_release(q->q_aio_ctx);
+
+	ocfs2_free(&q->q_events);
+	ocfs2_free(&q->q_iocbs);
+	ocfs2_free(&q->q_slots);
+	ocfs2_free(&q);
+	channel->io_queue = NULL;
+}
+
 /*
- * See if the rbtree has a block for the given block number.
- *
- * The rb_node garbage lets insertion share the search.  Trivial callers
- * pass NULL.
+ * Failing to set up a queue is not an error.  The channel just does its
+ * vectored reads synchronously.
  */
-static struct io_cache_block *io_cache_lookup(struct io_cache *ic,
-					      uint64_t blkno)
+static void unix_queue_init(io_channel *channel, unsigned int depth)
 {
-	struct rb_node *p = ic->ic_lookup.rb_node;
-	struct io_cache_block *icb;
+	int i;
+	errcode_t ret;
+	struct unix_queue *q;
 
-	while (p) {
-		icb = rb_entry(p, struct io_cache_block, icb_node);
-		if (blkno < icb->icb_blkno) {
-			p = p->rb_left;
-		} else if (blkno > icb->icb_blkno) {
-			p = p->rb_right;
-		} else
-			return icb;
+	ret = ocfs2_malloc0(sizeof(struct unix_queue), &q);
+	if (ret)
+		return;
+
+	q->q_depth = depth;
+	ret = ocfs2_malloc0(sizeof(struct unix_queue_slot) * depth,
+			    &q->q_slots);
+	if (ret)
+		goto out_free;
+
+	for (i = 0; i < depth; i++) {
+		q->q_slots[i].qs_next = q->q_free;
+		q->q_free = &q->q_slots[i];
 	}
 
-	return NULL;
+#ifdef HAVE_LIBURING
+	if (!io_uring_queue_init(depth, &q->q_ring, 0)) {
+		q->q_uring = 1;
+		channel->io_queue = q;
+		return;
+	}
+#endif
+
+	ret = ocfs2_malloc0(sizeof(struct iocb *) * depth, &q->q_iocbs);
+	if (ret)
+		goto out_free;
+	ret = ocfs2_malloc0(sizeof(struct io_event) * depth, &q->q_events);
+	if (ret)
+		goto out_free;
+	if (io_queue_init(depth, &q->q_aio_ctx))
+		goto out_free;
+
+	channel->io_queue = q;
+	return;
+
+out_free:
+	if (q->q_events)
+		ocfs2_free(&q->q_events);
+	if (q->q_iocbs)
+		ocfs2_free(&q->q_iocbs);
+	if (q->q_slots)
+		ocfs2_free(&q->q_slots);
+	ocfs2_free(&q);
 }
 
-static void io_cache_insert(struct io_cache *ic,
-			    struct io_cache_block *insert_icb)
+/*
+ * Register the cache data buffer with the ring.  This is best effort.
+ * If the kernel refuses (RLIMIT_MEMLOCK, usually), reads just don't use
+ * fixed buffers.  libaio has nothing to register.
+ */
+static void unix_queue_register(io_channel *channel, char *buf,
+				unsigned long len)
 {
-	struct rb_node **p = &ic->ic_lookup.rb_node;
-	struct rb_node *parent = NULL;
-	struct io_cache_block *icb = NULL;
+#ifdef HAVE_LIBURING
+	struct unix_queue *q = channel->io_queue;
+	struct iovec *iov = NULL;
+	unsigned long chunk;
+	unsigned int i, nr;
+
+	if (!q || !q->q_uring || q->q_reg_base)
+		return;
+
+	/* Chunks must hold whole blocks so that no block straddles two */
+	chunk = URING_MAX_REG_CHUNK - (URING_MAX_REG_CHUNK %
+				       channel->io_blksize);
+	if (chunk > len)
+		chunk = len;
+	nr = (len + chunk - 1) / chunk;
+
+	if (ocfs2_malloc(sizeof(struct iovec) * nr, &iov))
+		return;
+
+	for (i = 0; i < nr; i++) {
+		iov[i].iov_base = buf + ((unsigned long)i * chunk);
+		iov[i].iov_len = chunk;
+		if (((unsigned long)i * chunk) + chunk > len)
+			iov[i].iov_len = len - ((unsigned long)i * chunk);
+	}
 
-	while (*p) {
-		parent = *p;
-		icb = rb_entry(parent, struct io_cache_block, icb_node);
-		if (insert_icb->icb_blkno < icb->icb_blkno) {
-			p = &(*p)->rb_left;
-			icb = NULL;
-		} else if (insert_icb->icb_blkno > icb->icb_blkno) {
-			p = &(*p)->rb_right;
-			icb = NULL;
-		} else
-			assert(0);  /* We erased it, remember? */
+	if (!io_uring_register_buffers(&q->q_ring, iov, nr)) {
+		q->q_reg_base = buf;
+		q->q_reg_len = len;
+		q->q_reg_chunk = chunk;
+		q->q_reg_nr = nr;
 	}
 
-	rb_link_node(&insert_icb->icb_node, parent, p);
-	rb_insert_color(&insert_icb->icb_node, &ic->ic_lookup);
-	ic->ic_inserts++;
+	ocfs2_free(&iov);
+#endif
 }
 
-static void io_cache_seen(struct io_cache *ic, struct io_cache_block *icb)
+static void unix_queue_unregister(io_channel *channel)
 {
-	/* Move to the front of the LRU */
-	list_del(&icb->icb_list);
-	list_add_tail(&icb->icb_list, &ic->ic_lru);
-}
+#ifdef HAVE_LIBURING
+	struct unix_queue *q = channel->io_queue;
 
-static void io_cache_unsee(struct io_cache *ic, struct io_cache_block *icb)
-{
-	/*
-	 * Move to the end of the LRU.  There's no point in removing an
-	 * "unseen" buffer from the cache.  It's valid, but we want the
-	 * next I/O to steal it.
-	 */
-	list_del(&icb->icb_list);
-	list_add(&icb->icb_list, &ic->ic_lru);
+	if (!q || !q->q_reg_base)
+		return;
+
+	io_uring_unregister_buffers(&q->q_ring);
+	q->q_reg_base = NULL;
+	q->q_reg_len = 0;
+	q->q_reg_chunk = 0;
+	q->q_reg_nr = 0;
+#endif
 }
 
-static void io_cache_disconnect(struct io_cache *ic,
-				struct io_cache_block *icb)
+static int unix_queue_registered(io_channel *channel)
 {
-	/*
-	 * This icb should longer be looked up.
-	 * If icb->icb_blkno is UINT64_MAX, it's already disconnected.
-	 */
-	if (icb->icb_blkno != UINT64_MAX) {
-		rb_erase(&icb->icb_node, &ic->ic_lookup);
-		memset(&icb->icb_node, 0, sizeof(struct rb_node));
-		icb->icb_blkno = UINT64_MAX;
-	}
+#ifdef HAVE_LIBURING
+	return channel->io_queue && channel->io_queue->q_reg_base;
+#else
+	return 0;
+#endif
 }
 
-static struct io_cache_block *io_cache_pop_lru(struct io_cache *ic)
+#ifdef HAVE_LIBURING
+/*
+ * Returns the registered buffer index covering [buf, buf + len), or -1
+ * if the range isn't wholly inside one registered chunk.
+ */
+static int unix_queue_buf_index(struct unix_queue *q, char *buf,
+				uint32_t len)
 {
-	struct io_cache_block *icb;
+	unsigned long off;
+	int idx;
 
-	icb = list_entry(ic->ic_lru.next, struct io_cache_block, icb_list);
-	io_cache_disconnect(ic, icb);
-	ic->ic_removes++;
+	if (!q->q_reg_base || (buf < q->q_reg_base))
+		return -1;
 
-	return icb;
+	off = buf - q->q_reg_base;
+	if ((off + len) > q->q_reg_len)
+		return -1;
+
+	idx = off / q->q_reg_chunk;
+	if ((off + len) > ((unsigned long)(idx + 1) * q->q_reg_chunk))
+		return -1;
+
+	return idx;
+}
+#endif
+
+/* Prepare the remainder of a slot's read.  It goes out at the next submit. */
+static void unix_queue_prep_read(io_channel *channel,
+				 struct unix_queue_slot *slot)
+{
+	struct unix_queue *q = channel->io_queue;
+	struct io_vec_unit *ivu = slot->qs_ivu;
+	char *buf = ivu->ivu_buf + slot->qs_done;
+	uint32_t len = ivu->ivu_buflen - slot->qs_done;
+	uint64_t offset = (ivu->ivu_blkno * channel->io_blksize) +
+		slot->qs_done;
+
+	slot->qs_start = io_time_us();
+	if (channel->io_slow)
+		slot->qs_due = io_slow_due(channel->io_slow, slot->qs_start,
+					   len);
+
+#ifdef HAVE_LIBURING
+	if (q->q_uring) {
+		struct io_uring_sqe *sqe;
+		int idx;
+
+		/* There are never more than q_depth requests */
+		sqe = io_uring_get_sqe(&q->q_ring);
+		assert(sqe);
+
+		idx = unix_queue_buf_index(q, buf, len);
+		if (idx < 0)
+			io_uring_prep_read(sqe, channel->io_fd, buf, len,
+					   offset);
+		else
+			io_uring_prep_read_fixed(sqe, channel->io_fd, buf,
+						 len, offset, idx);
+		io_uring_sqe_set_data(sqe, slot);
+		q->q_queued++;
+		return;
+	}
+#endif
+
+	q->q_queued++;
+	io_prep_pread(&slot->qs_iocb, channel->io_fd, buf, len, offset);
+	slot->qs_iocb.data = slot;
+	q->q_iocbs[q->q_nr_iocbs++] = &slot->qs_iocb;
+}
+
+/* Returns the number of requests handed to the kernel, or -errno */
+static int unix_queue_submit(io_channel *channel)
+{
+	struct unix_queue *q = channel->io_queue;
+	int rc;
+
+#ifdef HAVE_LIBURING
+	if (q->q_uring)
+		rc = io_uring_submit(&q->q_ring);
+	else
+#endif
+	{
+		rc = io_submit(q->q_aio_ctx, q->q_nr_iocbs, q->q_iocbs);
+		if (rc > 0) {
+			q->q_nr_iocbs -= rc;
+			memmove(q->q_iocbs, q->q_iocbs + rc,
+				sizeof(struct iocb *) * q->q_nr_iocbs);
+		}
+	}
+
+	if (rc > 0) {
+		q->q_queued -= rc;
+		q->q_inflight += rc;
+	}
+
+	return rc;
+}
+
+/* Submit errors that just mean "try again once something completes" */
+static inline int unix_queue_submit_retry(int rc)
+{
+	return !rc || (rc == -EAGAIN) || (rc == -EINTR);
 }
 
 /*
- * Unlike its sync counterpart, this function issues ios even for cached blocks.
+ * Get the next completion from the kernel.  Fills in the slot and the
+ * result (bytes transferred or -errno).  Returns 0 or -errno if the
+ * wait failed.  If wait is false and nothing has completed, returns
+ * -EAGAIN.
  */
-static errcode_t io_cache_vec_read_blocks(io_channel *channel,
-					  struct io_vec_unit *ivus,
-					  int count, bool nocache)
+static int unix_queue_reap_kernel(io_channel *channel,
+				  struct unix_queue_slot **slot, int *res,
+				  bool wait)
 {
-	struct io_cache *ic = channel->io_cache;
-	struct io_cache_block *icb;
+	struct unix_queue *q = channel->io_queue;
+	struct io_event *ev;
+	struct timespec now = { 0, 0 };
+	int rc;
+
+#ifdef HAVE_LIBURING
+	if (q->q_uring) {
+		struct io_uring_cqe *cqe;
+
+		if (wait)
+			rc = io_uring_wait_cqe(&q->q_ring, &cqe);
+		else
+			rc = io_uring_peek_cqe(&q->q_ring, &cqe);
+		if (rc < 0)
+			return rc;
+
+		*slot = io_uring_cqe_get_data(cqe);
+		*res = cqe->res;
+		io_uring_cqe_seen(&q->q_ring, cqe);
+		return 0;
+	}
+#endif
+
+	/* Grab everything that's ready, but only hand back one */
+	if (q->q_next_event == q->q_nr_events) {
+		rc = io_getevents(q->q_aio_ctx, wait ? 1 : 0, q->q_depth,
+				  q->q_events, wait ? NULL : &now);
+		if (rc < 0)
+			return rc;
+		q->q_nr_events = rc;
+		q->q_next_event = 0;
+		if (!rc)
+			return wait ? -EINTR : -EAGAIN;
+	}
+
+	ev = &q->q_events[q->q_next_event++];
+	*slot = ev->data;
+	*res = (long)ev->res;
+	return 0;
+}
+
+/* Keep a completion until the slow device would have finished it */
+static void unix_queue_hold(struct unix_queue *q,
+			    struct unix_queue_slot *slot, int res)
+{
+	struct unix_queue_slot **p = &q->q_held;
+
+	while (*p && ((*p)->qs_due <= slot->qs_due))
+		p = &(*p)->qs_next;
+	slot->qs_res = res;
+	slot->qs_next = *p;
+	*p = slot;
+	q->q_nr_held++;
+}
+
+/*
+ * The kernel finishes requests long before the slow device would, so
+ * its completions are held and handed back in due order.  If the kernel
+ * is slower than the model, it sets the pace instead.
+ */
+static int unix_queue_reap_slow(io_channel *channel,
+				struct unix_queue_slot **slot, int *res,
+				bool wait)
+{
+	struct unix_queue *q = channel->io_queue;
+	struct unix_queue_slot *held;
+	int rc;
+
+	for (;;) {
+		while (q->q_inflight > q->q_nr_held) {
+			rc = unix_queue_reap_kernel(channel, &held, res,
+						    false);
+			if (rc == -EAGAIN)
+				break;
+			if (rc < 0)
+				return rc;
+			unix_queue_hold(q, held, *res);
+		}
+
+		held = q->q_held;
+		if (held && (held->qs_due <= io_time_us())) {
+			q->q_held = held->qs_next;
+			q->q_nr_held--;
+			*slot = held;
+			*res = held->qs_res;
+			return 0;
+		}
+
+		if (!wait)
+			return -EAGAIN;
+
+		if (held) {
+			io_slow_wait(held->qs_due);
+			continue;
+		}
+
+		rc = unix_queue_reap_kernel(channel, &held, res, true);
+		if (rc < 0)
+			return rc;
+		unix_queue_hold(q, held, *res);
+	}
+}
+
+/*
+ * Get the next completion.  Fills in the slot and the result (bytes
+ * transferred or -errno).  Returns 0 or -errno if the wait failed.  If
+ * wait is false and nothing has completed, returns -EAGAIN.
+ */
+static int unix_queue_reap(io_channel *channel,
+			   struct unix_queue_slot **slot, int *res, bool wait)
+{
+	struct unix_queue *q = channel->io_queue;
+	struct io_counters *ioc;
+	int rc;
+
+	if (channel->io_slow)
+		rc = unix_queue_reap_slow(channel, slot, res, wait);
+	else
+		rc = unix_queue_reap_kernel(channel, slot, res, wait);
+	if (rc < 0)
+		return rc;
+
+	io_account(channel, OCFS2_IO_VEC_READ, (*slot)->qs_start,
+		   (*slot)->qs_ivu->ivu_buflen - (*slot)->qs_done);
+	ioc = io_counters(channel);
+	ioc->ioc_queue_reaps++;
+	ioc->ioc_queue_inflight += q->q_inflight;
+	q->q_inflight--;
+	return 0;
+}
+
+/* Read the ivus one at a time, without the queue */
+static errcode_t unix_sync_vec_read_blocks(io_channel *channel,
+					   struct io_vec_unit *ivus,
+					   int count)
+{
+	int i;
 	errcode_t ret = 0;
-	int i, j, blksize = channel->io_blksize;
-	uint64_t blkno;
-	uint32_t numblks;
-	char *buf;
 
-	/*
-	 * Read all blocks. We could extend this to not issue ios for already
-	 * cached blocks. But is it worth the effort?
-	 */
-	ret = unix_vec_read_blocks(channel, ivus, count);
-	if (ret)
-		goto out;
+	/* -ative count means bytes */
+	for (i = 0; !ret && (i < count); i++)
+		ret = unix_io_read_block(channel, ivus[i].ivu_blkno,
+					 -(int)ivus[i].ivu_buflen,
+					 ivus[i].ivu_buf);
 
-	/* refresh cache */
-	for (i = 0; i < count; i++) {
-		blkno = ivus[i].ivu_blkno;
-		numblks = ivus[i].ivu_buflen / blksize;
-		buf = ivus[i].ivu_buf;
+	return ret;
+}
 
-		for (j = 0; j < numblks; ++j, ++blkno, buf += blksize) {
-			icb = io_cache_lookup(ic, blkno);
-			if (!icb) {
-				if (nocache)
+/*
+ * Read all the ivus through the queue.  We keep the queue as full as we
+ * can, queueing new requests as completions come back instead of
+ * waiting for the whole batch.  Short reads are resubmitted for the
+ * remainder.  On error we stop queueing new work, but we must reap
+ * everything already in flight before the caller's buffers go away.
+ */
+static errcode_t unix_queue_vec_read_blocks(io_channel *channel,
+					    struct io_vec_unit *ivus,
+					    int count)
+{
+	struct unix_queue *q = channel->io_queue;
+	struct unix_queue_slot *slot;
+	struct io_vec_unit *ivu;
+	int rc, res, next = 0, mine = 0;
+	errcode_t ret = 0;
+
+	/* mine counts our requests that are queued or in flight */
+	while ((!ret && (next < count)) || mine) {
+		while (!ret && (next < count) && q->q_free) {
+			slot = q->q_free;
+			q->q_free = slot->qs_next;
+			slot->qs_icb = NULL;
+			slot->qs_iar = NULL;
+			slot->qs_ivu = &ivus[next++];
+			slot->qs_done = 0;
+			unix_queue_prep_read(channel, slot);
+			mine++;
+		}
+
+		if (q->q_queued) {
+			rc = unix_queue_submit(channel);
+			if ((!rc || (rc == -EAGAIN)) && !q->q_inflight) {
+				/*
+				 * The kernel took nothing, and there's
+				 * nothing in flight whose completion would
+				 * free anything up.  Retrying would just
+				 * spin.  Our queued requests can't be taken
+				 * back, so throw the queue away like below
+				 * and read the whole batch synchronously.
+				 */
+				unix_queue_exit(channel);
+				return unix_sync_vec_read_blocks(channel, ivus,
+								 count);
+			}
+			if (unix_queue_submit_retry(rc)) {
+				/* Retry once something completes */
+				if (!q->q_inflight)
 					continue;
-				icb = io_cache_pop_lru(ic);
-				icb->icb_blkno = blkno;
-				io_cache_insert(ic, icb);
+			} else if (rc < 0) {
+				/*
+				 * The queue is in an unknown state.  Throw
+				 * it away; teardown reaps what the kernel
+				 * already has.  Future vectored reads are
+				 * done synchronously.
+				 */
+				io_counters(channel)->ioc_error = -rc;
+				unix_queue_exit(channel);
+				return OCFS2_ET_IO;
 			}
+		}
 
-			memcpy(icb->icb_buf, buf, blksize);
+		if (!q->q_inflight)
+			continue;
 
-			if (nocache)
-				io_cache_unsee(ic, icb);
-			else
-				io_cache_seen(ic, icb);
+		rc = unix_queue_reap(channel, &slot, &res, true);
+		if (rc == -EINTR)
+			continue;
+		if (rc < 0) {
+			io_counters(channel)->ioc_error = -rc;
+			unix_queue_exit(channel);
+			return OCFS2_ET_IO;
+		}
+
+		if (slot->qs_icb || slot->qs_iar) {
+			unix_queue_done_other(channel, slot, res);
+			continue;
+		}
+
+		ivu = slot->qs_ivu;
+		if (res < 0) {
+			io_counters(channel)->ioc_error = -res;
+			ret = OCFS2_ET_IO;
+		} else if (!res) {
+			/* Past the end of the device */
+			memset(ivu->ivu_buf + slot->qs_done, 0,
+			       ivu->ivu_buflen - slot->qs_done);
+			if (!ret)
+				ret = OCFS2_ET_SHORT_READ;
+		} else {
+			slot->qs_done += res;
+			io_counters(channel)->ioc_bytes_read += res;
+			if (slot->qs_done < ivu->ivu_buflen) {
+				unix_queue_prep_read(channel, slot);
+				continue;
+			}
 		}
+
+		mine--;
+		slot->qs_next = q->q_free;
+		q->q_free = slot;
 	}
 
-out:
 	return ret;
 }
 
 /*
- * This relies on the fact that our cache is always up to date.  If a
- * block is in the cache, the same thing is on disk.  Even if we re-read
- * the disk block, we don't need to update the cache.  This allows us
- * to look for optimal I/O sizes; it's better to call one read 1MB of
- * half-cached blocks than to read every other block.
- *
- * If the caller specifies "nocache", we still want to give them anything
- * we found in the cache, but we want cached blocks moved to the front
- * of the LRU.  That way they get stolen first.
+ * A threaded channel has one queue for all its threads, so they take
+ * turns with it.  Synchronous reads need no lock.
  */
-static errcode_t io_cache_read_blocks(io_channel *channel, int64_t blkno,
-				      int count, char *data, bool nocache)
+static errcode_t unix_vec_read_blocks(io_channel *channel,
+				      struct io_vec_unit *ivus, int count)
 {
-	int i, good_blocks;
 	errcode_t ret = 0;
-	struct io_cache *ic = channel->io_cache;
-	struct io_cache_block *icb;
 
-	/*
-	 * Here we check two things:
-	 *
-	 * 1) Are all the blocks cached?  If so, we can skip I/O.
-	 * 2) If they are not all cached, we want to start our read at the
-	 *    first uncached blkno.
-	 */
-	for (good_blocks = 0; good_blocks < count; good_blocks++) {
-		icb = io_cache_lookup(ic, blkno + good_blocks);
-		if (!icb)
-			break;
-		ic->ic_hits++;
+	if (channel->io_threaded) {
+		pthread_mutex_lock(&channel->io_queue_lock);
+		if (channel->io_queue) {
+			ret = unix_queue_vec_read_blocks(channel, ivus, count);
+			pthread_mutex_unlock(&channel->io_queue_lock);
+			return ret;
+		}
+		pthread_mutex_unlock(&channel->io_queue_lock);
+	} else if (channel->io_queue)
+		return unix_queue_vec_read_blocks(channel, ivus, count);
+
+	return unix_sync_vec_read_blocks(channel, ivus, count);
+}
+
+/*
+ * Fibonacci hashing.  Block numbers are mostly sequential, and the
+ * multiply spreads neighbours across the table.
+ */
+static inline uint64_t io_hash_slot(struct io_cache_hash *ih, uint64_t blkno)
+{
+	return (blkno * 0x9E3779B97F4A7C15ULL) >> ih->ih_shift;
+}
+
+/* Size the hash for nr entries. */
+static errcode_t io_hash_init(struct io_cache_hash *ih, uint64_t nr)
+{
+	uint64_t slots = 2;
+	int bits = 1;
+
+	while (slots < (nr * 2)) {
+		slots <<= 1;
+		bits++;
 	}
+	ih->ih_mask = slots - 1;
+	ih->ih_shift = 64 - bits;
 
-	/* Read any blocks not in the cache */
-	if (good_blocks < count) {
-		ic->ic_misses += (count - good_blocks);
-		ret = unix_io_read_block(channel, blkno + good_blocks,
-					 count - good_blocks,
-					 data + (channel->io_blksize *
-						 good_blocks));
-		if (ret)
-			goto out;
+	return ocfs2_malloc0(sizeof(struct io_cache_slot) * slots,
+			     &ih->ih_slots);
+}
+
+static void io_hash_free(struct io_cache_hash *ih)
+{
+	if (ih->ih_slots)
+		ocfs2_free(&ih->ih_slots);
+}
+
+/* Returns the idx stored for blkno, or 0 if there isn't one. */
+static uint32_t io_hash_find(struct io_cache_hash *ih, uint64_t blkno)
+{
+	struct io_cache_slot *slot;
+	uint64_t i;
+
+	for (i = io_hash_slot(ih, blkno); ; i = (i + 1) & ih->ih_mask) {
+		slot = &ih->ih_slots[i];
+		if (!slot->ics_idx)
+			return 0;
+		if (slot->ics_blkno == blkno)
+			return slot->ics_idx;
 	}
+}
 
-	/* Now we sync up the cache with the data buffer */
-	for (i = 0; i < count; i++, data += channel->io_blksize) {
-		icb = io_cache_lookup(ic, blkno + i);
-		if (i < good_blocks) {
-			/*
-			 * We skipped reading this because it was in the
-			 * cache.  Copy it to the data buffer.
-			 */
-			assert(icb);
-			memcpy(data, icb->icb_buf, channel->io_blksize);
-		} else if (!icb) {
-			if (nocache)
-				continue;
+static void io_hash_add(struct io_cache_hash *ih, uint64_t blkno,
+			uint32_t idx)
+{
+	struct io_cache_slot *slot;
+	uint64_t i;
 
-			/* Steal the LRU buffer */
-			icb = io_cache_pop_lru(ic);
-			icb->icb_blkno = blkno + i;
-			io_cache_insert(ic, icb);
+	for (i = io_hash_slot(ih, blkno); ; i = (i + 1) & ih->ih_mask) {
+		slot = &ih->ih_slots[i];
+		if (!slot->ics_idx)
+			break;
+		assert(slot->ics_blkno != blkno);  /* We erased it, remember? */
+	}
 
-			/*
-			 * We did I/O into the data buffer, now update
-			 * the cache.
-			 */
-			memcpy(icb->icb_buf, data, channel->io_blksize);
-		}
-		/*
-		 * What about if ((i >= good_blocks) && icb)?  That means
-		 * we had the buffer in the cache, but we read it anyway
-		 * to get a single I/O.  Our cache guarantees that the
-		 * contents will match, so we just skip to marking the
-		 * buffer seen.
-		 */
+	slot->ics_blkno = blkno;
+	slot->ics_idx = idx;
+}
 
-		if (nocache)
-			io_cache_unsee(ic, icb);
-		else
-			io_cache_seen(ic, icb);
+/*
+ * Remove blkno from the hash.  With linear probing, we can't just empty
+ * the slot; an entry later in the chain might have probed past it.  So
+ * we walk the rest of the chain and pull back any entry whose home slot
+ * isn't between the hole and its current position.
+ */
+static void io_hash_erase(struct io_cache_hash *ih, uint64_t blkno)
+{
+	struct io_cache_slot *slots = ih->ih_slots;
+	uint64_t mask = ih->ih_mask;
+	uint64_t i, j, home;
+
+	for (i = io_hash_slot(ih, blkno); ; i = (i + 1) & mask) {
+		assert(slots[i].ics_idx);
+		if (slots[i].ics_blkno == blkno)
+			break;
 	}
 
-out:
-	return ret;
+	for (j = (i + 1) & mask; slots[j].ics_idx; j = (j + 1) & mask) {
+		home = io_hash_slot(ih, slots[j].ics_blkno);
+		if (((j - home) & mask) < ((j - i) & mask))
+			continue;
+		slots[i] = slots[j];
+		i = j;
+	}
+
+	slots[i].ics_idx = 0;
 }
 
-static errcode_t io_cache_read_block(io_channel *channel, int64_t blkno,
-				     int count, char *data, bool nocache)
+static inline struct io_cache_block *io_cache_icb(struct io_cache *ic,
+						  uint32_t idx)
+{
+	return &ic->ic_metadata_buffer[idx - 1];
+}
 
+static inline uint32_t io_cache_idx(struct io_cache *ic,
+				    struct io_cache_block *icb)
 {
-	int todo = one_meg_of_blocks(channel);
-	errcode_t ret = 0;
+	return (icb - ic->ic_metadata_buffer) + 1;
+}
 
-	/*
-	 * We do this in one meg hunks so that each hunk has an
-	 * opportunity to be in cache, but we get a good throughput.
-	 */
-	while (count) {
-		if (todo > count)
-			todo = count;
-		ret = io_cache_read_blocks(channel, blkno, todo, data,
-					   nocache);
-		if (ret)
-			break;
+/* See if the index has a block for the given block number. */
+static struct io_cache_block *io_cache_lookup(struct io_cache *ic,
+					      uint64_t blkno)
+{
+	uint32_t idx;
 
-		blkno += todo;
-		count -= todo;
-		data += (channel->io_blksize * todo);
+	if (ic->ic_direct) {
+		if ((blkno < ic->ic_direct_len) && ic->ic_direct[blkno])
+			return io_cache_icb(ic, ic->ic_direct[blkno]);
+		return NULL;
 	}
 
-	return ret;
+	idx = io_hash_find(&ic->ic_hash, blkno);
+	return idx ? io_cache_icb(ic, idx) : NULL;
 }
 
 /*
- * This relies on the fact that our cache is always up to date.  If a
- * block is in the cache, the same thing is on disk.  So here we'll write
- * a whole stream and update the cache as needed.
+ * Look up a run of contiguous blocks starting at blkno.  The cached
+ * blocks are put in icbs, stopping at the first block that isn't
+ * cached.  Returns the length of the run.
  */
-static errcode_t io_cache_write_blocks(io_channel *channel, int64_t blkno,
-				       int count, const char *data,
-				       bool nocache)
+static int io_cache_lookup_run(struct io_cache *ic, uint64_t blkno,
+			       int count, struct io_cache_block **icbs)
 {
-	int i, completed = 0;
-	errcode_t ret;
-	struct io_cache *ic = channel->io_cache;
-	struct io_cache_block *icb;
+	int i;
+	uint32_t *direct;
+
+	if (ic->ic_direct) {
+		if (blkno >= ic->ic_direct_len)
+			return 0;
+		if (count > (ic->ic_direct_len - blkno))
+			count = ic->ic_direct_len - blkno;
+
+		direct = ic->ic_direct + blkno;
+		for (i = 0; (i < count) && direct[i]; i++)
+			icbs[i] = io_cache_icb(ic, direct[i]);
+		return i;
+	}
 
-	/* Get the write out of the way */
-	ret = unix_io_write_block_full(channel, blkno, count, data,
-				       &completed);
+	for (i = 0; i < count; i++) {
+		icbs[i] = io_cache_lookup(ic, blkno + i);
+		if (!icbs[i])
+			break;
+	}
 
-	/*
-	 * Now we sync up the cache with the data buffer.  We have
-	 * to sync up I/O that completed, even if the entire I/O did not.
-	 *
-	 * In the nocache case, we want to skip blocks that weren't in the
-	 * cache, but we want to update blocks that where.  Even though
-	 * the caller specified "don't cache this", it's already in the
-	 * cache.  We don't want stale data.
-	 */
-	for (i = 0; i < completed; i++, data += channel->io_blksize) {
-		icb = io_cache_lookup(ic, blkno + i);
-		if (!icb) {
-			if (nocache)
-				continue;
+	return i;
+}
+
+/* Make room in ic_direct for blkno.  Returns 0 on success. */
+static int io_cache_grow_direct(struct io_cache *ic, uint64_t blkno)
+{
+	uint64_t len = ic->ic_direct_len * 2;
+
+	if (len <= blkno)
+		len = blkno + 1;
+
+	if (ocfs2_realloc0(len * sizeof(uint32_t), &ic->ic_direct,
+			   ic->ic_direct_len * sizeof(uint32_t)))
+		return -1;
+
+	ic->ic_direct_len = len;
+	return 0;
+}
+
+/*
+ * insert_icb->icb_blkno must already be set.  The insert can't fail as
+ * far as callers are concerned.  In the unlikely case that ic_direct
+ * can't grow to hold the block, the icb is left disconnected.  It will
+ * be filled and used by the caller, but nobody will find it again.
+ */
+static void io_cache_insert(struct io_cache *ic,
+			    struct io_cache_block *insert_icb)
+{
+	uint64_t blkno = insert_icb->icb_blkno;
+
+	if (ic->ic_direct) {
+		if ((blkno >= ic->ic_direct_len) &&
+		    io_cache_grow_direct(ic, blkno)) {
+			insert_icb->icb_blkno = UINT64_MAX;
+			return;
+		}
+		assert(!ic->ic_direct[blkno]);  /* We erased it, remember? */
+		ic->ic_direct[blkno] = io_cache_idx(ic, insert_icb);
+	} else
+		io_hash_add(&ic->ic_hash, blkno, io_cache_idx(ic, insert_icb));
+
+	ic->ic_inserts++;
+}
+
+static struct io_cache_ghost *io_ghost_lookup(struct io_cache *ic,
+					      uint64_t blkno)
+{
+	uint32_t idx;
+
+	if (!ic->ic_nr_ghosts)
+		return NULL;
+
+	idx = io_hash_find(&ic->ic_ghost_hash, blkno);
+	return idx ? &ic->ic_ghosts[idx - 1] : NULL;
+}
+
+static void io_ghost_remove(struct io_cache *ic, struct io_cache_ghost *ig)
+{
+	io_hash_erase(&ic->ic_ghost_hash, ig->ig_blkno);
+	list_del(&ig->ig_list);
+	ic->ic_ghost_len[ig->ig_which]--;
+	list_add(&ig->ig_list, &ic->ic_ghost_free);
+}
+
+/* Forget the oldest ghost on the given list */
+static void io_ghost_drop(struct io_cache *ic, enum io_ghost_list which)
+{
+	io_ghost_remove(ic, list_entry(ic->ic_ghost_lists[which].next,
+				       struct io_cache_ghost, ig_list));
+}
+
+/*
+ * Remember that blkno was stolen from the cache.  If all the ghosts are
+ * in use, the oldest one on the same list is reused.
+ */
+static void io_ghost_add(struct io_cache *ic, enum io_ghost_list which,
+			 uint64_t blkno)
+{
+	struct io_cache_ghost *ig;
+
+	if (list_empty(&ic->ic_ghost_free)) {
+		if (!ic->ic_ghost_len[which])
+			which = !which;
+		io_ghost_drop(ic, which);
+	}
+
+	ig = list_entry(ic->ic_ghost_free.next, struct io_cache_ghost,
+			ig_list);
+	list_del(&ig->ig_list);
+	ig->ig_blkno = blkno;
+	ig->ig_which = which;
+	list_add_tail(&ig->ig_list, &ic->ic_ghost_lists[which]);
+	ic->ic_ghost_len[which]++;
+	io_hash_add(&ic->ic_ghost_hash, blkno, (ig - ic->ic_ghosts) + 1);
+}
+
+/* Put icb at the newest end of the given list */
+static void io_cache_move(struct io_cache *ic, struct io_cache_block *icb,
+			  enum io_cache_list which)
+{
+	list_del(&icb->icb_list);
+	ic->ic_list_len[icb->icb_which]--;
+	icb->icb_which = which;
+	ic->ic_list_len[which]++;
+	list_add_tail(&icb->icb_list, &ic->ic_lists[which]);
+}
+
+/*
+ * An icb on IO_CACHE_COLD has just been filled, or it was read with
+ * nocache.  Either way, it's new to the policy.  A block we stole a
+ * short while ago goes straight to IO_CACHE_FREQUENT.
+ */
+static void io_cache_admit(struct io_cache *ic, struct io_cache_block *icb)
+{
+	struct io_cache_ghost *ig = NULL;
+	uint32_t b1 = ic->ic_ghost_len[IO_GHOST_RECENT];
+	uint32_t b2 = ic->ic_ghost_len[IO_GHOST_FREQUENT];
+	uint32_t delta;
+
+	if (icb->icb_blkno != UINT64_MAX)
+		ig = io_ghost_lookup(ic, icb->icb_blkno);
+
+	if (!ig) {
+		/* ARC keeps T1 + B1 within the size of the cache */
+		if ((ic->ic_policy == IO_CACHE_POLICY_ARC) && b1 &&
+		    ((ic->ic_list_len[IO_CACHE_RECENT] + b1) >=
+		     ic->ic_nr_blocks))
+			io_ghost_drop(ic, IO_GHOST_RECENT);
+		io_cache_move(ic, icb, IO_CACHE_RECENT);
+		return;
+	}
+
+	ic->ic_ghost_hits++;
+	if (ic->ic_policy == IO_CACHE_POLICY_ARC) {
+		if (ig->ig_which == IO_GHOST_RECENT) {
+			delta = (b2 > b1) ? b2 / b1 : 1;
+			ic->ic_arc_target += delta;
+			if (ic->ic_arc_target > ic->ic_nr_blocks)
+				ic->ic_arc_target = ic->ic_nr_blocks;
+		} else {
+			delta = (b1 > b2) ? b1 / b2 : 1;
+			if (ic->ic_arc_target > delta)
+				ic->ic_arc_target -= delta;
+			else
+				ic->ic_arc_target = 0;
+		}
+	}
+
+	io_ghost_remove(ic, ig);
+	io_cache_move(ic, icb, IO_CACHE_FREQUENT);
+}
+
+static void io_cache_seen(struct io_cache *ic, struct io_cache_block *icb)
+{
+	switch (icb->icb_which) {
+	case IO_CACHE_COLD:
+		io_cache_admit(ic, icb);
+		break;
+
+	case IO_CACHE_RECENT:
+		ic->ic_recent_hits++;
+		if (ic->ic_policy == IO_CACHE_POLICY_LRU)
+			io_cache_move(ic, icb, IO_CACHE_RECENT);
+		else if (ic->ic_policy == IO_CACHE_POLICY_ARC)
+			io_cache_move(ic, icb, IO_CACHE_FREQUENT);
+		/* 2Q leaves re-reads of A1in blocks where they are */
+		break;
+
+	case IO_CACHE_FREQUENT:
+		ic->ic_frequent_hits++;
+		io_cache_move(ic, icb, IO_CACHE_FREQUENT);
+		break;
+
+	case IO_CACHE_DIRTY:
+		break;
+
+	default:
+		/* Pending and in-flight blocks are waited for first */
+		assert(0);
+	}
+}
+
+static void io_cache_unsee(struct io_cache *ic, struct io_cache_block *icb)
+{
+	/*
+	 * Move to the head of the cold list.  There's no point in
+	 * removing an "unseen" buffer from the cache.  It's valid, but we
+	 * want the next I/O to steal it.  A dirty buffer has to wait for
+	 * io_cache_flush().
+	 */
+	if (icb->icb_which == IO_CACHE_DIRTY)
+		return;
+
+	assert(icb->icb_which != IO_CACHE_PENDING);
+	assert(icb->icb_which != IO_CACHE_INFLIGHT);
+	io_cache_move(ic, icb, IO_CACHE_COLD);
+	list_del(&icb->icb_list);
+	list_add(&icb->icb_list, &ic->ic_lists[IO_CACHE_COLD]);
+}
+
+/*
+ * Take icb off its list so that io_cache_pop() can't steal it.  It has
+ * to be unpinned before anything else is done with it.
+ */
+static void io_cache_pin(struct io_cache *ic, struct io_cache_block *icb)
+{
+	list_del(&icb->icb_list);
+	ic->ic_list_len[icb->icb_which]--;
+}
+
+static void io_cache_unpin(struct io_cache *ic, struct io_cache_block *icb)
+{
+	list_add(&icb->icb_list, &ic->ic_lists[icb->icb_which]);
+	ic->ic_list_len[icb->icb_which]++;
+}
+
+static void io_cache_disconnect(struct io_cache *ic,
+				struct io_cache_block *icb)
+{
+	/*
+	 * This icb should longer be looked up.
+	 * If icb->icb_blkno is UINT64_MAX, it's already disconnected.
+	 */
+	if (icb->icb_blkno != UINT64_MAX) {
+		if (ic->ic_direct)
+			ic->ic_direct[icb->icb_blkno] = 0;
+		else
+			io_hash_erase(&ic->ic_hash, icb->icb_blkno);
+		icb->icb_blkno = UINT64_MAX;
+	}
+}
+
+/* Which list gives up a block, according to the policy */
+static enum io_cache_list io_cache_victim_list(struct io_cache *ic)
+{
+	uint32_t recent = ic->ic_list_len[IO_CACHE_RECENT];
+	uint32_t frequent = ic->ic_list_len[IO_CACHE_FREQUENT];
+
+	if (ic->ic_list_len[IO_CACHE_COLD])
+		return IO_CACHE_COLD;
+
+	switch (ic->ic_policy) {
+	case IO_CACHE_POLICY_2Q:
+		if (frequent && (recent <= ic->ic_recent_max))
+			return IO_CACHE_FREQUENT;
+		break;
+
+	case IO_CACHE_POLICY_ARC:
+		if (!recent || (frequent && (recent <= ic->ic_arc_target)))
+			return IO_CACHE_FREQUENT;
+		break;
+
+	default:
+		break;
+	}
+
+	return IO_CACHE_RECENT;
+}
+
+/*
+ * Steal a block.  It comes back disconnected and on IO_CACHE_COLD, so
+ * the caller's io_cache_seen() will admit it as a new block.
+ */
+static struct io_cache_block *io_cache_pop(struct io_cache *ic)
+{
+	struct io_cache_block *icb;
+	enum io_cache_list which = io_cache_victim_list(ic);
+
+	icb = list_entry(ic->ic_lists[which].next, struct io_cache_block,
+			 icb_list);
+
+	if ((which != IO_CACHE_COLD) && ic->ic_nr_ghosts &&
+	    (icb->icb_blkno != UINT64_MAX)) {
+		if (which == IO_CACHE_RECENT)
+			io_ghost_add(ic, IO_GHOST_RECENT, icb->icb_blkno);
+		else if (ic->ic_policy == IO_CACHE_POLICY_ARC)
+			io_ghost_add(ic, IO_GHOST_FREQUENT, icb->icb_blkno);
+	}
+
+	io_cache_disconnect(ic, icb);
+	io_cache_unsee(ic, icb);
+	ic->ic_removes++;
+
+	return icb;
+}
+
+/* Blocks that io_cache_pop() can't steal */
+static inline uint32_t io_cache_busy(struct io_cache *ic)
+{
+	return ic->ic_list_len[IO_CACHE_DIRTY] +
+		ic->ic_list_len[IO_CACHE_PENDING] +
+		ic->ic_list_len[IO_CACHE_INFLIGHT];
+}
+
+/* The shard that caches blkno */
+static inline struct io_cache *io_cache_shard(struct io_cache_set *cs,
+					      uint64_t blkno)
+{
+	return &cs->cs_shards[(blkno / IO_CACHE_SHARD_RUN) % cs->cs_nr_shards];
+}
+
+/* How many of count blocks from blkno live in blkno's shard */
+static inline int io_cache_shard_span(struct io_cache_set *cs,
+				      uint64_t blkno, int count)
+{
+	int span;
+
+	if (cs->cs_nr_shards == 1)
+		return count;
+
+	span = IO_CACHE_SHARD_RUN - (blkno % IO_CACHE_SHARD_RUN);
+	return (count < span) ? count : span;
+}
+
+static inline void io_cache_lock(struct io_cache_set *cs, struct io_cache *ic)
+{
+	if (cs->cs_threaded)
+		pthread_mutex_lock(&ic->ic_lock);
+}
+
+static inline void io_cache_unlock(struct io_cache_set *cs,
+				   struct io_cache *ic)
+{
+	if (cs->cs_threaded)
+		pthread_mutex_unlock(&ic->ic_lock);
+}
+
+/*
+ * Prefetches belong to the channel's queue, so only an unshared,
+ * unthreaded cache does them.  Returns its one shard, or NULL.
+ */
+static struct io_cache *io_cache_prefetch_shard(io_channel *channel)
+{
+	struct io_cache_set *cs = channel->io_cache;
+
+	if (!cs || cs->cs_threaded || (cs->cs_use_count > 1))
+		return NULL;
+	return cs->cs_shards;
+}
+
+/* Give free queue slots to pending prefetches, oldest first */
+static void io_cache_prefetch_queue(io_channel *channel)
+{
+	struct io_cache *ic = io_cache_prefetch_shard(channel);
+	struct unix_queue *q = channel->io_queue;
+	struct unix_queue_slot *slot;
+	struct io_cache_block *icb;
+
+	while (q->q_free && ic->ic_list_len[IO_CACHE_PENDING]) {
+		icb = list_entry(ic->ic_lists[IO_CACHE_PENDING].next,
+				 struct io_cache_block, icb_list);
+		io_cache_move(ic, icb, IO_CACHE_INFLIGHT);
+
+		slot = q->q_free;
+		q->q_free = slot->qs_next;
+		slot->qs_icb = icb;
+		slot->qs_iar = NULL;
+		slot->qs_prefetch.ivu_blkno = icb->icb_blkno;
+		slot->qs_prefetch.ivu_buf = icb->icb_buf;
+		slot->qs_prefetch.ivu_buflen = channel->io_blksize;
+		slot->qs_ivu = &slot->qs_prefetch;
+		slot->qs_done = 0;
+		unix_queue_prep_read(channel, slot);
+		q->q_prefetches++;
+	}
+}
+
+/*
+ * A prefetch read has completed.  A block that couldn't be read is
+ * dropped from the cache; whoever wants it will read it the normal way
+ * and get the error then.
+ */
+static void io_cache_prefetch_done(io_channel *channel,
+				   struct unix_queue_slot *slot, int res)
+{
+	struct io_cache *ic = io_cache_prefetch_shard(channel);
+	struct unix_queue *q = channel->io_queue;
+	struct io_cache_block *icb = slot->qs_icb;
+
+	if (res > 0) {
+		io_counters(channel)->ioc_bytes_read += res;
+		slot->qs_done += res;
+		if (slot->qs_done < slot->qs_ivu->ivu_buflen) {
+			unix_queue_prep_read(channel, slot);
+			return;
+		}
+	}
+
+	slot->qs_icb = NULL;
+	slot->qs_next = q->q_free;
+	q->q_free = slot;
+	q->q_prefetches--;
+
+	if (res > 0) {
+		io_cache_move(ic, icb, IO_CACHE_COLD);
+		io_cache_admit(ic, icb);
+	} else {
+		io_cache_disconnect(ic, icb);
+		io_cache_move(ic, icb, IO_CACHE_COLD);
+		io_cache_unsee(ic, icb);
+	}
+
+	io_cache_prefetch_queue(channel);
+}
+
+/* The queue is going away.  Drop every prefetch it had. */
+static void io_cache_prefetch_cancel(io_channel *channel)
+{
+	struct io_cache *ic = io_cache_prefetch_shard(channel);
+	struct unix_queue *q = channel->io_queue;
+	struct io_cache_block *icb;
+	int i;
+
+	if (!ic)
+		return;
+
+	for (i = 0; i < q->q_depth; i++) {
+		icb = q->q_slots[i].qs_icb;
+		if (!icb)
+			continue;
+		q->q_slots[i].qs_icb = NULL;
+		io_cache_disconnect(ic, icb);
+		io_cache_move(ic, icb, IO_CACHE_COLD);
+		io_cache_unsee(ic, icb);
+	}
+	q->q_prefetches = 0;
+
+	while (ic->ic_list_len[IO_CACHE_PENDING]) {
+		icb = list_entry(ic->ic_lists[IO_CACHE_PENDING].next,
+				 struct io_cache_block, icb_list);
+		io_cache_disconnect(ic, icb);
+		io_cache_move(ic, icb, IO_CACHE_COLD);
+		io_cache_unsee(ic, icb);
+	}
+}
+
+/*
+ * Blocks an async read brought in go into the cache like any other
+ * read's, so later readers find them there.  A block that is already
+ * cached is left alone; it is as new as what we read, or newer.
+ */
+static void io_cache_add_async_read(io_channel *channel,
+				    struct io_vec_unit *ivu)
+{
+	struct io_cache_set *cs = channel->io_cache;
+	struct io_cache *ic;
+	struct io_cache_block *icb;
+	uint64_t blkno = ivu->ivu_blkno;
+	char *buf = ivu->ivu_buf;
+	int i, count = ivu->ivu_buflen / channel->io_blksize;
+
+	for (i = 0; i < count; i++, blkno++, buf += channel->io_blksize) {
+		ic = io_cache_shard(cs, blkno);
+		io_cache_lock(cs, ic);
+		if (!io_cache_lookup(ic, blkno) &&
+		    (io_cache_busy(ic) < ic->ic_nr_blocks)) {
+			icb = io_cache_pop(ic);
+			icb->icb_blkno = blkno;
+			io_cache_insert(ic, icb);
+			memcpy(icb->icb_buf, buf, channel->io_blksize);
+			io_cache_seen(ic, icb);
+		}
+		io_cache_unlock(cs, ic);
+	}
+}
+
+/*
+ * An async read has completed.  Short reads are resubmitted for the
+ * remainder; the result waits in the io_async_read for
+ * io_finish_read().
+ */
+static void io_async_read_done(io_channel *channel,
+			       struct unix_queue_slot *slot, int res)
+{
+	struct unix_queue *q = channel->io_queue;
+	struct io_async_read *iar = slot->qs_iar;
+	struct io_vec_unit *ivu = slot->qs_ivu;
+
+	if (res < 0) {
+		io_counters(channel)->ioc_error = -res;
+		iar->iar_ret = OCFS2_ET_IO;
+	} else if (!res) {
+		/* Past the end of the device */
+		memset(ivu->ivu_buf + slot->qs_done, 0,
+		       ivu->ivu_buflen - slot->qs_done);
+		iar->iar_ret = OCFS2_ET_SHORT_READ;
+	} else {
+		slot->qs_done += res;
+		io_counters(channel)->ioc_bytes_read += res;
+		if (slot->qs_done < ivu->ivu_buflen) {
+			unix_queue_prep_read(channel, slot);
+			return;
+		}
+		iar->iar_ret = 0;
+
+		/* A write while we were reading may have made it stale */
+		if (slot->qs_cache &&
+		    (slot->qs_write_gen == channel->io_write_gen))
+			io_cache_add_async_read(channel, ivu);
+	}
+
+	iar->iar_pending = false;
+	slot->qs_iar = NULL;
+	slot->qs_next = q->q_free;
+	q->q_free = slot;
+}
+
+/* The queue is going away.  Fail every async read it had. */
+static void io_async_read_cancel(io_channel *channel)
+{
+	struct unix_queue *q = channel->io_queue;
+	struct io_async_read *iar;
+	int i;
+
+	for (i = 0; i < q->q_depth; i++) {
+		iar = q->q_slots[i].qs_iar;
+		if (!iar)
+			continue;
+		q->q_slots[i].qs_iar = NULL;
+		iar->iar_ret = OCFS2_ET_IO;
+		iar->iar_pending = false;
+	}
+}
+
+/* A completion for a slot that outlived the call that queued it */
+static void unix_queue_done_other(io_channel *channel,
+				  struct unix_queue_slot *slot, int res)
+{
+	if (slot->qs_icb)
+		io_cache_prefetch_done(channel, slot, res);
+	else {
+		assert(slot->qs_iar);
+		io_async_read_done(channel, slot, res);
+	}
+}
+
+/*
+ * Submit what is queued and handle one prefetch or async read
+ * completion.  If the queue fails, it is torn down, which cancels the
+ * rest.
+ */
+static errcode_t unix_queue_reap_other(io_channel *channel)
+{
+	struct unix_queue *q = channel->io_queue;
+	struct unix_queue_slot *slot;
+	int rc, res;
+
+	if (q->q_queued) {
+		rc = unix_queue_submit(channel);
+		if ((rc < 0) && !unix_queue_submit_retry(rc))
+			goto out_error;
+	}
+
+	if (!q->q_inflight)
+		return 0;
+
+	rc = unix_queue_reap(channel, &slot, &res, true);
+	if (rc == -EINTR)
+		return 0;
+	if (rc < 0)
+		goto out_error;
+
+	unix_queue_done_other(channel, slot, res);
+	return 0;
+
+out_error:
+	io_counters(channel)->ioc_error = -rc;
+	unix_queue_exit(channel);
+	return OCFS2_ET_IO;
+}
+
+/* Wait for one prefetched block.  A pending block jumps the line. */
+static void io_cache_prefetch_wait(io_channel *channel,
+				   struct io_cache_block *icb)
+{
+	struct io_cache *ic = io_cache_prefetch_shard(channel);
+
+	io_counters(channel)->ioc_prefetch_waits++;
+	while ((icb->icb_which == IO_CACHE_PENDING) ||
+	       (icb->icb_which == IO_CACHE_INFLIGHT)) {
+		if (icb->icb_which == IO_CACHE_PENDING) {
+			list_del(&icb->icb_list);
+			list_add(&icb->icb_list,
+				 &ic->ic_lists[IO_CACHE_PENDING]);
+			io_cache_prefetch_queue(channel);
+		}
+		if (unix_queue_reap_other(channel))
+			break;
+	}
+}
+
+/* Make sure no block in [blkno, blkno + count) is being prefetched */
+static void io_cache_prefetch_wait_range(io_channel *channel,
+					 int64_t blkno, int count)
+{
+	struct io_cache *ic = io_cache_prefetch_shard(channel);
+	struct io_cache_block *icb;
+	int i;
+
+	if (!ic || (!ic->ic_list_len[IO_CACHE_PENDING] &&
+		    !ic->ic_list_len[IO_CACHE_INFLIGHT]))
+		return;
+
+	for (i = 0; i < count; i++) {
+		icb = io_cache_lookup(ic, blkno + i);
+		if (icb && ((icb->icb_which == IO_CACHE_PENDING) ||
+			    (icb->icb_which == IO_CACHE_INFLIGHT)))
+			io_cache_prefetch_wait(channel, icb);
+	}
+}
+
+/* Wait for every prefetch.  Errors have already dropped the blocks. */
+static void io_cache_prefetch_drain(io_channel *channel)
+{
+	struct io_cache *ic = io_cache_prefetch_shard(channel);
+
+	while (channel->io_queue && ic &&
+	       (ic->ic_list_len[IO_CACHE_PENDING] ||
+		ic->ic_list_len[IO_CACHE_INFLIGHT])) {
+		io_cache_prefetch_queue(channel);
+		if (unix_queue_reap_other(channel))
+			break;
+	}
+}
+
+/*
+ * Queue reads for any of [blkno, blkno + count) that aren't cached, and
+ * return without waiting for them.  This is only a hint, so it quietly
+ * stops when the cache has no room to spare.
+ */
+static errcode_t io_cache_prefetch(io_channel *channel, int64_t blkno,
+				   int count)
+{
+	struct io_cache *ic = io_cache_prefetch_shard(channel);
+	struct unix_queue *q = channel->io_queue;
+	struct unix_queue_slot *slot;
+	struct io_cache_block *icb;
+	int i, rc, res;
+
+	if (!q || !ic)
+		return 0;
+
+	/* Pick up whatever has finished already; it frees slots */
+	while (q->q_inflight &&
+	       !unix_queue_reap(channel, &slot, &res, false))
+		unix_queue_done_other(channel, slot, res);
+
+	for (i = 0; i < count; i++) {
+		if (io_cache_busy(ic) >= (ic->ic_nr_blocks / 2))
+			break;
+
+		if (io_cache_lookup(ic, blkno + i))
+			continue;
+
+		icb = io_cache_pop(ic);
+		icb->icb_blkno = blkno + i;
+		io_cache_insert(ic, icb);
+		if (icb->icb_blkno == UINT64_MAX)
+			continue;
+
+		io_cache_move(ic, icb, IO_CACHE_PENDING);
+		io_counters(channel)->ioc_prefetch_blocks++;
+	}
+
+	io_cache_prefetch_queue(channel);
+	if (!q->q_queued)
+		return 0;
+
+	rc = unix_queue_submit(channel);
+	if ((rc < 0) && !unix_queue_submit_retry(rc)) {
+		io_counters(channel)->ioc_error = -rc;
+		unix_queue_exit(channel);
+		return OCFS2_ET_IO;
+	}
+
+	return 0;
+}
+
+/*
+ * A threaded channel doesn't fill.  Its queue can go away under
+ * another thread's feet, and the ring is a point of contention anyway.
+ */
+static bool io_cache_can_fill(io_channel *channel, struct io_cache *ic,
+			      int count, bool nocache)
+{
+	return !nocache && !channel->io_threaded &&
+		unix_queue_registered(channel) &&
+		(count <= (ic->ic_nr_blocks - io_cache_busy(ic)));
+}
+
+/*
+ * When the cache is registered with the ring, misses are read straight
+ * into cache blocks with fixed-buffer reads instead of into the caller's
+ * buffer.  Blocks already in the cache are not re-read.  Every block in
+ * [blkno, blkno + count) ends up in data, cached and marked seen.
+ *
+ * Each block is pinned as soon as we have it so that a later pop can't
+ * steal it back; io_cache_can_fill() made sure the range fits.  They
+ * are marked seen once the read is done.
+ */
+static errcode_t io_cache_fill_blocks(io_channel *channel,
+				      struct io_cache *ic, int64_t blkno,
+				      int count, char *data)
+{
+	struct io_cache_block *icb, **icbs;
+	struct io_vec_unit *ivus;
+	int i, j, nr = 0;
+	errcode_t ret;
+
+	ret = ocfs2_malloc((sizeof(struct io_vec_unit) +
+			    sizeof(struct io_cache_block *)) * count, &ivus);
+	if (ret)
+		return ret;
+	icbs = (struct io_cache_block **)(ivus + count);
+
+	for (i = 0; i < count; i++) {
+		icb = io_cache_lookup(ic, blkno + i);
+		if (!icb) {
+			icb = io_cache_pop(ic);
+			icb->icb_blkno = blkno + i;
+			io_cache_insert(ic, icb);
+
+			ivus[nr].ivu_blkno = blkno + i;
+			ivus[nr].ivu_buf = icb->icb_buf;
+			ivus[nr].ivu_buflen = channel->io_blksize;
+			nr++;
+		}
+		io_cache_pin(ic, icb);
+		icbs[i] = icb;
+	}
+
+	ret = unix_vec_read_blocks(channel, ivus, nr);
+
+	/* If the read failed, we don't know which blocks are good */
+	for (i = 0, j = 0; i < count; i++) {
+		io_cache_unpin(ic, icbs[i]);
+		if (ret && (j < nr) && (icbs[i]->icb_buf == ivus[j].ivu_buf)) {
+			io_cache_disconnect(ic, icbs[i]);
+			io_cache_unsee(ic, icbs[i]);
+			j++;
+		} else
+			io_cache_seen(ic, icbs[i]);
+	}
+	if (ret)
+		goto out;
+
+	for (i = 0; i < count; i++, data += channel->io_blksize)
+		memcpy(data, icbs[i]->icb_buf, channel->io_blksize);
+
+out:
+	ocfs2_free(&ivus);
+	return ret;
+}
+
+/*
+ * Only cache misses are read.  Blocks found in the cache are copied out
+ * directly.  Each ivu is split into runs of uncached blocks, and only
+ * those runs go to the device, all in one vectored read.  The misses are
+ * then added to the cache.
+ *
+ * A trailing partial block is always read and never cached.
+ */
+static errcode_t io_cache_vec_read_blocks(io_channel *channel,
+					  struct io_cache *ic,
+					  struct io_vec_unit *ivus,
+					  int count, bool nocache)
+{
+	struct io_cache_block *icb;
+	struct io_vec_unit *misses = NULL, *miss;
+	errcode_t ret = 0;
+	int i, j, nr_misses = 0, max_misses = 0;
+	int blksize = channel->io_blksize;
+	uint64_t blkno;
+	uint32_t numblks;
+	char *buf;
+
+	/* Every miss run holds at least one block, or a partial one */
+	for (i = 0; i < count; i++)
+		max_misses += (ivus[i].ivu_buflen + blksize - 1) / blksize;
+
+	ret = ocfs2_malloc(sizeof(struct io_vec_unit) * max_misses, &misses);
+	if (ret)
+		goto out;
+
+	for (i = 0; i < count; i++) {
+		blkno = ivus[i].ivu_blkno;
+		numblks = ivus[i].ivu_buflen / blksize;
+		buf = ivus[i].ivu_buf;
+		miss = NULL;
+
+		io_cache_prefetch_wait_range(channel, blkno,
+					     (ivus[i].ivu_buflen + blksize - 1) /
+					     blksize);
+
+		for (j = 0; j < numblks; ++j, ++blkno, buf += blksize) {
+			icb = io_cache_lookup(ic, blkno);
+			if (!icb) {
+				ic->ic_misses++;
+				if (miss) {
+					miss->ivu_buflen += blksize;
+					continue;
+				}
+				miss = &misses[nr_misses++];
+				miss->ivu_blkno = blkno;
+				miss->ivu_buf = buf;
+				miss->ivu_buflen = blksize;
+				continue;
+			}
+
+			ic->ic_hits++;
+			miss = NULL;
+			memcpy(buf, icb->icb_buf, blksize);
+			if (nocache)
+				io_cache_unsee(ic, icb);
+			else
+				io_cache_seen(ic, icb);
+		}
+
+		/*
+		 * A partial block comes from the cache if it's there.  It
+		 * may be dirty, and then the disk is stale.
+		 */
+		if (ivus[i].ivu_buflen % blksize) {
+			icb = io_cache_lookup(ic, blkno);
+			if (icb) {
+				memcpy(buf, icb->icb_buf,
+				       ivus[i].ivu_buflen % blksize);
+				continue;
+			}
+			if (!miss) {
+				miss = &misses[nr_misses++];
+				miss->ivu_blkno = blkno;
+				miss->ivu_buf = buf;
+				miss->ivu_buflen = 0;
+			}
+			miss->ivu_buflen += ivus[i].ivu_buflen % blksize;
+		}
+	}
+
+	if (!nr_misses)
+		goto out;
+
+	ret = unix_vec_read_blocks(channel, misses, nr_misses);
+	if (ret)
+		goto out;
+
+	/* Add what we read to the cache */
+	for (i = 0; i < nr_misses; i++) {
+		blkno = misses[i].ivu_blkno;
+		numblks = misses[i].ivu_buflen / blksize;
+		buf = misses[i].ivu_buf;
+
+		for (j = 0; j < numblks; ++j, ++blkno, buf += blksize) {
+			/* The same block may appear in more than one ivu */
+			icb = io_cache_lookup(ic, blkno);
+			if (!icb) {
+				if (nocache)
+					continue;
+				icb = io_cache_pop(ic);
+				icb->icb_blkno = blkno;
+				io_cache_insert(ic, icb);
+			}
+
+			memcpy(icb->icb_buf, buf, blksize);
+
+			if (nocache)
+				io_cache_unsee(ic, icb);
+			else
+				io_cache_seen(ic, icb);
+		}
+	}
+
+out:
+	if (misses)
+		ocfs2_free(&misses);
+	return ret;
+}
+
+/*
+ * This relies on the fact that our cache is always up to date.  If a
+ * block is in the cache, the same thing is on disk.  Even if we re-read
+ * the disk block, we don't need to update the cache.  This allows us
+ * to look for optimal I/O sizes; it's better to call one read 1MB of
+ * half-cached blocks than to read every other block.
+ *
+ * If the caller specifies "nocache", we still want to give them anything
+ * we found in the cache, but we want cached blocks moved to the front
+ * of the LRU.  That way they get stolen first.
+ */
+static errcode_t io_cache_read_blocks(io_channel *channel,
+				      struct io_cache *ic, int64_t blkno,
+				      int count, char *data, bool nocache)
+{
+	int i, run, good_blocks;
+	errcode_t ret = 0;
+	struct io_cache_block *icb, *icbs[IO_CACHE_RUN];
+
+	io_cache_prefetch_wait_range(channel, blkno, count);
+
+	/*
+	 * Copy out the cached blocks at the front of the range.  If they
+	 * are all cached, we can skip I/O.  If not, we want to start our
+	 * read at the first uncached blkno.
+	 */
+	good_blocks = 0;
+	do {
+		run = count - good_blocks;
+		if (run > IO_CACHE_RUN)
+			run = IO_CACHE_RUN;
+		run = io_cache_lookup_run(ic, blkno + good_blocks, run, icbs);
+
+		for (i = 0; i < run; i++) {
+			memcpy(data, icbs[i]->icb_buf, channel->io_blksize);
+			data += channel->io_blksize;
+			if (nocache)
+				io_cache_unsee(ic, icbs[i]);
+			else
+				io_cache_seen(ic, icbs[i]);
+		}
+
+		ic->ic_hits += run;
+		good_blocks += run;
+	} while (run == IO_CACHE_RUN);
+
+	if (good_blocks == count)
+		goto out;
+
+	/* Read any blocks not in the cache */
+	blkno += good_blocks;
+	count -= good_blocks;
+	ic->ic_misses += count;
+	if (io_cache_can_fill(channel, ic, count, nocache)) {
+		ret = io_cache_fill_blocks(channel, ic, blkno, count, data);
+		goto out;
+	}
+
+	ret = unix_io_read_block(channel, blkno, count, data);
+	if (ret)
+		goto out;
+
+	/* Now we sync up the cache with the data buffer */
+	for (i = 0; i < count; i++, data += channel->io_blksize) {
+		icb = io_cache_lookup(ic, blkno + i);
+		if (!icb) {
+			if (nocache)
+				continue;
+
+			/* Steal a buffer */
+			icb = io_cache_pop(ic);
+			icb->icb_blkno = blkno + i;
+			io_cache_insert(ic, icb);
+
+			/*
+			 * We did I/O into the data buffer, now update
+			 * the cache.
+			 */
+			memcpy(icb->icb_buf, data, channel->io_blksize);
+		}
+		/*
+		 * What if we found icb?  That means we had the buffer in
+		 * the cache, but we read it anyway to get a single I/O.
+		 * Our cache guarantees that the contents will match, so
+		 * we just skip to marking the buffer seen.  The exception
+		 * is a dirty buffer, which is newer than the disk.
+		 */
+		else if (icb->icb_which == IO_CACHE_DIRTY)
+			memcpy(data, icb->icb_buf, channel->io_blksize);
+
+		if (nocache)
+			io_cache_unsee(ic, icb);
+		else
+			io_cache_seen(ic, icb);
+	}
+
+out:
+	return ret;
+}
+
+static errcode_t io_cache_read_block(io_channel *channel, int64_t blkno,
+				     int count, char *data, bool nocache)
+
+{
+	struct io_cache_set *cs = channel->io_cache;
+	struct io_cache *ic;
+	int todo;
+	errcode_t ret = 0;
+
+	/*
+	 * We do this in one meg hunks so that each hunk has an
+	 * opportunity to be in cache, but we get a good throughput.
+	 * A hunk never crosses shards.
+	 */
+	while (count) {
+		todo = one_meg_of_blocks(channel);
+		if (todo > count)
+			todo = count;
+		todo = io_cache_shard_span(cs, blkno, todo);
+		ic = io_cache_shard(cs, blkno);
+
+		io_cache_lock(cs, ic);
+		ret = io_cache_read_blocks(channel, ic, blkno, todo, data,
+					   nocache);
+		io_cache_unlock(cs, ic);
+		if (ret)
+			break;
+
+		blkno += todo;
+		count -= todo;
+		data += (channel->io_blksize * todo);
+	}
+
+	return ret;
+}
+
+/*
+ * This relies on the fact that our cache is always up to date.  If a
+ * block is in the cache, the same thing is on disk.  So here we'll write
+ * a whole stream and update the cache as needed.
+ */
+static errcode_t io_cache_write_blocks(io_channel *channel,
+				       struct io_cache *ic, int64_t blkno,
+				       int count, const char *data,
+				       bool nocache)
+{
+	int i, completed = 0;
+	errcode_t ret;
+	struct io_cache_block *icb;
+
+	/* A prefetch landing after the write would be stale */
+	io_cache_prefetch_wait_range(channel, blkno,
+				     (count < 0) ?
+				     (-count + channel->io_blksize - 1) /
+				     channel->io_blksize : count);
+
+	/* Get the write out of the way */
+	ret = unix_io_write_block_full(channel, blkno, count, data,
+				       &completed);
+
+	/*
+	 * Now we sync up the cache with the data buffer.  We have
+	 * to sync up I/O that completed, even if the entire I/O did not.
+	 *
+	 * In the nocache case, we want to skip blocks that weren't in the
+	 * cache, but we want to update blocks that where.  Even though
+	 * the caller specified "don't cache this", it's already in the
+	 * cache.  We don't want stale data.
+	 */
+	for (i = 0; i < completed; i++, data += channel->io_blksize) {
+		icb = io_cache_lookup(ic, blkno + i);
+		if (!icb) {
+			if (nocache)
+				continue;
+
+			/*
+			 * Steal a buffer.  We can't error here, so
+			 * we can safely insert it before we copy the data.
+			 */
+			icb = io_cache_pop(ic);
+			icb->icb_blkno = blkno + i;
+			io_cache_insert(ic, icb);
+		}
+
+		memcpy(icb->icb_buf, data, channel->io_blksize);
+
+		/* It's on disk now */
+		if (icb->icb_which == IO_CACHE_DIRTY)
+			io_cache_move(ic, icb, IO_CACHE_COLD);
+
+		if (nocache)
+			io_cache_unsee(ic, icb);
+		else
+			io_cache_seen(ic, icb);
+	}
+
+	return ret;
+}
+
+static int io_cache_blkno_cmp(const void *a, const void *b)
+{
+	const struct io_cache_block *l = *(struct io_cache_block **)a;
+	const struct io_cache_block *r = *(struct io_cache_block **)b;
+
+	if (l->icb_blkno < r->icb_blkno)
+		return -1;
+	if (l->icb_blkno > r->icb_blkno)
+		return 1;
+	return 0;
+}
+
+/*
+ * Write out every dirty block.  They are sorted by block number, and
+ * each run of contiguous blocks goes out in one pwritev().  A block is
+ * marked clean only once its run is on disk, so a failed flush leaves
+ * the rest dirty for the next try.
+ */
+static errcode_t io_cache_flush_shard(io_channel *channel,
+				      struct io_cache *ic)
+{
+	int i, j, k, nr, nr_iov;
+	errcode_t ret;
+	struct io_cache_block **icbs;
+	struct list_head *pos;
+	struct iovec *iov;
+
+	if (!ic->ic_list_len[IO_CACHE_DIRTY])
+		return 0;
+
+	nr = ic->ic_list_len[IO_CACHE_DIRTY];
+	nr_iov = ocfs2_min(nr, IO_FLUSH_MAX_IOVS);
+	ret = ocfs2_malloc((sizeof(struct io_cache_block *) * nr) +
+			   (sizeof(struct iovec) * nr_iov), &icbs);
+	if (ret)
+		return ret;
+	iov = (struct iovec *)(icbs + nr);
+
+	i = 0;
+	list_for_each(pos, &ic->ic_lists[IO_CACHE_DIRTY])
+		icbs[i++] = list_entry(pos, struct io_cache_block, icb_list);
+	qsort(icbs, nr, sizeof(struct io_cache_block *), io_cache_blkno_cmp);
+
+	for (i = 0; i < nr; i = j) {
+		for (j = i; (j < nr) && ((j - i) < IO_FLUSH_MAX_IOVS); j++) {
+			if ((j > i) &&
+			    (icbs[j]->icb_blkno != (icbs[j - 1]->icb_blkno + 1)))
+				break;
+			iov[j - i].iov_base = icbs[j]->icb_buf;
+			iov[j - i].iov_len = channel->io_blksize;
+		}
+
+		ret = unix_io_writev_blocks(channel, icbs[i]->icb_blkno,
+					    iov, j - i);
+		if (ret)
+			break;
+
+		for (k = i; k < j; k++) {
+			io_cache_move(ic, icbs[k], IO_CACHE_COLD);
+			io_cache_seen(ic, icbs[k]);
+		}
+	}
+
+	ocfs2_free(&icbs);
+	return ret;
+}
+
+static errcode_t io_cache_flush(io_channel *channel)
+{
+	struct io_cache_set *cs = channel->io_cache;
+	struct io_cache *ic;
+	errcode_t ret = 0;
+	int i;
+
+	if (!cs)
+		return 0;
+
+	for (i = 0; !ret && (i < cs->cs_nr_shards); i++) {
+		ic = &cs->cs_shards[i];
+		io_cache_lock(cs, ic);
+		ret = io_cache_flush_shard(channel, ic);
+		io_cache_unlock(cs, ic);
+	}
+
+	return ret;
+}
+
+/*
+ * In write-back mode, the blocks are copied into the cache and marked
+ * dirty.  Nothing goes to disk until io_cache_flush().  Dirty blocks
+ * can't be stolen, so we keep at least half the cache clean for reads.
+ * When a write would go over that, we flush first.  A write that still
+ * doesn't fit goes straight to disk.
+ */
+static errcode_t io_cache_write_back(io_channel *channel,
+				     struct io_cache *ic, int64_t blkno,
+				     int count, const char *data)
+{
+	int i;
+	errcode_t ret;
+	struct io_cache_block *icb;
+
+	io_cache_prefetch_wait_range(channel, blkno, count);
+
+	if ((io_cache_busy(ic) + count) > (ic->ic_nr_blocks / 2)) {
+		ret = io_cache_flush_shard(channel, ic);
+		if (ret)
+			return ret;
+		if ((io_cache_busy(ic) + count) > (ic->ic_nr_blocks / 2))
+			return io_cache_write_blocks(channel, ic, blkno, count,
+						     data, false);
+	}
+
+	for (i = 0; i < count; i++, data += channel->io_blksize) {
+		icb = io_cache_lookup(ic, blkno + i);
+		if (!icb) {
+			icb = io_cache_pop(ic);
+			icb->icb_blkno = blkno + i;
+			io_cache_insert(ic, icb);
+		}
+
+		memcpy(icb->icb_buf, data, channel->io_blksize);
+
+		/* If nobody can find it again, it can't wait */
+		if (icb->icb_blkno == UINT64_MAX) {
+			io_cache_unsee(ic, icb);
+			ret = unix_io_write_block(channel, blkno + i, 1,
+						  icb->icb_buf);
+			if (ret)
+				return ret;
+			continue;
+		}
+
+		io_cache_move(ic, icb, IO_CACHE_DIRTY);
+	}
+
+	return 0;
+}
+
+/* One shard's part of io_cache_write_block() */
+static errcode_t io_cache_write_span(io_channel *channel, int64_t blkno,
+				     int count, const char *data,
+				     bool nocache)
+{
+	struct io_cache_set *cs = channel->io_cache;
+	struct io_cache *ic = io_cache_shard(cs, blkno);
+	errcode_t ret;
+
+	io_cache_lock(cs, ic);
+	if (channel->io_writeback && !nocache && (count > 0))
+		ret = io_cache_write_back(channel, ic, blkno, count, data);
+	else
+		ret = io_cache_write_blocks(channel, ic, blkno, count, data,
+					    nocache);
+	io_cache_unlock(cs, ic);
+
+	return ret;
+}
+
+static errcode_t io_cache_write_block(io_channel *channel, int64_t blkno,
+				      int count, const char *data,
+				      bool nocache)
+{
+	struct io_cache_set *cs = channel->io_cache;
+	int todo, rest = 0;
+	errcode_t ret = 0;
+
+	/*
+	 * Unlike io_read_cache_block(), we're going to do all of the
+	 * I/O no matter what.  We keep the separation of
+	 * io_cache_write_block() and io_cache_write_blocks() for
+	 * consistency.
+	 *
+	 * Write-back only deals in whole blocks.  A write given in bytes
+	 * goes straight to disk.
+	 *
+	 * Each shard gets its own piece.  A write in bytes that crosses
+	 * shards is split into its whole blocks and the partial one.
+	 */
+	if (cs->cs_nr_shards == 1)
+		return io_cache_write_span(channel, blkno, count, data,
+					   nocache);
+
+	if (count < 0) {
+		rest = -count % channel->io_blksize;
+		count = -count / channel->io_blksize;
+	}
+
+	while (!ret && count) {
+		todo = io_cache_shard_span(cs, blkno, count);
+		ret = io_cache_write_span(channel, blkno, todo, data,
+					  nocache);
+		blkno += todo;
+		count -= todo;
+		data += (channel->io_blksize * todo);
+	}
+
+	if (!ret && rest)
+		ret = io_cache_write_span(channel, blkno, -rest, data,
+					  nocache);
+
+	return ret;
+}
+
+/* Returns the size of the device in blocks, or 0 if we can't tell. */
+static uint64_t io_get_device_blocks(io_channel *channel)
+{
+	struct stat stat_buf;
+	uint64_t bytes = 0;
+
+	if (fstat(channel->io_fd, &stat_buf))
+		return 0;
+
+	if (S_ISREG(stat_buf.st_mode))
+		bytes = stat_buf.st_size;
+#ifdef BLKGETSIZE64
+	else if (S_ISBLK(stat_buf.st_mode) &&
+		 ioctl(channel->io_fd, BLKGETSIZE64, &bytes))
+		bytes = 0;
+#endif
+
+	return bytes / channel->io_blksize;
+}
+
+/*
+ * Build an empty index for ic->ic_nr_blocks.  dev_blocks is the size of
+ * the device, or 0 if unknown.  This is separate from io_init_cache() so
+ * that the lookup benchmark can build an index without a data buffer.
+ */
+static errcode_t io_cache_init_index(struct io_cache *ic, uint64_t dev_blocks)
+{
+	if (dev_blocks && (ic->ic_nr_blocks >= dev_blocks)) {
+		ic->ic_direct_len = dev_blocks;
+		return ocfs2_malloc0(sizeof(uint32_t) * dev_blocks,
+				     &ic->ic_direct);
+	}
+
+	return io_hash_init(&ic->ic_hash, ic->ic_nr_blocks);
+}
+
+/*
+ * Set up the lists and ghosts for ic->ic_policy.  2Q remembers half a
+ * cache worth of stolen blocks, ARC a whole cache worth.  A cache with a
+ * direct index holds the whole device and never steals anything, so it
+ * doesn't need ghosts at all.
+ */
+static errcode_t io_cache_init_policy(struct io_cache *ic)
+{
+	int i;
+	errcode_t ret;
+
+	for (i = 0; i < IO_CACHE_NR_LISTS; i++)
+		INIT_LIST_HEAD(&ic->ic_lists[i]);
+	for (i = 0; i < IO_GHOST_NR_LISTS; i++)
+		INIT_LIST_HEAD(&ic->ic_ghost_lists[i]);
+	INIT_LIST_HEAD(&ic->ic_ghost_free);
+
+	switch (ic->ic_policy) {
+	case IO_CACHE_POLICY_LRU:
+		return 0;
+
+	case IO_CACHE_POLICY_2Q:
+		ic->ic_recent_max = ic->ic_nr_blocks / 4;
+		ic->ic_nr_ghosts = ic->ic_nr_blocks / 2;
+		break;
+
+	case IO_CACHE_POLICY_ARC:
+		ic->ic_nr_ghosts = ic->ic_nr_blocks;
+		break;
+
+	default:
+		return OCFS2_ET_INVALID_ARGUMENT;
+	}
+
+	if (ic->ic_direct || !ic->ic_nr_ghosts) {
+		ic->ic_nr_ghosts = 0;
+		return 0;
+	}
+
+	ret = ocfs2_malloc0(sizeof(struct io_cache_ghost) * ic->ic_nr_ghosts,
+			    &ic->ic_ghosts);
+	if (!ret)
+		ret = io_hash_init(&ic->ic_ghost_hash, ic->ic_nr_ghosts);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < ic->ic_nr_ghosts; i++)
+		list_add_tail(&ic->ic_ghosts[i].ig_list, &ic->ic_ghost_free);
+
+	return 0;
+}
+
+static void io_free_shard(struct io_cache *ic, int threaded)
+{
+	if (ic->ic_direct)
+		ocfs2_free(&ic->ic_direct);
+	io_hash_free(&ic->ic_hash);
+	if (ic->ic_ghosts)
+		ocfs2_free(&ic->ic_ghosts);
+	io_hash_free(&ic->ic_ghost_hash);
+	if (threaded)
+		pthread_mutex_destroy(&ic->ic_lock);
+}
+
+static void io_free_cache(struct io_cache_set *cs)
+{
+	int i;
+
+	if (cs) {
+		if (cs->cs_shards) {
+			for (i = 0; i < cs->cs_nr_shards; i++)
+				io_free_shard(&cs->cs_shards[i],
+					      cs->cs_threaded);
+			ocfs2_free(&cs->cs_shards);
+		}
+		if (cs->cs_data_buffer) {
+			if (cs->cs_locked)
+				munlock(cs->cs_data_buffer,
+					cs->cs_data_buffer_len);
+			if (cs->cs_data_map)
+				munmap(cs->cs_data_map, cs->cs_data_map_len);
+			else
+				ocfs2_free(&cs->cs_data_buffer);
+		}
+		if (cs->cs_metadata_buffer) {
+			if (cs->cs_locked)
+				munlock(cs->cs_metadata_buffer,
+					cs->cs_metadata_buffer_len);
+			ocfs2_free(&cs->cs_metadata_buffer);
+		}
+		ocfs2_free(&cs);
+	}
+}
+
+void io_destroy_cache(io_channel *channel)
+{
+	if (channel->io_cache) {
+		/*
+		 * Nobody is left to write the dirty blocks after us.  If
+		 * this fails, io_get_error() has the reason; callers that
+		 * care should io_flush() first.
+		 */
+		io_cache_prefetch_drain(channel);
+		if (channel->io_cache->cs_use_count == 1)
+			io_cache_flush(channel);
+		unix_queue_unregister(channel);
+		if (!--channel->io_cache->cs_use_count)
+			io_free_cache(channel->io_cache);
+		channel->io_cache = NULL;
+	}
+}
+
+/*
+ * A cache is kind of pointless if it is swappable, right?  Let's give
+ * applications the ability to pin the cache memory.  This is a separate
+ * call from io_init_cache() because non-privileged users can't do it, and
+ * they still want to create small caches.
+ */
+errcode_t io_mlock_cache(io_channel *channel)
+{
+	int rc;
+	struct io_cache_set *cs = channel->io_cache;
+	long pages_wanted, avpages;
+
+	/* A mapped channel has no cache memory of its own to pin */
+	if (channel->io_map)
+		return 0;
+
+	if (!cs)
+		return OCFS2_ET_INVALID_ARGUMENT;
+
+	if (cs->cs_locked)
+		return 0;
+
+	/*
+	 * We're going to lock our cache pages.  We don't want to
+	 * request more memory than the system has, though.
+	 */
+	pages_wanted = channel->io_blksize * cs->cs_nr_blocks / getpagesize();
+	avpages = sysconf(_SC_AVPHYS_PAGES);
+	if (pages_wanted > avpages)
+		return OCFS2_ET_NO_MEMORY;
+
+	rc = mlock(cs->cs_data_buffer, cs->cs_data_buffer_len);
+	if (!rc) {
+		rc = mlock(cs->cs_metadata_buffer, cs->cs_metadata_buffer_len);
+		if (rc)
+			munlock(cs->cs_data_buffer, cs->cs_data_buffer_len);
+	}
+
+	if (rc)
+		return OCFS2_ET_NO_MEMORY;
+
+	cs->cs_locked = 1;
+	return 0;
+}
+
+#define IO_HUGE_2MB	(2UL * 1024 * 1024)
+#define IO_HUGE_1GB	(1024UL * 1024 * 1024)
+
+/* Map len bytes, aligned to align.  Returns the aligned start. */
+static char *io_cache_map(struct io_cache_set *cs, size_t len, size_t align,
+			  int flags)
+{
+	char *map;
+	size_t map_len = len;
+
+	/* hugetlb mappings come aligned; THP needs us to line them up */
+	if (!(flags & MAP_HUGETLB))
+		map_len += align;
+	else
+		map_len = (len + align - 1) & ~(align - 1);
+
+	map = mmap(NULL, map_len, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	cs->cs_data_map = map;
+	cs->cs_data_map_len = map_len;
+
+	return (char *)(((unsigned long)map + align - 1) & ~(align - 1));
+}
+
+/*
+ * Prefer the node we're running on for len bytes at buf.  This has to
+ * happen before the pages are touched.  MPOL_PREFERRED falls back to
+ * other nodes when ours is full, so it can't fail an allocation.
+ * Returns the node, or -1 if the buffer is left alone.
+ */
+static int io_cache_bind_local(char *buf, size_t len)
+{
+#ifdef __linux__
+	unsigned int cpu, node;
+	unsigned long mask;
+
+	if (syscall(SYS_getcpu, &cpu, &node, NULL))
+		return -1;
+	if (node >= (sizeof(mask) * 8 - 1))
+		return -1;
+
+	mask = 1UL << node;
+	if (syscall(SYS_mbind, buf, len, MPOL_PREFERRED, &mask,
+		    sizeof(mask) * 8, 0))
+		return -1;
+
+	return node;
+#else
+	return -1;
+#endif
+}
+
+/*
+ * Large caches spend a lot of time missing the TLB, so we back the data
+ * buffer with the biggest pages we can get.  hugetlbfs pages have to be
+ * reserved by the admin, and without them we ask for transparent huge
+ * pages.  Buffers smaller than a huge page, and systems with none of
+ * this, get ordinary memory.  Every mapping is page aligned, which is
+ * all O_DIRECT needs.
+ */
+static errcode_t io_cache_alloc_data(io_channel *channel,
+				     struct io_cache_set *cs)
+{
+	static const struct {
+		enum io_cache_pages pages;
+		size_t size;
+		int flags;
+	} huge[] = {
+		{ IO_CACHE_PAGES_1G, IO_HUGE_1GB,
+		  MAP_HUGETLB | (30 << MAP_HUGE_SHIFT) },
+		{ IO_CACHE_PAGES_2M, IO_HUGE_2MB,
+		  MAP_HUGETLB | (21 << MAP_HUGE_SHIFT) },
+		{ IO_CACHE_PAGES_THP, IO_HUGE_2MB, 0 },
+	};
+	size_t len = cs->cs_data_buffer_len;
+	char *buf = NULL;
+	int i;
+	errcode_t ret;
+
+	cs->cs_data_node = -1;
+
+	for (i = 0; !buf && (i < ARRAY_SIZE(huge)); i++) {
+		if (len < huge[i].size)
+			continue;
+
+		buf = io_cache_map(cs, len, huge[i].size, huge[i].flags);
+		if (buf && !huge[i].flags &&
+		    madvise(buf, len, MADV_HUGEPAGE)) {
+			munmap(cs->cs_data_map, cs->cs_data_map_len);
+			cs->cs_data_map = NULL;
+			buf = NULL;
+		}
+		if (buf)
+			cs->cs_data_pages = huge[i].pages;
+	}
+
+	if (!buf) {
+		cs->cs_data_pages = IO_CACHE_PAGES_NORMAL;
+		ret = ocfs2_malloc_blocks(channel, cs->cs_nr_blocks, &buf);
+		if (ret)
+			return ret;
+	}
+
+	if (channel->io_cache_local_node)
+		cs->cs_data_node = io_cache_bind_local(buf, len);
+
+	cs->cs_data_buffer = buf;
+	return 0;
+}
+
+/*
+ * A threaded channel gets a power of two shards, enough for every online
+ * CPU, as long as each still holds IO_CACHE_SHARD_MIN blocks.
+ */
+static int io_cache_nr_shards(int threaded, size_t nr_blocks)
+{
+	long cpus;
+	int nr = 1;
+
+	if (!threaded)
+		return 1;
+
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((nr < cpus) && (nr < IO_CACHE_MAX_SHARDS) &&
+	       ((nr_blocks / (nr * 2)) >= IO_CACHE_SHARD_MIN))
+		nr *= 2;
+
+	return nr;
+}
+
+/*
+ * Set up the index and policy for a shard of nr_blocks.  Its icbs are
+ * laid out afterwards with io_cache_place().  A lone shard indexes the
+ * whole device directly if it can hold it.  Shards of a threaded set
+ * always hash; a direct map per shard would cost a device's worth of
+ * index each.
+ */
+static errcode_t io_init_shard(io_channel *channel, struct io_cache *ic,
+			       enum io_cache_policy policy, int threaded,
+			       int nr_shards, size_t nr_blocks)
+{
+	errcode_t ret;
+
+	ic->ic_nr_blocks = nr_blocks;
+	ic->ic_policy = policy;
+	if (threaded)
+		pthread_mutex_init(&ic->ic_lock, NULL);
+
+	ret = io_cache_init_index(ic, (nr_shards == 1) ?
+					io_get_device_blocks(channel) : 0);
+	if (ret)
+		return ret;
+
+	return io_cache_init_policy(ic);
+}
+
+/*
+ * Put icb on the given list, holding blkno in buf.  An empty icb goes at
+ * the oldest end of IO_CACHE_COLD so that it's the first one stolen.
+ */
+static void io_cache_place(struct io_cache *ic, struct io_cache_block *icb,
+			   uint64_t blkno, char *buf,
+			   enum io_cache_list which)
+{
+	icb->icb_blkno = blkno;
+	icb->icb_buf = buf;
+	icb->icb_which = which;
+	ic->ic_list_len[which]++;
+	if (blkno == UINT64_MAX) {
+		list_add(&icb->icb_list, &ic->ic_lists[which]);
+		return;
+	}
+
+	list_add_tail(&icb->icb_list, &ic->ic_lists[which]);
+	io_cache_insert(ic, icb);
+}
+
+/* The number of blocks in shard i.  Any leftovers go to the last one. */
+static size_t io_cache_shard_blocks(size_t nr_blocks, int nr_shards, int i)
+{
+	size_t per_shard = nr_blocks / nr_shards;
+
+	if (i == (nr_shards - 1))
+		return nr_blocks - (per_shard * i);
+	return per_shard;
+}
+
+errcode_t io_init_cache_policy(io_channel *channel, size_t nr_blocks,
+			       enum io_cache_policy policy)
+{
+	int i, j;
+	struct io_cache_set *cs;
+	struct io_cache *ic;
+	size_t first, per_shard;
+	char *dbuf;
+	errcode_t ret;
+
+	/* The page cache already caches a mapped channel */
+	if (channel->io_map)
+		return 0;
+
+	/* The index stores icb positions in 32 bits */
+	if (nr_blocks >= UINT32_MAX)
+		return OCFS2_ET_NO_MEMORY;
+
+	ret = ocfs2_malloc0(sizeof(struct io_cache_set), &cs);
+	if (ret)
+		goto out;
+
+	cs->cs_nr_blocks = nr_blocks;
+	cs->cs_policy = policy;
+	cs->cs_threaded = channel->io_threaded;
+	cs->cs_nr_shards = io_cache_nr_shards(cs->cs_threaded, nr_blocks);
+
+	cs->cs_data_buffer_len = (unsigned long)nr_blocks * channel->io_blksize;
+	ret = io_cache_alloc_data(channel, cs);
+	if (ret)
+		goto out;
+
+	ret = ocfs2_malloc0(sizeof(struct io_cache_block) * nr_blocks,
+			    &cs->cs_metadata_buffer);
+	if (ret)
+		goto out;
+	cs->cs_metadata_buffer_len =
+		(unsigned long)nr_blocks * sizeof(struct io_cache_block);
+
+	ret = ocfs2_malloc0(sizeof(struct io_cache) * cs->cs_nr_shards,
+			    &cs->cs_shards);
+	if (ret)
+		goto out;
+
+	dbuf = cs->cs_data_buffer;
+	for (i = 0, first = 0; i < cs->cs_nr_shards; i++) {
+		ic = &cs->cs_shards[i];
+		per_shard = io_cache_shard_blocks(nr_blocks, cs->cs_nr_shards,
+						  i);
+		ret = io_init_shard(channel, ic, policy, cs->cs_threaded,
+				    cs->cs_nr_shards, per_shard);
+		if (ret) {
+			/* Don't free shards we never set up */
+			cs->cs_nr_shards = i + 1;
+			goto out;
+		}
+
+		/* Backwards, so that the first icb is the first stolen */
+		ic->ic_metadata_buffer = cs->cs_metadata_buffer + first;
+		for (j = per_shard - 1; j >= 0; j--)
+			io_cache_place(ic, &ic->ic_metadata_buffer[j],
+				       UINT64_MAX,
+				       dbuf + ((size_t)j *
+					       channel->io_blksize),
+				       IO_CACHE_COLD);
+		dbuf += per_shard * channel->io_blksize;
+		first += per_shard;
+	}
+
+	cs->cs_use_count = 1;
+	channel->io_cache = cs;
+	unix_queue_register(channel, cs->cs_data_buffer,
+			    cs->cs_data_buffer_len);
+
+out:
+	if (ret)
+		io_free_cache(cs);
+
+	return ret;
+}
+
+errcode_t io_init_cache(io_channel *channel, size_t nr_blocks)
+{
+	return io_init_cache_policy(channel, nr_blocks, IO_CACHE_POLICY_LRU);
+}
+
+const char *io_cache_policy_name(enum io_cache_policy policy)
+{
+	static const char *names[IO_CACHE_NR_POLICIES] = {
+		[IO_CACHE_POLICY_LRU]	= "lru",
+		[IO_CACHE_POLICY_2Q]	= "2q",
+		[IO_CACHE_POLICY_ARC]	= "arc",
+	};
+
+	if ((policy < 0) || (policy >= IO_CACHE_NR_POLICIES))
+		return NULL;
+	return names[policy];
+}
+
+errcode_t io_init_cache_size(io_channel *channel, size_t bytes)
+{
+	size_t blocks;
+
+	blocks = (bytes + (channel->io_blksize - 1)) / channel->io_blksize;
+
+	return io_init_cache(channel, blocks);
+}
+
+/* A mapped channel has the whole file in reach */
+size_t io_get_cache_size(io_channel *channel)
+{
+	if (channel->io_map)
+		return channel->io_map_len;
+	if (channel->io_cache)
+		return channel->io_cache->cs_data_buffer_len;
+	return 0;
+}
+
+errcode_t io_share_cache(io_channel *from, io_channel *to)
+{
+	/* Mapped channels share through the page cache */
+	if (from->io_map && !to->io_cache)
+		return 0;
+	if (!from->io_cache)
+		return OCFS2_ET_INTERNAL_FAILURE;
+	if (to->io_cache)
+		return OCFS2_ET_INTERNAL_FAILURE;
+	io_cache_prefetch_drain(from);
+	to->io_cache = from->io_cache;
+	from->io_cache->cs_use_count++;
+	unix_queue_register(to, to->io_cache->cs_data_buffer,
+			    to->io_cache->cs_data_buffer_len);
+	return 0;
+}
+
+static errcode_t io_validate_o_direct(io_channel *channel)
+{
+	errcode_t ret = OCFS2_ET_UNEXPECTED_BLOCK_SIZE;
+	int block_size;
+	char *blk;
+
+	for (block_size = io_get_blksize(channel);
+	     block_size <= OCFS2_MAX_BLOCKSIZE;
+	     block_size <<= 1) {
+		io_set_blksize(channel, block_size);
+		ret = ocfs2_malloc_block(channel, &blk);
+		if (ret)
+			break;
+
+		ret = unix_io_read_block(channel, 0, 1, blk);
+		ocfs2_free(&blk);
+		if (!ret)
+			break;
+	}
+
+	return ret;
+}
+
+int io_is_device_readonly(io_channel *channel)
+{
+	errcode_t ret;
+	int dev_ro;
+
+	ret = ioctl(channel->io_fd, BLKROGET, &dev_ro);
+	if (ret >= 0 && dev_ro)
+		return 1;
+	return 0;
+}
+
+/*
+ * A regular file opened read-only, like an o2image dump or a test
+ * volume, is mapped whole.  Reads copy from the mapping instead of
+ * going through pread64(), the io_cache, and the queue; the page cache
+ * does the caching, and io_map_block() can skip the copy entirely.  A
+ * file truncated while mapped raises SIGBUS on reads past the new end,
+ * so this is only for files that hold still.  If the mapping fails, the
+ * channel works as it always has.  A slow: channel is never mapped; it
+ * has to see every request.
+ */
+static void io_map_file(io_channel *channel, int flags)
+{
+	struct stat64 st;
+	void *map;
+
+	if ((flags & OCFS2_FLAG_RW) || channel->io_slow)
+		return;
+
+	if (fstat64(channel->io_fd, &st) || !S_ISREG(st.st_mode) ||
+	    !st.st_size || ((uint64_t)st.st_size > SIZE_MAX))
+		return;
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, channel->io_fd, 0);
+	if (map == MAP_FAILED)
+		return;
+
+	channel->io_map = map;
+	channel->io_map_len = st.st_size;
+}
+
+/*
+ * OCFS2_IO_TRACE traces any tool without changing it.  A tool may open
+ * more than one channel, so each after the first gets its own file.  A
+ * trace that can't be started is ignored.
+ */
+static void io_trace_from_env(io_channel *channel)
+{
+	static int nr_traces;
+	const char *env = getenv("OCFS2_IO_TRACE");
+	char *name;
+	int nr;
+
+	if (!env || !*env)
+		return;
+
+	nr = __sync_fetch_and_add(&nr_traces, 1);
+	if (!nr) {
+		io_start_trace(channel, env);
+		return;
+	}
+
+	if (ocfs2_malloc(strlen(env) + 16, &name))
+		return;
+	sprintf(name, "%s.%d", env, nr);
+	io_start_trace(channel, name);
+	ocfs2_free(&name);
+}
+
+/* A latency: "500us", "2ms", "1.5s".  A bare number is usecs. */
+static int io_slow_parse_lat(const char *val, uint64_t *lat)
+{
+	char *end;
+	double num = strtod(val, &end);
+
+	if ((end == val) || (num < 0))
+		return -1;
+
+	if (!strcmp(end, "ms"))
+		num *= 1000;
+	else if (!strcmp(end, "s"))
+		num *= 1000000;
+	else if (*end && strcmp(end, "us"))
+		return -1;
+
+	*lat = num;
+	return 0;
+}
+
+/* A bandwidth in bytes a second: "200M", "1.5G", "512K" */
+static int io_slow_parse_bw(const char *val, uint64_t *bw)
+{
+	char *end;
+	double num = strtod(val, &end);
+
+	if ((end == val) || (num < 0))
+		return -1;
+
+	switch (*end) {
+	case 'G':
+	case 'g':
+		num *= 1024;
+		/* Fall through */
+	case 'M':
+	case 'm':
+		num *= 1024;
+		/* Fall through */
+	case 'K':
+	case 'k':
+		num *= 1024;
+		end++;
+		break;
+	}
+	if (*end)
+		return -1;
+
+	*bw = num;
+	return 0;
+}
+
+static void io_slow_free(struct io_slow *sl)
+{
+	pthread_mutex_destroy(&sl->sl_lock);
+	if (sl->sl_idle)
+		ocfs2_free(&sl->sl_idle);
+	ocfs2_free(&sl);
+}
+
+/*
+ * Split a "slow:" name into the path it wraps and the device model.
+ * Returns OCFS2_ET_BAD_DEVICE_NAME for options we don't know.
+ */
+static errcode_t io_slow_init(io_channel *channel, const char *spec,
+			      char **path)
+{
+	struct io_slow *sl;
+	char *opts, *opt, *val, *next;
+	long qd = IO_SLOW_DEFAULT_QD;
+	errcode_t ret;
+
+	ret = ocfs2_malloc0(sizeof(struct io_slow), &sl);
+	if (ret)
+		return ret;
+	pthread_mutex_init(&sl->sl_lock, NULL);
+
+	ret = ocfs2_malloc(strlen(spec) + 1, path);
+	if (ret)
+		goto out;
+	strcpy(*path, spec);
+
+	opts = strchr(*path, '?');
+	if (opts)
+		*opts++ = '\0';
+
+	ret = OCFS2_ET_BAD_DEVICE_NAME;
+	for (opt = opts; opt && *opt; opt = next) {
+		next = strchr(opt, '&');
+		if (next)
+			*next++ = '\0';
+
+		val = strchr(opt, '=');
+		if (!val)
+			goto out;
+		*val++ = '\0';
+
+		if (!strcmp(opt, "lat")) {
+			if (io_slow_parse_lat(val, &sl->sl_lat))
+				goto out;
+		} else if (!strcmp(opt, "bw")) {
+			if (io_slow_parse_bw(val, &sl->sl_bw))
+				goto out;
+		} else if (!strcmp(opt, "qd")) {
+			qd = strtol(val, &val, 10);
+			if (*val || (qd < 1) || (qd > IO_MAX_QUEUE_DEPTH))
+				goto out;
+		} else
+			goto out;
+	}
+
+	if (!**path)
+		goto out;
+
+	sl->sl_qd = qd;
+	ret = ocfs2_malloc0(sizeof(uint64_t) * qd, &sl->sl_idle);
+	if (ret)
+		goto out;
+
+	channel->io_slow = sl;
+	return 0;
+
+out:
+	if (*path)
+		ocfs2_free(path);
+	io_slow_free(sl);
+	return ret;
+}
+
+errcode_t io_open(const char *name, int flags, io_channel **channel)
+{
+	errcode_t ret;
+	io_channel *chan = NULL;
+	char *path = NULL;
+#ifdef __linux__
+	struct stat stat_buf;
+	struct utsname ut;
+#endif
+
+	if (!name || !*name)
+		return OCFS2_ET_BAD_DEVICE_NAME;
+
+	ret = ocfs2_malloc0(sizeof(struct _io_channel), &chan);
+	if (ret)
+		return ret;
+
+	ret = ocfs2_malloc(strlen(name)+1, &chan->io_name);
+	if (ret)
+		goto out_chan;
+	strcpy(chan->io_name, name);
+	chan->io_blksize = OCFS2_MIN_BLOCKSIZE;
+	chan->io_flags = (flags & OCFS2_FLAG_RW) ? O_RDWR : O_RDONLY;
+	chan->io_nocache = false;
+	if (!(flags & OCFS2_FLAG_BUFFERED))
+		chan->io_flags |= O_DIRECT;
+	chan->io_counters.ioc_error = 0;
+
+	if (!strncmp(name, "slow:", 5)) {
+		ret = io_slow_init(chan, name + 5, &path);
+		if (ret)
+			goto out_name;
+		name = path;
+	}
+
+	chan->io_fd = open64(name, chan->io_flags);
+	if (path)
+		ocfs2_free(&path);
+	if (chan->io_fd < 0) {
+		/* chan will be freed, don't bother with the error */
+		if (errno == ENOENT)
+			ret = OCFS2_ET_NAMED_DEVICE_NOT_FOUND;
+		else
+			ret = OCFS2_ET_IO;
+		goto out_name;
+	}
+
+	if (!(flags & OCFS2_FLAG_BUFFERED)) {
+		ret = io_validate_o_direct(chan);
+		if (ret)
+			goto out_close;  /* FIXME: bindraw here */
+	}
+
+	/* Workaround from e2fsprogs */
+#ifdef __linux__
+#undef RLIM_INFINITY
+#if (defined(__alpha__) || ((defined(__sparc__) || defined(__mips__)) && (SIZEOF_LONG == 4)))
+#define RLIM_INFINITY	((unsigned long)(~0UL>>1))
+#else
+#define RLIM_INFINITY  (~0UL)
+#endif
+	/*
+	 * Work around a bug in 2.4.10-2.4.18 kernels where writes to
+	 * block devices are wrongly getting hit by the filesize
+	 * limit.  This workaround isn't perfect, since it won't work
+	 * if glibc wasn't built against 2.2 header files.  (Sigh.)
+	 * 
+	 */
+	if ((flags & OCFS2_FLAG_RW) &&
+	    (uname(&ut) == 0) &&
+	    ((ut.release[0] == '2') && (ut.release[1] == '.') &&
+	     (ut.release[2] == '4') && (ut.release[3] == '.') &&
+	     (ut.release[4] == '1') && (ut.release[5] >= '0') &&
+	     (ut.release[5] < '8')) &&
+	    (fstat(chan->io_fd, &stat_buf) == 0) &&
+	    (S_ISBLK(stat_buf.st_mode))) {
+		struct rlimit	rlim;
+		
+		rlim.rlim_cur = rlim.rlim_max = (unsigned long) RLIM_INFINITY;
+		setrlimit(RLIMIT_FSIZE, &rlim);
+		getrlimit(RLIMIT_FSIZE, &rlim);
+		if (((unsigned long) rlim.rlim_cur) <
+		    ((unsigned long) rlim.rlim_max)) {
+			rlim.rlim_cur = rlim.rlim_max;
+			setrlimit(RLIMIT_FSIZE, &rlim);
+		}
+	}
+#endif
+
+	io_map_file(chan, flags);
+	if (!chan->io_map)
+		unix_queue_init(chan, IO_DEFAULT_QUEUE_DEPTH);
+
+	io_trace_from_env(chan);
+
+	*channel = chan;
+	return 0;
+
+out_close:
+	/* Ignore the return, leave the original error */
+	close(chan->io_fd);
+
+out_name:
+	if (chan->io_slow)
+		io_slow_free(chan->io_slow);
+	ocfs2_free(&chan->io_name);
+
+out_chan:
+	ocfs2_free(&chan);
+
+	*channel = NULL;
+	return ret;
+}
+
+errcode_t io_close(io_channel *channel)
+{
+	errcode_t ret, tret;
+
+	ret = io_flush(channel);
+	io_destroy_cache(channel);
+	unix_queue_exit(channel);
+	io_set_threaded(channel, false);
+	tret = io_stop_trace(channel);
+	if (!ret)
+		ret = tret;
+
+	if (channel->io_map)
+		munmap(channel->io_map, channel->io_map_len);
+	if (channel->io_slow)
+		io_slow_free(channel->io_slow);
+
+	if ((close(channel->io_fd) < 0) && !ret)
+		ret = errno;
+
+	ocfs2_free(&channel->io_name);
+	ocfs2_free(&channel);
+
+	return ret;
+}
+
+int io_get_error(io_channel *channel)
+{
+	return io_counters(channel)->ioc_error;
+}
+
+errcode_t io_set_blksize(io_channel *channel, int blksize)
+{
+	if (blksize % OCFS2_MIN_BLOCKSIZE)
+		return OCFS2_ET_INVALID_ARGUMENT;
+
+	if (!blksize)
+		blksize = OCFS2_MIN_BLOCKSIZE;
+
+	if (channel->io_blksize != blksize) {
+		channel->io_blksize = blksize;
+		if (channel->io_trace) {
+			struct io_trace_mark tm;
+
+			io_trace_begin(channel, &tm);
+			io_trace_add(channel, &tm, OCFS2_IO_TRACE_BLKSIZE, 0,
+				     blksize, 0, 0);
+		}
+	}
+
+	return 0;
+}
+
+int io_get_blksize(io_channel *channel)
+{
+	return channel->io_blksize;
+}
+
+int io_get_fd(io_channel *channel)
+{
+	return channel->io_fd;
+}
+
+/*
+ * Changing the depth tears down the queue and builds a new one.  If the
+ * new queue can't be set up, vectored reads fall back to synchronous
+ * I/O; that's not an error.
+ */
+errcode_t io_set_queue_depth(io_channel *channel, int depth)
+{
+	if ((depth < 1) || (depth > IO_MAX_QUEUE_DEPTH))
+		return OCFS2_ET_INVALID_ARGUMENT;
+
+	/* Nothing to queue; reads are copies */
+	if (channel->io_map)
+		return 0;
+
+	if (channel->io_queue && (channel->io_queue->q_depth == depth))
+		return 0;
+
+	io_cache_prefetch_drain(channel);
+	unix_queue_exit(channel);
+	unix_queue_init(channel, depth);
+	if (channel->io_cache)
+		unix_queue_register(channel, channel->io_cache->cs_data_buffer,
+				    channel->io_cache->cs_data_buffer_len);
+
+	return 0;
+}
+
+int io_get_queue_depth(io_channel *channel)
+{
+	if (channel->io_queue)
+		return channel->io_queue->q_depth;
+	return 0;
+}
+
+/* Add from's numbers to to's.  The error is left alone. */
+static void io_add_counters(struct io_counters *to, struct io_counters *from)
+{
+	int i, j;
+
+	to->ioc_bytes_read += from->ioc_bytes_read;
+	to->ioc_bytes_written += from->ioc_bytes_written;
+	to->ioc_queue_reaps += from->ioc_queue_reaps;
+	to->ioc_queue_inflight += from->ioc_queue_inflight;
+	to->ioc_prefetch_blocks += from->ioc_prefetch_blocks;
+	to->ioc_prefetch_waits += from->ioc_prefetch_waits;
+	for (i = 0; i < OCFS2_IO_NR_KINDS; i++) {
+		for (j = 0; j < OCFS2_IO_HIST_BUCKETS; j++) {
+			to->ioc_lat_hist[i][j] += from->ioc_lat_hist[i][j];
+			to->ioc_size_hist[i][j] += from->ioc_size_hist[i][j];
+		}
+	}
+}
+
+/*
+ * Ask for the next io_init_cache*() to put its buffer on the node of the
+ * calling thread.  It's a preference; other nodes are used if ours runs
+ * out.
+ */
+void io_set_cache_local_node(io_channel *channel, bool local)
+{
+	channel->io_cache_local_node = local;
+}
+
+const char *io_cache_pages_name(enum io_cache_pages pages)
+{
+	static const char *names[IO_CACHE_NR_PAGES] = {
+		[IO_CACHE_PAGES_NORMAL]	= "normal",
+		[IO_CACHE_PAGES_THP]	= "transparent huge",
+		[IO_CACHE_PAGES_2M]	= "2MB huge",
+		[IO_CACHE_PAGES_1G]	= "1GB huge",
+	};
+
+	if ((pages < 0) || (pages >= IO_CACHE_NR_PAGES))
+		return NULL;
+	return names[pages];
+}
+
+/*
+ * A threaded channel's numbers are read while other threads may still
+ * be adding to them.  Each one is right, but they may not quite agree
+ * with each other.
+ */
+void io_get_stats(io_channel *channel, struct ocfs2_io_stats *stats)
+{
+	struct io_cache_set *cs = channel->io_cache;
+	struct io_counters sum, *ioc;
+	struct io_cache *ic;
+	int i;
+
+	memset(&sum, 0, sizeof(struct io_counters));
+	io_add_counters(&sum, &channel->io_counters);
+	if (channel->io_threaded) {
+		pthread_mutex_lock(&channel->io_counters_lock);
+		for (ioc = channel->io_thread_counters; ioc;
+		     ioc = ioc->ioc_next)
+			io_add_counters(&sum, ioc);
+		pthread_mutex_unlock(&channel->io_counters_lock);
+	}
+
+	memset(stats, 0, sizeof(struct ocfs2_io_stats));
+	stats->is_bytes_read = sum.ioc_bytes_read;
+	stats->is_bytes_written = sum.ioc_bytes_written;
+	stats->is_queue_depth = io_get_queue_depth(channel);
+	stats->is_queue_reaps = sum.ioc_queue_reaps;
+	stats->is_queue_inflight = sum.ioc_queue_inflight;
+	stats->is_prefetch_blocks = sum.ioc_prefetch_blocks;
+	stats->is_prefetch_waits = sum.ioc_prefetch_waits;
+	memcpy(stats->is_lat_hist, sum.ioc_lat_hist,
+	       sizeof(stats->is_lat_hist));
+	memcpy(stats->is_size_hist, sum.ioc_size_hist,
+	       sizeof(stats->is_size_hist));
+
+	stats->is_cache_node = -1;
+	if (!cs)
+		return;
+
+	stats->is_cache_policy = cs->cs_policy;
+	stats->is_cache_pages = cs->cs_data_pages;
+	stats->is_cache_node = cs->cs_data_node;
+	for (i = 0; i < cs->cs_nr_shards; i++) {
+		ic = &cs->cs_shards[i];
+		io_cache_lock(cs, ic);
+		stats->is_cache_hits += ic->ic_hits;
+		stats->is_cache_misses += ic->ic_misses;
+		stats->is_cache_inserts += ic->ic_inserts;
+		stats->is_cache_removes += ic->ic_removes;
+		stats->is_cache_recent_hits += ic->ic_recent_hits;
+		stats->is_cache_frequent_hits += ic->ic_frequent_hits;
+		stats->is_cache_ghost_hits += ic->ic_ghost_hits;
+		io_cache_unlock(cs, ic);
+	}
+}
+
+const char *io_kind_name(enum ocfs2_io_kind kind)
+{
+	static const char *names[OCFS2_IO_NR_KINDS] = {
+		[OCFS2_IO_READ]		= "read",
+		[OCFS2_IO_VEC_READ]	= "vec read",
+		[OCFS2_IO_WRITE]	= "write",
+		[OCFS2_IO_VEC_WRITE]	= "vec write",
+	};
+
+	if ((kind < 0) || (kind >= OCFS2_IO_NR_KINDS))
+		return NULL;
+	return names[kind];
+}
+
+/*
+ * If a channel is set to 'nocache', it will use the _nocache() functions
+ * even if called via the regular functions.  This allows control of
+ * naive code that we don't want to have to carry nocache parameters
+ * around.  Smarter code can ignore this function and use the _nocache()
+ * functions directly.
+ */
+void io_set_nocache(io_channel *channel, bool nocache)
+{
+	channel->io_nocache = nocache;
+}
 
-			/*
-			 * Steal the LRU buffer.  We can't error here, so
-			 * we can safely insert it before we copy the data.
-			 */
-			icb = io_cache_pop_lru(ic);
-			icb->icb_blkno = blkno + i;
-			io_cache_insert(ic, icb);
-		}
+/*
+ * In write-back mode, writes only go to the I/O cache.  Turning it off
+ * flushes the dirty blocks.  Without a cache, writes go straight to disk
+ * regardless.
+ */
+errcode_t io_set_writeback(io_channel *channel, bool writeback)
+{
+	errcode_t ret = 0;
 
-		memcpy(icb->icb_buf, data, channel->io_blksize);
-		if (nocache)
-			io_cache_unsee(ic, icb);
-		else
-			io_cache_seen(ic, icb);
-	}
+	if (!writeback)
+		ret = io_flush(channel);
+	if (!ret)
+		channel->io_writeback = writeback;
 
 	return ret;
 }
 
-static errcode_t io_cache_write_block(io_channel *channel, int64_t blkno,
-				      int count, const char *data,
-				      bool nocache)
+/*
+ * io_set_threaded() keeps the cache's clean blocks.  The data and icb
+ * buffers stay where they are; only the shards are rebuilt, and each
+ * block's icb is handed to the shard that owns it now.  Everything that
+ * can fail is allocated in io_reshard_prepare(), before the old shards
+ * are touched.
+ */
+struct io_reshard_block {
+	uint64_t rb_blkno;		/* UINT64_MAX if the buffer is free */
+	char *rb_buf;
+	enum io_cache_list rb_which;
+};
+
+struct io_reshard {
+	struct io_cache *rs_shards;
+	int rs_nr_shards;
+	int rs_threaded;
+	struct io_reshard_block *rs_blocks;
+};
+
+static void io_reshard_free(struct io_reshard *rs, int nr_init)
 {
-	/*
-	 * Unlike io_read_cache_block(), we're going to do all of the
-	 * I/O no matter what.  We keep the separation of
-	 * io_cache_write_block() and io_cache_write_blocks() for
-	 * consistency.
-	 */
-	return io_cache_write_blocks(channel, blkno, count, data,
-				     nocache);
+	int i;
+
+	for (i = 0; i < nr_init; i++)
+		io_free_shard(&rs->rs_shards[i], rs->rs_threaded);
+	if (rs->rs_shards)
+		ocfs2_free(&rs->rs_shards);
+	if (rs->rs_blocks)
+		ocfs2_free(&rs->rs_blocks);
 }
 
-static void io_free_cache(struct io_cache *ic)
+static errcode_t io_reshard_prepare(io_channel *channel, int threaded,
+				    struct io_reshard *rs)
 {
-	if (ic) {
-		if (ic->ic_data_buffer) {
-			if (ic->ic_locked)
-				munlock(ic->ic_data_buffer,
-					ic->ic_data_buffer_len);
-			ocfs2_free(&ic->ic_data_buffer);
-		}
-		if (ic->ic_metadata_buffer) {
-			if (ic->ic_locked)
-				munlock(ic->ic_metadata_buffer,
-					ic->ic_metadata_buffer_len);
-			ocfs2_free(&ic->ic_metadata_buffer);
-		}
-		ocfs2_free(&ic);
+	struct io_cache_set *cs = channel->io_cache;
+	int i;
+	errcode_t ret;
+
+	/* Only clean, idle blocks can be moved */
+	for (i = 0; i < cs->cs_nr_shards; i++) {
+		if (io_cache_busy(&cs->cs_shards[i]))
+			return OCFS2_ET_IO;
 	}
-}
 
-void io_destroy_cache(io_channel *channel)
-{
-	if (channel->io_cache) {
-		if (!--channel->io_cache->ic_use_count)
-			io_free_cache(channel->io_cache);
-		channel->io_cache = NULL;
+	memset(rs, 0, sizeof(struct io_reshard));
+	rs->rs_threaded = threaded;
+	rs->rs_nr_shards = io_cache_nr_shards(threaded, cs->cs_nr_blocks);
+
+	ret = ocfs2_malloc0(sizeof(struct io_cache) * rs->rs_nr_shards,
+			    &rs->rs_shards);
+	if (!ret)
+		ret = ocfs2_malloc(sizeof(struct io_reshard_block) *
+				   cs->cs_nr_blocks, &rs->rs_blocks);
+	if (ret) {
+		io_reshard_free(rs, 0);
+		return ret;
+	}
+
+	for (i = 0; i < rs->rs_nr_shards; i++) {
+		ret = io_init_shard(channel, &rs->rs_shards[i],
+				    cs->cs_policy, threaded, rs->rs_nr_shards,
+				    io_cache_shard_blocks(cs->cs_nr_blocks,
+							  rs->rs_nr_shards,
+							  i));
+		if (ret) {
+			io_reshard_free(rs, i + 1);
+			return ret;
+		}
 	}
+
+	return 0;
 }
 
 /*
- * A cache is kind of pointless if it is swappable, right?  Let's give
- * applications the ability to pin the cache memory.  This is a separate
- * call from io_init_cache() because non-privileged users can't do it, and
- * they still want to create small caches.
+ * Swap in the shards from io_reshard_prepare().  This can't fail.  The
+ * blocks are collected coldest first, so if a shard gets more than it
+ * can hold, the ones it drops are the ones it would have stolen next.
+ * Each block keeps its list; ghosts and ARC's target start over.
  */
-errcode_t io_mlock_cache(io_channel *channel)
+static void io_reshard(io_channel *channel, struct io_reshard *rs)
 {
-	int rc;
-	struct io_cache *ic = channel->io_cache;
-	long pages_wanted, avpages;
-
-	if (!ic)
-		return OCFS2_ET_INVALID_ARGUMENT;
+	static const enum io_cache_list lists[] = {
+		IO_CACHE_COLD, IO_CACHE_RECENT, IO_CACHE_FREQUENT,
+	};
+	struct io_cache_set *cs = channel->io_cache;
+	struct io_reshard_block *rb;
+	struct io_cache_block *icb;
+	struct io_cache *ic, stats;
+	struct list_head *pos;
+	size_t nr_valid = 0, nr_free = 0, first = 0, i;
+	size_t used[IO_CACHE_MAX_SHARDS], skip[IO_CACHE_MAX_SHARDS];
+	int s, l;
+
+	memset(&stats, 0, sizeof(struct io_cache));
+	for (s = 0; s < cs->cs_nr_shards; s++) {
+		ic = &cs->cs_shards[s];
+		for (l = 0; l < ARRAY_SIZE(lists); l++) {
+			list_for_each(pos, &ic->ic_lists[lists[l]]) {
+				icb = list_entry(pos, struct io_cache_block,
+						 icb_list);
+				if (icb->icb_blkno == UINT64_MAX)
+					rb = &rs->rs_blocks[cs->cs_nr_blocks -
+							    ++nr_free];
+				else
+					rb = &rs->rs_blocks[nr_valid++];
+				rb->rb_blkno = icb->icb_blkno;
+				rb->rb_buf = icb->icb_buf;
+				rb->rb_which = lists[l];
+			}
+		}
 
-	if (ic->ic_locked)
-		return 0;
+		stats.ic_hits += ic->ic_hits;
+		stats.ic_misses += ic->ic_misses;
+		stats.ic_inserts += ic->ic_inserts;
+		stats.ic_removes += ic->ic_removes;
+		stats.ic_recent_hits += ic->ic_recent_hits;
+		stats.ic_frequent_hits += ic->ic_frequent_hits;
+		stats.ic_ghost_hits += ic->ic_ghost_hits;
+		io_free_shard(ic, cs->cs_threaded);
+	}
+	assert((nr_valid + nr_free) == cs->cs_nr_blocks);
+	ocfs2_free(&cs->cs_shards);
+
+	cs->cs_shards = rs->rs_shards;
+	cs->cs_nr_shards = rs->rs_nr_shards;
+	cs->cs_threaded = rs->rs_threaded;
+
+	for (s = 0; s < cs->cs_nr_shards; s++) {
+		ic = &cs->cs_shards[s];
+		ic->ic_metadata_buffer = cs->cs_metadata_buffer + first;
+		first += ic->ic_nr_blocks;
+		used[s] = skip[s] = 0;
+	}
 
-	/*
-	 * We're going to lock our cache pages.  We don't want to
-	 * request more memory than the system has, though.
-	 */
-	pages_wanted = channel->io_blksize * ic->ic_nr_blocks / getpagesize();
-	avpages = sysconf(_SC_AVPHYS_PAGES);
-	if (pages_wanted > avpages)
-		return OCFS2_ET_NO_MEMORY;
+	/* skip[] starts as how many blocks each shard is offered */
+	for (i = 0; i < nr_valid; i++)
+		skip[io_cache_shard(cs, rs->rs_blocks[i].rb_blkno) -
+		     cs->cs_shards]++;
+	for (s = 0; s < cs->cs_nr_shards; s++) {
+		ic = &cs->cs_shards[s];
+		skip[s] = (skip[s] > ic->ic_nr_blocks) ?
+			skip[s] - ic->ic_nr_blocks : 0;
+	}
 
-	rc = mlock(ic->ic_data_buffer, ic->ic_data_buffer_len);
-	if (!rc) {
-		rc = mlock(ic->ic_metadata_buffer, ic->ic_metadata_buffer_len);
-		if (rc)
-			munlock(ic->ic_data_buffer, ic->ic_data_buffer_len);
+	for (i = 0; i < nr_valid; i++) {
+		rb = &rs->rs_blocks[i];
+		ic = io_cache_shard(cs, rb->rb_blkno);
+		s = ic - cs->cs_shards;
+		if (skip[s]) {
+			skip[s]--;
+			rb->rb_blkno = UINT64_MAX;
+			continue;
+		}
+		io_cache_place(ic, &ic->ic_metadata_buffer[used[s]++],
+			       rb->rb_blkno, rb->rb_buf, rb->rb_which);
+		rb->rb_buf = NULL;
 	}
 
-	if (rc)
-		return OCFS2_ET_NO_MEMORY;
+	/* Every buffer left over fills an empty icb somewhere */
+	for (i = 0, s = 0; i < cs->cs_nr_blocks; i++) {
+		rb = &rs->rs_blocks[i];
+		if (!rb->rb_buf)
+			continue;
+		while (used[s] == cs->cs_shards[s].ic_nr_blocks)
+			s++;
+		ic = &cs->cs_shards[s];
+		io_cache_place(ic, &ic->ic_metadata_buffer[used[s]++],
+			       UINT64_MAX, rb->rb_buf, IO_CACHE_COLD);
+	}
 
-	ic->ic_locked = 1;
-	return 0;
+	/* Reinserting isn't news; keep the old numbers */
+	ic = &cs->cs_shards[0];
+	ic->ic_hits = stats.ic_hits;
+	ic->ic_misses = stats.ic_misses;
+	ic->ic_inserts = stats.ic_inserts;
+	ic->ic_removes = stats.ic_removes;
+	ic->ic_recent_hits = stats.ic_recent_hits;
+	ic->ic_frequent_hits = stats.ic_frequent_hits;
+	ic->ic_ghost_hits = stats.ic_ghost_hits;
+	for (s = 1; s < cs->cs_nr_shards; s++)
+		cs->cs_shards[s].ic_inserts = 0;
+
+	ocfs2_free(&rs->rs_blocks);
 }
 
-errcode_t io_init_cache(io_channel *channel, size_t nr_blocks)
+/*
+ * In threaded mode, any number of threads may read and write through
+ * the channel at once.  The cache is split into shards by block number,
+ * each with its own lock, and every thread keeps its own stats and
+ * error.  Prefetching is off.
+ *
+ * Switching flushes an existing cache and moves its blocks into the new
+ * shards, so nothing may be doing I/O on the channel meanwhile.  A
+ * shared cache can't be resharded; switch before sharing it.  If the
+ * switch fails, the channel is left as it was.
+ */
+errcode_t io_set_threaded(io_channel *channel, bool threaded)
 {
-	int i;
-	struct io_cache *ic;
-	char *dbuf;
-	struct io_cache_block *icb_list;
+	struct io_cache_set *cs = channel->io_cache;
+	struct io_counters *ioc;
+	struct io_reshard rs;
 	errcode_t ret;
 
-	ret = ocfs2_malloc0(sizeof(struct io_cache), &ic);
-	if (ret)
-		goto out;
+	if (channel->io_threaded == threaded)
+		return 0;
 
-	ic->ic_nr_blocks = nr_blocks;
-	ic->ic_lookup = RB_ROOT;
-	INIT_LIST_HEAD(&ic->ic_lru);
+	if (cs) {
+		if (cs->cs_use_count > 1)
+			return OCFS2_ET_INVALID_ARGUMENT;
+		io_cache_prefetch_drain(channel);
+		ret = io_flush(channel);
+		if (ret)
+			return ret;
+	}
 
-	ret = ocfs2_malloc_blocks(channel, nr_blocks, &ic->ic_data_buffer);
-	if (ret)
-		goto out;
-	ic->ic_data_buffer_len = (unsigned long)nr_blocks * channel->io_blksize;
+	if (threaded) {
+		if (pthread_key_create(&channel->io_counters_key, NULL))
+			return OCFS2_ET_NO_MEMORY;
+	}
 
-	ret = ocfs2_malloc0(sizeof(struct io_cache_block) * nr_blocks,
-			    &ic->ic_metadata_buffer);
-	if (ret)
-		goto out;
-	ic->ic_metadata_buffer_len =
-		(unsigned long)nr_blocks * sizeof(struct io_cache_block);
+	if (cs) {
+		ret = io_reshard_prepare(channel, threaded, &rs);
+		if (ret) {
+			if (threaded)
+				pthread_key_delete(channel->io_counters_key);
+			return ret;
+		}
+	}
 
-	icb_list = ic->ic_metadata_buffer;
-	dbuf = ic->ic_data_buffer;
-	for (i = 0; i < nr_blocks; i++) {
-		icb_list[i].icb_blkno = UINT64_MAX;
-		icb_list[i].icb_buf = dbuf;
-		dbuf += channel->io_blksize;
-		list_add_tail(&icb_list[i].icb_list, &ic->ic_lru);
+	if (threaded) {
+		pthread_mutex_init(&channel->io_queue_lock, NULL);
+		pthread_mutex_init(&channel->io_counters_lock, NULL);
+		channel->io_thread_counters = NULL;
+	} else {
+		/* Fold the threads' numbers back into the channel's */
+		while ((ioc = channel->io_thread_counters)) {
+			channel->io_thread_counters = ioc->ioc_next;
+			io_add_counters(&channel->io_counters, ioc);
+			if (ioc->ioc_error)
+				channel->io_counters.ioc_error =
+					ioc->ioc_error;
+			ocfs2_free(&ioc);
+		}
+		pthread_key_delete(channel->io_counters_key);
+		pthread_mutex_destroy(&channel->io_queue_lock);
+		pthread_mutex_destroy(&channel->io_counters_lock);
 	}
+	channel->io_threaded = threaded;
 
-	ic->ic_use_count = 1;
-	channel->io_cache = ic;
+	if (cs)
+		io_reshard(channel, &rs);
 
-out:
-	if (ret)
-		io_free_cache(ic);
+	return 0;
+}
 
-	return ret;
+bool io_is_threaded(io_channel *channel)
+{
+	return channel->io_threaded;
 }
 
-errcode_t io_init_cache_size(io_channel *channel, size_t bytes)
+errcode_t io_flush(io_channel *channel)
 {
-	size_t blocks;
+	struct io_trace_mark tm;
+	errcode_t ret;
 
-	blocks = (bytes + (channel->io_blksize - 1)) / channel->io_blksize;
+	io_trace_begin(channel, &tm);
+	ret = io_cache_flush(channel);
+	io_trace_end(channel, &tm, OCFS2_IO_TRACE_FLUSH, false, 0, 0, ret);
 
-	return io_init_cache(channel, blocks);
+	return ret;
 }
 
-size_t io_get_cache_size(io_channel *channel)
+/* Whether any shard still holds dirty blocks */
+static bool io_cache_dirty(io_channel *channel)
 {
-	if (channel->io_cache)
-		return channel->io_cache->ic_data_buffer_len;
-	return 0;
-}
+	struct io_cache_set *cs = channel->io_cache;
+	struct io_cache *ic;
+	bool dirty = false;
+	int i;
 
-errcode_t io_share_cache(io_channel *from, io_channel *to)
-{
-	if (!from->io_cache)
-		return OCFS2_ET_INTERNAL_FAILURE;
-	if (to->io_cache)
-		return OCFS2_ET_INTERNAL_FAILURE;
-	to->io_cache = from->io_cache;
-	from->io_cache->ic_use_count++;
-	return 0;
+	for (i = 0; cs && !dirty && (i < cs->cs_nr_shards); i++) {
+		ic = &cs->cs_shards[i];
+		io_cache_lock(cs, ic);
+		dirty = !!ic->ic_list_len[IO_CACHE_DIRTY];
+		io_cache_unlock(cs, ic);
+	}
+
+	return dirty;
 }
 
-static errcode_t io_validate_o_direct(io_channel *channel)
+/*
+ * Write-back reorders writes, so callers need a way to say "everything
+ * so far must be on disk before anything that follows".  We flush the
+ * dirty blocks and wait for the device to have them.  In write-through
+ * mode, every write has completed by the time it returns, so there is
+ * nothing to do.
+ */
+errcode_t io_barrier(io_channel *channel)
 {
-	errcode_t ret = OCFS2_ET_UNEXPECTED_BLOCK_SIZE;
-	int block_size;
-	char *blk;
+	struct io_trace_mark tm;
+	errcode_t ret = 0;
 
-	for (block_size = io_get_blksize(channel);
-	     block_size <= OCFS2_MAX_BLOCKSIZE;
-	     block_size <<= 1) {
-		io_set_blksize(channel, block_size);
-		ret = ocfs2_malloc_block(channel, &blk);
-		if (ret)
-			break;
+	io_trace_begin(channel, &tm);
+	if (!channel->io_writeback && !io_cache_dirty(channel))
+		goto out;
 
-		ret = unix_io_read_block(channel, 0, 1, blk);
-		ocfs2_free(&blk);
-		if (!ret)
-			break;
+	ret = io_cache_flush(channel);
+	if (!ret && fdatasync(channel->io_fd)) {
+		io_counters(channel)->ioc_error = errno;
+		ret = OCFS2_ET_IO;
 	}
 
+out:
+	io_trace_end(channel, &tm, OCFS2_IO_TRACE_BARRIER, false, 0, 0, ret);
 	return ret;
 }
 
-int io_is_device_readonly(io_channel *channel)
+/* bytes from the start of blkno, cached or not.  Nothing is added. */
+static errcode_t io_cache_read_partial(io_channel *channel, int64_t blkno,
+				       int bytes, char *buf)
 {
-	errcode_t ret;
-	int dev_ro;
+	struct io_cache_set *cs = channel->io_cache;
+	struct io_cache *ic = io_cache_shard(cs, blkno);
+	struct io_cache_block *icb;
+	errcode_t ret = 0;
 
-	ret = ioctl(channel->io_fd, BLKROGET, &dev_ro);
-	if (ret >= 0 && dev_ro)
-		return 1;
-	return 0;
+	io_cache_lock(cs, ic);
+	icb = io_cache_lookup(ic, blkno);
+	if (icb)
+		memcpy(buf, icb->icb_buf, bytes);
+	else
+		ret = unix_io_read_block(channel, blkno, -bytes, buf);
+	io_cache_unlock(cs, ic);
+
+	return ret;
 }
 
-errcode_t io_open(const char *name, int flags, io_channel **channel)
+/*
+ * A threaded cache can't gather misses across shards, so each ivu goes
+ * through io_cache_read_block() shard by shard.  A partial block at the
+ * end is read as the unthreaded path does.
+ */
+static errcode_t io_cache_vec_read_threaded(io_channel *channel,
+					    struct io_vec_unit *ivus,
+					    int count, bool nocache)
+{
+	int i, numblks, rest;
+	errcode_t ret = 0;
+
+	for (i = 0; !ret && (i < count); i++) {
+		numblks = ivus[i].ivu_buflen / channel->io_blksize;
+		rest = ivus[i].ivu_buflen % channel->io_blksize;
+		if (numblks)
+			ret = io_cache_read_block(channel, ivus[i].ivu_blkno,
+						  numblks, ivus[i].ivu_buf,
+						  nocache);
+		if (!ret && rest)
+			ret = io_cache_read_partial(channel,
+						    ivus[i].ivu_blkno + numblks,
+						    rest, ivus[i].ivu_buf +
+						    (numblks * channel->io_blksize));
+	}
+
+	return ret;
+}
+
+static errcode_t __io_vec_read_blocks(io_channel *channel,
+				      struct io_vec_unit *ivus, int count)
 {
+	struct io_cache_set *cs = channel->io_cache;
 	errcode_t ret;
-	io_channel *chan = NULL;
-#ifdef __linux__
-	struct stat stat_buf;
-	struct utsname ut;
-#endif
 
-	if (!name || !*name)
-		return OCFS2_ET_BAD_DEVICE_NAME;
+	if (!cs)
+		return unix_vec_read_blocks(channel, ivus, count);
 
-	ret = ocfs2_malloc0(sizeof(struct _io_channel), &chan);
-	if (ret)
-		return ret;
+	if (cs->cs_nr_shards > 1)
+		return io_cache_vec_read_threaded(channel, ivus, count,
+						  channel->io_nocache);
 
-	ret = ocfs2_malloc(strlen(name)+1, &chan->io_name);
-	if (ret)
-		goto out_chan;
-	strcpy(chan->io_name, name);
-	chan->io_blksize = OCFS2_MIN_BLOCKSIZE;
-	chan->io_flags = (flags & OCFS2_FLAG_RW) ? O_RDWR : O_RDONLY;
-	chan->io_nocache = false;
-	if (!(flags & OCFS2_FLAG_BUFFERED))
-		chan->io_flags |= O_DIRECT;
-	chan->io_error = 0;
+	/* Serialized against other users of a threaded cache */
+	io_cache_lock(cs, cs->cs_shards);
+	ret = io_cache_vec_read_blocks(channel, cs->cs_shards, ivus, count,
+				       channel->io_nocache);
+	io_cache_unlock(cs, cs->cs_shards);
 
-	chan->io_fd = open64(name, chan->io_flags);
-	if (chan->io_fd < 0) {
-		/* chan will be freed, don't bother with chan->io_error */
-		if (errno == ENOENT)
-			ret = OCFS2_ET_NAMED_DEVICE_NOT_FOUND;
-		else
-			ret = OCFS2_ET_IO;
-		goto out_name;
-	}
+	return ret;
+}
 
-	if (!(flags & OCFS2_FLAG_BUFFERED)) {
-		ret = io_validate_o_direct(chan);
-		if (ret)
-			goto out_close;  /* FIXME: bindraw here */
-	}
+errcode_t io_vec_read_blocks(io_channel *channel, struct io_vec_unit *ivus,
+			     int count)
+{
+	struct io_trace_mark tm;
+	errcode_t ret;
 
-	/* Workaround from e2fsprogs */
-#ifdef __linux__
-#undef RLIM_INFINITY
-#if (defined(__alpha__) || ((defined(__sparc__) || defined(__mips__)) && (SIZEOF_LONG == 4)))
-#define RLIM_INFINITY	((unsigned long)(~0UL>>1))
-#else
-#define RLIM_INFINITY  (~0UL)
-#endif
-	/*
-	 * Work around a bug in 2.4.10-2.4.18 kernels where writes to
-	 * block devices are wrongly getting hit by the filesize
-	 * limit.  This workaround isn't perfect, since it won't work
-	 * if glibc wasn't built against 2.2 header files.  (Sigh.)
-	 * 
-	 */
-	if ((flags & OCFS2_FLAG_RW) &&
-	    (uname(&ut) == 0) &&
-	    ((ut.release[0] == '2') && (ut.release[1] == '.') &&
-	     (ut.release[2] == '4') && (ut.release[3] == '.') &&
-	     (ut.release[4] == '1') && (ut.release[5] >= '0') &&
-	     (ut.release[5] < '8')) &&
-	    (fstat(chan->io_fd, &stat_buf) == 0) &&
-	    (S_ISBLK(stat_buf.st_mode))) {
-		struct rlimit	rlim;
-		
-		rlim.rlim_cur = rlim.rlim_max = (unsigned long) RLIM_INFINITY;
-		setrlimit(RLIMIT_FSIZE, &rlim);
-		getrlimit(RLIMIT_FSIZE, &rlim);
-		if (((unsigned long) rlim.rlim_cur) <
-		    ((unsigned long) rlim.rlim_max)) {
-			rlim.rlim_cur = rlim.rlim_max;
-			setrlimit(RLIMIT_FSIZE, &rlim);
-		}
-	}
-#endif
+	io_trace_begin(channel, &tm);
+	ret = __io_vec_read_blocks(channel, ivus, count);
+	io_trace_vec(channel, &tm, OCFS2_IO_TRACE_VEC_READ, ivus, count, ret);
 
-	*channel = chan;
-	return 0;
+	return ret;
+}
 
-out_close:
-	/* Ignore the return, leave the original error */
-	close(chan->io_fd);
+/* Ask the kernel to read the mapped blocks ahead.  It's only a hint. */
+static errcode_t io_map_prefetch(io_channel *channel, int64_t blkno,
+				 int count)
+{
+	uint64_t start, end, page = getpagesize();
 
-out_name:
-	ocfs2_free(&chan->io_name);
+	start = (uint64_t)blkno * channel->io_blksize;
+	end = start + ((uint64_t)count * channel->io_blksize);
+	if (end > channel->io_map_len)
+		end = channel->io_map_len;
+	if (start >= end)
+		return 0;
 
-out_chan:
-	ocfs2_free(&chan);
+	start &= ~(page - 1);
+	madvise(channel->io_map + start, end - start, MADV_WILLNEED);
 
-	*channel = NULL;
-	return ret;
+	return 0;
 }
 
-errcode_t io_close(io_channel *channel)
+/*
+ * Start reading blocks into the cache without waiting for them.  A later
+ * read of one of them waits only for that block.  Without a cache or a
+ * queue, this does nothing.  Prefetching is a hint; the only error is a
+ * queue that fails outright.
+ */
+errcode_t io_prefetch_blocks(io_channel *channel, int64_t blkno, int count)
 {
+	struct io_trace_mark tm;
 	errcode_t ret = 0;
 
-	io_destroy_cache(channel);
+	io_trace_begin(channel, &tm);
+	if (channel->io_map)
+		ret = io_map_prefetch(channel, blkno, count);
+	else if (channel->io_cache)
+		ret = io_cache_prefetch(channel, blkno, count);
+	io_trace_end(channel, &tm, OCFS2_IO_TRACE_PREFETCH, false, blkno,
+		     count, ret);
 
-	if (close(channel->io_fd) < 0)
-		ret = errno;
+	return ret;
+}
 
-	ocfs2_free(&channel->io_name);
-	ocfs2_free(&channel);
+/* Partial blocks at the end of an ivu are not prefetched */
+errcode_t io_prefetch_vec(io_channel *channel, struct io_vec_unit *ivus,
+			  int count)
+{
+	int i;
+	errcode_t ret = 0;
+
+	for (i = 0; !ret && (i < count); i++)
+		ret = io_prefetch_blocks(channel, ivus[i].ivu_blkno,
+					 ivus[i].ivu_buflen /
+					 channel->io_blksize);
 
 	return ret;
 }
 
-int io_get_error(io_channel *channel)
+/*
+ * Async reads that miss the cache go to the device through the queue
+ * and add what they read to the cache when they complete.  That is
+ * only safe when the device has the latest copy of every block and
+ * nobody else is using the queue.  Everyone else reads synchronously
+ * in io_start_read().
+ */
+static bool io_can_read_async(io_channel *channel)
 {
-	return channel->io_error;
+	return channel->io_queue && !channel->io_threaded &&
+		!channel->io_map && !io_cache_dirty(channel);
 }
 
-errcode_t io_set_blksize(io_channel *channel, int blksize)
+/* Whether all count blocks from blkno are cached */
+static bool io_cache_has_blocks(io_channel *channel, int64_t blkno,
+				int count)
 {
-	if (blksize % OCFS2_MIN_BLOCKSIZE)
-		return OCFS2_ET_INVALID_ARGUMENT;
+	struct io_cache_set *cs = channel->io_cache;
+	struct io_cache *ic;
+	bool found = true;
+	int i;
 
-	if (!blksize)
-		blksize = OCFS2_MIN_BLOCKSIZE;
+	if (!cs)
+		return false;
 
-	if (channel->io_blksize != blksize)
-		channel->io_blksize = blksize;
+	for (i = 0; found && (i < count); i++) {
+		ic = io_cache_shard(cs, blkno + i);
+		io_cache_lock(cs, ic);
+		found = !!io_cache_lookup(ic, blkno + i);
+		io_cache_unlock(cs, ic);
+	}
 
-	return 0;
+	return found;
 }
 
-int io_get_blksize(io_channel *channel)
+errcode_t io_start_read(io_channel *channel, struct io_async_read *iar,
+			int64_t blkno, int count, char *data)
 {
-	return channel->io_blksize;
-}
+	struct unix_queue *q;
+	struct unix_queue_slot *slot;
+	struct io_trace_mark tm;
+	int rc;
 
-int io_get_fd(io_channel *channel)
-{
-	return channel->io_fd;
+	iar->iar_ivu.ivu_blkno = blkno;
+	iar->iar_ivu.ivu_buf = data;
+	iar->iar_ivu.ivu_buflen = count * channel->io_blksize;
+	iar->iar_pending = false;
+	iar->iar_ret = 0;
+
+	/* A read the cache can satisfy doesn't need the device */
+	if (io_cache_has_blocks(channel, blkno, count)) {
+		iar->iar_ret = io_read_block(channel, blkno, count, data);
+		return 0;
+	}
+
+	/* Every slot may be busy with prefetches or other async reads */
+	while (io_can_read_async(channel) && !channel->io_queue->q_free) {
+		if (unix_queue_reap_other(channel))
+			break;
+	}
+
+	if (!io_can_read_async(channel)) {
+		iar->iar_ret = io_read_block(channel, blkno, count, data);
+		return 0;
+	}
+
+	io_trace_begin(channel, &tm);
+
+	q = channel->io_queue;
+	slot = q->q_free;
+	q->q_free = slot->qs_next;
+	slot->qs_icb = NULL;
+	slot->qs_iar = iar;
+	slot->qs_ivu = &iar->iar_ivu;
+	slot->qs_done = 0;
+	slot->qs_cache = channel->io_cache && !channel->io_nocache;
+	slot->qs_write_gen = channel->io_write_gen;
+	unix_queue_prep_read(channel, slot);
+	iar->iar_pending = true;
+
+	rc = unix_queue_submit(channel);
+	if ((rc < 0) && !unix_queue_submit_retry(rc)) {
+		/* Teardown fails the read; io_finish_read() reports it */
+		io_counters(channel)->ioc_error = -rc;
+		unix_queue_exit(channel);
+	}
+	io_trace_end(channel, &tm, OCFS2_IO_TRACE_READ, true, blkno, count,
+		     0);
+
+	return 0;
 }
 
-void io_get_stats(io_channel *channel, struct ocfs2_io_stats *stats)
+errcode_t io_finish_read(io_channel *channel, struct io_async_read *iar)
 {
-	struct io_cache *ioc = channel->io_cache;
-
-	memset(stats, 0, sizeof(struct ocfs2_io_stats));
-	stats->is_bytes_read = channel->io_bytes_read;
-	stats->is_bytes_written = channel->io_bytes_written;
-	if (ioc) {
-		stats->is_cache_hits = ioc->ic_hits;
-		stats->is_cache_misses = ioc->ic_misses;
-		stats->is_cache_inserts = ioc->ic_inserts;
-		stats->is_cache_removes = ioc->ic_removes;
+	while (iar->iar_pending) {
+		if (unix_queue_reap_other(channel))
+			break;
 	}
+
+	return iar->iar_ret;
 }
 
 /*
- * If a channel is set to 'nocache', it will use the _nocache() functions
- * even if called via the regular functions.  This allows control of
- * naive code that we don't want to have to carry nocache parameters
- * around.  Smarter code can ignore this function and use the _nocache()
- * functions directly.
+ * Point *ptr at count blocks in the mapping instead of copying them.
+ * The pointer is good until io_close().  Channels that aren't mapped
+ * return OCFS2_ET_INVALID_ARGUMENT; callers fall back to
+ * io_read_block().
  */
-void io_set_nocache(io_channel *channel, bool nocache)
+errcode_t io_map_block(io_channel *channel, int64_t blkno, int count,
+		       const char **ptr)
 {
-	channel->io_nocache = nocache;
+	uint64_t location, size, start = io_time_us();
+
+	if (!channel->io_map || (count < 1))
+		return OCFS2_ET_INVALID_ARGUMENT;
+
+	location = (uint64_t)blkno * channel->io_blksize;
+	size = (uint64_t)count * channel->io_blksize;
+	if ((location >= channel->io_map_len) ||
+	    (size > (channel->io_map_len - location)))
+		return OCFS2_ET_SHORT_READ;
+
+	*ptr = channel->io_map + location;
+	io_account(channel, OCFS2_IO_READ, start, size);
+	io_counters(channel)->ioc_bytes_read += size;
+
+	return 0;
 }
 
-errcode_t io_vec_read_blocks(io_channel *channel, struct io_vec_unit *ivus,
-			     int count)
+/*
+ * Tell the kernel how the channel will be read, so it can size its
+ * readahead.  A mapped channel advises the mapping, any other the file.
+ */
+errcode_t io_set_access_pattern(io_channel *channel,
+				enum io_access_pattern pattern)
 {
-	if (channel->io_cache)
-		return io_cache_vec_read_blocks(channel, ivus, count,
-						channel->io_nocache);
+	static const int madv[IO_ACCESS_NR_PATTERNS] = {
+		[IO_ACCESS_NORMAL]	= MADV_NORMAL,
+		[IO_ACCESS_SEQUENTIAL]	= MADV_SEQUENTIAL,
+		[IO_ACCESS_RANDOM]	= MADV_RANDOM,
+	};
+	static const int fadv[IO_ACCESS_NR_PATTERNS] = {
+		[IO_ACCESS_NORMAL]	= POSIX_FADV_NORMAL,
+		[IO_ACCESS_SEQUENTIAL]	= POSIX_FADV_SEQUENTIAL,
+		[IO_ACCESS_RANDOM]	= POSIX_FADV_RANDOM,
+	};
+	int rc;
+
+	if ((pattern < 0) || (pattern >= IO_ACCESS_NR_PATTERNS))
+		return OCFS2_ET_INVALID_ARGUMENT;
+
+	if (channel->io_map)
+		rc = madvise(channel->io_map, channel->io_map_len,
+			     madv[pattern]) ? errno : 0;
 	else
-		return unix_vec_read_blocks(channel, ivus, count);
+		rc = posix_fadvise(channel->io_fd, 0, 0, fadv[pattern]);
+
+	if (rc) {
+		io_counters(channel)->ioc_error = rc;
+		return OCFS2_ET_IO;
+	}
+
+	return 0;
 }
 
 errcode_t io_read_block(io_channel *channel, int64_t blkno, int count,
 			char *data)
 {
+	struct io_trace_mark tm;
+	errcode_t ret;
+
+	io_trace_begin(channel, &tm);
 	if (channel->io_cache)
-		return io_cache_read_block(channel, blkno, count, data,
-					   channel->io_nocache);
+		ret = io_cache_read_block(channel, blkno, count, data,
+					  channel->io_nocache);
 	else
-		return unix_io_read_block(channel, blkno, count, data);
+		ret = unix_io_read_block(channel, blkno, count, data);
+	io_trace_end(channel, &tm, OCFS2_IO_TRACE_READ, channel->io_nocache,
+		     blkno, count, ret);
+
+	return ret;
 }
 
 errcode_t io_read_block_nocache(io_channel *channel, int64_t blkno, int count,
 				char *data)
 {
+	struct io_trace_mark tm;
+	errcode_t ret;
+
+	io_trace_begin(channel, &tm);
 	if (channel->io_cache)
-		return io_cache_read_block(channel, blkno, count, data,
-					   true);
+		ret = io_cache_read_block(channel, blkno, count, data,
+					  true);
 	else
-		return unix_io_read_block(channel, blkno, count, data);
+		ret = unix_io_read_block(channel, blkno, count, data);
+	io_trace_end(channel, &tm, OCFS2_IO_TRACE_READ, true, blkno, count,
+		     ret);
+
+	return ret;
 }
 
 errcode_t io_write_block(io_channel *channel, int64_t blkno, int count,
 			 const char *data)
 {
+	struct io_trace_mark tm;
+	errcode_t ret;
+
+	io_trace_begin(channel, &tm);
 	if (channel->io_cache)
-		return io_cache_write_block(channel, blkno, count, data,
-					    channel->io_nocache);
+		ret = io_cache_write_block(channel, blkno, count, data,
+					   channel->io_nocache);
 	else
-		return unix_io_write_block(channel, blkno, count, data);
+		ret = unix_io_write_block(channel, blkno, count, data);
+	io_trace_end(channel, &tm, OCFS2_IO_TRACE_WRITE, channel->io_nocache,
+		     blkno, count, ret);
+
+	return ret;
 }
 
 errcode_t io_write_block_nocache(io_channel *channel, int64_t blkno, int count,
 				 const char *data)
 {
+	struct io_trace_mark tm;
+	errcode_t ret;
+
+	io_trace_begin(channel, &tm);
 	if (channel->io_cache)
-		return io_cache_write_block(channel, blkno, count, data,
-					    true);
+		ret = io_cache_write_block(channel, blkno, count, data,
+					   true);
 	else
-		return unix_io_write_block(channel, blkno, count, data);
+		ret = unix_io_write_block(channel, blkno, count, data);
+	io_trace_end(channel, &tm, OCFS2_IO_TRACE_WRITE, true, blkno, count,
+		     ret);
+
+	return ret;
+}
+
+/*
+ * Start recording the channel's requests to filename, replacing what
+ * was there.  Like io_set_threaded(), this should be called while no
+ * I/O is running.
+ */
+errcode_t io_start_trace(io_channel *channel, const char *filename)
+{
+	struct io_trace *it;
+	struct ocfs2_io_trace_header th;
+	errcode_t ret;
+
+	if (channel->io_trace)
+		return OCFS2_ET_INVALID_ARGUMENT;
+
+	ret = ocfs2_malloc0(sizeof(struct io_trace), &it);
+	if (ret)
+		return ret;
+
+	it->it_fd = open64(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (it->it_fd < 0) {
+		ret = OCFS2_ET_IO;
+		goto out;
+	}
+
+	memset(&th, 0, sizeof(th));
+	memcpy(th.th_magic, OCFS2_IO_TRACE_MAGIC, sizeof(th.th_magic));
+	th.th_version = cpu_to_le32(OCFS2_IO_TRACE_VERSION);
+	th.th_blksize = cpu_to_le32(channel->io_blksize);
+	th.th_start = cpu_to_le64(time(NULL));
+	if (write(it->it_fd, &th, sizeof(th)) != sizeof(th)) {
+		ret = OCFS2_ET_IO;
+		goto out;
+	}
+
+	pthread_mutex_init(&it->it_lock, NULL);
+	it->it_start = io_time_us();
+	channel->io_trace = it;
+
+out:
+	if (ret) {
+		if (it->it_fd >= 0)
+			close(it->it_fd);
+		ocfs2_free(&it);
+	}
+
+	return ret;
+}
+
+/* Write out what's left.  Returns the first error writing the trace. */
+errcode_t io_stop_trace(io_channel *channel)
+{
+	struct io_trace *it = channel->io_trace;
+	errcode_t ret;
+
+	if (!it)
+		return 0;
+
+	channel->io_trace = NULL;
+	ret = it->it_error;
+	if (!ret && it->it_nr)
+		ret = io_trace_write(it);
+	if ((close(it->it_fd) < 0) && !ret)
+		ret = OCFS2_ET_IO;
+	pthread_mutex_destroy(&it->it_lock);
+	ocfs2_free(&it);
+
+	return ret;
 }
 
+const char *io_trace_op_name(enum ocfs2_io_trace_op op)
+{
+	static const char *names[OCFS2_IO_TRACE_NR_OPS] = {
+		[OCFS2_IO_TRACE_READ]		= "read",
+		[OCFS2_IO_TRACE_WRITE]		= "write",
+		[OCFS2_IO_TRACE_VEC_READ]	= "vec read",
+		[OCFS2_IO_TRACE_PREFETCH]	= "prefetch",
+		[OCFS2_IO_TRACE_FLUSH]		= "flush",
+		[OCFS2_IO_TRACE_BARRIER]	= "barrier",
+		[OCFS2_IO_TRACE_BLKSIZE]	= "blksize",
+	};
+
+	if ((op < 0) || (op >= OCFS2_IO_TRACE_NR_OPS))
+		return NULL;
+	return names[op];
+}
 
 #ifdef DEBUG_EXE
 #include <stdio.h>
@@ -1032,11 +4742,292 @@ static void dump_block(int64_t blkno, int blksize, char *buf)
 	fprintf(stdout, "\n");
 }
 
+/*
+ * Lookup microbenchmark.  We build an index over nr_blocks cached blocks
+ * (no data buffer needed) and time hits, misses, and run probes.  The
+ * old rbtree index is kept here for comparison.
+ */
+#define BENCH_LOOKUPS	(4 * 1024 * 1024)
+
+struct bench_node {
+	struct rb_node bn_node;
+	uint64_t bn_blkno;
+};
+
+static struct bench_node *bench_rb_lookup(struct rb_root *root,
+					  uint64_t blkno)
+{
+	struct rb_node *p = root->rb_node;
+	struct bench_node *bn;
+
+	while (p) {
+		bn = rb_entry(p, struct bench_node, bn_node);
+		if (blkno < bn->bn_blkno)
+			p = p->rb_left;
+		else if (blkno > bn->bn_blkno)
+			p = p->rb_right;
+		else
+			return bn;
+	}
+
+	return NULL;
+}
+
+static void bench_rb_insert(struct rb_root *root, struct bench_node *new)
+{
+	struct rb_node **p = &root->rb_node;
+	struct rb_node *parent = NULL;
+	struct bench_node *bn;
+
+	while (*p) {
+		parent = *p;
+		bn = rb_entry(parent, struct bench_node, bn_node);
+		if (new->bn_blkno < bn->bn_blkno)
+			p = &(*p)->rb_left;
+		else
+			p = &(*p)->rb_right;
+	}
+
+	rb_link_node(&new->bn_node, parent, p);
+	rb_insert_color(&new->bn_node, root);
+}
+
+static double bench_now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + (tv.tv_usec / 1000000.0);
+}
+
+static void bench_report(const char *name, double hit, double miss,
+			 double run)
+{
+	fprintf(stdout, "%-8s hit %7.1fns  miss %7.1fns  run %7.1fns/block\n",
+		name, hit * 1e9 / BENCH_LOOKUPS, miss * 1e9 / BENCH_LOOKUPS,
+		run * 1e9 / BENCH_LOOKUPS);
+}
+
+/*
+ * The cache holds every other extent of IO_CACHE_RUN blocks, so hits
+ * and misses are scattered over the same range.  bench_blkno() maps the
+ * nth cached block to its block number; adding IO_CACHE_RUN to that
+ * gives a miss.  Run probes walk a whole cached extent.
+ */
+static inline uint64_t bench_blkno(uint64_t n)
+{
+	return ((n / IO_CACHE_RUN) * IO_CACHE_RUN * 2) + (n % IO_CACHE_RUN);
+}
+
+static void bench_io_cache(struct io_cache *ic, const char *name,
+			   uint64_t *order, uint64_t *keys)
+{
+	struct io_cache_block *icbs[IO_CACHE_RUN];
+	uint64_t i, nr = ic->ic_nr_blocks, found = 0;
+	double start, hit, miss, run;
+
+	for (i = 0; i < nr; i++) {
+		ic->ic_metadata_buffer[i].icb_blkno = bench_blkno(order[i]);
+		io_cache_insert(ic, &ic->ic_metadata_buffer[i]);
+	}
+
+	start = bench_now();
+	for (i = 0; i < BENCH_LOOKUPS; i++)
+		found += !!io_cache_lookup(ic, keys[i]);
+	hit = bench_now() - start;
+
+	start = bench_now();
+	for (i = 0; i < BENCH_LOOKUPS; i++)
+		found += !!io_cache_lookup(ic, keys[i] + IO_CACHE_RUN);
+	miss = bench_now() - start;
+
+	start = bench_now();
+	for (i = 0; i < BENCH_LOOKUPS; i += IO_CACHE_RUN)
+		found += io_cache_lookup_run(ic,
+					     keys[i] - (keys[i] % IO_CACHE_RUN),
+					     IO_CACHE_RUN, icbs);
+	run = bench_now() - start;
+
+	if (found != (BENCH_LOOKUPS * 2))
+		fprintf(stderr, "%s: found %"PRIu64" blocks, expected %d\n",
+			name, found, BENCH_LOOKUPS * 2);
+	bench_report(name, hit, miss, run);
+}
+
+static int run_lookup_bench(uint64_t nr_blocks)
+{
+	struct io_cache ic;
+	struct rb_root root = RB_ROOT;
+	struct bench_node *nodes;
+	uint64_t i, j, tmp, found = 0, *order, *keys;
+	double start, hit, miss, run;
+
+
+	/* Whole extents only */
+	nr_blocks -= nr_blocks % IO_CACHE_RUN;
+	if (!nr_blocks) {
+		fprintf(stderr, "Need at least %d blocks\n", IO_CACHE_RUN);
+		return 1;
+	}
+
+	order = malloc(sizeof(uint64_t) * nr_blocks);
+	keys = malloc(sizeof(uint64_t) * BENCH_LOOKUPS);
+	nodes = malloc(sizeof(struct bench_node) * nr_blocks);
+	memset(&ic, 0, sizeof(ic));
+	ic.ic_nr_blocks = nr_blocks;
+	ic.ic_metadata_buffer = malloc(sizeof(struct io_cache_block) *
+				       nr_blocks);
+	if (!order || !keys || !nodes || !ic.ic_metadata_buffer) {
+		fprintf(stderr, "Unable to allocate benchmark memory\n");
+		return 1;
+	}
+
+	/* Insert in random order, like a real cache fills */
+	srand(nr_blocks);
+	for (i = 0; i < nr_blocks; i++)
+		order[i] = i;
+	for (i = nr_blocks - 1; i > 0; i--) {
+		j = ((uint64_t)rand() * RAND_MAX + rand()) % (i + 1);
+		tmp = order[i];
+		order[i] = order[j];
+		order[j] = tmp;
+	}
+	for (i = 0; i < BENCH_LOOKUPS; i++)
+		keys[i] = bench_blkno(((uint64_t)rand() * RAND_MAX + rand()) %
+				      nr_blocks);
+
+	fprintf(stdout, "Lookup cost with %"PRIu64" cached blocks:\n",
+		nr_blocks);
+
+	for (i = 0; i < nr_blocks; i++) {
+		nodes[i].bn_blkno = bench_blkno(order[i]);
+		bench_rb_insert(&root, &nodes[i]);
+	}
+	start = bench_now();
+	for (i = 0; i < BENCH_LOOKUPS; i++)
+		found += !!bench_rb_lookup(&root, keys[i]);
+	hit = bench_now() - start;
+	start = bench_now();
+	for (i = 0; i < BENCH_LOOKUPS; i++)
+		found += !!bench_rb_lookup(&root, keys[i] + IO_CACHE_RUN);
+	miss = bench_now() - start;
+	start = bench_now();
+	for (i = 0; i < BENCH_LOOKUPS; i += IO_CACHE_RUN)
+		for (j = 0; j < IO_CACHE_RUN; j++)
+			found += !!bench_rb_lookup(&root,
+					keys[i] - (keys[i] % IO_CACHE_RUN) + j);
+	run = bench_now() - start;
+	bench_report("rbtree", hit, miss, run);
+
+	/* A device bigger than the cache gets the hash */
+	if (!io_cache_init_index(&ic, bench_blkno(nr_blocks) * 2))
+		bench_io_cache(&ic, "hash", order, keys);
+	io_hash_free(&ic.ic_hash);
+
+	/*
+	 * A cache covering the device gets the direct map.  Ours only
+	 * covers half the range, so io_cache_insert() grows it.
+	 */
+	if (!io_cache_init_index(&ic, nr_blocks))
+		bench_io_cache(&ic, "direct", order, keys);
+	ocfs2_free(&ic.ic_direct);
+
+	free(ic.ic_metadata_buffer);
+	free(nodes);
+	free(keys);
+	free(order);
+
+	return 0;
+}
+
+/*
+ * Replacement policy simulation.  A hot set of half the cache is read
+ * over and over, with a quarter cache of new blocks read between each
+ * pass.  Every fourth pass is also followed by a scan of twice the cache
+ * size.  LRU loses the hot set to every scan.
+ */
+#define SIM_ROUNDS	64
+
+static void sim_access(struct io_cache *ic, uint64_t blkno)
+{
+	struct io_cache_block *icb;
+
+	icb = io_cache_lookup(ic, blkno);
+	if (icb)
+		ic->ic_hits++;
+	else {
+		ic->ic_misses++;
+		icb = io_cache_pop(ic);
+		icb->icb_blkno = blkno;
+		io_cache_insert(ic, icb);
+	}
+	io_cache_seen(ic, icb);
+}
+
+static int run_policy_sim(uint64_t nr_blocks)
+{
+	struct io_cache ic;
+	uint64_t i, r, next, hot = nr_blocks / 2;
+	enum io_cache_policy policy;
+
+	fprintf(stdout, "Hit ratio with %"PRIu64" cached blocks, "
+		"%"PRIu64" hot blocks:\n", nr_blocks, hot);
+
+	for (policy = 0; policy < IO_CACHE_NR_POLICIES; policy++) {
+		memset(&ic, 0, sizeof(ic));
+		ic.ic_nr_blocks = nr_blocks;
+		ic.ic_policy = policy;
+		if (ocfs2_malloc0(sizeof(struct io_cache_block) * nr_blocks,
+				  &ic.ic_metadata_buffer) ||
+		    io_cache_init_index(&ic, 0) ||
+		    io_cache_init_policy(&ic)) {
+			fprintf(stderr, "Unable to allocate the cache\n");
+			return 1;
+		}
+		for (i = 0; i < nr_blocks; i++) {
+			ic.ic_metadata_buffer[i].icb_blkno = UINT64_MAX;
+			ic.ic_metadata_buffer[i].icb_which = IO_CACHE_COLD;
+			list_add_tail(&ic.ic_metadata_buffer[i].icb_list,
+				      &ic.ic_lists[IO_CACHE_COLD]);
+		}
+		ic.ic_list_len[IO_CACHE_COLD] = nr_blocks;
+
+		next = hot;
+		for (r = 0; r < SIM_ROUNDS; r++) {
+			for (i = 0; i < hot; i++)
+				sim_access(&ic, i);
+			for (i = 0; i < (nr_blocks / 4); i++)
+				sim_access(&ic, next++);
+			if ((r % 4) != 3)
+				continue;
+			for (i = 0; i < (nr_blocks * 2); i++)
+				sim_access(&ic, next++);
+		}
+
+		fprintf(stdout,
+			"  %-6s %5.1f%%  recent %u, frequent %u, ghost %u\n",
+			io_cache_policy_name(policy),
+			100.0 * ic.ic_hits / (ic.ic_hits + ic.ic_misses),
+			ic.ic_recent_hits, ic.ic_frequent_hits,
+			ic.ic_ghost_hits);
+
+		io_hash_free(&ic.ic_hash);
+		io_hash_free(&ic.ic_ghost_hash);
+		if (ic.ic_ghosts)
+			ocfs2_free(&ic.ic_ghosts);
+		ocfs2_free(&ic.ic_metadata_buffer);
+	}
+
+	return 0;
+}
+
 static void print_usage(void)
 {
 	fprintf(stderr,
 		"Usage: unix_io [-b <blkno>] [-c <count>] [-B <blksize>]\n"
-	       	"               <filename>\n");
+	       	"               <filename>\n"
+		"       unix_io -l <nr_blocks>\n"
+		"       unix_io -s <nr_blocks>\n");
 }
 
 extern int opterr, optind;
@@ -1058,8 +5049,30 @@ int main(int argc, char *argv[])
 
 	initialize_ocfs_error_table();
 
-	while((c = getopt(argc, argv, "b:c:B:")) != EOF) {
+	while((c = getopt(argc, argv, "b:c:B:l:s:")) != EOF) {
 		switch (c) {
+			case 'l':
+				count = read_number(optarg);
+				if (count <= 0) {
+					fprintf(stderr,
+						"Invalid block count: %s\n",
+						optarg);
+					print_usage();
+					return 1;
+				}
+				return run_lookup_bench(count);
+
+			case 's':
+				count = read_number(optarg);
+				if (count < 4) {
+					fprintf(stderr,
+						"Invalid block count: %s\n",
+						optarg);
+					print_usage();
+					return 1;
+				}
+				return run_policy_sim(count);
+
 			case 'b':
 				blkno = read_number(optarg);
 				if (blkno < 0) {
@@ -401,7 +401,8 @@ static void format_quota_files(State *s, ocfs2_filesys *fs)
 		}
 	}
 
-	ret = ocfs2_compute_quota_usage(fs, usr_hash, grp_hash);
+	ret = ocfs2_compute_quota_usage(fs, usr_hash, grp_hash,
+					OCFS2_INODE_SCAN_ALLOCATED);
 	if (ret) {
 		com_err(s->progname, ret, "while computing quota usage");
 		goto error;
@@ -1956,41 +1957,22 @@ destroy_bitmap(AllocBitmap *bitmap)
 static int
 find_clear_bits(void *buf, unsigned int size, uint32_t num_bits, uint32_t offset)
 {
-	uint32_t next_zero, off, count = 0, first_zero = -1;
+	uint32_t first_zero, next_one, off = offset;
 
-	off = offset;
-
-	while ((size - off + count >= num_bits) &&
-	       (next_zero = ocfs2_find_next_bit_clear(buf, size, off)) != size) {
-		if (next_zero >= size)
+	/* Hop from each clear run to the set bit that ends it */
+	while ((off < size) && (size - off >= num_bits)) {
+		first_zero = ocfs2_find_next_bit_clear(buf, size, off);
+		if (first_zero >= size)
 			break;
 
-		if (next_zero != off) {
-			first_zero = next_zero;
-			off = next_zero + 1;
-			count = 0;
-		} else {
-			off++;
-			if (count == 0)
-				first_zero = next_zero;
-		}
-
-		count++;
-
-		if (count == num_bits)
-			goto bail;
-	}
-
-	first_zero = -1;
+		next_one = ocfs2_find_next_bit_set(buf, size, first_zero);
+		if (next_one - first_zero >= num_bits)
+			return first_zero;
 
-bail:
-	if (first_zero != (uint32_t)-1 && first_zero > size) {
-		fprintf(stderr, "erf... first_zero > bitmap->valid_bits "
-				"(%d > %d)", first_zero, size);
-		first_zero = -1;
+		off = next_one + 1;
 	}
 
-	return first_zero;
+	return -1;
 }
 
 static int
@@ -2906,6 +2888,8 @@ static void index_system_dirs(State *s, ocfs2_filesys *fs)
 	int i, num_slots = OCFS2_RAW_SB(fs->fs_super)->s_max_slots;
 	uint64_t orphan_dir_blkno;
 
+	/* Write the allocators once, after every directory is indexed */
+	ocfs2_begin_alloc_batch(fs);
 
 	/* Start with the root directory */
 	ret = ocfs2_dx_dir_build(fs, fs->fs_root_blkno);
@@ -2931,6 +2915,13 @@ static void index_system_dirs(State *s, ocfs2_filesys *fs)
 		}
 	}
 
+	ret = ocfs2_end_alloc_batch(fs);
+	if (ret) {
+		com_err(s->progname, ret,
+			"while writing allocators for indexed directories");
+		goto bail;
+	}
+
 	return;
 
 bail:
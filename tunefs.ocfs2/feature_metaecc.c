@@ -42,7 +42,9 @@
  * write that last from fs->fs_super.
  *
  * We store all of this in an rb-tree of block_to_ecc structures.  We can
- * look blocks back up if needed, and we have writeback functions attached.
+ * look blocks back up if needed, and we have functions attached that turn
+ * a copy of each block into its on-disk form.  The ECC for those copies
+ * is computed in big batches across all CPUs before they are written.
  *
  * For directory inodes, we pass e_buf into tunefs_prepare_dir_trailer(),
  * which does not copy off the inode.  Thus, when
@@ -58,7 +60,8 @@ struct block_to_ecc {
 	uint64_t e_blkno;
 	struct ocfs2_dinode *e_di;
 	char *e_buf;
-	errcode_t (*e_write)(ocfs2_filesys *fs, struct block_to_ecc *block);
+	errcode_t (*e_prepare)(ocfs2_filesys *fs, struct block_to_ecc *block,
+			       char *buf, struct ocfs2_block_check **bc);
 };
 
 /*
@@ -156,10 +159,16 @@ static errcode_t block_insert(struct add_ecc_context *ctxt,
 	return ret;
 }
 
-static errcode_t dinode_write_func(ocfs2_filesys *fs,
-				   struct block_to_ecc *block)
+static errcode_t dinode_prepare_func(ocfs2_filesys *fs,
+				     struct block_to_ecc *block, char *buf,
+				     struct ocfs2_block_check **bc)
 {
-	return ocfs2_write_inode(fs, block->e_blkno, block->e_buf);
+	struct ocfs2_dinode *di = (struct ocfs2_dinode *)buf;
+
+	ocfs2_swap_inode_from_cpu(fs, di);
+	*bc = &di->i_check;
+
+	return 0;
 }
 
 static errcode_t block_insert_dinode(ocfs2_filesys *fs,
@@ -180,7 +189,7 @@ static errcode_t block_insert_dinode(ocfs2_filesys *fs,
 	memcpy(block->e_buf, di, fs->fs_blocksize);
 	block->e_di = (struct ocfs2_dinode *)block->e_buf;
 	block->e_blkno = di->i_blkno;
-	block->e_write = dinode_write_func;
+	block->e_prepare = dinode_prepare_func;
 	block_insert(ctxt, block);
 
 out:
@@ -189,10 +198,16 @@ out:
 	return ret;
 }
 
-static errcode_t eb_write_func(ocfs2_filesys *fs,
-			       struct block_to_ecc *block)
+static errcode_t eb_prepare_func(ocfs2_filesys *fs,
+				 struct block_to_ecc *block, char *buf,
+				 struct ocfs2_block_check **bc)
 {
-	return ocfs2_write_extent_block(fs, block->e_blkno, block->e_buf);
+	struct ocfs2_extent_block *eb = (struct ocfs2_extent_block *)buf;
+
+	ocfs2_swap_extent_block_from_cpu(fs, eb);
+	*bc = &eb->h_check;
+
+	return 0;
 }
 
 static errcode_t block_insert_eb(ocfs2_filesys *fs,
@@ -213,7 +228,7 @@ static errcode_t block_insert_eb(ocfs2_filesys *fs,
 
 	memcpy(block->e_buf, eb, fs->fs_blocksize);
 	block->e_blkno = eb->h_blkno;
-	block->e_write = eb_write_func;
+	block->e_prepare = eb_prepare_func;
 	block_insert(ctxt, block);
 
 out:
@@ -222,10 +237,16 @@ out:
 	return ret;
 }
 
-static errcode_t gd_write_func(ocfs2_filesys *fs,
-			       struct block_to_ecc *block)
+static errcode_t gd_prepare_func(ocfs2_filesys *fs,
+				 struct block_to_ecc *block, char *buf,
+				 struct ocfs2_block_check **bc)
 {
-	return ocfs2_write_group_desc(fs, block->e_blkno, block->e_buf);
+	struct ocfs2_group_desc *gd = (struct ocfs2_group_desc *)buf;
+
+	ocfs2_swap_group_desc_from_cpu(fs, gd);
+	*bc = &gd->bg_check;
+
+	return 0;
 }
 
 static errcode_t block_insert_gd(ocfs2_filesys *fs,
@@ -246,7 +267,7 @@ static errcode_t block_insert_gd(ocfs2_filesys *fs,
 
 	memcpy(block->e_buf, gd, fs->fs_blocksize);
 	block->e_blkno = gd->bg_blkno;
-	block->e_write = gd_write_func;
+	block->e_prepare = gd_prepare_func;
 	block_insert(ctxt, block);
 
 out:
@@ -255,11 +276,28 @@ out:
 	return ret;
 }
 
-static errcode_t dirblock_write_func(ocfs2_filesys *fs,
-				     struct block_to_ecc *block)
+/* The same steps as ocfs2_write_dir_block() */
+static errcode_t dirblock_prepare_func(ocfs2_filesys *fs,
+				       struct block_to_ecc *block, char *buf,
+				       struct ocfs2_block_check **bc)
 {
-	return ocfs2_write_dir_block(fs, block->e_di, block->e_blkno,
-				     block->e_buf);
+	errcode_t ret;
+	int end = fs->fs_blocksize;
+	struct ocfs2_dir_block_trailer *trailer;
+
+	if (ocfs2_dir_has_trailer(fs, block->e_di))
+		end = ocfs2_dir_trailer_blk_off(fs);
+
+	ret = ocfs2_swap_dir_entries_from_cpu(buf, end);
+	if (ret)
+		return ret;
+
+	trailer = ocfs2_dir_trailer_from_block(fs, buf);
+	if (ocfs2_dir_has_trailer(fs, block->e_di))
+		ocfs2_swap_dir_trailer(trailer);
+	*bc = &trailer->db_check;
+
+	return 0;
 }
 
 static errcode_t block_insert_dirblock(ocfs2_filesys *fs,
@@ -281,7 +319,7 @@ static errcode_t block_insert_dirblock(ocfs2_filesys *fs,
 	memcpy(block->e_buf, buf, fs->fs_blocksize);
 	block->e_di = di;
 	block->e_blkno = blkno;
-	block->e_write = dirblock_write_func;
+	block->e_prepare = dirblock_prepare_func;
 	block_insert(ctxt, block);
 
 out:
@@ -698,18 +736,125 @@ static errcode_t install_trailers(ocfs2_filesys *fs,
 	return ret;
 }
 
+/*
+ * Blocks go out in batches of ECC_WRITE_BATCH.  Each batch is put into
+ * disk format, has its ECC computed by the pool, and is written in runs
+ * of contiguous blocks.
+ */
+#define ECC_WRITE_BATCH		1024
+
+struct ecc_write_batch {
+	ocfs2_ecc_pool *wb_pool;
+	char *wb_bufs;
+	void **wb_blocks;
+	struct ocfs2_block_check **wb_bcs;
+	uint64_t *wb_blknos;
+	int wb_nr;
+};
+
+static void free_write_batch(struct ecc_write_batch *wb)
+{
+	ocfs2_ecc_pool_destroy(wb->wb_pool);
+	if (wb->wb_bufs)
+		ocfs2_free(&wb->wb_bufs);
+	if (wb->wb_blocks)
+		ocfs2_free(&wb->wb_blocks);
+	if (wb->wb_bcs)
+		ocfs2_free(&wb->wb_bcs);
+	if (wb->wb_blknos)
+		ocfs2_free(&wb->wb_blknos);
+}
+
+static errcode_t init_write_batch(ocfs2_filesys *fs,
+				  struct ecc_write_batch *wb)
+{
+	errcode_t ret;
+
+	memset(wb, 0, sizeof(struct ecc_write_batch));
+
+	ret = ocfs2_malloc_blocks(fs->fs_io, ECC_WRITE_BATCH, &wb->wb_bufs);
+	if (!ret)
+		ret = ocfs2_malloc0(sizeof(void *) * ECC_WRITE_BATCH,
+				    &wb->wb_blocks);
+	if (!ret)
+		ret = ocfs2_malloc0(sizeof(struct ocfs2_block_check *) *
+				    ECC_WRITE_BATCH, &wb->wb_bcs);
+	if (!ret)
+		ret = ocfs2_malloc0(sizeof(uint64_t) * ECC_WRITE_BATCH,
+				    &wb->wb_blknos);
+	if (!ret)
+		ret = ocfs2_ecc_pool_create(0, &wb->wb_pool);
+
+	if (ret)
+		free_write_batch(wb);
+	return ret;
+}
+
+static errcode_t add_write_batch(ocfs2_filesys *fs,
+				 struct ecc_write_batch *wb,
+				 struct block_to_ecc *block)
+{
+	char *buf = wb->wb_bufs + (wb->wb_nr * fs->fs_blocksize);
+
+	memcpy(buf, block->e_buf, fs->fs_blocksize);
+	wb->wb_blocks[wb->wb_nr] = buf;
+	wb->wb_blknos[wb->wb_nr] = block->e_blkno;
+
+	return block->e_prepare(fs, block, buf, &wb->wb_bcs[wb->wb_nr++]);
+}
+
+static errcode_t flush_write_batch(ocfs2_filesys *fs,
+				   struct ecc_write_batch *wb)
+{
+	errcode_t ret = 0;
+	int i, run;
+
+	ocfs2_compute_meta_ecc_batch(fs, wb->wb_pool, wb->wb_blocks,
+				     wb->wb_bcs, wb->wb_nr);
+
+	/* The tree is sorted, so neighbours on disk are neighbours here */
+	for (i = 0; i < wb->wb_nr; i += run) {
+		for (run = 1; (i + run) < wb->wb_nr; run++) {
+			if (wb->wb_blknos[i + run] != wb->wb_blknos[i] + run)
+				break;
+		}
+
+		ret = io_write_block(fs->fs_io, wb->wb_blknos[i], run,
+				     wb->wb_blocks[i]);
+		if (ret)
+			break;
+		fs->fs_flags |= OCFS2_FLAG_CHANGED;
+	}
+
+	wb->wb_nr = 0;
+	return ret;
+}
+
 static errcode_t write_ecc_blocks(ocfs2_filesys *fs,
 				  struct add_ecc_context *ctxt)
 {
-	errcode_t ret = 0;
+	errcode_t ret = 0, err;
 	struct rb_node *n;
 	struct block_to_ecc *block;
 	struct tools_progress *prog;
+	struct ecc_write_batch wb;
+
+	ret = init_write_batch(fs, &wb);
+	if (ret)
+		return ret;
 
 	prog = tools_progress_start("Writing blocks", "ECC",
 				    ctxt->ae_blockcount);
-	if (!prog)
+	if (!prog) {
+		free_write_batch(&wb);
 		return TUNEFS_ET_NO_MEMORY;
+	}
+
+	/*
+	 * The blocks are scattered all over the disk.  Let the I/O cache
+	 * hold them and write them out in big sorted batches.
+	 */
+	io_set_writeback(fs->fs_io, true);
 
 	n = rb_first(&ctxt->ae_blocks);
 	while (n) {
@@ -718,13 +863,27 @@ static errcode_t write_ecc_blocks(ocfs2_filesys *fs,
 			 block->e_blkno);
 
 		tools_progress_step(prog, 1);
-		ret = block->e_write(fs, block);
+		ret = add_write_batch(fs, &wb, block);
 		if (ret)
 			break;
 
+		if (wb.wb_nr == ECC_WRITE_BATCH) {
+			ret = flush_write_batch(fs, &wb);
+			if (ret)
+				break;
+		}
+
 		n = rb_next(n);
 	}
+
+	if (!ret && wb.wb_nr)
+		ret = flush_write_batch(fs, &wb);
+
+	err = io_set_writeback(fs->fs_io, false);
+	if (!ret)
+		ret = err;
 	tools_progress_stop(prog);
+	free_write_batch(&wb);
 
 	return ret;
 }
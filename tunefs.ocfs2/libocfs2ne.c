@@ -566,6 +566,9 @@ errcode_t tunefs_foreach_inode(ocfs2_filesys *fs,
 		goto out_free;
 	}
 
+	/* The journals are clean, so the inode alloc bitmaps are right */
+	ocfs2_inode_scan_set_flags(scan, OCFS2_INODE_SCAN_ALLOCATED);
+
 	for(;;) {
 		ret = ocfs2_get_next_inode(scan, &blkno, buf);
 		if (ret) {
@@ -580,6 +583,14 @@ errcode_t tunefs_foreach_inode(ocfs2_filesys *fs,
 		if (ret)
 			continue;
 
+		/* A live inode we can't trust stops us, as a read would */
+		ret = ocfs2_inode_scan_ecc_status(scan);
+		if (ret) {
+			verbosef(VL_LIB, "%s while scanning inode %"PRIu64"\n",
+				 error_message(ret), blkno);
+			break;
+		}
+
 		if (func) {
 			ret = func(fs, di, user_data);
 			if (ret)
@@ -1871,6 +1882,7 @@ static void tunefs_init_cache(ocfs2_filesys *fs)
 	errcode_t err;
 	struct tunefs_private *tp = to_private(fs);
 	struct tunefs_filesystem_state *state = tunefs_get_state(fs);
+	struct ocfs2_io_stats stats;
 	uint64_t blocks_wanted;
 	int scale_down;
 
@@ -1892,9 +1904,11 @@ static void tunefs_init_cache(ocfs2_filesys *fs)
 	 * chain allocator is 4MB, so let's do 8MB and allow for
 	 * incidental blocks.
 	 */
-	if (tp->tp_open_flags & TUNEFS_FLAG_LARGECACHE)
+	if (tp->tp_open_flags & TUNEFS_FLAG_LARGECACHE) {
 		blocks_wanted = fs->fs_blocks;
-	else
+		/* A cache this big should sit next to us */
+		io_set_cache_local_node(fs->fs_io, true);
+	} else
 		blocks_wanted = ocfs2_blocks_in_bytes(fs, 8 * 1024 * 1024);
 
 	/*
@@ -1924,8 +1938,13 @@ static void tunefs_init_cache(ocfs2_filesys *fs)
 				err = 0;
 		}
 		if (!err) {
-			verbosef(VL_LIB, "Got %"PRIu64" blocks\n",
-				 blocks_wanted);
+			io_get_stats(fs->fs_io, &stats);
+			verbosef(VL_LIB,
+				 "Got %"PRIu64" blocks on %s pages, "
+				 "NUMA node %d\n",
+				 blocks_wanted,
+				 io_cache_pages_name(stats.is_cache_pages),
+				 stats.is_cache_node);
 			/* If we've already scaled down, we're done. */
 			if (!scale_down)
 				break;
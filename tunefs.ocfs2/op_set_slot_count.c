@@ -54,12 +54,12 @@ struct remove_slot_ctxt {
 
 static errcode_t add_slots(ocfs2_filesys *fs, int num_slots)
 {
-	errcode_t ret;
+	errcode_t ret, tmp;
 	uint16_t old_num = OCFS2_RAW_SB(fs->fs_super)->s_max_slots;
 	struct ocfs2_super_block *super = OCFS2_RAW_SB(fs->fs_super);
 	char fname[OCFS2_MAX_FILENAME_LEN];
 	uint64_t blkno;
-	int i, j, max_slots;
+	int i, j, max_slots, batch = 0;
 	int ftype;
 	struct tools_progress *prog = NULL;
 
@@ -82,6 +82,10 @@ static errcode_t add_slots(ocfs2_filesys *fs, int num_slots)
 		goto bail;
 	}
 
+	/* The allocators are written once, when every file is made */
+	ocfs2_begin_alloc_batch(fs);
+	batch = 1;
+
 	ret = 0;
 	for (i = OCFS2_LAST_GLOBAL_SYSTEM_INODE + 1; i < NUM_SYSTEM_INODES; ++i) {
 		if (i == LOCAL_USER_QUOTA_SYSTEM_INODE &&
@@ -183,6 +187,11 @@ static errcode_t add_slots(ocfs2_filesys *fs, int num_slots)
 	}
 
 bail:
+	if (batch) {
+		tmp = ocfs2_end_alloc_batch(fs);
+		if (!ret)
+			ret = tmp;
+	}
 	if (prog)
 		tools_progress_stop(prog);
 